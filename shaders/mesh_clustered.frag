@@ -0,0 +1,197 @@
+#version 450
+
+// Vertex color or virtual texture lit by the shadowed sun and the lights of the
+// fragment's cluster, see light_cluster.comp, ShadowCache and VirtualTexture
+
+// feedback is only written for fragments that pass the depth test
+layout( early_fragment_tests ) in;
+
+layout( location = 0 ) in vec3 inColor;
+layout( location = 1 ) in vec3 inWorldPosition;
+layout( location = 2 ) in vec3 inNormal;
+layout( location = 3 ) in vec2 inTexCoord;
+layout( location = 4 ) flat in uint inTexture; // ~0 for vertex color
+layout( location = 5 ) flat in uint inObjectId;
+
+layout( location = 0 ) out vec4 outFragColor;
+layout( location = 1 ) out uint outObjectId; // renderable index + 1, for picking
+
+struct Light
+{
+  vec4 positionRadius;
+  vec4 color; // w = cos of the spot's inner angle
+  vec4 spot;  // xyz direction, w cos of the outer angle, -2 for point lights
+};
+
+layout( set = 1, binding = 0 ) uniform LightingParams
+{
+  mat4 viewProj;
+  mat4 view;
+  mat4 invProj;
+  uvec4 grid;
+  uvec4 info;
+  vec4 depth; // xy near and far, slice = log( view depth ) * z - w
+  vec4 tile;  // xy cluster size in pixels
+  vec4 ambient;
+  mat4 lightView;
+  vec4 sunDirection; // xyz the way the light travels, w shadow depth range
+  vec4 sunColor;     // w shadow map resolution
+  vec4 cascades[ 3 ]; // xy window origin in texels, z texel size
+  uvec4 feedback;     // xy the pixel of each square writing feedback, z feedback width
+} params;
+
+layout( std430, set = 1, binding = 1 ) readonly buffer LightBuffer
+{
+  Light lights[];
+};
+
+layout( std430, set = 1, binding = 2 ) readonly buffer ClusterBuffer
+{
+  uint clusters[];
+};
+
+// cascades side by side, the cache is addressed toroidally, the dynamic maps by window
+layout( set = 1, binding = 3 ) uniform sampler2DShadow staticShadows;
+layout( set = 1, binding = 4 ) uniform sampler2DShadow dynamicShadows;
+
+// per texture a header of pages per side at mip 0, mip count and where each mip's
+// entries start, then one entry per page: atlas slot in the low 16 bits, the mip of
+// the page that is actually there above, ~0 if nothing is
+layout( std430, set = 1, binding = 5 ) readonly buffer PageTable
+{
+  uint pageTable[];
+};
+
+layout( set = 1, binding = 6 ) uniform sampler2D pageAtlas;
+
+layout( std430, set = 1, binding = 7 ) writeonly buffer Feedback
+{
+  uint feedback[];
+};
+
+const int CascadeCount = 3;
+
+const uint PageSize = 128;
+const uint PageBorder = 4;
+const uint SlotSize = PageSize + 2 * PageBorder;
+const uint AtlasPages = 16;
+const uint FeedbackScale = 8;
+const uint HeaderSize = 16;
+const uint NotMapped = 0xffffffff;
+
+// alpha 0 if not even the coarsest page is resident yet
+vec4 sample_virtual( uint textureId, vec2 uv )
+{
+  uint header = textureId * HeaderSize;
+  uint pages = pageTable[ header ];
+  uint mipCount = pageTable[ header + 1 ];
+
+  // the mip hardware filtering would pick, from the derivatives in mip 0 texels
+  vec2 texels = uv * float( pages * PageSize );
+  vec2 dx = dFdx( texels );
+  vec2 dy = dFdy( texels );
+  float lod = 0.5 * log2( max( max( dot( dx, dx ), dot( dy, dy ) ), 1 ) );
+  uint mip = min( uint( lod ), mipCount - 1 );
+
+  uint mipPages = pages >> mip;
+  vec2 wrapped = fract( uv );
+  uvec2 page = min( uvec2( wrapped * float( mipPages ) ), uvec2( mipPages - 1 ) );
+
+  uvec2 pixel = uvec2( gl_FragCoord.xy );
+  if( all( equal( pixel % FeedbackScale, params.feedback.xy ) ) )
+  {
+    uvec2 cell = pixel / FeedbackScale;
+    feedback[ cell.y * params.feedback.z + cell.x ] = ( textureId << 24 ) | ( mip << 20 ) | ( page.y << 10 ) | page.x;
+  }
+
+  uint entry = pageTable[ pageTable[ header + 2 + mip ] + page.y * mipPages + page.x ];
+  if( entry == NotMapped )
+    return vec4( 0 );
+
+  // the page there may be an ancestor, covering 2^( mapped - mip ) pages per side
+  uint slot = entry & 0xffff;
+  uint mapped = entry >> 16;
+  vec2 inPage = wrapped * float( pages >> mapped ) - vec2( page >> ( mapped - mip ) );
+  vec2 atlasTexel = vec2( slot % AtlasPages, slot / AtlasPages ) * float( SlotSize ) + float( PageBorder ) + inPage * float( PageSize );
+  return vec4( textureLod( pageAtlas, atlasTexel / float( AtlasPages * SlotSize ), 0 ).rgb, 1 );
+}
+
+float sample_shadow( sampler2DShadow atlas, ivec2 texel, float depth )
+{
+  vec2 size = vec2( CascadeCount, 1 ) * params.sunColor.w;
+  return textureLod( atlas, vec3( ( vec2( texel ) + 0.5 ) / size, depth ), 0 );
+}
+
+// 1 where the sun reaches, bilinear over 2x2 texels of the finest cascade covering the point
+float sun_visibility( vec3 worldPosition )
+{
+  vec3 lightPosition = ( params.lightView * vec4( worldPosition, 1 ) ).xyz;
+  float range = params.sunDirection.w;
+  float depth = ( range - lightPosition.z ) / ( 2 * range );
+  int n = int( params.sunColor.w );
+  for( int c = 0; c < CascadeCount; ++c )
+  {
+    vec2 t = lightPosition.xy / params.cascades[ c ].z - 0.5;
+    vec2 relative = t - params.cascades[ c ].xy;
+    if( any( lessThan( relative, vec2( 1.5 ) ) ) || any( greaterThanEqual( relative, vec2( n - 1.5 ) ) ) )
+      continue;
+
+    ivec2 base = ivec2( floor( t ) );
+    vec2 f = t - vec2( base );
+    vec4 visible;
+    for( int i = 0; i < 4; ++i )
+    {
+      ivec2 texel = base + ivec2( i & 1, i >> 1 );
+      ivec2 cached = ivec2( c * n + ( texel.x & ( n - 1 ) ), texel.y & ( n - 1 ) );
+      ivec2 windowed = ivec2( c * n, 0 ) + texel - ivec2( params.cascades[ c ].xy );
+      visible[ i ] = min( sample_shadow( staticShadows, cached, depth ), sample_shadow( dynamicShadows, windowed, depth ) );
+    }
+    return mix( mix( visible.x, visible.y, f.x ), mix( visible.z, visible.w, f.x ), f.y );
+  }
+  return 1;
+}
+
+void main()
+{
+  float viewDepth = -( params.view * vec4( inWorldPosition, 1 ) ).z;
+  uint slice = uint( max( log( viewDepth ) * params.depth.z - params.depth.w, 0 ) );
+  uvec3 cluster = min( uvec3( uvec2( gl_FragCoord.xy / params.tile.xy ), slice ), params.grid.xyz - 1 );
+  uint clusterCount = params.grid.x * params.grid.y * params.grid.z;
+  uint index = cluster.x + params.grid.x * ( cluster.y + params.grid.y * cluster.z );
+  uint first = clusterCount + index * params.grid.w;
+  uint count = clusters[ index ];
+
+  vec3 normal = normalize( inNormal );
+
+  vec3 albedo = inColor;
+  if( inTexture != NotMapped )
+  {
+    vec4 texel = sample_virtual( inTexture, inTexCoord );
+    albedo = mix( albedo, texel.rgb, texel.a );
+  }
+
+  vec3 lighting = params.ambient.rgb;
+  float sun = max( dot( normal, -params.sunDirection.xyz ), 0 );
+  if( sun > 0 )
+    lighting += params.sunColor.rgb * sun * sun_visibility( inWorldPosition );
+  for( uint i = 0; i < count; ++i )
+  {
+    Light light = lights[ clusters[ first + i ] ];
+    vec3 toLight = light.positionRadius.xyz - inWorldPosition;
+    float distanceSquared = dot( toLight, toLight );
+    float radius = light.positionRadius.w;
+    if( distanceSquared >= radius * radius )
+      continue;
+
+    // inverse square, windowed to reach zero at the radius
+    vec3 direction = toLight * inversesqrt( max( distanceSquared, 1e-8 ) );
+    float ratio = distanceSquared / ( radius * radius );
+    float window = clamp( 1 - ratio * ratio, 0, 1 );
+    float attenuation = window * window / ( distanceSquared + 1 );
+    if( light.spot.w > -1 )
+      attenuation *= smoothstep( light.spot.w, light.color.w, dot( -direction, light.spot.xyz ) );
+    lighting += light.color.rgb * max( dot( normal, direction ), 0 ) * attenuation;
+  }
+  outFragColor = vec4( albedo * lighting, 1 );
+  outObjectId = inObjectId;
+}
@@ -0,0 +1,16 @@
+#version 450
+
+// Soft round sprite, blended additively
+
+layout( location = 0 ) in vec2 inCorner;
+layout( location = 1 ) in vec4 inColor;
+
+layout( location = 0 ) out vec4 outFragColor;
+
+void main()
+{
+  float d = dot( inCorner, inCorner );
+  if( d > 1 )
+    discard;
+  outFragColor = vec4( inColor.rgb * inColor.a * ( 1 - d ), 0 );
+}
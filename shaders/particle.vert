@@ -0,0 +1,50 @@
+#version 450
+
+// Camera facing quad per particle, the instance indexes the alive list being drawn.
+
+layout( location = 0 ) out vec2 outCorner;
+layout( location = 1 ) out vec4 outColor;
+
+struct Particle
+{
+  vec4 positionLife;
+  vec4 velocityLifetime;
+};
+
+layout( std430, set = 0, binding = 0 ) readonly buffer ParticleBuffer
+{
+  Particle particles[];
+};
+
+layout( std430, set = 0, binding = 1 ) readonly buffer ListBuffer
+{
+  uint lists[];
+};
+
+layout( push_constant ) uniform constants
+{
+  mat4 viewProj;
+  vec4 cameraRight; // w = size
+  vec4 cameraUp;
+  uint capacity;
+  uint list;
+} PushConstants;
+
+const vec2 corners[ 6 ] = vec2[]( vec2( -1, -1 ), vec2( 1, -1 ), vec2( 1, 1 ),
+                                  vec2( -1, -1 ), vec2( 1, 1 ), vec2( -1, 1 ) );
+
+void main()
+{
+  uint index = lists[ PushConstants.capacity * ( 1 + PushConstants.list ) + gl_InstanceIndex ];
+  Particle p = particles[ index ];
+  vec2 corner = corners[ gl_VertexIndex ];
+  float size = PushConstants.cameraRight.w;
+  vec3 position = p.positionLife.xyz +
+                  ( PushConstants.cameraRight.xyz * corner.x + PushConstants.cameraUp.xyz * corner.y ) * size;
+  gl_Position = PushConstants.viewProj * vec4( position, 1 );
+
+  // white hot when emitted, fading through orange
+  float age = clamp( p.positionLife.w / p.velocityLifetime.w, 0, 1 );
+  outColor = vec4( mix( vec3( 0.8, 0.2, 0.05 ), vec3( 1, 0.9, 0.6 ), age ), age );
+  outCorner = corner;
+}
@@ -0,0 +1,15 @@
+#version 450
+
+// Depth only, for the sun's shadow cascades
+
+layout( location = 0 ) in vec3 vPosition;
+
+layout( push_constant ) uniform constants
+{
+  mat4 mvp;
+} PushConstants;
+
+void main()
+{
+  gl_Position = PushConstants.mvp * vec4( vPosition, 1 );
+}
@@ -1,9 +0,0 @@
-#version 450
-
-layout( location = 0 ) out vec4 outFragColor;
-
-void main()
-{
-  outFragColor = vec4( 1, 0, 0, 1 );
-}
-
@@ -5,18 +5,45 @@
 layout( location = 0 ) in vec3 vPosition;
 layout( location = 1 ) in vec3 vNormal;
 layout( location = 2 ) in vec3 vColor;
+layout( location = 3 ) in vec2 vTexCoord;
 
 layout( location = 0 ) out vec3 outColor;
+layout( location = 1 ) out vec3 outWorldPosition;
+layout( location = 2 ) out vec3 outNormal;
+layout( location = 3 ) out vec2 outTexCoord;
+layout( location = 4 ) flat out uint outTexture;
+layout( location = 5 ) flat out uint outObjectId;
 
-layout( push_constant ) uniform constants
+struct ObjectData
 {
-	vec4 data;
-	mat4 render_matrix;
-} PushConstants;
+  mat4 model;
+  vec4 boundsMin;
+  vec4 boundsMax;
+  uvec4 info;
+};
+
+// indirect draws put the object index in firstInstance
+layout( std430, set = 0, binding = 0 ) readonly buffer ObjectBuffer
+{
+  ObjectData objects[];
+};
+
+// the start of the lighting params, the camera is read from a buffer so recorded draws can be reused
+layout( set = 1, binding = 0 ) uniform LightingParams
+{
+  mat4 viewProj;
+} params;
 
 void main()
 {
-  gl_Position = PushConstants.render_matrix *vec4( vPosition, 1 );
+  mat4 model = objects[ gl_InstanceIndex ].model;
+  vec4 worldPosition = model * vec4( vPosition, 1 );
+  gl_Position = params.viewProj * worldPosition;
   outColor = vColor;
+  outWorldPosition = worldPosition.xyz;
+  // models are only scaled uniformly
+  outNormal = mat3( model ) * vNormal;
+  outTexCoord = vTexCoord;
+  outTexture = objects[ gl_InstanceIndex ].info.y;
+  outObjectId = objects[ gl_InstanceIndex ].info.x + 1;
 }
-
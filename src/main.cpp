@@ -1,10 +1,66 @@
 #include <vk_engine.h>
+#include <vk_bench.h>
+#include <vk_capture.h>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
 
-int main( int, char** )
+int main( int argc, char** argv )
 {
+  if( argc > 2 && strcmp( argv[ 1 ], "--bench" ) == 0 )
+    return run_bench( argv[ 2 ] );
+  if( argc > 3 && strcmp( argv[ 1 ], "--compare" ) == 0 )
+    return compare_timings( argv[ 2 ], argv[ 3 ] );
+  if( argc > 3 && strcmp( argv[ 1 ], "--build-world" ) == 0 )
+  {
+    const float chunkSize = argc > 4 ? ( float )atof( argv[ 4 ] ) : WorldStreamer::DefaultChunkSize;
+    return WorldStreamer::build( argv[ 2 ], argv[ 3 ], chunkSize ) ? 0 : 1;
+  }
+
   VulkanEngine engine;
+  bool presentRequested = false;
+  for( int i = 1; i + 1 < argc; i += 2 )
+  {
+    if( strcmp( argv[ i ], "--present" ) == 0 )
+    {
+      presentRequested = true;
+      if( strcmp( argv[ i + 1 ], "mailbox" ) == 0 )
+        engine._requestedPresentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+      else if( strcmp( argv[ i + 1 ], "immediate" ) == 0 )
+        engine._requestedPresentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+      else if( strcmp( argv[ i + 1 ], "fifo" ) == 0 )
+        engine._requestedPresentMode = VK_PRESENT_MODE_FIFO_KHR;
+      else
+        std::cout << "unknown present mode " << argv[ i + 1 ] << ", expected fifo, mailbox or immediate" << std::endl;
+    }
+    else if( strcmp( argv[ i ], "--fps" ) == 0 )
+      engine._maxFrameRate = ( float )atof( argv[ i + 1 ] );
+    else if( strcmp( argv[ i ], "--async-compute" ) == 0 )
+      engine._asyncComputeRequested = strcmp( argv[ i + 1 ], "off" ) != 0;
+    else if( strcmp( argv[ i ], "--render-thread" ) == 0 )
+      engine._renderThread = strcmp( argv[ i + 1 ], "off" ) != 0;
+    else if( strcmp( argv[ i ], "--capture" ) == 0 )
+      engine._capturePath = argv[ i + 1 ];
+    else if( strcmp( argv[ i ], "--replay" ) == 0 )
+    {
+      if( !engine._capture.load( argv[ i + 1 ] ) )
+        return 1;
+      engine._replay = true;
+    }
+    else if( strcmp( argv[ i ], "--timings" ) == 0 )
+      engine._timingsPath = argv[ i + 1 ];
+    else if( strcmp( argv[ i ], "--screenshots" ) == 0 )
+      engine._screenshotDir = argv[ i + 1 ];
+    else if( strcmp( argv[ i ], "--world" ) == 0 )
+      engine._worldPath = argv[ i + 1 ];
+    else if( strcmp( argv[ i ], "--world-budget" ) == 0 )
+      engine._world._budgetBytes = ( uint64_t )atoll( argv[ i + 1 ] ) << 20;
+  }
+  // a replay measures frames, not the display's refresh rate
+  if( engine._replay && !presentRequested )
+    engine._requestedPresentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+
   engine.init();
   engine.run();
   engine.cleanup();
 }
-
@@ -0,0 +1,83 @@
+﻿#include <vk_alloc_counter.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Replaces the global operator new and delete. The nothrow forms forward to
+// these by default, so they are counted too. The sized deletes are replaced as
+// well, not every runtime forwards them to the unsized ones.
+
+static std::atomic< uint64_t > s_allocations{ 0 };
+static std::atomic< uint64_t > s_frees{ 0 };
+static std::atomic< uint64_t > s_bytes{ 0 };
+
+AllocationCounters get_allocation_counters()
+{
+  AllocationCounters counters;
+  counters.allocations = s_allocations.load( std::memory_order_relaxed );
+  counters.frees = s_frees.load( std::memory_order_relaxed );
+  counters.bytes = s_bytes.load( std::memory_order_relaxed );
+  return counters;
+}
+
+static void* counted_alloc( size_t size )
+{
+  s_allocations.fetch_add( 1, std::memory_order_relaxed );
+  s_bytes.fetch_add( size, std::memory_order_relaxed );
+  void* p = malloc( size ? size : 1 );
+  if( !p )
+    throw std::bad_alloc();
+  return p;
+}
+
+static void counted_free( void* p )
+{
+  if( !p )
+    return;
+  s_frees.fetch_add( 1, std::memory_order_relaxed );
+  free( p );
+}
+
+static void* counted_aligned_alloc( size_t size, std::align_val_t alignment )
+{
+  s_allocations.fetch_add( 1, std::memory_order_relaxed );
+  s_bytes.fetch_add( size, std::memory_order_relaxed );
+  const size_t align = ( size_t )alignment;
+#ifdef _WIN32
+  void* p = _aligned_malloc( size ? size : 1, align );
+#else
+  // aligned_alloc wants a multiple of the alignment
+  void* p = aligned_alloc( align, ( ( size ? size : 1 ) + align - 1 ) / align * align );
+#endif
+  if( !p )
+    throw std::bad_alloc();
+  return p;
+}
+
+static void counted_aligned_free( void* p )
+{
+  if( !p )
+    return;
+  s_frees.fetch_add( 1, std::memory_order_relaxed );
+#ifdef _WIN32
+  _aligned_free( p );
+#else
+  free( p );
+#endif
+}
+
+void* operator new( size_t size ) { return counted_alloc( size ); }
+void* operator new[]( size_t size ) { return counted_alloc( size ); }
+void operator delete( void* p ) noexcept { counted_free( p ); }
+void operator delete[]( void* p ) noexcept { counted_free( p ); }
+void operator delete( void* p, size_t ) noexcept { counted_free( p ); }
+void operator delete[]( void* p, size_t ) noexcept { counted_free( p ); }
+
+void* operator new( size_t size, std::align_val_t alignment ) { return counted_aligned_alloc( size, alignment ); }
+void* operator new[]( size_t size, std::align_val_t alignment ) { return counted_aligned_alloc( size, alignment ); }
+void operator delete( void* p, std::align_val_t ) noexcept { counted_aligned_free( p ); }
+void operator delete[]( void* p, std::align_val_t ) noexcept { counted_aligned_free( p ); }
+void operator delete( void* p, size_t, std::align_val_t ) noexcept { counted_aligned_free( p ); }
+void operator delete[]( void* p, size_t, std::align_val_t ) noexcept { counted_aligned_free( p ); }
+
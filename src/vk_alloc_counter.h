@@ -0,0 +1,21 @@
+﻿#pragma once
+
+#include <cstdint>
+
+// Totals of every allocation through the global operator new since startup.
+// That covers the standard containers and strings but not malloc, so driver
+// and SDL allocations don't show up. Diff two snapshots to count a frame.
+struct AllocationCounters
+{
+  uint64_t allocations = 0;
+  uint64_t frees = 0;
+  uint64_t bytes = 0; // allocated, frees don't subtract
+};
+
+AllocationCounters get_allocation_counters();
+
+inline AllocationCounters operator-( const AllocationCounters& a, const AllocationCounters& b )
+{
+  return { a.allocations - b.allocations, a.frees - b.frees, a.bytes - b.bytes };
+}
+
@@ -0,0 +1,670 @@
+﻿#include <vk_bench.h>
+#include <vk_bvh.h>
+#include <vk_engine.h>
+#include <vk_alloc_counter.h>
+#include <vk_initializers.h>
+
+#include <glm/gtx/transform.hpp>
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::high_resolution_clock;
+
+static double ms_since( bench_clock::time_point start )
+{
+  return std::chrono::duration< double, std::milli >( bench_clock::now() - start ).count();
+}
+
+struct CpuFrameTimes
+{
+  double frameMs; // per frame, the wall time
+  double cpuMs;   // per frame, of draw() alone
+};
+
+// Draws the given number of frames. draw() is only timed once the frame's fence
+// signalled, so its cpu time doesn't include the wait for the gpu. beforeFrame( i )
+// runs ahead of every frame, outside that timing.
+template< typename BeforeFrame >
+static CpuFrameTimes time_cpu_frames( VulkanEngine& engine, int frames, BeforeFrame beforeFrame )
+{
+  double cpuMs = 0;
+  auto start = bench_clock::now();
+  for( int i = 0; i < frames; ++i )
+  {
+    beforeFrame( i );
+    VkFence fence = engine.get_current_frame()._renderFence;
+    VK_CHECK( vkWaitForFences( engine._device, 1, &fence, true, UINT64_MAX ) );
+    auto drawStart = bench_clock::now();
+    engine.draw();
+    cpuMs += ms_since( drawStart );
+  }
+  return { ms_since( start ) / frames, cpuMs / frames };
+}
+
+static CpuFrameTimes time_cpu_frames( VulkanEngine& engine, int frames )
+{
+  return time_cpu_frames( engine, frames, []( int ) {} );
+}
+
+// Frustum and ray query cost of the dynamic bvh against a linear scan over the
+// same boxes. Objects are scattered with constant density, so the number of
+// visible objects stays roughly the same while the scene grows.
+static int bench_bvh()
+{
+  const int counts[] = { 10000, 100000, 1000000 };
+  const int queryCount = 20;
+  const float density = 0.001f; // objects per cubic unit
+
+  std::cout << "objects   build(ms)  move 1%(ms)  height  visible  linear(ms)  bvh(ms)  speedup  ray linear(ms)  ray bvh(ms)" << std::endl;
+  for( int count : counts )
+  {
+    std::mt19937 rng( 1234 );
+    const float side = std::cbrt( count / density );
+    std::uniform_real_distribution< float > pos( -side * 0.5f, side * 0.5f );
+    std::uniform_real_distribution< float > size( 0.2f, 2.0f );
+
+    std::vector< AABB > boxes( count );
+    for( AABB& box : boxes )
+    {
+      glm::vec3 c = { pos( rng ), pos( rng ), pos( rng ) };
+      glm::vec3 e = glm::vec3( size( rng ) ) * 0.5f;
+      box.min = c - e;
+      box.max = c + e;
+    }
+
+    auto buildStart = bench_clock::now();
+    DynamicBVH bvh;
+    std::vector< int > proxies( count );
+    for( int i = 0; i < count; ++i )
+      proxies[ i ] = bvh.create_proxy( boxes[ i ], ( uint32_t )i );
+    const double buildMs = ms_since( buildStart );
+
+    // refit: nudge 1% of the objects, as a frame of moving objects would
+    std::uniform_real_distribution< float > nudge( -1.0f, 1.0f );
+    auto moveStart = bench_clock::now();
+    for( int i = 0; i < count; i += 100 )
+    {
+      glm::vec3 d = { nudge( rng ), nudge( rng ), nudge( rng ) };
+      boxes[ i ].min += d;
+      boxes[ i ].max += d;
+      bvh.move_proxy( proxies[ i ], boxes[ i ] );
+    }
+    const double moveMs = ms_since( moveStart );
+
+    // camera sweeps around the center looking outward, 200 units of view distance
+    std::vector< Frustum > frustums;
+    std::vector< Ray > rays;
+    const glm::mat4 proj = glm::perspective( glm::radians( 70.0f ), 1700.0f / 900.0f, 0.1f, 200.0f );
+    for( int q = 0; q < queryCount; ++q )
+    {
+      float angle = glm::radians( 360.0f * q / queryCount );
+      glm::vec3 dir = { std::cos( angle ), 0, std::sin( angle ) };
+      glm::mat4 view = glm::lookAt( glm::vec3( 0 ), dir, glm::vec3( 0, 1, 0 ) );
+      frustums.push_back( Frustum::from_matrix( proj * view ) );
+      rays.push_back( { glm::vec3( 0 ), dir } );
+    }
+
+    size_t visibleLinear = 0;
+    auto linearStart = bench_clock::now();
+    for( const Frustum& frustum : frustums )
+      for( const AABB& box : boxes )
+        visibleLinear += frustum.is_visible( box );
+    const double linearMs = ms_since( linearStart ) / queryCount;
+
+    size_t visibleBvh = 0;
+    auto bvhStart = bench_clock::now();
+    for( const Frustum& frustum : frustums )
+      bvh.query_frustum( frustum, [ & ]( uint32_t ) { ++visibleBvh; } );
+    const double bvhMs = ms_since( bvhStart ) / queryCount;
+
+    // closest hit picking, against the tight boxes in both cases
+    int rayHits = 0;
+    auto rayLinearStart = bench_clock::now();
+    for( const Ray& ray : rays )
+    {
+      float tBest = FLT_MAX;
+      for( const AABB& box : boxes )
+      {
+        float t;
+        if( ray.intersect( box, tBest, &t ) )
+          tBest = t;
+      }
+      rayHits += tBest < FLT_MAX;
+    }
+    const double rayLinearMs = ms_since( rayLinearStart ) / queryCount;
+
+    auto rayBvhStart = bench_clock::now();
+    for( const Ray& ray : rays )
+    {
+      float tBest = FLT_MAX;
+      bvh.query_ray( ray, FLT_MAX, [ & ]( uint32_t i, float tMax ) {
+        float t;
+        if( ray.intersect( boxes[ i ], tMax, &t ) )
+          tBest = tMax = t;
+        return tMax;
+      } );
+      rayHits -= tBest < FLT_MAX;
+    }
+    const double rayBvhMs = ms_since( rayBvhStart ) / queryCount;
+
+    printf( "%7d  %10.1f  %11.3f  %6d  %7zu  %10.3f  %7.3f  %6.1fx  %14.3f  %11.4f\n",
+            count,
+            buildMs,
+            moveMs,
+            bvh.get_height(),
+            visibleBvh / queryCount,
+            linearMs,
+            bvhMs,
+            linearMs / bvhMs,
+            rayLinearMs,
+            rayBvhMs );
+
+    // the bvh uses fat boxes so it may report a few extra, but never fewer
+    if( visibleBvh < visibleLinear || rayHits != 0 )
+    {
+      std::cout << "bvh results don't match the linear scan" << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Steady state frames of the init_scene workload must not touch the heap. The
+// camera sways so the visible set changes, the warmup frames see the same range.
+static int bench_frame()
+{
+  const int warmupFrames = 64;
+  const int measuredFrames = 512;
+
+  VulkanEngine engine;
+  engine.init();
+  const glm::vec3 camPos = engine._camPos;
+  auto sway = [ & ]( int frame ) {
+    engine._camPos = camPos + glm::vec3( 4.0f * std::sin( frame * 0.1f ), 0, 0 );
+  };
+
+  // the first frames grow the frame arena and containers to their working size
+  for( int i = 0; i < warmupFrames; ++i )
+  {
+    sway( i );
+    engine.draw();
+  }
+
+  int allocatingFrames = 0;
+  AllocationCounters total = {};
+  auto start = bench_clock::now();
+  for( int i = 0; i < measuredFrames; ++i )
+  {
+    sway( i );
+    const AllocationCounters before = get_allocation_counters();
+    engine.draw();
+    const AllocationCounters frame = get_allocation_counters() - before;
+    allocatingFrames += frame.allocations > 0;
+    total.allocations += frame.allocations;
+    total.bytes += frame.bytes;
+  }
+  const double frameMs = ms_since( start ) / measuredFrames;
+  size_t arenaPeak = 0;
+  for( uint32_t i = 0; i < VulkanEngine::RenderSnapshotSlots; ++i )
+    arenaPeak = std::max( arenaPeak, engine._snapshots.get_slot( i ).arena.get_peak_usage() );
+  engine.cleanup();
+
+  printf( "frames  cpu+gpu(ms)  allocating frames  allocations  bytes  arena peak(KiB)\n" );
+  printf( "%6d  %11.3f  %17d  %11llu  %5llu  %15zu\n",
+          measuredFrames,
+          frameMs,
+          allocatingFrames,
+          ( unsigned long long )total.allocations,
+          ( unsigned long long )total.bytes,
+          arenaPeak / 1024 );
+  if( allocatingFrames > 0 )
+  {
+    std::cout << "steady state frames allocated on the heap" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Cpu cost of recording a draw of the init_scene workload, through the loader's
+// dispatch trampolines and through the device level pointers volk loads. Each
+// object is drawn on its own with its vertex buffer bound, as without
+// multiDrawIndirect. Recorded into a secondary command buffer inside the early
+// draw's render pass, never submitted.
+static int bench_dispatch()
+{
+  const int iterations = 200;
+
+  VulkanEngine engine;
+  engine.init();
+
+  struct DrawFunctions
+  {
+    PFN_vkCmdBindPipeline bindPipeline;
+    PFN_vkCmdBindDescriptorSets bindDescriptorSets;
+    PFN_vkCmdBindVertexBuffers bindVertexBuffers;
+    PFN_vkCmdDrawIndirect drawIndirect;
+  };
+  // vkGetInstanceProcAddr hands out the loader's trampolines for device functions
+  auto load = [ & ]( auto getProcAddr, auto handle ) {
+    DrawFunctions functions;
+    functions.bindPipeline = ( PFN_vkCmdBindPipeline )getProcAddr( handle, "vkCmdBindPipeline" );
+    functions.bindDescriptorSets = ( PFN_vkCmdBindDescriptorSets )getProcAddr( handle, "vkCmdBindDescriptorSets" );
+    functions.bindVertexBuffers = ( PFN_vkCmdBindVertexBuffers )getProcAddr( handle, "vkCmdBindVertexBuffers" );
+    functions.drawIndirect = ( PFN_vkCmdDrawIndirect )getProcAddr( handle, "vkCmdDrawIndirect" );
+    return functions;
+  };
+  const DrawFunctions loader = load( vkGetInstanceProcAddr, engine._instance );
+  const DrawFunctions direct = load( vkGetDeviceProcAddr, engine._device );
+
+  std::vector< VkBuffer > vertexBuffers;
+  for( const RenderObject& object : engine._renderables )
+  {
+    const Mesh* mesh = engine._meshes.get( object.mesh );
+    vertexBuffers.push_back( mesh->is_skinned() ? engine._skinning.get_output_buffer() : mesh->_vertexBuffer._buffer );
+  }
+  const uint32_t drawCount = ( uint32_t )vertexBuffers.size();
+
+  VkCommandPoolCreateInfo poolInfo = vkinit::command_pool_create_info( engine._graphicsQueueFamily );
+  VkCommandPool pool;
+  VK_CHECK( vkCreateCommandPool( engine._device, &poolInfo, nullptr, &pool ) );
+  VkCommandBufferAllocateInfo allocInfo = vkinit::command_buffer_allocate_info( pool, 1, VK_COMMAND_BUFFER_LEVEL_SECONDARY );
+  VkCommandBuffer cmd;
+  VK_CHECK( vkAllocateCommandBuffers( engine._device, &allocInfo, &cmd ) );
+
+  VkCommandBufferInheritanceInfo inheritance = {};
+  inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+  inheritance.renderPass = engine._renderPass;
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+  beginInfo.pInheritanceInfo = &inheritance;
+
+  // best of the iterations, the first ones grow the pool
+  auto measure = [ & ]( const DrawFunctions& functions ) {
+    double bestMs = DBL_MAX;
+    for( int i = 0; i < iterations; ++i )
+    {
+      VK_CHECK( vkResetCommandPool( engine._device, pool, 0 ) );
+      VK_CHECK( vkBeginCommandBuffer( cmd, &beginInfo ) );
+      functions.bindPipeline( cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, engine._meshPipeline );
+      functions.bindDescriptorSets( cmd,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    engine._meshPipelineLayout,
+                                    0, 1, &engine._frames[ 0 ]._objectSet,
+                                    0, nullptr );
+      auto start = bench_clock::now();
+      for( uint32_t d = 0; d < drawCount; ++d )
+      {
+        const VkDeviceSize offset = 0;
+        functions.bindVertexBuffers( cmd, 0, 1, &vertexBuffers[ d ], &offset );
+        functions.drawIndirect( cmd,
+                                engine._frameRing.get_buffer(),
+                                d * sizeof( VkDrawIndirectCommand ),
+                                1,
+                                sizeof( VkDrawIndirectCommand ) );
+      }
+      bestMs = std::min( bestMs, ms_since( start ) );
+      VK_CHECK( vkEndCommandBuffer( cmd ) );
+    }
+    return bestMs;
+  };
+  const double loaderMs = measure( loader );
+  const double directMs = measure( direct );
+
+  vkDestroyCommandPool( engine._device, pool, nullptr );
+  engine.cleanup();
+
+  printf( "draws  loader(ms)  direct(ms)  loader per draw(ns)  direct per draw(ns)  saved per draw(ns)\n" );
+  printf( "%5u  %10.3f  %10.3f  %19.1f  %19.1f  %18.1f\n",
+          drawCount,
+          loaderMs,
+          directMs,
+          loaderMs * 1e6 / drawCount,
+          directMs * 1e6 / drawCount,
+          ( loaderMs - directMs ) * 1e6 / drawCount );
+  return 0;
+}
+
+// Frame cost of the particle system from 10k to 4M particles. Emission keeps the
+// pool full, so every particle is simulated and drawn each frame. The cpu time of
+// draw() should stay flat while the frame time grows with the gpu work. Presents
+// immediately so vsync doesn't hide it.
+static int bench_particles()
+{
+  const std::array capacities = { 10000u, 100000u, 1000000u, 4000000u };
+  const int measuredFrames = 256;
+
+  printf( "particles  frame(ms)  cpu draw(ms)\n" );
+  for( uint32_t capacity : capacities )
+  {
+    VulkanEngine engine;
+    engine._particleCapacity = capacity;
+    engine._requestedPresentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+    engine.init();
+
+    // one lifetime fills the pool
+    const float fillMs = engine._particles._emitter.lifetime * 1000;
+    auto warmup = bench_clock::now();
+    for( int i = 0; i < 16 || ms_since( warmup ) < fillMs; ++i )
+      engine.draw();
+
+    const CpuFrameTimes times = time_cpu_frames( engine, measuredFrames );
+    engine.cleanup();
+
+    printf( "%9u  %9.3f  %12.3f\n", capacity, times.frameMs, times.cpuMs );
+  }
+  return 0;
+}
+
+// Frame time of the init_scene workload lit by 16 to 16k point and spot lights
+// scattered over the triangle grid. Every light is binned, the fragment cost
+// follows the lights per cluster, which stays bounded as the lights get smaller.
+static int bench_lights()
+{
+  const std::array lightCounts = { 16u, 64u, 256u, 1024u, 4096u, 16384u };
+  const int warmupFrames = 32;
+  const int measuredFrames = 256;
+
+  VulkanEngine engine;
+  engine._requestedPresentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+  engine.init();
+
+  std::mt19937 rng( 7 );
+  std::uniform_real_distribution< float > unit( 0, 1 );
+  printf( "lights  frame(ms)\n" );
+  for( uint32_t lightCount : lightCounts )
+  {
+    // same total light over the scene, so the radius shrinks as the count grows
+    const float radius = std::max( 0.75f, 24 / std::sqrt( ( float )lightCount ) );
+    engine._lights.clear();
+    for( uint32_t i = 0; i < lightCount; ++i )
+    {
+      Light light;
+      light.type = i % 4 == 0 ? LightType::Spot : LightType::Point;
+      light.position = glm::vec3( unit( rng ) * 40 - 20, 0.5f + unit( rng ) * 2.5f, unit( rng ) * 40 - 20 );
+      light.radius = radius;
+      light.color = glm::vec3( unit( rng ), unit( rng ), unit( rng ) );
+      light.intensity = 4;
+      light.direction = glm::vec3( unit( rng ) - 0.5f, -1, unit( rng ) - 0.5f );
+      engine._lights.push_back( light );
+    }
+
+    for( int i = 0; i < warmupFrames; ++i )
+      engine.draw();
+    auto start = bench_clock::now();
+    for( int i = 0; i < measuredFrames; ++i )
+      engine.draw();
+    printf( "%6u  %9.3f\n", lightCount, ms_since( start ) / measuredFrames );
+  }
+  engine.cleanup();
+  return 0;
+}
+
+// The default scene drawn object by object and with its static objects merged
+// into chunks. Draws are the visible renderables, each one an indirect draw;
+// batches are the multi draws they are recorded with.
+static int bench_static()
+{
+  const int warmupFrames = 32;
+  const int measuredFrames = 512;
+
+  VulkanEngine engine;
+  engine._requestedPresentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+  engine.init();
+
+  printf( "batching  draws  batches  frame(ms)\n" );
+  for( bool batching : { false, true } )
+  {
+    engine.set_static_batching( batching );
+    for( int i = 0; i < warmupFrames; ++i )
+      engine.draw();
+    auto start = bench_clock::now();
+    for( int i = 0; i < measuredFrames; ++i )
+      engine.draw();
+    const double frameMs = ms_since( start ) / measuredFrames;
+    printf( "%-8s  %5zu  %7zu  %9.3f\n",
+            batching ? "on" : "off",
+            engine._snapshot->objects.size(),
+            engine._snapshot->batches.size(),
+            frameMs );
+  }
+  engine.cleanup();
+  return 0;
+}
+
+// Cpu cost of draw() for the default scene with the camera moving every frame,
+// recording the object draws every frame against reusing the recorded ones.
+static int bench_reuse()
+{
+  const int warmupFrames = 32;
+  const int measuredFrames = 512;
+
+  VulkanEngine engine;
+  engine._requestedPresentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+  engine.init();
+  const glm::vec3 camPos = engine._camPos;
+
+  printf( "reuse  recorded  reused  cpu draw(ms)  frame(ms)\n" );
+  for( bool reuse : { false, true } )
+  {
+    engine._reuseDraws = reuse;
+    for( int i = 0; i < warmupFrames; ++i )
+      engine.draw();
+    engine._drawsRecorded = 0;
+    engine._drawsReused = 0;
+
+    const CpuFrameTimes times = time_cpu_frames( engine, measuredFrames, [ & ]( int i ) {
+      engine._camPos = camPos + glm::vec3( std::sin( i * 0.05f ) * 4, 0, 0 );
+    } );
+    printf( "%-5s  %8u  %6u  %12.3f  %9.3f\n",
+            reuse ? "on" : "off",
+            engine._drawsRecorded,
+            engine._drawsReused,
+            times.cpuMs,
+            times.frameMs );
+  }
+  engine.cleanup();
+  return 0;
+}
+
+// Frame cost of 16 to 2048 skinned tentacles added to the default scene. Every one
+// is posed on the cpu and skinned once per frame by the compute pass, then drawn by
+// the shadow and main passes from the skinned vertices. cpu draw() only grows with
+// the posing.
+static int bench_skinning()
+{
+  const std::array counts = { 16u, 128u, 512u, 2048u };
+  const int warmupFrames = 32;
+  const int measuredFrames = 256;
+
+  VulkanEngine engine;
+  engine._requestedPresentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+  engine._skinnedVertexCapacity = 2 << 20;
+  engine.init();
+
+  RenderObject tentacle;
+  tentacle.mesh = engine.get_mesh( hash_name( "tentacle" ) );
+  tentacle.material = engine.get_material( hash_name( "defaultmesh" ) );
+  const uint32_t side = 48;
+  uint32_t added = 0;
+
+  printf( "skinned  vertices  cpu draw(ms)  frame(ms)\n" );
+  for( uint32_t count : counts )
+  {
+    // a growing square of them in front of the camera
+    for( ; added < count; ++added )
+    {
+      const glm::vec3 position = { ( ( int )( added % side ) - ( int )side / 2 ) * 0.5f, 0, -( float )( added / side ) * 0.5f };
+      tentacle.transformMatrix = glm::translate( glm::mat4( 1 ), position );
+      engine.add_renderable( tentacle );
+    }
+
+    for( int i = 0; i < warmupFrames; ++i )
+      engine.draw();
+    const CpuFrameTimes times = time_cpu_frames( engine, measuredFrames );
+    printf( "%7u  %8u  %12.3f  %9.3f\n", count, engine._skinnedVertexCount, times.cpuMs, times.frameMs );
+  }
+  engine.cleanup();
+  return 0;
+}
+
+// Gpu time of the post processing passes on the default scene at the window size,
+// averaged over the measured frames. The timings are read back FRAME_OVERLAP frames
+// late, the warmup covers that.
+static int bench_post()
+{
+  const int warmupFrames = 32;
+  const int measuredFrames = 256;
+
+  VulkanEngine engine;
+  engine._requestedPresentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+  engine.init();
+  if( engine._graphicsTimestampPeriod == 0 )
+  {
+    std::cout << "the graphics queue has no timestamps" << std::endl;
+    engine.cleanup();
+    return 1;
+  }
+
+  for( int i = 0; i < warmupFrames; ++i )
+    engine.draw();
+  PostTimings sum;
+  auto start = bench_clock::now();
+  for( int i = 0; i < measuredFrames; ++i )
+  {
+    engine.draw();
+    const PostTimings timings = engine._post.get_timings();
+    sum.bloomDownMs += timings.bloomDownMs;
+    sum.bloomUpMs += timings.bloomUpMs;
+    sum.compositeMs += timings.compositeMs;
+    sum.totalMs += timings.totalMs;
+  }
+  const double frameMs = ms_since( start ) / measuredFrames;
+  printf( "%ux%u, the composite %s the swapchain\n",
+          engine._windowExtent.width,
+          engine._windowExtent.height,
+          engine._swapchainStorage ? "writes" : "copies into" );
+  printf( "downsample(ms)  upsample(ms)  composite(ms)  post total(ms)  frame(ms)\n" );
+  printf( "%14.3f  %12.3f  %13.3f  %14.3f  %9.3f\n",
+          sum.bloomDownMs / measuredFrames,
+          sum.bloomUpMs / measuredFrames,
+          sum.compositeMs / measuredFrames,
+          sum.totalMs / measuredFrames,
+          frameMs );
+  engine.cleanup();
+  return 0;
+}
+
+// World streaming on its own, no device: a 1024x1024 terrain cut into a world file,
+// then flown over at 60 frames a second at up to 90 units a second, with a budget far
+// below what the flight passes over and with ones it all fits into. Counts the frames
+// the loaders fell behind, the first few load the start, and times the cpu side of
+// the updates.
+static int bench_world()
+{
+  const int frames = 480;
+  const int size = 1024;
+
+  std::vector< Vertex > triangles;
+  triangles.reserve( ( size_t )size * size * 6 );
+  for( int z = 0; z < size; ++z )
+  {
+    for( int x = 0; x < size; ++x )
+    {
+      const int corners[ 6 ][ 2 ] = { { 0, 0 }, { 1, 0 }, { 0, 1 }, { 0, 1 }, { 1, 0 }, { 1, 1 } };
+      for( const auto& corner : corners )
+      {
+        Vertex& vertex = triangles.emplace_back();
+        const float px = ( float )( x + corner[ 0 ] - size / 2 );
+        const float pz = ( float )( z + corner[ 1 ] - size / 2 );
+        vertex.position = glm::vec3( px, std::sin( px * 0.05f ) * std::cos( pz * 0.05f ) * 4, pz );
+        vertex.normal = glm::vec3( 0, 1, 0 );
+        vertex.color = glm::vec3( 0.5f );
+        vertex.uv = glm::vec2( px, pz ) / ( float )size;
+      }
+    }
+  }
+  const std::string path = ( std::filesystem::temp_directory_path() / "bench.world" ).string();
+  if( !WorldStreamer::build( triangles, path.c_str(), WorldStreamer::DefaultChunkSize ) )
+    return 1;
+  std::vector< Vertex >().swap( triangles );
+
+  const glm::mat4 projection = glm::perspective( glm::radians( 70.0f ), 1700.0f / 900.0f, 0.1f, 200.0f );
+  printf( "budget(MiB)  loaded  evicted  peak resident(MiB)  missing frames  update(ms)\n" );
+  for( uint64_t budgetMiB : { 16, 64, 256 } )
+  {
+    WorldStreamer world;
+    world._budgetBytes = budgetMiB << 20;
+    if( !world.open( path.c_str() ) )
+      return 1;
+
+    double updateMs = 0;
+    uint64_t peakBytes = 0;
+    bench_clock::time_point deadline = bench_clock::now();
+    for( int i = 0; i < frames; ++i )
+    {
+      const float t = i / 60.0f;
+      const glm::vec3 position( std::sin( t * 0.3f ) * 300, 10, std::cos( t * 0.2f ) * 300 );
+      const glm::vec3 forward = glm::normalize( glm::vec3( std::cos( t * 0.3f ), -0.2f, -std::sin( t * 0.2f ) ) );
+      const glm::mat4 view = glm::lookAt( position, position + forward, glm::vec3( 0, 1, 0 ) );
+      auto start = bench_clock::now();
+      world.update( position, forward, Frustum::from_matrix( projection * view ) );
+      updateMs += ms_since( start );
+      world.get_uploads().clear();
+      peakBytes = std::max( peakBytes, world.get_stats().residentBytes );
+      deadline += std::chrono::microseconds( 16667 );
+      std::this_thread::sleep_until( deadline );
+    }
+    const WorldStreamStats stats = world.get_stats();
+    printf( "%11u  %6u  %7u  %18.1f  %8u / %3d  %10.3f\n",
+            ( uint32_t )budgetMiB,
+            stats.loaded,
+            stats.evicted,
+            peakBytes / ( 1024.0 * 1024.0 ),
+            stats.missingFrames,
+            frames,
+            updateMs / frames );
+    world.close();
+  }
+  std::filesystem::remove( path );
+  return 0;
+}
+
+int run_bench( const char* name )
+{
+  if( strcmp( name, "bvh" ) == 0 )
+    return bench_bvh();
+  if( strcmp( name, "frame" ) == 0 )
+    return bench_frame();
+  if( strcmp( name, "dispatch" ) == 0 )
+    return bench_dispatch();
+  if( strcmp( name, "particles" ) == 0 )
+    return bench_particles();
+  if( strcmp( name, "lights" ) == 0 )
+    return bench_lights();
+  if( strcmp( name, "static" ) == 0 )
+    return bench_static();
+  if( strcmp( name, "reuse" ) == 0 )
+    return bench_reuse();
+  if( strcmp( name, "skinning" ) == 0 )
+    return bench_skinning();
+  if( strcmp( name, "post" ) == 0 )
+    return bench_post();
+  if( strcmp( name, "world" ) == 0 )
+    return bench_world();
+
+  std::cout << "unknown benchmark " << name << std::endl;
+  return 1;
+}
+
@@ -0,0 +1,8 @@
+﻿#pragma once
+
+// Standalone benchmarks, run with `vulkan_guide --bench <name>`.
+// All but the bvh benchmark create a window and a vulkan device.
+//
+// returns the process exit code, nonzero if the benchmark name is unknown
+int run_bench( const char* name );
+
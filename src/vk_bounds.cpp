@@ -0,0 +1,126 @@
+﻿#include <vk_bounds.h>
+#include <algorithm>
+
+float AABB::area() const
+{
+  glm::vec3 d = max - min;
+  return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+void AABB::grow( const glm::vec3& p )
+{
+  min = glm::min( min, p );
+  max = glm::max( max, p );
+}
+
+void AABB::grow( const AABB& other )
+{
+  min = glm::min( min, other.min );
+  max = glm::max( max, other.max );
+}
+
+bool AABB::contains( const AABB& other ) const
+{
+  return min.x <= other.min.x && min.y <= other.min.y && min.z <= other.min.z &&
+         max.x >= other.max.x && max.y >= other.max.y && max.z >= other.max.z;
+}
+
+bool AABB::overlaps( const AABB& other ) const
+{
+  return min.x <= other.max.x && max.x >= other.min.x &&
+         min.y <= other.max.y && max.y >= other.min.y &&
+         min.z <= other.max.z && max.z >= other.min.z;
+}
+
+AABB AABB::merge( const AABB& a, const AABB& b )
+{
+  AABB result;
+  result.min = glm::min( a.min, b.min );
+  result.max = glm::max( a.max, b.max );
+  return result;
+}
+
+AABB transform_aabb( const AABB& box, const glm::mat4& m )
+{
+  if( box.is_empty() )
+    return box;
+
+  // start at the translation and add the min/max contribution of each axis
+  AABB result;
+  result.min = glm::vec3( m[ 3 ] );
+  result.max = glm::vec3( m[ 3 ] );
+  for( int col = 0; col < 3; ++col )
+  {
+    for( int row = 0; row < 3; ++row )
+    {
+      float a = m[ col ][ row ] * box.min[ col ];
+      float b = m[ col ][ row ] * box.max[ col ];
+      result.min[ row ] += std::min( a, b );
+      result.max[ row ] += std::max( a, b );
+    }
+  }
+  return result;
+}
+
+bool Ray::intersect( const AABB& box, float tMax, float* tHit ) const
+{
+  // slab test, division by zero gives +-inf which the min/max handle
+  glm::vec3 invDir = 1.0f / dir;
+  glm::vec3 t0 = ( box.min - origin ) * invDir;
+  glm::vec3 t1 = ( box.max - origin ) * invDir;
+  glm::vec3 tNear = glm::min( t0, t1 );
+  glm::vec3 tFar = glm::max( t0, t1 );
+  float tEnter = std::max( std::max( tNear.x, tNear.y ), std::max( tNear.z, 0.0f ) );
+  float tExit = std::min( std::min( tFar.x, tFar.y ), std::min( tFar.z, tMax ) );
+  if( tEnter > tExit )
+    return false;
+  if( tHit )
+    *tHit = tEnter;
+  return true;
+}
+
+Frustum Frustum::from_matrix( const glm::mat4& viewProj )
+{
+  // glm matrices are column major, so row i is ( m[0][i], m[1][i], m[2][i], m[3][i] )
+  const glm::mat4 t = glm::transpose( viewProj );
+  Frustum frustum;
+  frustum.planes[ Left ] = t[ 3 ] + t[ 0 ];
+  frustum.planes[ Right ] = t[ 3 ] - t[ 0 ];
+  frustum.planes[ Bottom ] = t[ 3 ] + t[ 1 ];
+  frustum.planes[ Top ] = t[ 3 ] - t[ 1 ];
+  frustum.planes[ Near ] = t[ 3 ] + t[ 2 ];
+  frustum.planes[ Far ] = t[ 3 ] - t[ 2 ];
+  for( glm::vec4& plane : frustum.planes )
+    plane /= glm::length( glm::vec3( plane ) );
+  return frustum;
+}
+
+FrustumTest Frustum::test( const AABB& box, uint32_t* planeMask ) const
+{
+  const glm::vec3 center = box.center();
+  const glm::vec3 extents = box.extents();
+  FrustumTest result = FrustumTest::Inside;
+  for( int i = 0; i < PlaneCount; ++i )
+  {
+    const uint32_t bit = 1u << i;
+    if( !( *planeMask & bit ) )
+      continue;
+    const glm::vec3 n = glm::vec3( planes[ i ] );
+    const float dist = glm::dot( n, center ) + planes[ i ].w;
+    const float radius = glm::dot( extents, glm::abs( n ) );
+    if( dist < -radius )
+      return FrustumTest::Outside;
+    if( dist < radius )
+      result = FrustumTest::Intersecting;
+    else
+      *planeMask &= ~bit;
+  }
+  return result;
+}
+
+bool Frustum::is_visible( const AABB& box ) const
+{
+  uint32_t mask = AllPlanes;
+  return test( box, &mask ) != FrustumTest::Outside;
+}
+
@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include <glm/glm.hpp>
+#include <cfloat>
+#include <cstdint>
+
+// Axis aligned bounding box. Default constructed boxes are empty (min > max)
+// so that they can be grown point by point.
+struct AABB
+{
+  glm::vec3 min = glm::vec3( FLT_MAX );
+  glm::vec3 max = glm::vec3( -FLT_MAX );
+
+  bool is_empty() const { return min.x > max.x; }
+  glm::vec3 center() const { return ( min + max ) * 0.5f; }
+  glm::vec3 extents() const { return ( max - min ) * 0.5f; }
+
+  // half the surface area, which is all the sah cost needs
+  float area() const;
+
+  void grow( const glm::vec3& p );
+  void grow( const AABB& other );
+  bool contains( const AABB& other ) const;
+  bool overlaps( const AABB& other ) const;
+
+  static AABB merge( const AABB& a, const AABB& b );
+};
+
+// Transforms a local space box by an affine matrix and returns the world space
+// box that encloses it ( Arvo )
+AABB transform_aabb( const AABB& box, const glm::mat4& m );
+
+struct Ray
+{
+  glm::vec3 origin;
+  glm::vec3 dir;
+
+  // returns false on miss, otherwise the entry distance is written to tHit
+  bool intersect( const AABB& box, float tMax, float* tHit ) const;
+};
+
+enum class FrustumTest
+{
+  Outside,
+  Intersecting,
+  Inside,
+};
+
+// Six planes pointing inward, extracted from a clip matrix ( Gribb / Hartmann ).
+// Planes are stored as ( normal, d ) with dot( normal, p ) + d >= 0 for points inside.
+struct Frustum
+{
+  enum { Left, Right, Bottom, Top, Near, Far, PlaneCount };
+  glm::vec4 planes[ PlaneCount ];
+
+  static Frustum from_matrix( const glm::mat4& viewProj );
+
+  // Tests only the planes whose bit is set in *planeMask. Planes the box is fully
+  // inside are cleared from the mask so children of the box can skip them.
+  FrustumTest test( const AABB& box, uint32_t* planeMask ) const;
+  bool is_visible( const AABB& box ) const;
+
+  static const uint32_t AllPlanes = ( 1u << PlaneCount ) - 1;
+};
+
@@ -0,0 +1,218 @@
+﻿#include <vk_bvh.h>
+#include <algorithm>
+#include <cassert>
+
+int DynamicBVH::allocate_node()
+{
+  if( _freeList == NullNode )
+  {
+    _nodes.emplace_back();
+    _freeList = ( int )_nodes.size() - 1;
+    _nodes[ _freeList ].parent = NullNode;
+  }
+  int node = _freeList;
+  _freeList = _nodes[ node ].parent;
+  _nodes[ node ] = Node();
+  return node;
+}
+
+void DynamicBVH::free_node( int node )
+{
+  _nodes[ node ].parent = _freeList;
+  _nodes[ node ].height = -1;
+  _freeList = node;
+}
+
+int DynamicBVH::create_proxy( const AABB& box, uint32_t userData )
+{
+  int proxy = allocate_node();
+  Node& n = _nodes[ proxy ];
+  n.box.min = box.min - glm::vec3( _margin );
+  n.box.max = box.max + glm::vec3( _margin );
+  n.userData = userData;
+  n.height = 0;
+  insert_leaf( proxy );
+  ++_proxyCount;
+  return proxy;
+}
+
+void DynamicBVH::destroy_proxy( int proxy )
+{
+  assert( _nodes[ proxy ].is_leaf() );
+  remove_leaf( proxy );
+  free_node( proxy );
+  --_proxyCount;
+}
+
+bool DynamicBVH::move_proxy( int proxy, const AABB& box )
+{
+  assert( _nodes[ proxy ].is_leaf() );
+  if( _nodes[ proxy ].box.contains( box ) )
+    return false;
+
+  remove_leaf( proxy );
+  _nodes[ proxy ].box.min = box.min - glm::vec3( _margin );
+  _nodes[ proxy ].box.max = box.max + glm::vec3( _margin );
+  insert_leaf( proxy );
+  return true;
+}
+
+void DynamicBVH::clear()
+{
+  _nodes.clear();
+  _root = NullNode;
+  _freeList = NullNode;
+  _proxyCount = 0;
+}
+
+void DynamicBVH::insert_leaf( int leaf )
+{
+  if( _root == NullNode )
+  {
+    _root = leaf;
+    _nodes[ leaf ].parent = NullNode;
+    return;
+  }
+
+  // Find the best sibling by walking down the tree. The cost of making a node
+  // the sibling is the area of the new parent plus the growth of every ancestor.
+  const AABB leafBox = _nodes[ leaf ].box;
+  int index = _root;
+  while( !_nodes[ index ].is_leaf() )
+  {
+    const Node& n = _nodes[ index ];
+    const float area = n.box.area();
+    const float combinedArea = AABB::merge( n.box, leafBox ).area();
+
+    // cost of creating a new parent for this node and the leaf
+    const float cost = 2 * combinedArea;
+
+    // minimum cost of pushing the leaf further down
+    const float inheritanceCost = 2 * ( combinedArea - area );
+
+    auto child_cost = [ & ]( int child ) {
+      const Node& c = _nodes[ child ];
+      const float newArea = AABB::merge( leafBox, c.box ).area();
+      return c.is_leaf() ? newArea + inheritanceCost
+                         : ( newArea - c.box.area() ) + inheritanceCost;
+    };
+    const float cost1 = child_cost( n.child1 );
+    const float cost2 = child_cost( n.child2 );
+
+    if( cost < cost1 && cost < cost2 )
+      break;
+    index = cost1 < cost2 ? n.child1 : n.child2;
+  }
+
+  const int sibling = index;
+  const int oldParent = _nodes[ sibling ].parent;
+  const int newParent = allocate_node();
+  _nodes[ newParent ].parent = oldParent;
+  _nodes[ newParent ].box = AABB::merge( leafBox, _nodes[ sibling ].box );
+  _nodes[ newParent ].height = _nodes[ sibling ].height + 1;
+  _nodes[ newParent ].child1 = sibling;
+  _nodes[ newParent ].child2 = leaf;
+  _nodes[ sibling ].parent = newParent;
+  _nodes[ leaf ].parent = newParent;
+
+  if( oldParent == NullNode )
+    _root = newParent;
+  else if( _nodes[ oldParent ].child1 == sibling )
+    _nodes[ oldParent ].child1 = newParent;
+  else
+    _nodes[ oldParent ].child2 = newParent;
+
+  refit_ancestors( _nodes[ leaf ].parent );
+}
+
+void DynamicBVH::remove_leaf( int leaf )
+{
+  if( leaf == _root )
+  {
+    _root = NullNode;
+    return;
+  }
+
+  const int parent = _nodes[ leaf ].parent;
+  const int grandParent = _nodes[ parent ].parent;
+  const int sibling = _nodes[ parent ].child1 == leaf ? _nodes[ parent ].child2 : _nodes[ parent ].child1;
+
+  // the sibling takes the place of the parent
+  if( grandParent == NullNode )
+  {
+    _root = sibling;
+    _nodes[ sibling ].parent = NullNode;
+    free_node( parent );
+    return;
+  }
+
+  if( _nodes[ grandParent ].child1 == parent )
+    _nodes[ grandParent ].child1 = sibling;
+  else
+    _nodes[ grandParent ].child2 = sibling;
+  _nodes[ sibling ].parent = grandParent;
+  free_node( parent );
+  refit_ancestors( grandParent );
+}
+
+void DynamicBVH::refit_ancestors( int node )
+{
+  while( node != NullNode )
+  {
+    node = balance( node );
+    Node& n = _nodes[ node ];
+    n.box = AABB::merge( _nodes[ n.child1 ].box, _nodes[ n.child2 ].box );
+    n.height = 1 + std::max( _nodes[ n.child1 ].height, _nodes[ n.child2 ].height );
+    node = n.parent;
+  }
+}
+
+// If a is imbalanced, rotate the taller child up. Returns the new subtree root.
+int DynamicBVH::balance( int iA )
+{
+  Node& A = _nodes[ iA ];
+  if( A.is_leaf() || A.height < 2 )
+    return iA;
+
+  const int iB = A.child1;
+  const int iC = A.child2;
+  const int heightDiff = _nodes[ iC ].height - _nodes[ iB ].height;
+  if( heightDiff >= -1 && heightDiff <= 1 )
+    return iA;
+
+  // rotate the taller child ( up ) above A
+  const int iUp = heightDiff > 1 ? iC : iB;
+  const int iStay = heightDiff > 1 ? iB : iC;
+  Node& Up = _nodes[ iUp ];
+  const int iF = Up.child1;
+  const int iG = Up.child2;
+
+  Up.child1 = iA;
+  Up.parent = A.parent;
+  A.parent = iUp;
+  if( Up.parent == NullNode )
+    _root = iUp;
+  else if( _nodes[ Up.parent ].child1 == iA )
+    _nodes[ Up.parent ].child1 = iUp;
+  else
+    _nodes[ Up.parent ].child2 = iUp;
+
+  // the taller grandchild stays under up, the shorter one moves under A
+  const bool fTaller = _nodes[ iF ].height > _nodes[ iG ].height;
+  const int iKeep = fTaller ? iF : iG;
+  const int iMove = fTaller ? iG : iF;
+  Up.child2 = iKeep;
+  if( heightDiff > 1 )
+    A.child2 = iMove;
+  else
+    A.child1 = iMove;
+  _nodes[ iMove ].parent = iA;
+
+  const Node& stay = _nodes[ iStay ];
+  A.box = AABB::merge( stay.box, _nodes[ iMove ].box );
+  A.height = 1 + std::max( stay.height, _nodes[ iMove ].height );
+  Up.box = AABB::merge( A.box, _nodes[ iKeep ].box );
+  Up.height = 1 + std::max( A.height, _nodes[ iKeep ].height );
+  return iUp;
+}
+
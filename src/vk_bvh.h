@@ -0,0 +1,205 @@
+﻿#pragma once
+
+#include <vk_bounds.h>
+#include <vector>
+
+// Dynamic bounding volume hierarchy ( same idea as box2d's b2DynamicTree ).
+//
+// Leaves store a "fat" box that is slightly bigger than the object so that
+// small movements don't touch the tree. Inserts pick a sibling with the
+// surface area heuristic and the tree is kept balanced with rotations.
+//
+// Proxies are the node index of the leaf and stay valid until destroy_proxy.
+class DynamicBVH
+{
+public:
+  static const int NullNode = -1;
+
+  // fattening margin added around each leaf, in world units
+  float _margin = 0.1f;
+
+  int create_proxy( const AABB& box, uint32_t userData );
+  void destroy_proxy( int proxy );
+
+  // Refit for a moving object. Returns false if the fat box still contains
+  // the new box and the tree was left untouched.
+  bool move_proxy( int proxy, const AABB& box );
+
+  uint32_t get_user_data( int proxy ) const { return _nodes[ proxy ].userData; }
+  void set_user_data( int proxy, uint32_t userData ) { _nodes[ proxy ].userData = userData; }
+  const AABB& get_fat_aabb( int proxy ) const { return _nodes[ proxy ].box; }
+
+  // Calls visit( userData ) for every leaf touching the frustum. Subtrees outside
+  // the frustum are rejected and subtrees fully inside skip all further plane tests.
+  template< typename Visitor >
+  void query_frustum( const Frustum& frustum, Visitor&& visit ) const;
+
+  // Calls visit( userData ) for every leaf overlapping the box
+  template< typename Visitor >
+  void query_aabb( const AABB& box, Visitor&& visit ) const;
+
+  // Calls visit( userData, tMax ) for every leaf the ray enters before tMax, nearest
+  // subtree first. visit returns the new tMax, so returning the hit distance of an
+  // exact test turns this into a closest hit query.
+  template< typename Visitor >
+  void query_ray( const Ray& ray, float tMax, Visitor&& visit ) const;
+
+  int get_height() const { return _root == NullNode ? 0 : _nodes[ _root ].height; }
+  int get_proxy_count() const { return _proxyCount; }
+  void clear();
+
+private:
+  // traversal stacks live on the stack so queries never allocate. The tree is
+  // kept balanced, so its height stays far below this even at millions of leaves.
+  static const int MaxStackDepth = 128;
+
+  struct Node
+  {
+    AABB box;
+    int parent = NullNode; // doubles as the next link while on the free list
+    int child1 = NullNode;
+    int child2 = NullNode;
+    int height = 0; // leaf = 0, free = -1
+    uint32_t userData = 0;
+    bool is_leaf() const { return child1 == NullNode; }
+  };
+
+  int allocate_node();
+  void free_node( int node );
+  void insert_leaf( int leaf );
+  void remove_leaf( int leaf );
+  int balance( int node );
+  void refit_ancestors( int node );
+
+  template< typename Visitor >
+  void visit_subtree( int node, Visitor& visit ) const;
+
+  std::vector< Node > _nodes;
+  int _root = NullNode;
+  int _freeList = NullNode;
+  int _proxyCount = 0;
+};
+
+template< typename Visitor >
+void DynamicBVH::visit_subtree( int node, Visitor& visit ) const
+{
+  int stack[ MaxStackDepth ];
+  int stackSize = 0;
+  stack[ stackSize++ ] = node;
+  while( stackSize )
+  {
+    const Node& n = _nodes[ stack[ --stackSize ] ];
+    if( n.is_leaf() )
+    {
+      visit( n.userData );
+      continue;
+    }
+    stack[ stackSize++ ] = n.child1;
+    stack[ stackSize++ ] = n.child2;
+  }
+}
+
+template< typename Visitor >
+void DynamicBVH::query_frustum( const Frustum& frustum, Visitor&& visit ) const
+{
+  if( _root == NullNode )
+    return;
+
+  // plane masks travel with the node so children only test planes the parent straddles
+  struct Entry { int node; uint32_t planeMask; };
+  Entry stack[ MaxStackDepth ];
+  int stackSize = 0;
+  stack[ stackSize++ ] = { _root, Frustum::AllPlanes };
+  while( stackSize )
+  {
+    Entry entry = stack[ --stackSize ];
+    const Node& n = _nodes[ entry.node ];
+    FrustumTest result = frustum.test( n.box, &entry.planeMask );
+    if( result == FrustumTest::Outside )
+      continue;
+    if( result == FrustumTest::Inside || n.is_leaf() )
+    {
+      visit_subtree( entry.node, visit );
+      continue;
+    }
+    stack[ stackSize++ ] = { n.child1, entry.planeMask };
+    stack[ stackSize++ ] = { n.child2, entry.planeMask };
+  }
+}
+
+template< typename Visitor >
+void DynamicBVH::query_aabb( const AABB& box, Visitor&& visit ) const
+{
+  if( _root == NullNode )
+    return;
+
+  int stack[ MaxStackDepth ];
+  int stackSize = 0;
+  stack[ stackSize++ ] = _root;
+  while( stackSize )
+  {
+    const Node& n = _nodes[ stack[ --stackSize ] ];
+    if( !n.box.overlaps( box ) )
+      continue;
+    if( n.is_leaf() )
+    {
+      visit( n.userData );
+      continue;
+    }
+    stack[ stackSize++ ] = n.child1;
+    stack[ stackSize++ ] = n.child2;
+  }
+}
+
+template< typename Visitor >
+void DynamicBVH::query_ray( const Ray& ray, float tMax, Visitor&& visit ) const
+{
+  if( _root == NullNode )
+    return;
+
+  struct Entry { int node; float tEnter; };
+  Entry stack[ MaxStackDepth ];
+  int stackSize = 0;
+  float tRoot;
+  if( !ray.intersect( _nodes[ _root ].box, tMax, &tRoot ) )
+    return;
+  stack[ stackSize++ ] = { _root, tRoot };
+  while( stackSize )
+  {
+    Entry entry = stack[ --stackSize ];
+
+    // a closer hit may have been found since this entry was pushed
+    if( entry.tEnter > tMax )
+      continue;
+    const Node& n = _nodes[ entry.node ];
+    if( n.is_leaf() )
+    {
+      tMax = visit( n.userData, tMax );
+      continue;
+    }
+
+    float t1, t2;
+    bool hit1 = ray.intersect( _nodes[ n.child1 ].box, tMax, &t1 );
+    bool hit2 = ray.intersect( _nodes[ n.child2 ].box, tMax, &t2 );
+
+    // push the far child first so the near one is popped first
+    if( hit1 && hit2 )
+    {
+      if( t1 < t2 )
+      {
+        stack[ stackSize++ ] = { n.child2, t2 };
+        stack[ stackSize++ ] = { n.child1, t1 };
+      }
+      else
+      {
+        stack[ stackSize++ ] = { n.child1, t1 };
+        stack[ stackSize++ ] = { n.child2, t2 };
+      }
+    }
+    else if( hit1 )
+      stack[ stackSize++ ] = { n.child1, t1 };
+    else if( hit2 )
+      stack[ stackSize++ ] = { n.child2, t2 };
+  }
+}
+
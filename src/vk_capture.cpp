@@ -0,0 +1,290 @@
+﻿#include <vk_capture.h>
+#include <vk_engine.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+// Layout, counts are uint32:
+//   magic, version
+//   object count, objects: mesh, material, 16 floats transform, uint8 static
+//   light count, lights: uint32 type, 14 floats in Light's order
+//   ambient, sun direction, sun color, 3 floats each
+//   frame count, frames: camera position, transform count, transforms: object, 16 floats,
+//   event count, events: type, code, x, y
+static const uint32_t CaptureMagic = 0x50434b56; // "VKCP"
+static const uint32_t CaptureVersion = 1;
+
+template< typename T >
+static void put( std::vector< char >& out, const T& value )
+{
+  const char* bytes = ( const char* )&value;
+  out.insert( out.end(), bytes, bytes + sizeof( T ) );
+}
+
+// reads past the end leave the value alone and fail the reader
+class CaptureReader
+{
+public:
+  CaptureReader( const std::vector< char >& data ) : _data( data ) {}
+
+  template< typename T >
+  T get()
+  {
+    T value = {};
+    if( _offset + sizeof( T ) > _data.size() )
+    {
+      _failed = true;
+      return value;
+    }
+    memcpy( &value, _data.data() + _offset, sizeof( T ) );
+    _offset += sizeof( T );
+    return value;
+  }
+
+  // a count of elements at least minSize bytes each, 0 if the file can't hold that many
+  uint32_t get_count( size_t minSize )
+  {
+    const uint32_t count = get< uint32_t >();
+    if( ( _data.size() - std::min( _offset, _data.size() ) ) / minSize < count )
+    {
+      _failed = true;
+      return 0;
+    }
+    return count;
+  }
+
+  bool failed() const { return _failed; }
+
+private:
+  const std::vector< char >& _data;
+  size_t _offset = 0;
+  bool _failed = false;
+};
+
+bool Capture::save( const char* path ) const
+{
+  std::vector< char > out;
+  put( out, CaptureMagic );
+  put( out, CaptureVersion );
+
+  put( out, ( uint32_t )objects.size() );
+  for( const CaptureObject& object : objects )
+  {
+    put( out, object.mesh );
+    put( out, object.material );
+    put( out, object.transform );
+    put( out, ( uint8_t )object.isStatic );
+  }
+
+  put( out, ( uint32_t )lights.size() );
+  for( const Light& light : lights )
+  {
+    put( out, ( uint32_t )light.type );
+    put( out, light.position );
+    put( out, light.radius );
+    put( out, light.color );
+    put( out, light.intensity );
+    put( out, light.direction );
+    put( out, light.innerAngle );
+    put( out, light.outerAngle );
+  }
+  put( out, ambientLight );
+  put( out, sunDirection );
+  put( out, sunColor );
+
+  put( out, ( uint32_t )frames.size() );
+  for( const CaptureFrame& frame : frames )
+  {
+    put( out, frame.cameraPosition );
+    put( out, ( uint32_t )frame.transforms.size() );
+    for( const CaptureTransform& transform : frame.transforms )
+    {
+      put( out, transform.object );
+      put( out, transform.transform );
+    }
+    put( out, ( uint32_t )frame.events.size() );
+    for( const CaptureEvent& event : frame.events )
+      put( out, event );
+  }
+
+  std::ofstream file( path, std::ios::binary );
+  file.write( out.data(), out.size() );
+  if( !file )
+  {
+    std::cout << "could not write capture " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool Capture::load( const char* path )
+{
+  std::ifstream file( path, std::ios::binary | std::ios::ate );
+  if( !file.is_open() )
+  {
+    std::cout << "could not open capture " << path << std::endl;
+    return false;
+  }
+  std::vector< char > data( ( size_t )file.tellg() );
+  file.seekg( 0 );
+  file.read( data.data(), data.size() );
+
+  CaptureReader in( data );
+  if( in.get< uint32_t >() != CaptureMagic || in.get< uint32_t >() != CaptureVersion )
+  {
+    std::cout << path << " is not a capture of this version" << std::endl;
+    return false;
+  }
+
+  objects.resize( in.get_count( 73 ) );
+  for( CaptureObject& object : objects )
+  {
+    object.mesh = in.get< NameHash >();
+    object.material = in.get< NameHash >();
+    object.transform = in.get< glm::mat4 >();
+    object.isStatic = in.get< uint8_t >() != 0;
+  }
+
+  lights.resize( in.get_count( 60 ) );
+  for( Light& light : lights )
+  {
+    light.type = ( LightType )in.get< uint32_t >();
+    light.position = in.get< glm::vec3 >();
+    light.radius = in.get< float >();
+    light.color = in.get< glm::vec3 >();
+    light.intensity = in.get< float >();
+    light.direction = in.get< glm::vec3 >();
+    light.innerAngle = in.get< float >();
+    light.outerAngle = in.get< float >();
+  }
+  ambientLight = in.get< glm::vec3 >();
+  sunDirection = in.get< glm::vec3 >();
+  sunColor = in.get< glm::vec3 >();
+
+  frames.resize( in.get_count( 20 ) );
+  for( CaptureFrame& frame : frames )
+  {
+    frame.cameraPosition = in.get< glm::vec3 >();
+    frame.transforms.resize( in.get_count( 68 ) );
+    for( CaptureTransform& transform : frame.transforms )
+    {
+      transform.object = in.get< uint32_t >();
+      transform.transform = in.get< glm::mat4 >();
+    }
+    frame.events.resize( in.get_count( sizeof( CaptureEvent ) ) );
+    for( CaptureEvent& event : frame.events )
+      event = in.get< CaptureEvent >();
+  }
+
+  if( in.failed() )
+  {
+    std::cout << "capture " << path << " is truncated" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool write_timings( const char* path, const std::vector< FrameTiming >& timings )
+{
+  std::ofstream file( path );
+  file << "frame,cpu_ms,frame_ms\n";
+  for( size_t i = 0; i < timings.size(); ++i )
+    file << i << "," << timings[ i ].cpuMs << "," << timings[ i ].frameMs << "\n";
+  if( !file )
+  {
+    std::cout << "could not write timings " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool read_timings( const char* path, std::vector< FrameTiming >& timings )
+{
+  std::ifstream file( path );
+  if( !file.is_open() )
+  {
+    std::cout << "could not open timings " << path << std::endl;
+    return false;
+  }
+  std::string line;
+  std::getline( file, line ); // header
+  while( std::getline( file, line ) )
+  {
+    std::istringstream fields( line );
+    std::string frame, cpu, total;
+    if( !std::getline( fields, frame, ',' ) || !std::getline( fields, cpu, ',' ) || !std::getline( fields, total ) )
+      continue;
+    timings.push_back( { std::stod( cpu ), std::stod( total ) } );
+  }
+  return true;
+}
+
+static double percentile( std::vector< double > values, double p )
+{
+  if( values.empty() )
+    return 0;
+  std::sort( values.begin(), values.end() );
+  return values[ std::min( ( size_t )( p * values.size() ), values.size() - 1 ) ];
+}
+
+static void print_comparison( const char* name, const std::vector< double >& base, const std::vector< double >& next )
+{
+  double baseSum = 0, nextSum = 0;
+  for( double v : base )
+    baseSum += v;
+  for( double v : next )
+    nextSum += v;
+  const double baseMean = baseSum / std::max( base.size(), ( size_t )1 );
+  const double nextMean = nextSum / std::max( next.size(), ( size_t )1 );
+
+  std::cout << name << std::endl;
+  std::cout << "         base(ms)   new(ms)   change" << std::endl;
+  auto row = [ & ]( const char* label, double b, double n ) {
+    printf( "  %-5s %9.3f %9.3f %+8.1f%%\n", label, b, n, b > 0 ? ( n - b ) / b * 100 : 0 );
+  };
+  row( "mean", baseMean, nextMean );
+  row( "p50", percentile( base, 0.5 ), percentile( next, 0.5 ) );
+  row( "p95", percentile( base, 0.95 ), percentile( next, 0.95 ) );
+  row( "p99", percentile( base, 0.99 ), percentile( next, 0.99 ) );
+  row( "max", percentile( base, 1 ), percentile( next, 1 ) );
+}
+
+int compare_timings( const char* basePath, const char* newPath )
+{
+  std::vector< FrameTiming > base, next;
+  if( !read_timings( basePath, base ) || !read_timings( newPath, next ) )
+    return 1;
+  if( base.size() != next.size() )
+    std::cout << "frame counts differ, " << base.size() << " and " << next.size()
+              << ", comparing the first " << std::min( base.size(), next.size() ) << std::endl;
+  const size_t count = std::min( base.size(), next.size() );
+
+  std::vector< double > baseCpu, nextCpu, baseFrame, nextFrame;
+  for( size_t i = 0; i < count; ++i )
+  {
+    baseCpu.push_back( base[ i ].cpuMs );
+    nextCpu.push_back( next[ i ].cpuMs );
+    baseFrame.push_back( base[ i ].frameMs );
+    nextFrame.push_back( next[ i ].frameMs );
+  }
+  print_comparison( "cpu", baseCpu, nextCpu );
+  print_comparison( "frame", baseFrame, nextFrame );
+
+  // the same frame draws the same thing in both, so the worst frames point at what regressed
+  std::vector< size_t > worst( count );
+  for( size_t i = 0; i < count; ++i )
+    worst[ i ] = i;
+  std::sort( worst.begin(), worst.end(), [ & ]( size_t a, size_t b ) {
+    return nextFrame[ a ] - baseFrame[ a ] > nextFrame[ b ] - baseFrame[ b ];
+  } );
+  worst.resize( std::min( count, ( size_t )5 ) );
+  std::cout << "largest frame time increases" << std::endl;
+  for( size_t i : worst )
+    printf( "  frame %zu %.3f -> %.3f ms\n", i, baseFrame[ i ], nextFrame[ i ] );
+  return 0;
+}
@@ -0,0 +1,74 @@
+﻿#pragma once
+
+#include <vk_registry.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+struct Light;
+
+// A renderable of the captured scene, mesh and material by name
+struct CaptureObject
+{
+  NameHash mesh;
+  NameHash material;
+  glm::mat4 transform;
+  bool isStatic;
+};
+
+struct CaptureTransform
+{
+  uint32_t object; // index into the renderables at the time
+  glm::mat4 transform;
+};
+
+// Key and mouse button events, enough to rebuild the SDL_Event
+struct CaptureEvent
+{
+  uint32_t type; // SDL event type
+  int32_t code;  // key sym or mouse button
+  int32_t x;
+  int32_t y;
+};
+
+// what changed before a frame was drawn, in the order it happened
+struct CaptureFrame
+{
+  glm::vec3 cameraPosition;
+  std::vector< CaptureTransform > transforms;
+  std::vector< CaptureEvent > events;
+};
+
+// Scene and per frame input of a run, replayed to compare performance across builds.
+//
+// The file is the scene followed by the frames, little endian, see vk_capture.cpp.
+// Meshes and materials are stored by NameHash, so a capture only replays on a build
+// that registers the same names.
+struct Capture
+{
+  std::vector< CaptureObject > objects;
+  std::vector< Light > lights;
+  glm::vec3 ambientLight;
+  glm::vec3 sunDirection;
+  glm::vec3 sunColor;
+  std::vector< CaptureFrame > frames;
+
+  // return false and print why on failure
+  bool save( const char* path ) const;
+  bool load( const char* path );
+};
+
+// Timing of one replayed frame
+struct FrameTiming
+{
+  double cpuMs;   // draw, from the frame's start to its present
+  double frameMs; // from the previous frame's start
+};
+
+// one line per frame, frame,cpu_ms,frame_ms
+bool write_timings( const char* path, const std::vector< FrameTiming >& );
+
+// Prints percentiles of two timing files written by write_timings and their
+// difference, per frame and overall. Returns the process exit code.
+int compare_timings( const char* basePath, const char* newPath );
@@ -1,5 +1,6 @@
 ﻿#include "vk_engine.h"
 #include "vk_pipeline.h"
+#include "vk_init_graph.h"
 
 #include <SDL.h>
 #include <SDL_vulkan.h>
@@ -8,8 +9,15 @@
 #include <vk_initializers.h>
 #include <iostream>
 #include <array>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <thread>
 #include <glm/gtx/transform.hpp>
+#include <glm/gtc/constants.hpp>
 
 #include "VkBootstrap.h"
 
@@ -33,6 +41,97 @@ static int round_up_nearest_multiple( int val, int mult )
   return ( ( val + mult - 1 ) / mult ) * mult;
 }
 
+// resource names, hashed at compile time
+constexpr NameHash MonkeyMesh = hash_name( "monkey" );
+constexpr NameHash TriangleMesh = hash_name( "triangle" );
+constexpr NameHash DefaultMaterial = hash_name( "defaultmesh" );
+constexpr NameHash TexturedMaterial = hash_name( "texturedmesh" );
+constexpr NameHash TentacleMesh = hash_name( "tentacle" );
+
+// A tapering tube standing on the origin with a chain of joints up its middle.
+// Each ring follows the two joints nearest to it, blended by distance.
+static Mesh build_tentacle( uint32_t jointCount )
+{
+  const uint32_t rings = 2 * jointCount;
+  const uint32_t sides = 8;
+  const float height = 2.0f;
+  const float segment = height / jointCount;
+
+  Mesh mesh;
+  for( uint32_t j = 0; j < jointCount; ++j )
+    mesh._jointPivots.push_back( { 0, j * segment, 0 } );
+
+  auto add_vertex = [ & ]( uint32_t ring, uint32_t side ) {
+    const float y = ring * height / rings;
+    const float angle = side * glm::two_pi< float >() / sides;
+    const float radius = 0.25f - 0.2f * y / height;
+    Vertex vertex;
+    vertex.normal = { std::cos( angle ), 0, std::sin( angle ) };
+    vertex.position = vertex.normal * radius + glm::vec3( 0, y, 0 );
+    vertex.color = glm::mix( glm::vec3( 0.5f, 0.1f, 0.4f ), glm::vec3( 1.0f, 0.6f, 0.3f ), y / height );
+    vertex.uv = { ( float )side / sides, y / height };
+    mesh._verticies.push_back( vertex );
+
+    const float t = y / segment - 0.5f;
+    VertexSkin skin;
+    const uint32_t a = std::min( ( uint32_t )std::max( t, 0.0f ), jointCount - 1 );
+    const uint32_t b = std::min( a + 1, jointCount - 1 );
+    const float w = glm::clamp( t - a, 0.0f, 1.0f );
+    skin.joints = { a, b, 0, 0 };
+    skin.weights = { 1 - w, w, 0, 0 };
+    mesh._skin.push_back( skin );
+  };
+  for( uint32_t r = 0; r < rings; ++r )
+    for( uint32_t s = 0; s < sides; ++s )
+    {
+      const uint32_t next = ( s + 1 ) % sides;
+      for( auto [ ring, side ] : { std::pair( r, s ), std::pair( r + 1, s ), std::pair( r + 1, next ),
+                                   std::pair( r, s ), std::pair( r + 1, next ), std::pair( r, next ) } )
+        add_vertex( ring, side );
+    }
+  mesh.compute_bounds();
+  return mesh;
+}
+
+static float to_ms( std::chrono::steady_clock::duration duration )
+{
+  return std::chrono::duration< float, std::milli >( duration ).count();
+}
+
+static const char* present_mode_name( VkPresentModeKHR mode )
+{
+  switch( mode )
+  {
+    case VK_PRESENT_MODE_IMMEDIATE_KHR: return "immediate";
+    case VK_PRESENT_MODE_MAILBOX_KHR: return "mailbox";
+    case VK_PRESENT_MODE_FIFO_KHR: return "fifo";
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "fifo relaxed";
+    default: return "unknown";
+  }
+}
+
+// tightly packed 8 bit rgba or bgra rows into a binary ppm, alpha dropped
+static bool write_ppm( const std::filesystem::path& path, const uint8_t* pixels, VkExtent2D extent, bool bgra )
+{
+  std::ofstream file( path, std::ios::binary );
+  if( !file.is_open() )
+    return false;
+  file << "P6\n" << extent.width << " " << extent.height << "\n255\n";
+  std::vector< uint8_t > row( extent.width * 3 );
+  for( uint32_t y = 0; y < extent.height; ++y )
+  {
+    const uint8_t* src = pixels + ( size_t )y * extent.width * 4;
+    for( uint32_t x = 0; x < extent.width; ++x, src += 4 )
+    {
+      row[ x * 3 + 0 ] = src[ bgra ? 2 : 0 ];
+      row[ x * 3 + 1 ] = src[ 1 ];
+      row[ x * 3 + 2 ] = src[ bgra ? 0 : 2 ];
+    }
+    file.write( ( const char* )row.data(), row.size() );
+  }
+  return file.good();
+}
+
 
 void VK_CHECK( VkResult err )
 {
@@ -46,7 +145,8 @@ void VulkanEngine::init()
 {
   SDL_Init( SDL_INIT_VIDEO );
 
-  SDL_WindowFlags window_flags = SDL_WINDOW_VULKAN;
+  // a replay is only timed, nobody needs to see it
+  SDL_WindowFlags window_flags = ( SDL_WindowFlags )( SDL_WINDOW_VULKAN | ( _replay ? SDL_WINDOW_HIDDEN : 0 ) );
 
   _window = SDL_CreateWindow( "Vulkan Engine",
                               SDL_WINDOWPOS_UNDEFINED,
@@ -55,15 +155,37 @@ void VulkanEngine::init()
                               _windowExtent.height,
                               window_flags );
 
-  init_vulkan();
-  init_swapchain();
-  init_commands();
-  init_default_renderpass();
-  init_framebuffers();
-  init_sync_structures();
-  init_pipelines();
-  load_meshes();
-  init_scene();
+  for( uint32_t i = 0; i < RenderSnapshotSlots; ++i )
+    _snapshots.get_slot( i ).arena.init( 256 * 1024 );
+
+  // Disk reads and parsing start right away, the rest once the device exists.
+  // The memory manager isn't thread safe, so the steps that track allocations
+  // are chained: buffers, render graph, mesh upload.
+  InitGraph graph;
+  InitGraph::Step readShaders = graph.add_step( "read shaders", {}, [ this ] { read_shaders(); } );
+  InitGraph::Step loadMeshes = graph.add_step( "load meshes", {}, [ this ] { load_meshes(); } );
+  InitGraph::Step vulkan = graph.add_step( "vulkan", {}, [ this ] { init_vulkan(); }, true );
+  InitGraph::Step swapchain = graph.add_step( "swapchain", { vulkan }, [ this ] { init_swapchain(); } );
+  graph.add_step( "commands", { vulkan }, [ this ] { init_commands(); } );
+  graph.add_step( "sync structures", { vulkan }, [ this ] { init_sync_structures(); } );
+  InitGraph::Step buffers = graph.add_step( "buffers", { vulkan }, [ this ] { init_buffers(); } );
+  InitGraph::Step renderGraph = graph.add_step( "render graph", { swapchain, buffers }, [ this ] { init_render_graph(); } );
+  InitGraph::Step layouts = graph.add_step( "descriptor layouts", { vulkan }, [ this ] { init_descriptor_layouts(); } );
+  graph.add_step( "descriptors", { layouts, renderGraph }, [ this ] { init_descriptors(); } );
+  InitGraph::Step pipelines = graph.add_step( "pipelines",
+                                              { readShaders, layouts, renderGraph },
+                                              [ this ] { init_pipelines(); } );
+  graph.add_step( "compute pipelines", { readShaders, layouts }, [ this ] { init_compute_pipelines(); } );
+  graph.add_step( "upload meshes", { loadMeshes, renderGraph }, [ this ] { upload_meshes(); } );
+  // only reads the mesh bounds, so it doesn't wait for the upload
+  graph.add_step( "scene", { loadMeshes, pipelines }, [ this ] { init_scene(); } );
+  graph.run( std::thread::hardware_concurrency() );
+
+  _shaderFiles.clear();
+  graph.print_report();
+
+  if( !_capturePath.empty() )
+    begin_capture();
 
   _isInitialized = true;
 }
@@ -72,16 +194,71 @@ void VulkanEngine::cleanup()
 {
   if( _isInitialized )
   {
-    // Destroying the pool destroys all its comand buffers
-    vkDestroyCommandPool( _device, _commandPool, nullptr );
+    vkDeviceWaitIdle( _device );
+
+    _world.close();
+    _memory.destroy();
+    for( RetiredBuffer& retired : _retiredChunkBuffers )
+      vmaDestroyBuffer( _allocator, retired.buffer._buffer, retired.buffer._allocation );
+    for( Mesh& mesh : _meshes )
+      if( mesh._vertexBuffer._buffer )
+        vmaDestroyBuffer( _allocator, mesh._vertexBuffer._buffer, mesh._vertexBuffer._allocation );
+
+    _particles.destroy();
+    _skinning.destroy();
+    _post.destroy();
+    _virtualTexture.destroy();
+    // screenshots of the last frames are still written
+    _readback.finish();
+    _readback.destroy();
+    wait_for_screenshots();
+    vkDestroyPipeline( _device, _cullPipeline, nullptr );
+    vkDestroyPipelineLayout( _device, _cullLayout, nullptr );
+    vkDestroyPipeline( _device, _lightCullPipeline, nullptr );
+    vkDestroyPipelineLayout( _device, _lightCullLayout, nullptr );
+    vkDestroyPipeline( _device, _depthReducePipeline, nullptr );
+    vkDestroyPipelineLayout( _device, _depthReduceLayout, nullptr );
+    vkDestroyDescriptorPool( _device, _descriptorPool, nullptr );
+    vkDestroyDescriptorSetLayout( _device, _objectSetLayout, nullptr );
+    vkDestroyDescriptorSetLayout( _device, _depthReduceSetLayout, nullptr );
+    vkDestroyDescriptorSetLayout( _device, _cullSetLayout, nullptr );
+    vkDestroyDescriptorSetLayout( _device, _lightSetLayout, nullptr );
+    vmaUnmapMemory( _allocator, _cullStatsBuffer._allocation );
+    _frameRing.destroy();
+    vmaDestroyBuffer( _allocator, _visibilityBuffer._buffer, _visibilityBuffer._allocation );
+    vmaDestroyBuffer( _allocator, _cullStatsBuffer._buffer, _cullStatsBuffer._allocation );
+    vmaDestroyBuffer( _allocator, _clusterBuffer._buffer, _clusterBuffer._allocation );
+    _pipelineCache.destroy();
+    vkDestroyPipelineLayout( _device, _meshPipelineLayout, nullptr );
+    vkDestroyPipelineLayout( _device, _shadowPipelineLayout, nullptr );
+    vkDestroySampler( _device, _shadowSampler, nullptr );
+    vkDestroyImageView( _device, _staticShadowView, nullptr );
+    vmaDestroyImage( _allocator, _staticShadowAtlas._image, _staticShadowAtlas._allocation );
+    vkDestroySampler( _device, _depthSampler, nullptr );
+    _renderGraph.destroy();
+
+    for( FrameData& frame : _frames )
+    {
+      // Destroying the pool destroys all its comand buffers
+      vkDestroyCommandPool( _device, frame._commandPool, nullptr );
+      vkDestroyFence( _device, frame._renderFence, nullptr );
+      vkDestroySemaphore( _device, frame._presentSemaphore, nullptr );
+      vkDestroySemaphore( _device, frame._renderSemaphore, nullptr );
+      if( _asyncCompute )
+      {
+        vkDestroyCommandPool( _device, frame._computeCommandPool, nullptr );
+        vkDestroySemaphore( _device, frame._computeSemaphore, nullptr );
+        vkDestroySemaphore( _device, frame._visibilitySemaphore, nullptr );
+        if( frame._computeTimestampPool )
+        {
+          vkDestroyQueryPool( _device, frame._computeTimestampPool, nullptr );
+          vkDestroyQueryPool( _device, frame._graphicsTimestampPool, nullptr );
+        }
+      }
+    }
 
     vkDestroySwapchainKHR( _device, _swapchain, nullptr );
 
-    vkDestroyRenderPass( _device, _renderPass, nullptr );
-
-    for( auto framebuffer : _framebuffers )
-      vkDestroyFramebuffer( _device, framebuffer, nullptr );
-
     // Only need to destroy the imageviews and not the images
     // because the images are destroyed with the swap chain
     for( auto view : _swapchainImageViews )
@@ -95,125 +272,428 @@ void VulkanEngine::cleanup()
   }
 }
 
+void RenderSnapshot::clear()
+{
+  FrameVector< uint32_t >( visible.get_allocator() ).swap( visible );
+  FrameVector< GPUObjectData >( objects.get_allocator() ).swap( objects );
+  FrameVector< DrawBatch >( batches.get_allocator() ).swap( batches );
+  FrameVector< GPULight >( lights.get_allocator() ).swap( lights );
+  FrameVector< ShadowTileDraws >( shadowTiles.get_allocator() ).swap( shadowTiles );
+  FrameVector< ShadowDraw >( shadowDraws.get_allocator() ).swap( shadowDraws );
+  FrameVector< SkinInstance >( skinInstances.get_allocator() ).swap( skinInstances );
+  FrameVector< glm::mat4 >( joints.get_allocator() ).swap( joints );
+  uploads.clear();
+  arena.reset();
+}
+
 void VulkanEngine::draw()
+{
+  build_snapshot( _snapshots.begin_write() );
+  _snapshots.end_write();
+  render( *_snapshots.begin_read() );
+  _snapshots.end_read();
+}
+
+void VulkanEngine::build_snapshot( RenderSnapshot& snapshot )
+{
+  snapshot.clear();
+  update_static_chunks( snapshot );
+
+  // clamped so a hitch doesn't launch everything at once
+  const Clock::time_point now = Clock::now();
+  snapshot.dt = _lastSimulationTime == Clock::time_point() ? 0 :
+                std::min( std::chrono::duration< float >( now - _lastSimulationTime ).count(), 0.1f );
+  if( _fixedTimestep > 0 )
+    snapshot.dt = _fixedTimestep;
+  _lastSimulationTime = now;
+  const glm::mat4 viewProj = get_view_proj();
+  const glm::mat4 invView = glm::inverse( get_view() );
+  snapshot.cameraRight = glm::vec3( invView[ 0 ] );
+  snapshot.cameraUp = glm::vec3( invView[ 1 ] );
+  update_world( snapshot, glm::vec3( invView[ 3 ] ), -glm::vec3( invView[ 2 ] ), viewProj );
+
+  // every skinned object is posed each frame, the shadows need the ones off screen too.
+  // The phase comes from the position, so neighbours don't sway in step and replays match.
+  _animationTime += snapshot.dt;
+  snapshot.skinInstances.reserve( _skinnedObjects.size() );
+  snapshot.joints.resize( _skinnedJointCount );
+  uint32_t skinnedVertices = 0;
+  uint32_t skinnedJoints = 0;
+  for( uint32_t index : _skinnedObjects )
+  {
+    const RenderObject& object = _renderables[ index ];
+    const Mesh& mesh = *_meshes.get( object.mesh );
+    const uint32_t vertexCount = ( uint32_t )mesh._skin.size();
+    snapshot.skinInstances.push_back( { mesh._skinSource, vertexCount, skinnedVertices, skinnedJoints } );
+    const glm::vec3 position = glm::vec3( object.transformMatrix[ 3 ] );
+    pose_joint_chain( mesh, _animationTime, position.x * 0.7f + position.z * 1.3f, &snapshot.joints[ skinnedJoints ] );
+    skinnedVertices += vertexCount;
+    skinnedJoints += ( uint32_t )mesh._jointPivots.size();
+  }
+
+  // scrolls the cascades with the camera and collects what the static cache renders again
+  _shadowCache.update( _sunDirection, glm::vec3( invView[ 3 ] ) );
+  ShadowStats& shadowStats = snapshot.shadowStats;
+  shadowStats = {};
+  shadowStats.cascadesUpdated = _shadowCache.get_updated_cascades();
+  shadowStats.cascadesCached = ShadowCache::CascadeCount - shadowStats.cascadesUpdated;
+  shadowStats.tilesRendered = ( uint32_t )_shadowCache.get_tiles().size();
+  for( const ShadowTile& tile : _shadowCache.get_tiles() )
+    collect_shadow_casters( snapshot, tile, true );
+  for( uint32_t c = 0; c < ShadowCache::CascadeCount; ++c )
+    collect_shadow_casters( snapshot, _shadowCache.get_window( c ), false );
+
+  // bvh order is spatial, sort back to insertion order so draws stay batched by material and mesh.
+  // Reused draws need the same list whatever the camera does, so then it is everything in the bvh.
+  snapshot.visible.reserve( _renderables.size() );
+  if( _reuseDraws )
+  {
+    for( uint32_t i = 0; i < ( uint32_t )_renderables.size(); ++i )
+      if( _renderables[ i ].bvhProxy != DynamicBVH::NullNode )
+        snapshot.visible.push_back( i );
+  }
+  else
+  {
+    _renderableBVH.query_frustum( Frustum::from_matrix( viewProj ),
+                                  [ & ]( uint32_t index ) { snapshot.visible.push_back( index ); } );
+    std::sort( snapshot.visible.begin(), snapshot.visible.end() );
+  }
+  const uint32_t visibleCount = ( uint32_t )snapshot.visible.size();
+  snapshot.objectCount = ( uint32_t )_renderables.size();
+
+  // Consecutive objects with the same pipeline, layout and mesh share a batch, up
+  // to 65535, the guaranteed minimum of maxDrawIndirectCount with multiDrawIndirect.
+  // Objects whose material is gone aren't drawn.
+  snapshot.objects.reserve( visibleCount );
+  const uint32_t maxBatchSize = 65535;
+  MeshHandle lastMesh;
+  Mesh* mesh = nullptr;
+  MaterialHandle lastMaterial;
+  const Material* material = nullptr;
+  uint32_t texture = ~0u;
+  for( uint32_t i = 0; i < visibleCount; ++i )
+  {
+    const RenderObject& object = _renderables[ snapshot.visible[ i ] ];
+    if( object.mesh != lastMesh )
+    {
+      mesh = _meshes.get( object.mesh );
+      lastMesh = object.mesh;
+    }
+    if( object.material != lastMaterial )
+    {
+      material = _materials.get( object.material );
+      texture = material && material->texture >= 0 ? ( uint32_t )material->texture : ~0u;
+      lastMaterial = object.material;
+    }
+    if( !material )
+      continue;
+    if( snapshot.batches.empty() ||
+        snapshot.batches.back().pipeline != material->pipeline ||
+        snapshot.batches.back().pipelineLayout != material->pipelineLayout ||
+        snapshot.batches.back().mesh != mesh ||
+        snapshot.batches.back().count == maxBatchSize )
+      snapshot.batches.push_back( { material->pipeline, material->pipelineLayout, mesh, ( uint32_t )snapshot.objects.size(), 0 } );
+    snapshot.batches.back().count++;
+    GPUObjectData& data = snapshot.objects.emplace_back();
+    data.model = object.transformMatrix;
+    data.boundsMin = glm::vec4( object.worldBounds.min, 0 );
+    data.boundsMax = glm::vec4( object.worldBounds.max, 0 );
+    const uint32_t firstVertex = object.skinnedObject >= 0 ? snapshot.skinInstances[ object.skinnedObject ].outputFirst : 0;
+    data.info = glm::uvec4( snapshot.visible[ i ], texture, firstVertex, 0 );
+  }
+
+  // lights are binned on the gpu, the cpu only converts them
+  const uint32_t lightCount = std::min( ( uint32_t )_lights.size(), MaxLights );
+  snapshot.lights.reserve( lightCount );
+  for( uint32_t i = 0; i < lightCount; ++i )
+  {
+    const Light& light = _lights[ i ];
+    const bool spot = light.type == LightType::Spot;
+    GPULight& gpuLight = snapshot.lights.emplace_back();
+    gpuLight.positionRadius = glm::vec4( light.position, light.radius );
+    gpuLight.color = glm::vec4( light.color * light.intensity, spot ? std::cos( light.innerAngle ) : -2.0f );
+    gpuLight.spot = glm::vec4( glm::normalize( light.direction ), spot ? std::cos( light.outerAngle ) : -2.0f );
+  }
+
+  // depth slices are spaced exponentially, so clusters are roughly cubes in view space
+  GPULightingParams& lighting = snapshot.lighting;
+  const float sliceScale = ClustersZ / std::log( _zFar / _zNear );
+  lighting.viewProj = viewProj;
+  lighting.view = get_view();
+  lighting.invProj = glm::inverse( get_projection() );
+  lighting.grid = glm::uvec4( ClustersX, ClustersY, ClustersZ, MaxLightsPerCluster );
+  lighting.info = glm::uvec4( lightCount, 0, 0, 0 );
+  lighting.depth = glm::vec4( _zNear, _zFar, sliceScale, sliceScale * std::log( _zNear ) );
+  lighting.tile = glm::vec4( ( float )_windowExtent.width / ClustersX, ( float )_windowExtent.height / ClustersY, 0, 0 );
+  lighting.ambient = glm::vec4( _ambientLight, 0 );
+  lighting.lightView = _shadowCache.get_light_view();
+  lighting.sunDirection = glm::vec4( glm::normalize( _sunDirection ), _shadowCache.get_depth_range() );
+  lighting.sunColor = glm::vec4( _sunColor, ( float )ShadowResolution );
+  for( uint32_t c = 0; c < ShadowCache::CascadeCount; ++c )
+    lighting.cascades[ c ] = _shadowCache.get_cascade_params( c );
+
+  snapshot.sceneRevision = _sceneRevision;
+  snapshot.reuseDraws = _reuseDraws;
+  snapshot.hasInput = _frameHasInput;
+  snapshot.inputTime = _frameInputTime;
+  _frameHasInput = false;
+  snapshot.requests = _pendingRequests;
+  _pendingRequests = {};
+}
+
+void VulkanEngine::collect_shadow_casters( RenderSnapshot& snapshot, const ShadowTile& tile, bool isStatic )
+{
+  // the frustum test treats the depth range as -1..1, so it keeps a few casters too many
+  const uint32_t first = ( uint32_t )snapshot.shadowDraws.size();
+  MeshHandle lastMesh;
+  Mesh* mesh = nullptr;
+  _renderableBVH.query_frustum( Frustum::from_matrix( tile.viewProj ), [ & ]( uint32_t index ) {
+    const RenderObject& object = _renderables[ index ];
+    if( object.isStatic != isStatic )
+      return;
+    if( object.mesh != lastMesh )
+    {
+      mesh = _meshes.get( object.mesh );
+      lastMesh = object.mesh;
+    }
+    const uint32_t firstVertex = object.skinnedObject >= 0 ? snapshot.skinInstances[ object.skinnedObject ].outputFirst : 0;
+    snapshot.shadowDraws.push_back( { tile.viewProj * object.transformMatrix, mesh, firstVertex } );
+  } );
+  const uint32_t count = ( uint32_t )snapshot.shadowDraws.size() - first;
+  snapshot.shadowTiles.push_back( { tile, isStatic, first, count } );
+  ( isStatic ? snapshot.shadowStats.staticCasters : snapshot.shadowStats.dynamicCasters ) += count;
+}
+
+void VulkanEngine::render( const RenderSnapshot& snapshot )
 {
   const uint64_t one_sec_in_ns = 1000000000;
-  // wait for gpu to finish rendering last frame
+  const uint32_t frameIndex = _frameNumber % FRAME_OVERLAP;
+  FrameData& frame = get_current_frame();
+
+  // wait for gpu to finish rendering the frame that last used this slot
   // 1s timeout
   //
   // fence is for cpu sync, semaphore for the gpu sync
-  VK_CHECK( vkWaitForFences( _device, 1, &_renderFence, true, one_sec_in_ns ) );
-  VK_CHECK( vkResetFences( _device, 1, &_renderFence ) );
+  // already signalled when called from run, see pace_frame
+  VK_CHECK( vkWaitForFences( _device, 1, &frame._renderFence, true, one_sec_in_ns ) );
+  VK_CHECK( vkResetFences( _device, 1, &frame._renderFence ) );
+  _memory.begin_frame( _frameNumber );
+  _frameRing.begin_frame( frameIndex );
+  _virtualTexture.begin_frame( frameIndex, _frameNumber );
+  _readback.begin_frame( frameIndex );
+  _skinning.update( frameIndex,
+                    snapshot.skinInstances.data(),
+                    ( uint32_t )snapshot.skinInstances.size(),
+                    snapshot.joints.data(),
+                    ( uint32_t )snapshot.joints.size() );
+
+  // the culling results of that frame are complete now that its fence signalled
+  if( _frameNumber >= FRAME_OVERLAP )
+  {
+    VK_CHECK( vmaInvalidateAllocation( _allocator,
+                                       _cullStatsBuffer._allocation,
+                                       frameIndex * _cullStatsStride,
+                                       sizeof( GPUCullStats ) ) );
+    const GPUCullStats* gpuStats = ( const GPUCullStats* )( _cullStatsData + frameIndex * _cullStatsStride );
+    _cullingStats = frame._cullingStats;
+    _cullingStats.occlusionCulled = gpuStats->occlusionCulled;
+    _cullingStats.drawnEarly = gpuStats->drawnEarly;
+    _cullingStats.drawnLate = gpuStats->drawnLate;
+    if( frame._computeTimestampPool )
+      read_compute_timings( frame );
+  }
 
   uint32_t iSwapchainImage;
   VK_CHECK( vkAcquireNextImageKHR( _device,
                                    _swapchain,
                                    one_sec_in_ns,
-                                   _presentSemaphore,
+                                   frame._presentSemaphore,
                                    nullptr, // choosing not to signal any fence here
                                    &iSwapchainImage ) );
 
-  VK_CHECK( vkResetCommandBuffer( _mainCommandBuffer, 0 ) );
-
-  // shorthand
-  VkCommandBuffer cmd = _mainCommandBuffer;
-  VkCommandBufferBeginInfo cmdBeginInfo = {};
-  cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  // this command buffer will be submitted once
-  cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-  VK_CHECK( vkBeginCommandBuffer( cmd, &cmdBeginInfo ) );
-
-  float flash = 1;// abs( sin( _frameNumber / 120.0f ) );
-  VkClearValue clearColor;
-  clearColor.color = { flash, flash, 0, 1 };
-  VkClearValue clearDepth;
-  clearDepth.depthStencil.depth = 1;
-  std::array clearValues = { clearColor, clearDepth };
-
-  VkRenderPassBeginInfo rpInfo = vkinit::renderpass_begin_info( _renderPass,
-                                                                _windowExtent,
-                                                                _framebuffers[ iSwapchainImage ] );
-  //VkRenderPassBeginInfo rpInfo = {};
-  //rpInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-  //rpInfo.renderPass = _renderPass;
-  //rpInfo.renderArea.extent = _windowExtent;
-  //rpInfo.framebuffer = _framebuffers[ iSwapchainImage ];
-  rpInfo.clearValueCount = ( uint32_t )clearValues.size();
-  rpInfo.pClearValues = clearValues.data();
-
-  // this will
-  // - bind framebuffers
-  // - clear image
-  // - put image in layout specified during renderpass creation
-  vkCmdBeginRenderPass( cmd, &rpInfo, VK_SUBPASS_CONTENTS_INLINE );
-
-
-#if 0
-  //VkPipeline pipeline = _selectedShader ? _trianglePipeline : _redTrianglePipeline;
-  VkPipeline pipeline = _meshPipeline;
-  vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline );
-  //vkCmdDraw( cmd, 3, 1, 0, 0 );
-
-  VkDeviceSize offset = 0;
-
-  //Mesh* mesh = &_triangleMesh;
-  Mesh* mesh = &_monkeyMesh;
-
-  vkCmdBindVertexBuffers( cmd, 0, 1, &mesh->_vertexBuffer._buffer, &offset );
-
-  const float aspect = ( float )_windowExtent.width / ( float )_windowExtent.height;
-  glm::vec3 camPos = { 0,0,-4 };
-  glm::mat4 view = glm::translate( glm::mat4( 1 ), camPos );
-  glm::mat4 proj = glm::perspective( glm::radians( 70.0f ), aspect, 0.1f, 200.0f );
-  proj[ 1 ][ 1 ] *= -1;
-  glm::mat4 model = glm::rotate( glm::mat4( 1 ), glm::radians( _frameNumber * 1.5f ), glm::vec3( 0, 1, 0 ) );
-  glm::mat4 mesh_matrix = proj * view * model;
-  MeshPushConstants constants;
-  constants.render_matrix = mesh_matrix;
-  vkCmdPushConstants( cmd,
-                      _meshPipelineLayout,
-                      VK_SHADER_STAGE_VERTEX_BIT,
-                      0,
-                      sizeof( MeshPushConstants ),
-                      &constants );
-
-  vkCmdDraw( cmd, ( uint32_t )mesh->_verticies.size(), 1, 0, 0 );
-#else
-
-  draw_objects( cmd, _renderables.data(), (int) _renderables.size() );
-
-#endif
-
-  vkCmdEndRenderPass( cmd );
-  VK_CHECK( vkEndCommandBuffer( cmd ) );
-
-  // prepare submission to the queue
-  // wait on the _presentSemaphore, which is signalled when the swapchain is ready
-  // signal the _renderSemaphore, to signal that rendering has finished
-
-  std::array submitWaitSemaphores = { _presentSemaphore };
-  std::array submitSignalSemaphores = { _renderSemaphore };
-  std::array cmdBufs = { cmd };
-  VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-  VkSubmitInfo submit = {};
-  submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-
-  // This is hard to explain, so pls be patient
-  submit.pWaitDstStageMask = &waitStage;
+  // the graph's passes record from the snapshot
+  _snapshot = &snapshot;
+  _swapchainImageIndex = iSwapchainImage;
+  _post.begin_frame( frameIndex, _frameNumber, iSwapchainImage );
+  apply_mesh_uploads( snapshot );
+  const RenderRequests& requests = snapshot.requests;
+  if( requests.toggleLatencyLog )
+    _logLatency = !_logLatency;
+  if( requests.defragment )
+    _memory.request_defragmentation();
+  if( requests.printMemory )
+  {
+    _memory.print_report();
+    std::cout << "  frame ring peak " << _frameRing.get_peak_usage() / 1024 << " / "
+              << _frameRing.get_region_size() / 1024 << " KiB per frame" << std::endl;
+  }
+  if( requests.printStats )
+    print_render_stats( snapshot );
+
+  _particles.update( snapshot.dt, snapshot.lighting.viewProj, snapshot.cameraRight, snapshot.cameraUp );
+
+  // lights are binned on the gpu, the cpu only copies them. They, the lighting and
+  // the page table have room set aside in the region and go first, so they always fit.
+  const uint32_t lightCount = ( uint32_t )snapshot.lights.size();
+  frame._lights = _frameRing.allocate( std::max( lightCount, 1u ) * sizeof( GPULight ) );
+  frame._lightingParams = _frameRing.allocate( sizeof( GPULightingParams ) );
+  frame._pageTable = _frameRing.allocate( _virtualTexture.get_page_table_size() );
+  assert( frame._lights.data && frame._lightingParams.data && frame._pageTable.data &&
+          "the ring region sets aside room for MaxLights, the lighting and MaxPageTableEntries" );
+  memcpy( frame._lights.data, snapshot.lights.data(), lightCount * sizeof( GPULight ) );
+  memcpy( frame._lightingParams.data, &snapshot.lighting, sizeof( GPULightingParams ) );
+  ( ( GPULightingParams* )frame._lightingParams.data )->feedback = _virtualTexture.get_feedback_params( _frameNumber );
+  _virtualTexture.write_page_table( frame._pageTable.data );
+
+  // One object entry and one draw per phase for each frustum visible object,
+  // written straight into this frame's ring region. The culling shader fills in
+  // the instance counts. Never empty, descriptors can't have a zero range.
+  // add_renderable only asserts MaxObjects, so when they don't fit the frame
+  // draws no objects rather than writing past the region or the visibility buffer.
+  uint32_t visibleCount = ( uint32_t )snapshot.objects.size();
+  const uint32_t allocCount = std::max( visibleCount, 1u );
+  frame._objects = _frameRing.allocate( allocCount * sizeof( GPUObjectData ) );
+  frame._draws = _frameRing.allocate( 2 * allocCount * sizeof( VkDrawIndirectCommand ) );
+  if( !frame._objects.data || !frame._draws.data || visibleCount > MaxObjects )
+  {
+    std::cout << visibleCount << " objects don't fit the frame, none drawn" << std::endl;
+    if( frame._objects.data )
+      _frameRing.rewind( frame._objects );
+    else if( frame._draws.data )
+      _frameRing.rewind( frame._draws );
+    visibleCount = 0;
+    frame._objects = _frameRing.allocate( sizeof( GPUObjectData ) );
+    frame._draws = _frameRing.allocate( 2 * sizeof( VkDrawIndirectCommand ) );
+  }
+  _drawnObjects = visibleCount;
+  frame._cullingStats.objects = snapshot.objectCount;
+  frame._cullingStats.frustumCulled = snapshot.objectCount - ( uint32_t )snapshot.objects.size();
+  memcpy( frame._objects.data, snapshot.objects.data(), visibleCount * sizeof( GPUObjectData ) );
+  VkDrawIndirectCommand* drawCommands = ( VkDrawIndirectCommand* )frame._draws.data;
+  for( const DrawBatch& batch : snapshot.batches )
+  {
+    if( visibleCount == 0 )
+      break;
+    // skinned meshes are drawn from the skinned vertices
+    if( !batch.mesh->is_skinned() )
+      make_mesh_resident( *batch.mesh );
+    VkDrawIndirectCommand command = {};
+    command.vertexCount = batch.mesh->_vertexCount;
+    for( uint32_t i = batch.first; i < batch.first + batch.count; ++i )
+    {
+      command.firstVertex = snapshot.objects[ i ].info.z;
+      command.firstInstance = i;
+      drawCommands[ i ] = command;
+      drawCommands[ visibleCount + i ] = command;
+    }
+  }
+  const Mesh* lastShadowMesh = nullptr;
+  for( const ShadowDraw& draw : snapshot.shadowDraws )
+  {
+    if( draw.mesh == lastShadowMesh || draw.mesh->is_skinned() )
+      continue;
+    make_mesh_resident( *draw.mesh );
+    lastShadowMesh = draw.mesh;
+  }
+  _frameRing.flush();
+
+  // The frame's sets aren't in use, its fence signalled. Writing them invalidates the
+  // draws recorded with them, but the ring hands out the same ranges every frame
+  // while the object and light counts stay the same, so usually there is nothing to write.
+  const std::array< VkDescriptorBufferInfo, 5 > infos = { {
+    { frame._objects.buffer, frame._objects.offset, frame._objects.size },
+    { frame._draws.buffer, frame._draws.offset, frame._draws.size },
+    { frame._lightingParams.buffer, frame._lightingParams.offset, frame._lightingParams.size },
+    { frame._lights.buffer, frame._lights.offset, frame._lights.size },
+    { frame._pageTable.buffer, frame._pageTable.offset, frame._pageTable.size },
+  } };
+  if( memcmp( infos.data(), frame._descriptorInfos.data(), sizeof( infos ) ) != 0 )
+  {
+    frame._descriptorInfos = infos;
+    const VkDescriptorBufferInfo& objectInfo = frame._descriptorInfos[ 0 ];
+    const VkDescriptorBufferInfo& drawInfo = frame._descriptorInfos[ 1 ];
+    const VkDescriptorBufferInfo& lightingInfo = frame._descriptorInfos[ 2 ];
+    const VkDescriptorBufferInfo& lightInfo = frame._descriptorInfos[ 3 ];
+    const VkDescriptorBufferInfo& pageTableInfo = frame._descriptorInfos[ 4 ];
+    std::array frameWrites = {
+      vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame._objectSet, &objectInfo, 0 ),
+      vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame._cullSet, &objectInfo, 0 ),
+      vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame._cullSet, &drawInfo, 1 ),
+      vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, frame._lightSet, &lightingInfo, 0 ),
+      vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame._lightSet, &lightInfo, 1 ),
+      vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame._lightSet, &pageTableInfo, 5 ),
+    };
+    vkUpdateDescriptorSets( _device, ( uint32_t )frameWrites.size(), frameWrites.data(), 0, nullptr );
+    for( CachedDraws& cached : frame._cachedDraws )
+      cached.valid = false;
+  }
 
-  submit.pWaitSemaphores = submitWaitSemaphores.data();
-  submit.waitSemaphoreCount = ( uint32_t )submitWaitSemaphores.size();
-  submit.pSignalSemaphores = submitSignalSemaphores.data();
-  submit.signalSemaphoreCount = ( uint32_t )submitSignalSemaphores.size();
-  submit.commandBufferCount = ( uint32_t )cmdBufs.size();
-  submit.pCommandBuffers = cmdBufs.data();
+  if( _asyncCompute )
+  {
+    submit_async_cull( frame );
+    submit_async_graphics( frame, iSwapchainImage );
+  }
+  else
+  {
+    VK_CHECK( vkResetCommandBuffer( frame._mainCommandBuffer, 0 ) );
+
+    // shorthand
+    VkCommandBuffer cmd = frame._mainCommandBuffer;
+    VkCommandBufferBeginInfo cmdBeginInfo = {};
+    cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    // this command buffer will be submitted once
+    cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK( vkBeginCommandBuffer( cmd, &cmdBeginInfo ) );
+
+    // moves vertex buffers, before the draws read them
+    _memory.defragment( cmd );
+    prepare_shadow_cache( cmd );
+    _virtualTexture.prepare( cmd );
+    _post.prepare( cmd );
+
+    // culling, both draws and the pyramid in between, see init_render_graph
+    _renderGraph.execute( cmd, iSwapchainImage );
+
+    VK_CHECK( vkEndCommandBuffer( cmd ) );
+
+    // prepare submission to the queue
+    // wait on the _presentSemaphore, which is signalled when the swapchain is ready
+    // signal the _renderSemaphore, to signal that rendering has finished
+
+    std::array submitWaitSemaphores = { frame._presentSemaphore };
+    std::array submitSignalSemaphores = { frame._renderSemaphore };
+    std::array cmdBufs = { cmd };
+    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    VkSubmitInfo submit = {};
+    submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+
+    // This is hard to explain, so pls be patient
+    submit.pWaitDstStageMask = &waitStage;
+
+    submit.pWaitSemaphores = submitWaitSemaphores.data();
+    submit.waitSemaphoreCount = ( uint32_t )submitWaitSemaphores.size();
+    submit.pSignalSemaphores = submitSignalSemaphores.data();
+    submit.signalSemaphoreCount = ( uint32_t )submitSignalSemaphores.size();
+    submit.commandBufferCount = ( uint32_t )cmdBufs.size();
+    submit.pCommandBuffers = cmdBufs.data();
+
+    // submit the command buffers to the queue
+    // the frame's fence will now block until the graphics commands finish execution
+    std::array submits = { submit };
+    VK_CHECK( vkQueueSubmit( _graphicsQueue, ( uint32_t )submits.size(), submits.data(), frame._renderFence ) );
+  }
 
-  // submit the command buffers to the queue
-  // _renderFence will now block until the graphics commands finish execution
-  std::array submits = { submit };
-  VK_CHECK( vkQueueSubmit( _graphicsQueue, ( uint32_t )submits.size(), submits.data(), _renderFence ) );
+  const Clock::time_point submitTime = Clock::now();
+  _frameWorkTime = ( _frameWorkTime * 7 + ( submitTime - _frameStart ) ) / 8;
+  if( snapshot.hasInput )
+  {
+    frame._latency.hasInput = true;
+    frame._latency.inputToSubmitMs = to_ms( submitTime - snapshot.inputTime );
+    frame._latency.cpuWorkMs = to_ms( submitTime - _frameStart );
+    frame._inputTime = snapshot.inputTime;
+  }
 
-  std::array presentWaitSemaphores = { _renderSemaphore };
+  std::array presentWaitSemaphores = { frame._renderSemaphore };
   std::array swapchains = { _swapchain };
   VkPresentInfoKHR presentInfo = {};
   presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -227,48 +707,505 @@ void VulkanEngine::draw()
   _frameNumber++;
 }
 
+void VulkanEngine::render_loop()
+{
+  // the simulation closes the queue when it quits, the frames it published are still rendered
+  while( const RenderSnapshot* snapshot = _snapshots.begin_read() )
+  {
+    pace_frame();
+    render( *snapshot );
+    _snapshots.end_read();
+  }
+}
+
+void VulkanEngine::print_render_stats( const RenderSnapshot& snapshot )
+{
+  std::cout << "objects " << _cullingStats.objects
+            << " frustum culled " << _cullingStats.frustumCulled
+            << " occlusion culled " << _cullingStats.occlusionCulled
+            << " drawn early " << _cullingStats.drawnEarly
+            << " drawn late " << _cullingStats.drawnLate << std::endl;
+  const ShadowStats& shadowStats = snapshot.shadowStats;
+  std::cout << "shadow cascades cached " << shadowStats.cascadesCached
+            << " updated " << shadowStats.cascadesUpdated
+            << " tiles " << shadowStats.tilesRendered
+            << " static casters " << shadowStats.staticCasters
+            << " dynamic casters " << shadowStats.dynamicCasters << std::endl;
+  uint32_t skinnedVertices = 0;
+  for( const SkinInstance& instance : snapshot.skinInstances )
+    skinnedVertices += instance.vertexCount;
+  std::cout << "skinned objects " << snapshot.skinInstances.size() << " vertices " << skinnedVertices << " of "
+            << _skinning.get_output_capacity() << ", joints " << snapshot.joints.size() << std::endl;
+  const WorldStreamStats& world = snapshot.worldStats;
+  if( world.chunks > 0 )
+    std::cout << "world chunks resident " << world.residentChunks << " of " << world.chunks << " ( "
+              << world.residentBytes / ( 1024 * 1024 ) << " of " << world.budgetBytes / ( 1024 * 1024 )
+              << " MiB ), pending " << world.pendingRequests << ", missing " << world.missingChunks
+              << ", frames with missing chunks " << world.missingFrames << " of " << world.frames
+              << ", loaded " << world.loaded << ", evicted " << world.evicted << std::endl;
+  std::cout << "draw phases recorded " << _drawsRecorded << " reused " << _drawsReused
+            << " since the last print" << std::endl;
+  _drawsRecorded = 0;
+  _drawsReused = 0;
+  if( _asyncCompute && _timestampPeriod > 0 )
+    std::cout << "async early cull " << _computeTimings.computeMs << " ms, "
+              << _computeTimings.overlappedMs << " ms of it overlapped with graphics" << std::endl;
+  if( _graphicsTimestampPeriod > 0 )
+  {
+    const PostTimings post = _post.get_timings();
+    std::cout << "post processing " << post.totalMs << " ms: bloom downsample " << post.bloomDownMs
+              << " ms, bloom upsample " << post.bloomUpMs << " ms, fused composite " << post.compositeMs
+              << ( _swapchainStorage ? " ms" : " ms with the copy" ) << std::endl;
+  }
+  const VirtualTextureStats pageStats = _virtualTexture.take_stats();
+  const float uploadMiB = pageStats.uploadBytes / ( 1024.0f * 1024.0f );
+  std::cout << "virtual texture since the last print: pages hit " << pageStats.resident << " of " << pageStats.requested
+            << " requested ( " << ( pageStats.requested ? 100.0f * pageStats.resident / pageStats.requested : 100.0f )
+            << "% ), uploaded " << pageStats.uploaded << " ( " << uploadMiB << " MiB, "
+            << ( pageStats.seconds > 0 ? uploadMiB / pageStats.seconds : 0.0f ) << " MiB/s ), evicted "
+            << pageStats.evicted << ", now resident " << _virtualTexture.get_resident_pages() << " / "
+            << VirtualTexture::AtlasPages * VirtualTexture::AtlasPages << std::endl;
+  std::cout << "snapshots " << _snapshots.get_read_count()
+            << ", simulation waited " << _snapshots.get_producer_wait_ms()
+            << " ms for a free slot, rendering " << _snapshots.get_consumer_wait_ms()
+            << " ms for a snapshot" << std::endl;
+}
+
+void VulkanEngine::record_readbacks( VkCommandBuffer cmd )
+{
+  const RenderRequests& requests = _snapshot->requests;
+  if( requests.pick )
+  {
+    const VkOffset2D pixel = { std::clamp( requests.pickX, 0, ( int32_t )_windowExtent.width - 1 ),
+                               std::clamp( requests.pickY, 0, ( int32_t )_windowExtent.height - 1 ) };
+    _readback.copy_image( cmd,
+                          _renderGraph.get_image( _objectIds ),
+                          VK_IMAGE_ASPECT_COLOR_BIT,
+                          pixel,
+                          { 1, 1 },
+                          sizeof( uint32_t ),
+                          [ this ]( const void* data, VkDeviceSize ) {
+                            _pickResult.store( *( const uint32_t* )data );
+                          } );
+  }
+
+  if( requests.screenshot )
+  {
+    const bool bgra = _swapchainImageFormat == VK_FORMAT_B8G8R8A8_UNORM ||
+                      _swapchainImageFormat == VK_FORMAT_B8G8R8A8_SRGB;
+    const bool rgba = _swapchainImageFormat == VK_FORMAT_R8G8B8A8_UNORM ||
+                      _swapchainImageFormat == VK_FORMAT_R8G8B8A8_SRGB;
+    if( !bgra && !rgba )
+    {
+      std::cout << "can't take screenshots of swapchain format " << _swapchainImageFormat << std::endl;
+      return;
+    }
+    const std::filesystem::path dir = _screenshotDir;
+    const std::filesystem::path path = dir / ( "frame_" + std::to_string( _frameNumber ) + ".ppm" );
+    const VkExtent2D extent = _windowExtent;
+    const bool recorded = _readback.copy_image( cmd,
+                                                _swapchainImages[ _swapchainImageIndex ],
+                                                VK_IMAGE_ASPECT_COLOR_BIT,
+                                                { 0, 0 },
+                                                extent,
+                                                4,
+                                                [ this, dir, path, extent, bgra ]( const void* data, VkDeviceSize ) {
+                                                  // the readback space is reused, the file is written off the render thread
+                                                  const uint8_t* pixels = ( const uint8_t* )data;
+                                                  std::vector< uint8_t > copy( pixels, pixels + ( size_t )extent.width * extent.height * 4 );
+                                                  _screenshotWrites.push_back( std::async( std::launch::async, [ dir, path, extent, bgra, copy = std::move( copy ) ] {
+                                                    std::error_code error;
+                                                    if( !dir.empty() )
+                                                      std::filesystem::create_directories( dir, error );
+                                                    if( write_ppm( path, copy.data(), extent, bgra ) )
+                                                      std::cout << "screenshot written to " << path.string() << std::endl;
+                                                    else
+                                                      std::cout << "can't write screenshot " << path.string() << std::endl;
+                                                  } ) );
+                                                } );
+    if( !recorded )
+      std::cout << "no readback space left for a screenshot" << std::endl;
+  }
+
+  // forget the writes that are done
+  auto done = std::remove_if( _screenshotWrites.begin(), _screenshotWrites.end(), []( std::future< void >& write ) {
+    return write.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready;
+  } );
+  _screenshotWrites.erase( done, _screenshotWrites.end() );
+}
+
+void VulkanEngine::wait_for_screenshots()
+{
+  for( std::future< void >& write : _screenshotWrites )
+    write.wait();
+  _screenshotWrites.clear();
+}
+
+void VulkanEngine::report_pick()
+{
+  const uint32_t id = _pickResult.exchange( NoPick );
+  if( id == NoPick || id == 0 )
+    return;
+
+  // the id is from when the pixel was drawn, the scene may have changed since
+  int picked = ( int )id - 1;
+  if( picked >= ( int )_renderables.size() )
+    return;
+  // a chunk is drawn as one object, the ray finds which of its objects was clicked
+  if( _renderables[ picked ].isChunk )
+    picked = pick_renderable( _pickPosition.x, _pickPosition.y );
+  if( picked >= 0 )
+    std::cout << "picked renderable " << picked << std::endl;
+}
+
 void VulkanEngine::run()
 {
+  if( _replay )
+  {
+    run_replay();
+    return;
+  }
+
   SDL_Event e;
   bool bQuit = false;
+  std::thread renderThread;
+  if( _renderThread )
+    renderThread = std::thread( [ this ] { render_loop(); } );
 
   //main loop
-  while( !bQuit )
+  for( uint64_t loop = 0; !bQuit; ++loop )
   {
+    // The render thread paces itself, the simulation only waits when it is a whole
+    // queue ahead. Either way before polling, so the input is as fresh as possible.
+    const AllocationCounters loopStart = get_allocation_counters();
+    RenderSnapshot* snapshot = nullptr;
+    if( _renderThread )
+      snapshot = &_snapshots.begin_write();
+    else
+      pace_frame();
+    if( _capturing )
+      _capture.frames.emplace_back();
+    report_pick();
+
     //Handle events on queue
     while( SDL_PollEvent( &e ) )
     {
-      switch( e.type )
+      // SDL timestamps are ms since init, so events are aged by the time they spent queued
+      if( e.type == SDL_KEYDOWN ||
+          e.type == SDL_KEYUP ||
+          e.type == SDL_MOUSEBUTTONDOWN ||
+          e.type == SDL_MOUSEBUTTONUP ||
+          e.type == SDL_MOUSEMOTION )
       {
-        case SDL_QUIT:
-        {
-          //close the window when user alt-f4s or clicks the X button			
-          bQuit = true;
-        } break;
-        case SDL_KEYDOWN:
-        {
-          if( e.key.keysym.sym == SDLK_SPACE )
-            _selectedShader = !_selectedShader;
+        const Clock::time_point eventTime = Clock::now() -
+                                            std::chrono::milliseconds( SDL_GetTicks() - e.common.timestamp );
+        if( !_frameHasInput || eventTime < _frameInputTime )
+          _frameInputTime = eventTime;
+        _frameHasInput = true;
+      }
+
+      //close the window when user alt-f4s or clicks the X button
+      if( e.type == SDL_QUIT )
+        bQuit = true;
+      else
+        handle_event( e );
+    }
+
+    if( _capturing )
+      _capture.frames.back().cameraPosition = _camPos;
+    if( _renderThread )
+    {
+      build_snapshot( *snapshot );
+      _snapshots.end_write();
+    }
+    else
+      draw();
+
+    _frameAllocations = get_allocation_counters() - loopStart;
+    if( _logAllocations && _frameAllocations.allocations > 0 )
+      std::cout << "frame " << loop << " made " << _frameAllocations.allocations
+                << " heap allocations, " << _frameAllocations.bytes << " bytes" << std::endl;
+  }
+
+  if( _renderThread )
+  {
+    _snapshots.close();
+    renderThread.join();
+  }
+
+  if( _capturing )
+  {
+    _capture.save( _capturePath.c_str() );
+    std::cout << "captured " << _capture.frames.size() << " frames to " << _capturePath << std::endl;
+  }
+}
 
-        } break;
+void VulkanEngine::handle_event( const SDL_Event& e )
+{
+  if( _capturing )
+  {
+    if( e.type == SDL_KEYDOWN || e.type == SDL_KEYUP )
+      _capture.frames.back().events.push_back( { e.type, e.key.keysym.sym, 0, 0 } );
+    else if( e.type == SDL_MOUSEBUTTONDOWN || e.type == SDL_MOUSEBUTTONUP )
+      _capture.frames.back().events.push_back( { e.type, e.button.button, e.button.x, e.button.y } );
+  }
 
+  switch( e.type )
+  {
+    case SDL_KEYDOWN:
+    {
+      if( e.key.keysym.sym == SDLK_SPACE )
+        _selectedShader = !_selectedShader;
+      // the render side prints and does its part with the next snapshot
+      if( e.key.keysym.sym == SDLK_c )
+      {
+        size_t batched = 0;
+        for( const StaticChunk& chunk : _staticChunks )
+          batched += chunk.objects.size();
+        std::cout << "static chunks " << _staticChunks.size() << " holding " << batched << " objects" << std::endl;
+        _pendingRequests.printStats = true;
+      }
+      if( e.key.keysym.sym == SDLK_l )
+        _pendingRequests.toggleLatencyLog = true;
+      if( e.key.keysym.sym == SDLK_a )
+        _logAllocations = !_logAllocations;
+      if( e.key.keysym.sym == SDLK_m )
+        _pendingRequests.printMemory = true;
+      if( e.key.keysym.sym == SDLK_d )
+        _pendingRequests.defragment = true;
+      if( e.key.keysym.sym == SDLK_p )
+        _pendingRequests.screenshot = true;
+
+    } break;
+    case SDL_MOUSEBUTTONDOWN:
+    {
+      // the render thread reads the object id under the cursor back, see report_pick
+      if( e.button.button == SDL_BUTTON_LEFT )
+      {
+        _pendingRequests.pick = true;
+        _pendingRequests.pickX = e.button.x;
+        _pendingRequests.pickY = e.button.y;
+        _pickPosition = { e.button.x, e.button.y };
       }
+    } break;
+  }
+}
+
+void VulkanEngine::begin_capture()
+{
+  _capture.objects.clear();
+  // chunks are rebuilt from the objects by the replay, the world streams in again
+  for( const RenderObject& object : _renderables )
+    if( !object.isChunk && object.worldChunk < 0 )
+      _capture.objects.push_back( { _meshes.get_name( object.mesh ),
+                                    _materials.get_name( object.material ),
+                                    object.transformMatrix,
+                                    object.isStatic } );
+  _capture.lights = _lights;
+  _capture.ambientLight = _ambientLight;
+  _capture.sunDirection = _sunDirection;
+  _capture.sunColor = _sunColor;
+  _capture.frames.clear();
+  _capturing = true;
+}
+
+void VulkanEngine::run_replay()
+{
+  if( _replayMissing > 0 )
+  {
+    std::cout << "can't replay, " << _replayMissing << " captured objects use meshes or materials this build doesn't have" << std::endl;
+    return;
+  }
+
+  // the simulation steps the same no matter how long frames take
+  _fixedTimestep = ReplayTimestep;
+  std::vector< FrameTiming > timings;
+  timings.reserve( _capture.frames.size() );
+  Clock::time_point lastStart;
+  for( const CaptureFrame& frame : _capture.frames )
+  {
+    pace_frame();
+
+    // hidden, but the window system still wants its events drained
+    SDL_Event e;
+    while( SDL_PollEvent( &e ) )
+      ;
 
+    _camPos = frame.cameraPosition;
+    for( const CaptureTransform& transform : frame.transforms )
+      if( transform.object < _renderables.size() )
+        set_renderable_transform( transform.object, transform.transform );
+    for( const CaptureEvent& event : frame.events )
+    {
+      SDL_Event replayed = {};
+      replayed.type = event.type;
+      if( event.type == SDL_KEYDOWN || event.type == SDL_KEYUP )
+        replayed.key.keysym.sym = event.code;
+      else
+      {
+        replayed.button.button = ( Uint8 )event.code;
+        replayed.button.x = event.x;
+        replayed.button.y = event.y;
+      }
+      handle_event( replayed );
     }
+    if( !_screenshotDir.empty() && &frame == &_capture.frames.back() )
+      _pendingRequests.screenshot = true;
 
     draw();
+    report_pick();
+
+    const Clock::time_point end = Clock::now();
+    timings.push_back( { to_ms( end - _frameStart ), timings.empty() ? 0 : to_ms( _frameStart - lastStart ) } );
+    lastStart = _frameStart;
+  }
+  VK_CHECK( vkDeviceWaitIdle( _device ) );
+  _readback.finish();
+  wait_for_screenshots();
+  report_pick();
+
+  double cpuSum = 0, frameSum = 0;
+  for( const FrameTiming& timing : timings )
+  {
+    cpuSum += timing.cpuMs;
+    frameSum += timing.frameMs;
+  }
+  const size_t count = std::max( timings.size(), ( size_t )1 );
+  std::cout << "replayed " << timings.size() << " frames, cpu " << cpuSum / count
+            << " ms, frame " << frameSum / std::max( count - 1, ( size_t )1 ) << " ms on average" << std::endl;
+  if( !_timingsPath.empty() )
+    write_timings( _timingsPath.c_str(), timings );
+}
+
+void VulkanEngine::pace_frame()
+{
+  if( _maxFrameRate > 0 )
+  {
+    const Clock::duration period = std::chrono::duration_cast< Clock::duration >(
+      std::chrono::duration< float >( 1.0f / _maxFrameRate ) );
+
+    // Start late enough that the submit lands on the deadline. If we already
+    // missed it, don't try to catch up with a burst of frames.
+    const Clock::time_point now = Clock::now();
+    if( _nextFrameDeadline < now + _frameWorkTime )
+      _nextFrameDeadline = now + _frameWorkTime;
+    const Clock::time_point wake = _nextFrameDeadline - _frameWorkTime;
+
+    // Sleep is only good to a ms or so, yield for the rest. While a frame with input
+    // is still on the gpu the sleep is cut into ms steps polling its fence, so the
+    // limiter's sleep doesn't count as its latency.
+    const Clock::duration sleepSlack = std::chrono::milliseconds( 1 );
+    for( Clock::time_point t = now; wake - t > sleepSlack; t = Clock::now() )
+    {
+      if( !poll_latency() )
+      {
+        std::this_thread::sleep_for( wake - t - sleepSlack );
+        break;
+      }
+      std::this_thread::sleep_for( std::min( wake - t - sleepSlack, sleepSlack ) );
+    }
+    while( Clock::now() < wake )
+      std::this_thread::yield();
+    _nextFrameDeadline += period;
+  }
+
+  poll_latency();
+  VK_CHECK( vkWaitForFences( _device, 1, &get_current_frame()._renderFence, true, 1000000000 ) );
+  _frameStart = Clock::now();
+  poll_latency();
+}
+
+bool VulkanEngine::poll_latency()
+{
+  // oldest frame first, the one about to be waited for
+  const Clock::time_point now = Clock::now();
+  bool pending = false;
+  for( uint32_t i = 0; i < FRAME_OVERLAP; ++i )
+  {
+    FrameData& frame = _frames[ ( _frameNumber + i ) % FRAME_OVERLAP ];
+    if( !frame._latency.hasInput )
+      continue;
+    if( vkGetFenceStatus( _device, frame._renderFence ) != VK_SUCCESS )
+    {
+      pending = true;
+      continue;
+    }
+    frame._latency.inputToPresentMs = to_ms( now - frame._inputTime );
+    _latencyStats = frame._latency;
+    frame._latency.hasInput = false;
+    if( _logLatency )
+      std::cout << "input to submit " << _latencyStats.inputToSubmitMs
+                << " ms, input to present " << _latencyStats.inputToPresentMs
+                << " ms, cpu " << _latencyStats.cpuWorkMs << " ms" << std::endl;
   }
+  return pending;
 }
 
 void VulkanEngine::init_swapchain()
 {
+  // the requested mode first, then towards fifo. Immediate falls back to mailbox
+  // as the next lowest latency, mailbox goes straight to fifo rather than tearing.
+  std::vector< VkPresentModeKHR > candidates = { _requestedPresentMode };
+  if( _requestedPresentMode == VK_PRESENT_MODE_IMMEDIATE_KHR )
+    candidates.push_back( VK_PRESENT_MODE_MAILBOX_KHR );
+  candidates.push_back( VK_PRESENT_MODE_FIFO_KHR );
+
+  uint32_t modeCount = 0;
+  VK_CHECK( vkGetPhysicalDeviceSurfacePresentModesKHR( _chosenGPU, _surface, &modeCount, nullptr ) );
+  std::vector< VkPresentModeKHR > availableModes( modeCount );
+  VK_CHECK( vkGetPhysicalDeviceSurfacePresentModesKHR( _chosenGPU, _surface, &modeCount, availableModes.data() ) );
+  _presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  for( VkPresentModeKHR mode : candidates )
+  {
+    if( std::find( availableModes.begin(), availableModes.end(), mode ) != availableModes.end() )
+    {
+      _presentMode = mode;
+      break;
+    }
+  }
+  if( _presentMode != _requestedPresentMode )
+    std::cout << present_mode_name( _requestedPresentMode ) << " present mode is not supported, using "
+              << present_mode_name( _presentMode ) << std::endl;
+
+  // Post processing writes the swapchain from a compute shader when it can be a storage
+  // image. srgb formats never can, so that takes an 8 bit unorm format, the shader encodes.
+  VkSurfaceCapabilitiesKHR capabilities;
+  VK_CHECK( vkGetPhysicalDeviceSurfaceCapabilitiesKHR( _chosenGPU, _surface, &capabilities ) );
+  uint32_t formatCount = 0;
+  VK_CHECK( vkGetPhysicalDeviceSurfaceFormatsKHR( _chosenGPU, _surface, &formatCount, nullptr ) );
+  std::vector< VkSurfaceFormatKHR > surfaceFormats( formatCount );
+  VK_CHECK( vkGetPhysicalDeviceSurfaceFormatsKHR( _chosenGPU, _surface, &formatCount, surfaceFormats.data() ) );
+  VkSurfaceFormatKHR storageFormat = {};
+  _swapchainStorage = false;
+  for( const VkSurfaceFormatKHR& surfaceFormat : surfaceFormats )
+  {
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties( _chosenGPU, surfaceFormat.format, &properties );
+    const bool unorm = surfaceFormat.format == VK_FORMAT_B8G8R8A8_UNORM || surfaceFormat.format == VK_FORMAT_R8G8B8A8_UNORM;
+    if( unorm && surfaceFormat.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR &&
+        ( capabilities.supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT ) &&
+        ( properties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT ) )
+    {
+      storageFormat = surfaceFormat;
+      _swapchainStorage = true;
+      break;
+    }
+  }
+
   vkb::SwapchainBuilder swapchainBuilder( _chosenGPU, _device, _surface );
-  vkb::Swapchain vkbSwapchain = swapchainBuilder
+  swapchainBuilder
     .use_default_format_selection()
-    .set_desired_present_mode( VK_PRESENT_MODE_FIFO_KHR )
+    .set_desired_present_mode( _presentMode )
     .set_desired_extent( _windowExtent.width, _windowExtent.height )
-    .build()
-    .value();
+    .add_image_usage_flags( VK_IMAGE_USAGE_TRANSFER_SRC_BIT ); // screenshots
+  if( _swapchainStorage )
+    swapchainBuilder.set_desired_format( storageFormat ).add_image_usage_flags( VK_IMAGE_USAGE_STORAGE_BIT );
+  else
+  {
+    swapchainBuilder.add_image_usage_flags( VK_IMAGE_USAGE_TRANSFER_DST_BIT );
+    std::cout << "the swapchain can't be a storage image, post processing copies into it" << std::endl;
+  }
+  vkb::Swapchain vkbSwapchain = swapchainBuilder.build().value();
   _swapchain = vkbSwapchain.swapchain;
 
   // [ ] Q: What do i need these for?
@@ -276,40 +1213,16 @@ void VulkanEngine::init_swapchain()
 
   _swapchainImageViews = vkbSwapchain.get_image_views().value();
   _swapchainImageFormat = vkbSwapchain.image_format;
-
-
-
-  VkExtent3D depthImageExtent = { _windowExtent.width, _windowExtent.height, 1 };
-  _depthFormat = VK_FORMAT_D32_SFLOAT;
-  VkImageCreateInfo depth_image_info = vkinit::image_create_info( _depthFormat,
-                                                                  VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-                                                                  depthImageExtent );
-  VmaAllocationCreateInfo depth_image_allocinfo = {};
-
-  // make sure image is allcated on fast vram,
-  // this is critical for images we are rendering to
-  depth_image_allocinfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-  //depth_image_allocinfo.requiredFlags = VkMemoryPropertyFlags( VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT );
-
-  // Force allocate image on vram no matter what ( VmaMemoryUsage more of a hint )
-  depth_image_allocinfo.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
-  vmaCreateImage( _allocator,
-                  &depth_image_info,
-                  &depth_image_allocinfo,
-                  &_depthImage._image,
-                  &_depthImage._allocation,
-                  nullptr );
-  VkImageViewCreateInfo depth_image_view_info = vkinit::image_view_create_info( _depthFormat,
-                                                                                _depthImage._image,
-                                                                                VK_IMAGE_ASPECT_DEPTH_BIT );
-  VK_CHECK( vkCreateImageView( _device, &depth_image_view_info, nullptr, &_depthImageView ) );
 }
 
 void VulkanEngine::init_vulkan()
 {
   uint32_t vkMajorVer = 1;
   uint32_t vkMinorVer = 1;
-  vkb::InstanceBuilder builder;
+
+  // vkbootstrap gets the loader volk found, so both use the same one
+  VK_CHECK( volkInitialize() );
+  vkb::InstanceBuilder builder( vkGetInstanceProcAddr );
   auto inst_ret = builder
     .set_app_name( "Example Vulkan Application" )
     .request_validation_layers( true )
@@ -320,29 +1233,125 @@ void VulkanEngine::init_vulkan()
   vkb::Instance vkb_inst = inst_ret.value();
   _instance = vkb_inst.instance;
   _debug_messenger = vkb_inst.debug_messenger;
+  volkLoadInstanceOnly( _instance );
 
   SDL_Vulkan_CreateSurface( _window, _instance, &_surface );
+  // gpu culling puts the object index in the firstInstance of indirect draws
+  VkPhysicalDeviceFeatures requiredFeatures = {};
+  requiredFeatures.drawIndirectFirstInstance = VK_TRUE;
+  // the mesh shader writes virtual texture feedback
+  requiredFeatures.fragmentStoresAndAtomics = VK_TRUE;
+  // post processing stores to bgra swapchain images, which have no shader format
+  requiredFeatures.shaderStorageImageWriteWithoutFormat = VK_TRUE;
+
   vkb::PhysicalDeviceSelector selector( vkb_inst );
   vkb::PhysicalDevice physicalDevice = selector
     .set_minimum_version( vkMajorVer, vkMinorVer )
     .set_surface( _surface ) // grab a gpu which can render to this surface
+    .set_required_features( requiredFeatures )
+    .add_desired_extension( VK_EXT_MEMORY_BUDGET_EXTENSION_NAME )
     .select()
     .value();
 
+  // desired extensions are enabled when present, vkbootstrap doesn't say which ones were
+  uint32_t extensionCount = 0;
+  VK_CHECK( vkEnumerateDeviceExtensionProperties( physicalDevice.physical_device, nullptr, &extensionCount, nullptr ) );
+  std::vector< VkExtensionProperties > extensions( extensionCount );
+  VK_CHECK( vkEnumerateDeviceExtensionProperties( physicalDevice.physical_device, nullptr, &extensionCount, extensions.data() ) );
+  const bool memoryBudget = std::any_of( extensions.begin(), extensions.end(), []( const VkExtensionProperties& ext ) {
+    return strcmp( ext.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME ) == 0;
+  } );
+
+  // optional features go through VkPhysicalDeviceFeatures2, which replaces the
+  // required features vkbootstrap would otherwise enable
+  VkPhysicalDeviceFeatures supportedFeatures;
+  vkGetPhysicalDeviceFeatures( physicalDevice.physical_device, &supportedFeatures );
+  _multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+  VkPhysicalDeviceFeatures2 enabledFeatures = {};
+  enabledFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  enabledFeatures.features = requiredFeatures;
+  enabledFeatures.features.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+
   vkb::DeviceBuilder deviceBuilder( physicalDevice );
-  vkb::Device vkbDevice = deviceBuilder.build().value();
+  vkb::Device vkbDevice = deviceBuilder
+    .add_pNext( &enabledFeatures )
+    .build()
+    .value();
   _device = vkbDevice.device;
   _chosenGPU = physicalDevice.physical_device;
 
+  // Device functions straight from the driver, skipping the loader's dispatch
+  // through the device handle. Only this device can be used with them.
+  volkLoadDevice( _device );
+
   _graphicsQueue = vkbDevice.get_queue( vkb::QueueType::graphics ).value();
   _graphicsQueueFamily = vkbDevice.get_queue_index( vkb::QueueType::graphics ).value();
 
-  // Initialize the memory allocator
+  // a family without graphics runs alongside it, vkbootstrap prefers one without transfer too
+  auto computeQueue = vkbDevice.get_queue( vkb::QueueType::compute );
+  _asyncCompute = _asyncComputeRequested && computeQueue.has_value();
+  if( _asyncCompute )
+  {
+    _computeQueue = computeQueue.value();
+    _computeQueueFamily = vkbDevice.get_queue_index( vkb::QueueType::compute ).value();
+    std::cout << "async compute on queue family " << _computeQueueFamily << std::endl;
+  }
+  else
+  {
+    _computeQueue = _graphicsQueue;
+    _computeQueueFamily = _graphicsQueueFamily;
+    if( _asyncComputeRequested )
+      std::cout << "no separate compute queue family, culling stays on the graphics queue" << std::endl;
+  }
+
+  // the overlap is measured with timestamps from both queues
+  uint32_t familyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties( _chosenGPU, &familyCount, nullptr );
+  std::vector< VkQueueFamilyProperties > families( familyCount );
+  vkGetPhysicalDeviceQueueFamilyProperties( _chosenGPU, &familyCount, families.data() );
+  VkPhysicalDeviceProperties deviceProperties;
+  vkGetPhysicalDeviceProperties( _chosenGPU, &deviceProperties );
+  if( families[ _graphicsQueueFamily ].timestampValidBits )
+    _graphicsTimestampPeriod = deviceProperties.limits.timestampPeriod;
+  if( _graphicsTimestampPeriod > 0 && families[ _computeQueueFamily ].timestampValidBits )
+    _timestampPeriod = _graphicsTimestampPeriod;
+
+  // Initialize the memory allocator, with the functions volk loaded
+  VmaVulkanFunctions vulkanFunctions = {};
+  vulkanFunctions.vkGetPhysicalDeviceProperties = vkGetPhysicalDeviceProperties;
+  vulkanFunctions.vkGetPhysicalDeviceMemoryProperties = vkGetPhysicalDeviceMemoryProperties;
+  vulkanFunctions.vkAllocateMemory = vkAllocateMemory;
+  vulkanFunctions.vkFreeMemory = vkFreeMemory;
+  vulkanFunctions.vkMapMemory = vkMapMemory;
+  vulkanFunctions.vkUnmapMemory = vkUnmapMemory;
+  vulkanFunctions.vkFlushMappedMemoryRanges = vkFlushMappedMemoryRanges;
+  vulkanFunctions.vkInvalidateMappedMemoryRanges = vkInvalidateMappedMemoryRanges;
+  vulkanFunctions.vkBindBufferMemory = vkBindBufferMemory;
+  vulkanFunctions.vkBindImageMemory = vkBindImageMemory;
+  vulkanFunctions.vkGetBufferMemoryRequirements = vkGetBufferMemoryRequirements;
+  vulkanFunctions.vkGetImageMemoryRequirements = vkGetImageMemoryRequirements;
+  vulkanFunctions.vkCreateBuffer = vkCreateBuffer;
+  vulkanFunctions.vkDestroyBuffer = vkDestroyBuffer;
+  vulkanFunctions.vkCreateImage = vkCreateImage;
+  vulkanFunctions.vkDestroyImage = vkDestroyImage;
+  vulkanFunctions.vkCmdCopyBuffer = vkCmdCopyBuffer;
+  // core in 1.1, which is what vma uses them as
+  vulkanFunctions.vkGetBufferMemoryRequirements2KHR = vkGetBufferMemoryRequirements2;
+  vulkanFunctions.vkGetImageMemoryRequirements2KHR = vkGetImageMemoryRequirements2;
+  vulkanFunctions.vkBindBufferMemory2KHR = vkBindBufferMemory2;
+  vulkanFunctions.vkBindImageMemory2KHR = vkBindImageMemory2;
+  vulkanFunctions.vkGetPhysicalDeviceMemoryProperties2KHR = vkGetPhysicalDeviceMemoryProperties2;
+
   VmaAllocatorCreateInfo allocatorInfo = {};
+  allocatorInfo.pVulkanFunctions = &vulkanFunctions;
   allocatorInfo.physicalDevice = _chosenGPU;
   allocatorInfo.device = _device;
   allocatorInfo.instance = _instance;
+  allocatorInfo.vulkanApiVersion = VK_MAKE_VERSION( vkMajorVer, vkMinorVer, 0 );
+  if( memoryBudget )
+    allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
   vmaCreateAllocator( &allocatorInfo, &_allocator );
+  _memory.init( _device, _allocator, memoryBudget, FRAME_OVERLAP );
 }
 
 void VulkanEngine::init_commands()
@@ -351,93 +1360,29 @@ void VulkanEngine::init_commands()
   // this pool can reset individual command buffers
   VkCommandPoolCreateInfo commandPoolInfo = vkinit::command_pool_create_info( _graphicsQueueFamily,
                                                                               VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT );
-  VK_CHECK( vkCreateCommandPool( _device, &commandPoolInfo, nullptr, &_commandPool ) );
-
-
-  VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info( _commandPool );
-  VK_CHECK( vkAllocateCommandBuffers( _device, &cmdAllocInfo, &_mainCommandBuffer ) );
-}
-
-void VulkanEngine::init_default_renderpass()
-{
-  VkAttachmentDescription color_attachment = {};
-  color_attachment.format = _swapchainImageFormat;
-  color_attachment.samples = VK_SAMPLE_COUNT_1_BIT; // 1 sample, no msaa
-
-  // cleared when render pass begins
-  color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-
-  // rendered contents stored in memory, can be read later.
-  // we want to store them so we can render it to the screen.
-  color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-  color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-  color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-
-  // dont know/care about starting layout of attachment
-  color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-
-  // after renderpass ends, image must be in a display layout
-  color_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-
-  VkAttachmentDescription depth_attachment = {};
-  depth_attachment.format = _depthFormat;
-  depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-  depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-  depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-
-  std::array render_pass_attachments = { color_attachment, depth_attachment };
-
-  std::array color_attachment_refs = { []() {
-    VkAttachmentReference color_attachment_ref = {};
-    color_attachment_ref.attachment = 0;
-    color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    return color_attachment_ref;
-  }( ) };
-
-  VkAttachmentReference depth_attachment_ref = {};
-  depth_attachment_ref.attachment = 1;
-  depth_attachment_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+  for( FrameData& frame : _frames )
+  {
+    VK_CHECK( vkCreateCommandPool( _device, &commandPoolInfo, nullptr, &frame._commandPool ) );
 
-  std::array subpasses = { [ & ](){
-    VkSubpassDescription subpass = {};
-    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpass.colorAttachmentCount = ( uint32_t )color_attachment_refs.size();
-    subpass.pColorAttachments = color_attachment_refs.data();
-    subpass.pDepthStencilAttachment = &depth_attachment_ref;
-    return subpass;
-  }( ) };
+    VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info( frame._commandPool );
+    VK_CHECK( vkAllocateCommandBuffers( _device, &cmdAllocInfo, &frame._mainCommandBuffer ) );
 
+    VkCommandBufferAllocateInfo drawAllocInfo = vkinit::command_buffer_allocate_info( frame._commandPool,
+                                                                                       1,
+                                                                                       VK_COMMAND_BUFFER_LEVEL_SECONDARY );
+    for( CachedDraws& cached : frame._cachedDraws )
+      VK_CHECK( vkAllocateCommandBuffers( _device, &drawAllocInfo, &cached.cmd ) );
 
-  VkRenderPassCreateInfo render_pass_info = {};
-  render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-  render_pass_info.attachmentCount = ( uint32_t )render_pass_attachments.size();
-  render_pass_info.pAttachments = render_pass_attachments.data();
-  render_pass_info.subpassCount = ( uint32_t )subpasses.size();
-  render_pass_info.pSubpasses = subpasses.data();
-  VK_CHECK( vkCreateRenderPass( _device, &render_pass_info, nullptr, &_renderPass ) );
-}
+    if( _asyncCompute )
+    {
+      VK_CHECK( vkAllocateCommandBuffers( _device, &cmdAllocInfo, &frame._lateCommandBuffer ) );
 
-void VulkanEngine::init_framebuffers()
-{
-  const int framebufferCount = ( int )_swapchainImageViews.size();
-  _framebuffers.resize( framebufferCount );
-  for( int i = 0; i < framebufferCount; ++i )
-  {
-    // depth image view can be reused between frames, it is cleared each render
-    std::array attachments = { _swapchainImageViews[ i ], _depthImageView };
-    VkFramebufferCreateInfo fb_info = {};
-    fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-    fb_info.renderPass = _renderPass;
-    fb_info.attachmentCount = ( uint32_t )attachments.size();
-    fb_info.pAttachments = attachments.data();
-    fb_info.width = _windowExtent.width;
-    fb_info.height = _windowExtent.height;
-    fb_info.layers = 1;
-    VK_CHECK( vkCreateFramebuffer( _device, &fb_info, nullptr, &_framebuffers[ i ] ) );
+      VkCommandPoolCreateInfo computePoolInfo = vkinit::command_pool_create_info( _computeQueueFamily,
+                                                                                  VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT );
+      VK_CHECK( vkCreateCommandPool( _device, &computePoolInfo, nullptr, &frame._computeCommandPool ) );
+      VkCommandBufferAllocateInfo computeAllocInfo = vkinit::command_buffer_allocate_info( frame._computeCommandPool );
+      VK_CHECK( vkAllocateCommandBuffers( _device, &computeAllocInfo, &frame._computeCommandBuffer ) );
+    }
   }
 }
 
@@ -448,66 +1393,497 @@ void VulkanEngine::init_sync_structures()
 
   // we will start signalled because our VulkanEngine::draw() starts with a vkWaitForFences
   fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-  VK_CHECK( vkCreateFence( _device, &fenceInfo, nullptr, &_renderFence ) );
 
   VkSemaphoreCreateInfo semaphoreInfo = {};
   semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-  VK_CHECK( vkCreateSemaphore( _device, &semaphoreInfo, nullptr, &_presentSemaphore ) );
-  VK_CHECK( vkCreateSemaphore( _device, &semaphoreInfo, nullptr, &_renderSemaphore ) );
-}
-
-void VulkanEngine::init_pipelines()
-{
-  struct ShaderStageCreator
+  for( FrameData& frame : _frames )
   {
-    VulkanEngine* _engine;
-    ~ShaderStageCreator()
-    {
-      for( VkShaderModule shaderModule : _shaderModules )
-      {
-        vkDestroyShaderModule( _engine->_device, shaderModule, nullptr );
-      }
-    }
-    bool AddModuleInfo( const char* path, VkShaderStageFlagBits stage )
+    VK_CHECK( vkCreateFence( _device, &fenceInfo, nullptr, &frame._renderFence ) );
+    VK_CHECK( vkCreateSemaphore( _device, &semaphoreInfo, nullptr, &frame._presentSemaphore ) );
+    VK_CHECK( vkCreateSemaphore( _device, &semaphoreInfo, nullptr, &frame._renderSemaphore ) );
+
+    if( _asyncCompute )
     {
-      VkShaderModule shaderModule = VK_NULL_HANDLE;
-      if( !_engine->load_shader_module( path, &shaderModule ) )
+      VK_CHECK( vkCreateSemaphore( _device, &semaphoreInfo, nullptr, &frame._computeSemaphore ) );
+      VK_CHECK( vkCreateSemaphore( _device, &semaphoreInfo, nullptr, &frame._visibilitySemaphore ) );
+      if( _timestampPeriod > 0 )
       {
-        std::cout << "failed to load shader " << path << std::endl;
-        return false;
+        VkQueryPoolCreateInfo queryPoolInfo = {};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = 2;
+        VK_CHECK( vkCreateQueryPool( _device, &queryPoolInfo, nullptr, &frame._computeTimestampPool ) );
+        VK_CHECK( vkCreateQueryPool( _device, &queryPoolInfo, nullptr, &frame._graphicsTimestampPool ) );
       }
-      _shaderStages.push_back( vkinit::shader_stage_create_info( stage, shaderModule ) );
-      return true;
     }
-    void clear() { _shaderStages.clear(); }
-    std::vector< VkPipelineShaderStageCreateInfo > _shaderStages;
-    std::vector< VkShaderModule > _shaderModules;
-  } shaderStageCreator = { this };
-  if( !shaderStageCreator.AddModuleInfo( "shaders/triangle.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT ) ||
-      !shaderStageCreator.AddModuleInfo( "shaders/triangle.vert.spv", VK_SHADER_STAGE_VERTEX_BIT ) )
-    return;
+  }
+}
 
-  VkPipelineLayoutCreateInfo pipeline_layout = vkinit::pipeline_layout_create_info();
-  VK_CHECK( vkCreatePipelineLayout( _device, &pipeline_layout, nullptr, &_trianglePipelineLayout ) );
+void VulkanEngine::init_buffers()
+{
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties( _chosenGPU, &properties );
+  const VkDeviceSize alignment = std::max( properties.limits.minUniformBufferOffsetAlignment,
+                                           properties.limits.minStorageBufferOffsetAlignment );
+
+  // The cpu writes objects and draws every frame, the gpu only fills in instance
+  // counts. A region fits them for MaxObjects, the lights, the largest page table
+  // and room left for smaller streams.
+  const VkDeviceSize regionSize = MaxObjects * ( sizeof( GPUObjectData ) + 2 * sizeof( VkDrawIndirectCommand ) ) +
+                                  MaxLights * sizeof( GPULight ) +
+                                  VirtualTexture::MaxPageTableEntries * sizeof( uint32_t ) +
+                                  1024 * 1024;
+  _frameRing.init( _allocator,
+                   regionSize,
+                   FRAME_OVERLAP,
+                   VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                   VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                   VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                   VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                   alignment );
+  _memory.track( _frameRing.get_allocation(), MemoryCategory::GpuData );
+
+  _visibilityBuffer = create_buffer( MaxObjects * sizeof( uint32_t ),
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                     VMA_MEMORY_USAGE_GPU_ONLY,
+                                     MemoryCategory::GpuData );
+  // each frame in flight counts into its own slot, read back after its fence
+  _cullStatsStride = ( sizeof( GPUCullStats ) + properties.limits.minStorageBufferOffsetAlignment - 1 ) /
+                     properties.limits.minStorageBufferOffsetAlignment * properties.limits.minStorageBufferOffsetAlignment;
+  _cullStatsBuffer = create_buffer( FRAME_OVERLAP * _cullStatsStride,
+                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                    VMA_MEMORY_USAGE_GPU_TO_CPU,
+                                    MemoryCategory::GpuData );
+  VK_CHECK( vmaMapMemory( _allocator, _cullStatsBuffer._allocation, ( void** )&_cullStatsData ) );
+
+  const uint32_t clusterCount = ClustersX * ClustersY * ClustersZ;
+  _clusterBuffer = create_buffer( clusterCount * ( 1 + MaxLightsPerCluster ) * sizeof( uint32_t ),
+                                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                  VMA_MEMORY_USAGE_GPU_ONLY,
+                                  MemoryCategory::GpuData );
+
+  // the shadow cache keeps its contents across frames, so the render graph only imports it
+  _shadowCache.init( ShadowResolution, { 12, 36, 108 }, 100 );
+  VkImageCreateInfo shadowInfo = vkinit::image_create_info( VK_FORMAT_D32_SFLOAT,
+                                                            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+                                                            VK_IMAGE_USAGE_SAMPLED_BIT,
+                                                            { ShadowCache::CascadeCount * ShadowResolution, ShadowResolution, 1 } );
+  VmaAllocationCreateInfo shadowAllocInfo = {};
+  shadowAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+  VK_CHECK( vmaCreateImage( _allocator,
+                            &shadowInfo,
+                            &shadowAllocInfo,
+                            &_staticShadowAtlas._image,
+                            &_staticShadowAtlas._allocation,
+                            nullptr ) );
+  _memory.track( _staticShadowAtlas._allocation, MemoryCategory::RenderTarget );
+  VkImageViewCreateInfo shadowViewInfo = vkinit::image_view_create_info( VK_FORMAT_D32_SFLOAT,
+                                                                         _staticShadowAtlas._image,
+                                                                         VK_IMAGE_ASPECT_DEPTH_BIT );
+  VK_CHECK( vkCreateImageView( _device, &shadowViewInfo, nullptr, &_staticShadowView ) );
+
+  _particles.init( _device, _allocator, _memory, _particleCapacity );
+  _skinning.init( _device, _allocator, _memory, _skinnedVertexCapacity, FRAME_OVERLAP );
+  _post.init( _device, _allocator, _memory, _graphicsTimestampPeriod, FRAME_OVERLAP );
+  _virtualTexture.init( _device,
+                        _allocator,
+                        _memory,
+                        _windowExtent,
+                        FRAME_OVERLAP,
+                        properties.limits.minStorageBufferOffsetAlignment );
+  // a screenshot and plenty of picks per frame
+  _readback.init( _allocator, _memory, ( VkDeviceSize )_windowExtent.width * _windowExtent.height * 4 + 4096, FRAME_OVERLAP );
+}
 
-  std::array pushConstants = { []()
+void VulkanEngine::init_render_graph()
+{
+  // The acquire semaphore is waited on at the color output stage, so that is where the
+  // swapchain image comes from. Only post processing writes it.
+  RGImportDesc swapchainImport = {};
+  swapchainImport.initialStages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  swapchainImport.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  swapchainImport.finalStages = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+  RGHandle swapchain = _renderGraph.import_image( "swapchain",
+                                                  _swapchainImages,
+                                                  _swapchainImageViews,
+                                                  { _swapchainImageFormat, _windowExtent, 1 },
+                                                  swapchainImport );
+
+  // Objects and draws, written by the cpu before submit, the submission makes that
+  // visible. Frames in flight use separate regions, so there is nothing to wait for.
+  RGHandle frameRing = _renderGraph.import_buffer( "frame ring", _frameRing.get_buffer(), {} );
+
+  // The late cull of one frame feeds the early cull of the next. With async compute
+  // the early cull is on the other queue and the ownership transfers sync it.
+  RGImportDesc visibilityImport = {};
+  if( !_asyncCompute )
   {
-    VkPushConstantRange push_constant = {};
-    push_constant.size = sizeof( MeshPushConstants );
-    push_constant.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-    return push_constant;
-  }( ) };
+    visibilityImport.initialStages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    visibilityImport.initialWriteAccess = VK_ACCESS_SHADER_WRITE_BIT;
+    visibilityImport.finalStages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    visibilityImport.finalAccess = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  }
+  RGHandle visibility = _renderGraph.import_buffer( "visibility", _visibilityBuffer._buffer, visibilityImport );
+
+  // read back on the cpu once the fence signals
+  RGImportDesc statsImport = {};
+  statsImport.finalStages = VK_PIPELINE_STAGE_HOST_BIT;
+  statsImport.finalAccess = VK_ACCESS_HOST_READ_BIT;
+  RGHandle stats = _renderGraph.import_buffer( "cull stats", _cullStatsBuffer._buffer, statsImport );
+
+  // rebuilt every frame, after the previous frame's draws are done reading it
+  RGImportDesc clusterImport = {};
+  clusterImport.finalStages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  clusterImport.finalAccess = VK_ACCESS_SHADER_WRITE_BIT;
+  RGHandle clusters = _renderGraph.import_buffer( "light clusters", _clusterBuffer._buffer, clusterImport );
+
+  // sampled by the previous frame, loaded by the cache pass so the valid parts survive
+  RGImportDesc shadowCacheImport = {};
+  shadowCacheImport.initialLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  shadowCacheImport.initialStages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+  shadowCacheImport.initialWriteAccess = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  shadowCacheImport.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  shadowCacheImport.finalStages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+  shadowCacheImport.finalAccess = VK_ACCESS_SHADER_READ_BIT;
+  const VkExtent2D shadowExtent = { ShadowCache::CascadeCount * ShadowResolution, ShadowResolution };
+  _staticShadows = _renderGraph.import_image( "shadow cache",
+                                              { _staticShadowAtlas._image },
+                                              { _staticShadowView },
+                                              { VK_FORMAT_D32_SFLOAT, shadowExtent, 1 },
+                                              shadowCacheImport );
+  _dynamicShadows = _renderGraph.create_image( "dynamic shadows", { VK_FORMAT_D32_SFLOAT, shadowExtent, 1 } );
+
+  _depthFormat = VK_FORMAT_D32_SFLOAT;
+  _depthImage = _renderGraph.create_image( "depth", { _depthFormat, _windowExtent, 1 } );
+  const RGHandle hdrColor = _post.create_target( _renderGraph, _windowExtent );
+  _objectIds = _renderGraph.create_image( "object ids", { VK_FORMAT_R32_UINT, _windowExtent, 1 } );
+
+  // mip 0 is half the depth resolution, levels use the usual vulkan mip sizes
+  _depthPyramidExtent = { std::max( _windowExtent.width / 2, 1u ), std::max( _windowExtent.height / 2, 1u ) };
+  _depthPyramidLevels = 1;
+  while( ( std::max( _depthPyramidExtent.width, _depthPyramidExtent.height ) >> _depthPyramidLevels ) > 0 )
+    ++_depthPyramidLevels;
+  _depthPyramid = _renderGraph.create_image( "depth pyramid",
+                                             { VK_FORMAT_R32_SFLOAT, _depthPyramidExtent, _depthPyramidLevels } );
+
+  // async compute records these two on its own queue, see submit_async_cull
+  if( !_asyncCompute )
+  {
+    _renderGraph.add_compute_pass( "reset culling",
+      [ & ]( RGPassBuilder& builder ) {
+        // only this frame's stats are cleared and the visibility only on the first
+        // frame, the rest is kept for the passes after
+        builder.transfer_write( stats, RGUsage::ReadWrite );
+        builder.transfer_write( visibility, RGUsage::ReadWrite );
+      },
+      [ this ]( VkCommandBuffer cmd ) {
+        // nothing was visible before the first frame, so it is all drawn late
+        if( _frameNumber == 0 )
+          vkCmdFillBuffer( cmd, _visibilityBuffer._buffer, 0, VK_WHOLE_SIZE, 0 );
+        vkCmdFillBuffer( cmd,
+                         _cullStatsBuffer._buffer,
+                         ( _frameNumber % FRAME_OVERLAP ) * _cullStatsStride,
+                         sizeof( GPUCullStats ),
+                         0 );
+      } );
+
+    _renderGraph.add_compute_pass( "cull early",
+      [ & ]( RGPassBuilder& builder ) {
+        builder.storage_buffer( frameRing, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::ReadWrite );
+        builder.storage_buffer( visibility, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::Read );
+        builder.storage_buffer( stats, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::ReadWrite );
+      },
+      [ this ]( VkCommandBuffer cmd ) {
+        cull_objects( cmd, 0, _drawnObjects );
+      } );
+  }
+
+  _particles.add_simulation_pass( _renderGraph );
+  _skinning.add_pass( _renderGraph );
+  const RGHandle skinnedVertices = _skinning.get_output();
+
+  _renderGraph.add_compute_pass( "light binning",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.storage_buffer( frameRing, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::Read );
+      builder.storage_buffer( clusters, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::Write );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      bin_lights( cmd );
+    } );
+
+  // only the invalid tiles are drawn, a frame with a valid cache records nothing
+  _shadowCachePass = _renderGraph.add_raster_pass( "shadow cache",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.depth_attachment( _staticShadows );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      for( const ShadowTileDraws& tile : _snapshot->shadowTiles )
+        if( tile.isStatic )
+          draw_shadow_casters( cmd, tile );
+    } );
+
+  const VkClearDepthStencilValue clearShadows = { 1, 0 };
+  _renderGraph.add_raster_pass( "dynamic shadows",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.depth_attachment( _dynamicShadows, &clearShadows );
+      builder.vertex_buffer( skinnedVertices );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      for( const ShadowTileDraws& tile : _snapshot->shadowTiles )
+        if( !tile.isStatic )
+          draw_shadow_casters( cmd, tile );
+    } );
+
+  _virtualTexture.add_upload_pass( _renderGraph );
+  const RGHandle pageAtlas = _virtualTexture.get_atlas();
+  const RGHandle feedback = _virtualTexture.get_feedback();
+
+  const VkClearColorValue clearColor = { { 1, 1, 0, 1 } };
+  const VkClearDepthStencilValue clearDepth = { 1, 0 };
+  const VkClearColorValue clearIds = {}; // nothing drawn
+  RGPass earlyDraw = _renderGraph.add_raster_pass( "early draw",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.color_attachment( hdrColor, &clearColor );
+      builder.color_attachment( _objectIds, &clearIds );
+      builder.depth_attachment( _depthImage, &clearDepth );
+      builder.indirect_buffer( frameRing );
+      builder.vertex_buffer( skinnedVertices );
+      builder.storage_buffer( frameRing, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, RGUsage::Read );
+      builder.storage_buffer( clusters, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, RGUsage::Read );
+      builder.sampled_image( _staticShadows, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT );
+      builder.sampled_image( _dynamicShadows, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT );
+      builder.sampled_image( pageAtlas, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT );
+      builder.storage_buffer( feedback, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, RGUsage::ReadWrite );
+      builder.secondary_command_buffers();
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      execute_draws( cmd, 0 );
+    } );
+
+  _renderGraph.add_compute_pass( "depth pyramid",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.sampled_image( _depthImage, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT );
+      builder.storage_image( _depthPyramid, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::Write );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      build_depth_pyramid( cmd );
+    } );
+
+  _cullLatePass = _renderGraph.add_compute_pass( "cull late",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.sampled_image( _depthPyramid, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT );
+      builder.storage_buffer( frameRing, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::ReadWrite );
+      builder.storage_buffer( visibility, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::ReadWrite );
+      builder.storage_buffer( stats, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::ReadWrite );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      cull_objects( cmd, 1, _drawnObjects );
+    } );
+
+  _renderGraph.add_raster_pass( "late draw",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.color_attachment( hdrColor );
+      builder.color_attachment( _objectIds );
+      builder.depth_attachment( _depthImage );
+      builder.indirect_buffer( frameRing );
+      builder.vertex_buffer( skinnedVertices );
+      builder.storage_buffer( frameRing, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, RGUsage::Read );
+      builder.storage_buffer( clusters, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, RGUsage::Read );
+      builder.sampled_image( _staticShadows, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT );
+      builder.sampled_image( _dynamicShadows, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT );
+      builder.sampled_image( pageAtlas, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT );
+      builder.storage_buffer( feedback, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, RGUsage::ReadWrite );
+      builder.secondary_command_buffers();
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      execute_draws( cmd, 1 );
+    } );
+
+  _particleDrawPass = _particles.add_draw_pass( _renderGraph, hdrColor, _depthImage );
+  _post.add_passes( _renderGraph, swapchain, _swapchainImageFormat, _swapchainStorage );
+
+  // Picks and screenshots, into the frame's region of the readback queue. Runs every
+  // frame, so the swapchain image always passes through the transfer layout.
+  RGImportDesc readbackImport = {};
+  readbackImport.finalStages = VK_PIPELINE_STAGE_HOST_BIT;
+  readbackImport.finalAccess = VK_ACCESS_HOST_READ_BIT;
+  RGHandle readback = _renderGraph.import_buffer( "readback", _readback.get_buffer(), readbackImport );
+  _renderGraph.add_compute_pass( "readback",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.transfer_read( swapchain );
+      builder.transfer_read( _objectIds );
+      builder.transfer_write( readback );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      record_readbacks( cmd );
+    } );
+
+  _renderGraph.compile( _device, _allocator );
+  for( VmaAllocation allocation : _renderGraph.get_allocations() )
+    _memory.track( allocation, MemoryCategory::RenderTarget );
+  _renderPass = _renderGraph.get_render_pass( earlyDraw );
+
+  std::cout << "render graph" << std::endl;
+  _renderGraph.print_summary();
+}
+
+void VulkanEngine::init_descriptor_layouts()
+{
+  // only depend on the device, so the pipeline layouts don't wait for the render graph
+  auto create_set_layout = [ & ]( auto& bindings, VkDescriptorSetLayout* out ) {
+    VkDescriptorSetLayoutCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    info.bindingCount = ( uint32_t )bindings.size();
+    info.pBindings = bindings.data();
+    VK_CHECK( vkCreateDescriptorSetLayout( _device, &info, nullptr, out ) );
+  };
+
+  std::array objectBindings = {
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0 ),
+  };
+  create_set_layout( objectBindings, &_objectSetLayout );
+
+  std::array depthReduceBindings = {
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 0 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1 ),
+  };
+  create_set_layout( depthReduceBindings, &_depthReduceSetLayout );
+
+  std::array cullBindings = {
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 3 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4 ),
+  };
+  create_set_layout( cullBindings, &_cullSetLayout );
+
+  // the mesh vertex shader reads the camera from the lighting params
+  const VkShaderStageFlags lightStages = VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+  std::array lightBindings = {
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, lightStages | VK_SHADER_STAGE_VERTEX_BIT, 0 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lightStages, 1 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lightStages, 2 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 3 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 4 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 5 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 6 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 7 ),
+  };
+  create_set_layout( lightBindings, &_lightSetLayout );
+}
+
+void VulkanEngine::init_descriptors()
+{
+  // only used with texelFetch, so filtering doesn't matter
+  VkSamplerCreateInfo sampler_info = vkinit::sampler_create_info( VK_FILTER_NEAREST,
+                                                                  VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE );
+  VK_CHECK( vkCreateSampler( _device, &sampler_info, nullptr, &_depthSampler ) );
+
+  // the shader filters by hand, the cache wraps around
+  VkSamplerCreateInfo shadow_sampler_info = vkinit::sampler_create_info( VK_FILTER_NEAREST,
+                                                                         VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE );
+  shadow_sampler_info.compareEnable = VK_TRUE;
+  shadow_sampler_info.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+  VK_CHECK( vkCreateSampler( _device, &shadow_sampler_info, nullptr, &_shadowSampler ) );
+
+  std::array poolSizes = {
+    VkDescriptorPoolSize{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 16 + 8 * FRAME_OVERLAP },
+    VkDescriptorPoolSize{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, FRAME_OVERLAP },
+    VkDescriptorPoolSize{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 8 + 3 * FRAME_OVERLAP + _depthPyramidLevels },
+    VkDescriptorPoolSize{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _depthPyramidLevels },
+  };
+  VkDescriptorPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.maxSets = 8 + 3 * FRAME_OVERLAP + _depthPyramidLevels;
+  pool_info.poolSizeCount = ( uint32_t )poolSizes.size();
+  pool_info.pPoolSizes = poolSizes.data();
+  VK_CHECK( vkCreateDescriptorPool( _device, &pool_info, nullptr, &_descriptorPool ) );
+
+  auto allocate_set = [ & ]( VkDescriptorSetLayout layout ) {
+    VkDescriptorSetAllocateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    info.descriptorPool = _descriptorPool;
+    info.descriptorSetCount = 1;
+    info.pSetLayouts = &layout;
+    VkDescriptorSet set;
+    VK_CHECK( vkAllocateDescriptorSets( _device, &info, &set ) );
+    return set;
+  };
+
+  // objects and draws move around the ring, draw() points the sets at them every frame
+  VkDescriptorBufferInfo visibilityInfo = { _visibilityBuffer._buffer, 0, VK_WHOLE_SIZE };
+  VkDescriptorBufferInfo clusterInfo = { _clusterBuffer._buffer, 0, VK_WHOLE_SIZE };
+  VkDescriptorImageInfo staticShadowInfo = { _shadowSampler,
+                                             _renderGraph.get_image_view( _staticShadows ),
+                                             VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+  VkDescriptorImageInfo dynamicShadowInfo = { _shadowSampler,
+                                              _renderGraph.get_image_view( _dynamicShadows ),
+                                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+  VkDescriptorImageInfo pyramidInfo = { _depthSampler,
+                                        _renderGraph.get_image_view( _depthPyramid ),
+                                        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+  VkDescriptorImageInfo atlasInfo = _virtualTexture.get_atlas_info();
+  std::array< VkDescriptorBufferInfo, FRAME_OVERLAP > statsInfos;
+  std::array< VkDescriptorBufferInfo, FRAME_OVERLAP > feedbackInfos;
+
+  std::vector< VkWriteDescriptorSet > writes;
+  for( uint32_t i = 0; i < FRAME_OVERLAP; ++i )
+  {
+    FrameData& frame = _frames[ i ];
+    frame._objectSet = allocate_set( _objectSetLayout );
+    frame._cullSet = allocate_set( _cullSetLayout );
+    frame._lightSet = allocate_set( _lightSetLayout );
+    statsInfos[ i ] = { _cullStatsBuffer._buffer, i * _cullStatsStride, sizeof( GPUCullStats ) };
+    writes.push_back( vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame._cullSet, &visibilityInfo, 2 ) );
+    writes.push_back( vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, frame._cullSet, &pyramidInfo, 3 ) );
+    writes.push_back( vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame._cullSet, &statsInfos[ i ], 4 ) );
+    writes.push_back( vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame._lightSet, &clusterInfo, 2 ) );
+    writes.push_back( vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, frame._lightSet, &staticShadowInfo, 3 ) );
+    writes.push_back( vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, frame._lightSet, &dynamicShadowInfo, 4 ) );
+    feedbackInfos[ i ] = _virtualTexture.get_feedback_info( i );
+    writes.push_back( vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, frame._lightSet, &atlasInfo, 6 ) );
+    writes.push_back( vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame._lightSet, &feedbackInfos[ i ], 7 ) );
+  }
+
+  // each reduction reads the level above it, the first one reads the depth image
+  std::vector< VkDescriptorImageInfo > reduceInfos( 2 * _depthPyramidLevels );
+  _depthReduceSets.resize( _depthPyramidLevels );
+  for( uint32_t i = 0; i < _depthPyramidLevels; ++i )
+  {
+    _depthReduceSets[ i ] = allocate_set( _depthReduceSetLayout );
+    VkDescriptorImageInfo& src = reduceInfos[ 2 * i ];
+    VkDescriptorImageInfo& dst = reduceInfos[ 2 * i + 1 ];
+    src = i == 0
+      ? VkDescriptorImageInfo{ _depthSampler, _renderGraph.get_image_view( _depthImage ), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL }
+      : VkDescriptorImageInfo{ _depthSampler, _renderGraph.get_mip_view( _depthPyramid, i - 1 ), VK_IMAGE_LAYOUT_GENERAL };
+    dst = { VK_NULL_HANDLE, _renderGraph.get_mip_view( _depthPyramid, i ), VK_IMAGE_LAYOUT_GENERAL };
+    writes.push_back( vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _depthReduceSets[ i ], &src, 0 ) );
+    writes.push_back( vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _depthReduceSets[ i ], &dst, 1 ) );
+  }
+  vkUpdateDescriptorSets( _device, ( uint32_t )writes.size(), writes.data(), 0, nullptr );
+}
+
+void VulkanEngine::init_pipelines()
+{
+  // graphics pipelines and their shader modules are owned by the cache,
+  // a shader or pipeline asked for twice is created once
+  _pipelineCache.init( _device );
+  auto load_stage = [ this ]( const char* path, VkShaderStageFlagBits stage ) {
+    return vkinit::shader_stage_create_info( stage, get_shader_module( path ) );
+  };
+
+  // no push constants, the draws are recorded once and reused while the camera moves
   VkPipelineLayoutCreateInfo mesh_pipeline_layout_info = vkinit::pipeline_layout_create_info();
-  mesh_pipeline_layout_info.pPushConstantRanges = pushConstants.data();
-  mesh_pipeline_layout_info.pushConstantRangeCount = ( uint32_t )pushConstants.size();
+  std::array meshSetLayouts = { _objectSetLayout, _lightSetLayout };
+  mesh_pipeline_layout_info.setLayoutCount = ( uint32_t )meshSetLayouts.size();
+  mesh_pipeline_layout_info.pSetLayouts = meshSetLayouts.data();
   VK_CHECK( vkCreatePipelineLayout( _device, &mesh_pipeline_layout_info, nullptr, &_meshPipelineLayout ) );
 
   VertexInputDescription vertexDesc = Vertex::get_vertex_description();
 
   PipelineBuilder pipelineBuilder = {};
-  pipelineBuilder._shaderStages = shaderStageCreator._shaderStages;
-
-  // not using atm because not reading vertexes from vertex buffers
   pipelineBuilder._vertexInputInfo = vkinit::vertex_input_state_create_info();
   pipelineBuilder._inputAssembly = vkinit::input_assembly_create_info( VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST );
   pipelineBuilder._viewport.width = ( float )_windowExtent.width;
@@ -520,40 +1896,122 @@ void VulkanEngine::init_pipelines()
   // no multisampling, run 1spp
   pipelineBuilder._multisampling = vkinit::multisample_state_create_info();
 
-  // single blend attachment, no blend, write rgba
+  // no blend, write rgba
   pipelineBuilder._colorBlendAttachment = vkinit::color_blend_attachment_state();
   pipelineBuilder._pipelineLayout = _meshPipelineLayout;
+  // the color and the object ids
+  pipelineBuilder._colorAttachmentCount = 2;
   pipelineBuilder._depthStencil = vkinit::depth_stencil_create_info( true, true, VK_COMPARE_OP_LESS_OR_EQUAL );
-  _redTrianglePipeline = pipelineBuilder.build_pipeline( _device, _renderPass );
-
-  shaderStageCreator.clear();
-  if( !shaderStageCreator.AddModuleInfo( "shaders/colored_triangle.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT ) ||
-      !shaderStageCreator.AddModuleInfo( "shaders/colored_triangle.vert.spv", VK_SHADER_STAGE_VERTEX_BIT ) )
-    return;
-  pipelineBuilder._shaderStages = shaderStageCreator._shaderStages;
-  _trianglePipeline = pipelineBuilder.build_pipeline( _device, _renderPass );
 
-  shaderStageCreator.clear();
-  if( !shaderStageCreator.AddModuleInfo( "shaders/triangle_mesh.vert.spv", VK_SHADER_STAGE_VERTEX_BIT ) ||
-      !shaderStageCreator.AddModuleInfo( "shaders/colored_triangle.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT ) )
+  pipelineBuilder._shaderStages = {
+    load_stage( "shaders/triangle_mesh.vert.spv", VK_SHADER_STAGE_VERTEX_BIT ),
+    load_stage( "shaders/mesh_clustered.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT ),
+  };
+  if( !pipelineBuilder._shaderStages[ 0 ].module || !pipelineBuilder._shaderStages[ 1 ].module )
     return;
-  pipelineBuilder._shaderStages = shaderStageCreator._shaderStages;
   pipelineBuilder._vertexInputInfo.pVertexAttributeDescriptions = vertexDesc.attributes.data();
   pipelineBuilder._vertexInputInfo.vertexAttributeDescriptionCount = ( uint32_t )vertexDesc.attributes.size();
   pipelineBuilder._vertexInputInfo.pVertexBindingDescriptions = vertexDesc.bindings.data();
   pipelineBuilder._vertexInputInfo.vertexBindingDescriptionCount = ( uint32_t )vertexDesc.bindings.size();
-  _meshPipeline = pipelineBuilder.build_pipeline( _device, _renderPass );
+  _meshPipeline = _pipelineCache.get_pipeline( pipelineBuilder, _renderPass );
+
+  create_material( _meshPipeline, _meshPipelineLayout, DefaultMaterial );
+  // the same pipeline, the objects tell the shader which texture they sample
+  MaterialHandle textured = create_material( _meshPipeline, _meshPipelineLayout, TexturedMaterial );
+  _materials.get( textured )->texture = _virtualTexture.add_texture( "assets/lost_empire-RGBA.png" );
+
+  // depth only, the viewport and scissor are set per shadow tile
+  VkShaderModule shadowModule = get_shader_module( "shaders/shadow.vert.spv" );
+  if( shadowModule )
+  {
+    VkPushConstantRange shadowPushConstant = {};
+    shadowPushConstant.size = sizeof( ShadowPushConstants );
+    shadowPushConstant.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    VkPipelineLayoutCreateInfo shadow_layout_info = vkinit::pipeline_layout_create_info();
+    shadow_layout_info.pushConstantRangeCount = 1;
+    shadow_layout_info.pPushConstantRanges = &shadowPushConstant;
+    VK_CHECK( vkCreatePipelineLayout( _device, &shadow_layout_info, nullptr, &_shadowPipelineLayout ) );
+
+    pipelineBuilder._shaderStages = { vkinit::shader_stage_create_info( VK_SHADER_STAGE_VERTEX_BIT, shadowModule ) };
+    pipelineBuilder._pipelineLayout = _shadowPipelineLayout;
+    pipelineBuilder._colorAttachmentCount = 0;
+    pipelineBuilder._dynamicStates = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+    pipelineBuilder._rasterizer.depthBiasEnable = VK_TRUE;
+    pipelineBuilder._rasterizer.depthBiasConstantFactor = 1.25f;
+    pipelineBuilder._rasterizer.depthBiasSlopeFactor = 1.75f;
+    _shadowPipeline = _pipelineCache.get_pipeline( pipelineBuilder, _renderGraph.get_render_pass( _shadowCachePass ) );
+  }
+  std::cout << "pipelines: " << _pipelineCache.get_pipeline_count() << " built, "
+            << _pipelineCache.get_reuse_count() << " reused, "
+            << _pipelineCache.get_module_count() << " shader modules" << std::endl;
+
+  auto load = [ this ]( const char* path ) {
+    VkShaderModule shaderModule = VK_NULL_HANDLE;
+    if( !load_shader_module( path, &shaderModule ) )
+      std::cout << "failed to load shader " << path << std::endl;
+    return shaderModule;
+  };
+  _particles.init_pipelines( _renderGraph.get_render_pass( _particleDrawPass ), _windowExtent, load );
+  _skinning.init_pipeline( load );
+  _post.init_pipelines( _renderGraph, load );
+}
 
-  create_material( _meshPipeline, _meshPipelineLayout, "defaultmesh" );
+void VulkanEngine::init_compute_pipelines()
+{
+  auto create_compute_pipeline = [ & ]( const char* path,
+                                        VkDescriptorSetLayout setLayout,
+                                        uint32_t pushConstantSize,
+                                        VkPipelineLayout* outLayout,
+                                        VkPipeline* outPipeline ) {
+    VkPushConstantRange push_constant = {};
+    push_constant.size = pushConstantSize;
+    push_constant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    VkPipelineLayoutCreateInfo layout_info = vkinit::pipeline_layout_create_info();
+    layout_info.setLayoutCount = 1;
+    layout_info.pSetLayouts = &setLayout;
+    layout_info.pushConstantRangeCount = pushConstantSize > 0 ? 1 : 0;
+    layout_info.pPushConstantRanges = &push_constant;
+    VK_CHECK( vkCreatePipelineLayout( _device, &layout_info, nullptr, outLayout ) );
+
+    VkShaderModule shaderModule;
+    if( !load_shader_module( path, &shaderModule ) )
+    {
+      std::cout << "failed to load shader " << path << std::endl;
+      return;
+    }
+    *outPipeline = build_compute_pipeline( _device, *outLayout, shaderModule );
+    vkDestroyShaderModule( _device, shaderModule, nullptr );
+  };
+  create_compute_pipeline( "shaders/depth_reduce.comp.spv",
+                           _depthReduceSetLayout,
+                           sizeof( DepthReducePushConstants ),
+                           &_depthReduceLayout,
+                           &_depthReducePipeline );
+  create_compute_pipeline( "shaders/occlusion_cull.comp.spv",
+                           _cullSetLayout,
+                           sizeof( CullPushConstants ),
+                           &_cullLayout,
+                           &_cullPipeline );
+  create_compute_pipeline( "shaders/light_cluster.comp.spv",
+                           _lightSetLayout,
+                           0,
+                           &_lightCullLayout,
+                           &_lightCullPipeline );
 }
 
 void VulkanEngine::init_scene()
 {
+  if( _replay )
+  {
+    init_scene_from_capture();
+    return;
+  }
+
   RenderObject monkey;
-  monkey.mesh = get_mesh( "monkey" );
-  monkey.material = get_material( "defaultmesh" );
+  monkey.mesh = get_mesh( MonkeyMesh );
+  monkey.material = get_material( TexturedMaterial );
   monkey.transformMatrix = glm::mat4( 1 );
-  _renderables.push_back( monkey );
+  add_renderable( monkey );
 
   for( int x = -20; x <= 20; ++x )
   {
@@ -563,21 +2021,93 @@ void VulkanEngine::init_scene()
       glm::mat4 scale = glm::scale( glm::mat4( 1 ), glm::vec3( .2, .2, .2 ) );
 
       RenderObject tri;
-      tri.mesh = get_mesh( "triangle" );
-      tri.material = get_material( "defaultmesh" );
+      tri.mesh = get_mesh( TriangleMesh );
+      tri.material = get_material( DefaultMaterial );
       tri.transformMatrix = translation * scale;
-      _renderables.push_back( tri );
+      add_renderable( tri );
 
     }
   }
+
+  // swaying in front of the monkey, skinned on the gpu
+  for( int x = -3; x <= 3; x += 2 )
+  {
+    for( int z = 2; z <= 5; z += 3 )
+    {
+      RenderObject tentacle;
+      tentacle.mesh = get_mesh( TentacleMesh );
+      tentacle.material = get_material( DefaultMaterial );
+      tentacle.transformMatrix = glm::translate( glm::mat4( 1 ), glm::vec3( x, 0, z ) );
+      add_renderable( tentacle );
+    }
+  }
+
+  // a ring of colored point lights over the triangles and a spot on the monkey
+  for( int i = 0; i < 32; ++i )
+  {
+    const float angle = i * glm::two_pi< float >() / 32;
+    Light light;
+    light.position = glm::vec3( 12 * std::cos( angle ), 1.5f, 12 * std::sin( angle ) );
+    light.radius = 6;
+    light.color = glm::vec3( 0.5f + 0.5f * std::cos( angle ), 0.5f + 0.5f * std::sin( angle ), 0.6f );
+    light.intensity = 4;
+    _lights.push_back( light );
+  }
+  Light spot;
+  spot.type = LightType::Spot;
+  spot.position = { 0, 6, 2 };
+  spot.direction = glm::vec3( 0, -6, -2 );
+  spot.radius = 15;
+  spot.intensity = 20;
+  _lights.push_back( spot );
+}
+
+void VulkanEngine::init_scene_from_capture()
+{
+  // objects that can't be built are counted, run_replay refuses to replay without them
+  for( const CaptureObject& captured : _capture.objects )
+  {
+    RenderObject object;
+    object.mesh = get_mesh( captured.mesh );
+    object.material = get_material( captured.material );
+    object.transformMatrix = captured.transform;
+    object.isStatic = captured.isStatic;
+    if( object.mesh.is_null() || object.material.is_null() )
+    {
+      _replayMissing++;
+      continue;
+    }
+    add_renderable( object );
+  }
+  _lights = _capture.lights;
+  _ambientLight = _capture.ambientLight;
+  _sunDirection = _capture.sunDirection;
+  _sunColor = _capture.sunColor;
+}
+
+std::vector< char > VulkanEngine::read_spirv( const char* spirvpath )
+{
+  // read ahead at startup, from the disk after that
+  auto it = _shaderFiles.find( spirvpath );
+  std::vector< char > buf = it != _shaderFiles.end() ? it->second : file_to_bytes( spirvpath );
+  buf.resize( round_up_nearest_multiple( ( int )buf.size(), sizeof( uint32_t ) ) );
+  return buf;
+}
+
+VkShaderModule VulkanEngine::get_shader_module( const char* spirvpath )
+{
+  std::vector< char > buf = read_spirv( spirvpath );
+  VkShaderModule shaderModule = buf.empty() ? VK_NULL_HANDLE : _pipelineCache.get_shader_module( buf );
+  if( !shaderModule )
+    std::cout << "failed to load shader " << spirvpath << std::endl;
+  return shaderModule;
 }
 
 bool VulkanEngine::load_shader_module( const char* spirvpath, VkShaderModule* out )
 {
-  auto buf = file_to_bytes( spirvpath );
+  std::vector< char > buf = read_spirv( spirvpath );
   if( buf.empty() )
     return false;
-  buf.resize( round_up_nearest_multiple( ( int )buf.size(), sizeof( uint32_t ) ) );
 
   VkShaderModuleCreateInfo createInfo = {};
   createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
@@ -593,32 +2123,118 @@ bool VulkanEngine::load_shader_module( const char* spirvpath, VkShaderModule* ou
   return true;
 }
 
+void VulkanEngine::read_shaders()
+{
+  // a missing directory reads nothing, the pipelines report the missing shaders
+  std::error_code error;
+  for( const auto& entry : std::filesystem::directory_iterator( "shaders", error ) )
+  {
+    if( entry.path().extension() != ".spv" )
+      continue;
+    // keyed the way the pipelines ask for them
+    const std::string path = "shaders/" + entry.path().filename().string();
+    _shaderFiles[ path ] = file_to_bytes( path.c_str() );
+  }
+}
+
 void VulkanEngine::load_meshes()
 {
-  _triangleMesh._verticies.resize( 3 );
-  _triangleMesh._verticies[ 0 ].position = { 1, 1, 0 };
-  _triangleMesh._verticies[ 1 ].position = { -1, 1, 0 };
-  _triangleMesh._verticies[ 2 ].position = { 0, -1, 0 };
-  _triangleMesh._verticies[ 0 ].color = { 0, 1, 0 };
-  _triangleMesh._verticies[ 1 ].color = { 0, 1, 0 };
-  _triangleMesh._verticies[ 2 ].color = { 0, 1, 0 };
-  upload_mesh( _triangleMesh );
+  if( !_worldPath.empty() )
+    _world.open( _worldPath.c_str() );
+  _meshes.reserve( MaxMeshes + _world.get_chunk_count() );
+
+  Mesh triangle;
+  triangle._verticies.resize( 3 );
+  triangle._verticies[ 0 ].position = { 1, 1, 0 };
+  triangle._verticies[ 1 ].position = { -1, 1, 0 };
+  triangle._verticies[ 2 ].position = { 0, -1, 0 };
+  triangle._verticies[ 0 ].color = { 0, 1, 0 };
+  triangle._verticies[ 1 ].color = { 0, 1, 0 };
+  triangle._verticies[ 2 ].color = { 0, 1, 0 };
+  triangle._verticies[ 0 ].uv = { 1, 0 };
+  triangle._verticies[ 1 ].uv = { 0, 0 };
+  triangle._verticies[ 2 ].uv = { 0.5f, 1 };
+  for( Vertex& vertex : triangle._verticies )
+    vertex.normal = { 0, 0, 1 };
+  triangle.compute_bounds();
+
+  Mesh monkey;
+  monkey.load_from_obj( "assets/monkey_smooth.obj" );
+
+  _meshes.add( MonkeyMesh, std::move( monkey ) );
+  _meshes.add( TriangleMesh, std::move( triangle ) );
+  _meshes.add( TentacleMesh, build_tentacle( 8 ) );
+  load_world();
+}
 
-  _monkeyMesh.load_from_obj( "assets/monkey_smooth.obj" );
-  upload_mesh( _monkeyMesh );
+void VulkanEngine::load_world()
+{
+  // the meshes get their vertices with the upload of a chunk and lose them with its eviction
+  _worldMeshes.reserve( _world.get_chunk_count() );
+  _worldRenderables.assign( _world.get_chunk_count(), -1 );
+  for( uint32_t i = 0; i < _world.get_chunk_count(); ++i )
+  {
+    Mesh mesh;
+    mesh._bounds = _world.get_chunk_bounds( i );
+    _worldMeshes.push_back( _meshes.add( hash_name( "world chunk " + std::to_string( i ) ), std::move( mesh ) ) );
+  }
+}
 
-  _meshes[ "monkey" ] = _monkeyMesh;
-  _meshes[ "triangle" ] = _triangleMesh;
+void VulkanEngine::upload_meshes()
+{
+  // the memory manager keeps pointers to the vertex buffers, so every mesh is
+  // added before the first upload and the registry never moves them afterwards
+  for( NameHash name : { MonkeyMesh, TriangleMesh, TentacleMesh } )
+  {
+    Mesh& mesh = *_meshes.get( get_mesh( name ) );
+    if( !mesh.is_skinned() )
+      upload_mesh( mesh );
+    else if( !_skinning.add_mesh( mesh ) )
+      std::cout << "no room for the bind pose of skinned mesh " << name << std::endl;
+  }
 }
 
 void VulkanEngine::upload_mesh( Mesh& mesh )
 {
-  VkBufferCreateInfo bufferInfo = {};
-  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  bufferInfo.size = mesh._verticies.size() * sizeof( Vertex );
-  bufferInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+  // the buffer is host visible, so the upload is done and the cpu copy can go.
+  // Generated meshes keep theirs, static batching merges them from it.
+  if( !mesh._verticies.empty() )
+  {
+    create_vertex_buffer( mesh, mesh._verticies );
+    if( !mesh._sourcePath.empty() )
+      std::vector< Vertex >().swap( mesh._verticies );
+    return;
+  }
+
+  // an evicted mesh reads its vertices from the source again, into a copy as the
+  // simulation reads the mesh's bounds meanwhile
+  Mesh source;
+  source.load_from_obj( mesh._sourcePath.c_str() );
+  create_vertex_buffer( mesh, source._verticies );
+}
+
+void VulkanEngine::make_mesh_resident( Mesh& mesh )
+{
+  if( !mesh._vertexBuffer._buffer )
+    upload_mesh( mesh );
+  _memory.touch( mesh._vertexBuffer._allocation );
+}
+
+void VulkanEngine::create_vertex_buffer( Mesh& mesh, const std::vector< Vertex >& vertices )
+{
+  // transfer usage lets defragmentation copy it around
+  const VkDeviceSize size = vertices.size() * sizeof( Vertex );
+  const VkBufferUsageFlags usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                                   VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                   VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  VkBufferCreateInfo bufferInfo = vkinit::buffer_create_info( size, usage );
   VmaAllocationCreateInfo vmaAllocInfo = {};
   vmaAllocInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+
+  uint32_t memoryType;
+  VK_CHECK( vmaFindMemoryTypeIndexForBufferInfo( _allocator, &bufferInfo, &vmaAllocInfo, &memoryType ) );
+  _memory.make_room( memoryType, size );
+
   VK_CHECK( vmaCreateBuffer( _allocator,
                              &bufferInfo,
                              &vmaAllocInfo,
@@ -628,79 +2244,897 @@ void VulkanEngine::upload_mesh( Mesh& mesh )
   // Copy data into buffer
   void* data;
   vmaMapMemory( _allocator, mesh._vertexBuffer._allocation, &data );
-  memcpy( data, mesh._verticies.data(), mesh._verticies.size() * sizeof( Vertex ) );
+  memcpy( data, vertices.data(), size );
   vmaUnmapMemory( _allocator, mesh._vertexBuffer._allocation );
+  mesh._vertexCount = ( uint32_t )vertices.size();
+  _meshRevision++; // draws recorded with the old buffer
+
+  // generated meshes have nothing to reload from, they stay resident
+  MemoryManager::EvictFn evict;
+  if( !mesh._sourcePath.empty() )
+    evict = [ this, &mesh ]() {
+      _memory.untrack( mesh._vertexBuffer._allocation );
+      vmaDestroyBuffer( _allocator, mesh._vertexBuffer._buffer, mesh._vertexBuffer._allocation );
+      mesh._vertexBuffer = {};
+      _meshRevision++;
+    };
+  _memory.track( mesh._vertexBuffer._allocation,
+                 MemoryCategory::Mesh,
+                 &mesh._vertexBuffer,
+                 size,
+                 usage,
+                 evict );
 }
 
-Material* VulkanEngine::create_material( VkPipeline pipeline,
-                                         VkPipelineLayout pipelineLayout,
-                                         const std::string& name )
+MaterialHandle VulkanEngine::create_material( VkPipeline pipeline,
+                                              VkPipelineLayout pipelineLayout,
+                                              NameHash name )
 {
   Material mat;
   mat.pipeline = pipeline;
   mat.pipelineLayout = pipelineLayout;
-  _materials[ name ] = mat;
-  return &_materials[ name ];
+  return _materials.add( name, std::move( mat ) );
 }
 
-// returns nullptr if not found
-Material* VulkanEngine::get_material( const std::string& name )
+// returns the null handle if not found
+MaterialHandle VulkanEngine::get_material( NameHash name )
 {
-  auto it = _materials.find( name );
-  return it == _materials.end() ? nullptr : &( *it ).second;
+  return _materials.find( name );
 }
 
-// returns nullptr if not found
-Mesh* VulkanEngine::get_mesh( const std::string& name )
+// returns the null handle if not found
+MeshHandle VulkanEngine::get_mesh( NameHash name )
 {
-  auto it = _meshes.find( name );
-  return it == _meshes.end() ? nullptr : &( *it ).second;
+  return _meshes.find( name );
+}
+
+uint32_t VulkanEngine::add_renderable( const RenderObject& object )
+{
+  // the gpu culling buffers are sized for MaxObjects
+  assert( _renderables.size() < MaxObjects );
+  const uint32_t index = ( uint32_t )_renderables.size();
+  _renderables.push_back( object );
+  _sceneRevision++;
+  RenderObject& added = _renderables.back();
+  const Mesh* mesh = _meshes.get( added.mesh );
+  added.worldBounds = transform_aabb( mesh->_bounds, added.transformMatrix );
+  if( mesh->is_skinned() )
+  {
+    // the skinning buffers are sized for the capacities, see SkinningSystem
+    assert( _skinnedObjects.size() < SkinningSystem::MaxInstances );
+    assert( _skinnedVertexCount + mesh->_skin.size() <= _skinnedVertexCapacity );
+    assert( _skinnedJointCount + mesh->_jointPivots.size() <= SkinningSystem::MaxJoints );
+    added.isStatic = false;
+    added.skinnedObject = ( int )_skinnedObjects.size();
+    _skinnedObjects.push_back( index );
+    _skinnedVertexCount += ( uint32_t )mesh->_skin.size();
+    _skinnedJointCount += ( uint32_t )mesh->_jointPivots.size();
+  }
+  if( _staticBatching && added.isStatic && !added.isChunk && added.worldChunk < 0 )
+    batch_static_object( index );
+  else
+    added.bvhProxy = _renderableBVH.create_proxy( added.worldBounds, index );
+  if( added.isStatic )
+    _shadowCache.invalidate( added.worldBounds );
+  return index;
 }
 
-void VulkanEngine::draw_objects( VkCommandBuffer cmd, RenderObject* objects, int objectCount )
+void VulkanEngine::remove_renderable( uint32_t index )
+{
+  // chunks stay in place once built, even when empty
+  assert( !_renderables[ index ].isChunk );
+  _sceneRevision++;
+  if( _renderables[ index ].staticChunk >= 0 )
+    remove_from_static_chunk( index );
+  else
+    _renderableBVH.destroy_proxy( _renderables[ index ].bvhProxy );
+  if( _renderables[ index ].isStatic )
+    _shadowCache.invalidate( _renderables[ index ].worldBounds );
+  if( _renderables[ index ].skinnedObject >= 0 )
+  {
+    // swapped out of _skinnedObjects the same way
+    const Mesh* mesh = _meshes.get( _renderables[ index ].mesh );
+    _skinnedVertexCount -= ( uint32_t )mesh->_skin.size();
+    _skinnedJointCount -= ( uint32_t )mesh->_jointPivots.size();
+    const int skinned = _renderables[ index ].skinnedObject;
+    _skinnedObjects[ skinned ] = _skinnedObjects.back();
+    _renderables[ _skinnedObjects[ skinned ] ].skinnedObject = skinned;
+    _skinnedObjects.pop_back();
+  }
+  if( index != _renderables.size() - 1 )
+  {
+    const uint32_t last = ( uint32_t )_renderables.size() - 1;
+    RenderObject& moved = _renderables[ index ] = _renderables.back();
+    if( moved.bvhProxy != DynamicBVH::NullNode )
+      _renderableBVH.set_user_data( moved.bvhProxy, index );
+    if( moved.skinnedObject >= 0 )
+      _skinnedObjects[ moved.skinnedObject ] = index;
+    if( moved.worldChunk >= 0 )
+      _worldRenderables[ moved.worldChunk ] = ( int )index;
+    if( moved.isChunk )
+      _staticChunks[ moved.staticChunk ].renderable = ( int )index;
+    else if( moved.staticChunk >= 0 )
+    {
+      std::vector< uint32_t >& objects = _staticChunks[ moved.staticChunk ].objects;
+      *std::find( objects.begin(), objects.end(), last ) = index;
+    }
+  }
+  _renderables.pop_back();
+}
+
+void VulkanEngine::set_renderable_transform( uint32_t index, const glm::mat4& transform )
+{
+  if( _capturing && !_capture.frames.empty() )
+    _capture.frames.back().transforms.push_back( { index, transform } );
+
+  RenderObject& object = _renderables[ index ];
+  object.transformMatrix = transform;
+  const AABB oldBounds = object.worldBounds;
+  object.worldBounds = transform_aabb( _meshes.get( object.mesh )->_bounds, transform );
+  if( object.staticChunk >= 0 && !object.isChunk )
+  {
+    // may have moved to another cell
+    remove_from_static_chunk( index );
+    batch_static_object( index );
+  }
+  else
+    _renderableBVH.move_proxy( object.bvhProxy, object.worldBounds );
+  if( object.isStatic )
+  {
+    _shadowCache.invalidate( oldBounds );
+    _shadowCache.invalidate( object.worldBounds );
+  }
+}
+
+// key of _staticChunkLookup, cells are 16 bits per axis
+static uint64_t static_chunk_key( MaterialHandle material, const glm::ivec3& cell )
+{
+  return ( uint64_t )material.index << 48 |
+         ( uint64_t )( cell.x & 0xffff ) << 32 |
+         ( uint64_t )( cell.y & 0xffff ) << 16 |
+         ( uint64_t )( cell.z & 0xffff );
+}
+
+void VulkanEngine::batch_static_object( uint32_t index )
+{
+  RenderObject& object = _renderables[ index ];
+  const glm::ivec3 cell = glm::ivec3( glm::floor( object.worldBounds.center() / StaticChunkSize ) );
+  auto [ it, inserted ] = _staticChunkLookup.try_emplace( static_chunk_key( object.material, cell ),
+                                                          ( uint32_t )_staticChunks.size() );
+  if( inserted )
+  {
+    StaticChunk chunk;
+    chunk.material = object.material;
+    chunk.cell = cell;
+    _staticChunks.push_back( std::move( chunk ) );
+  }
+  StaticChunk& chunk = _staticChunks[ it->second ];
+  chunk.objects.push_back( index );
+  chunk.dirty = true;
+  object.staticChunk = ( int )it->second;
+  if( object.bvhProxy != DynamicBVH::NullNode )
+  {
+    _renderableBVH.destroy_proxy( object.bvhProxy );
+    object.bvhProxy = DynamicBVH::NullNode;
+  }
+}
+
+void VulkanEngine::remove_from_static_chunk( uint32_t index )
+{
+  RenderObject& object = _renderables[ index ];
+  StaticChunk& chunk = _staticChunks[ object.staticChunk ];
+  std::vector< uint32_t >::iterator it = std::find( chunk.objects.begin(), chunk.objects.end(), index );
+  *it = chunk.objects.back();
+  chunk.objects.pop_back();
+  chunk.dirty = true;
+  object.staticChunk = -1;
+}
+
+void VulkanEngine::set_static_batching( bool enabled )
+{
+  if( enabled == _staticBatching )
+    return;
+  _staticBatching = enabled;
+  _sceneRevision++;
+  for( uint32_t i = 0; i < ( uint32_t )_renderables.size(); ++i )
+  {
+    RenderObject& object = _renderables[ i ];
+    if( !object.isStatic || object.isChunk || object.worldChunk >= 0 || ( object.staticChunk >= 0 ) == enabled )
+      continue;
+    if( enabled )
+      batch_static_object( i );
+    else
+    {
+      remove_from_static_chunk( i );
+      object.bvhProxy = _renderableBVH.create_proxy( object.worldBounds, i );
+    }
+  }
+}
+
+const std::vector< Vertex >& VulkanEngine::get_static_source_vertices( MeshHandle handle )
+{
+  // generated meshes keep their cpu copy
+  const Mesh& mesh = *_meshes.get( handle );
+  if( mesh._sourcePath.empty() )
+    return mesh._verticies;
+
+  // the others dropped it with the upload, their buffers belong to the render thread
+  const uint64_t key = ( uint64_t )handle.generation << 32 | handle.index;
+  auto it = _staticSourceVertices.find( key );
+  if( it != _staticSourceVertices.end() )
+    return it->second;
+  Mesh source;
+  source.load_from_obj( mesh._sourcePath.c_str() );
+  return _staticSourceVertices[ key ] = std::move( source._verticies );
+}
+
+void VulkanEngine::update_static_chunks( RenderSnapshot& snapshot )
+{
+  for( uint32_t id = 0; id < ( uint32_t )_staticChunks.size(); ++id )
+  {
+    StaticChunk& chunk = _staticChunks[ id ];
+    if( !chunk.dirty )
+      continue;
+    chunk.dirty = false;
+    _sceneRevision++;
+
+    // Growing the registry past what load_meshes reserved would move the meshes
+    // under the memory manager and the snapshots, so a chunk without a mesh when
+    // it is full isn't built and its objects are drawn one by one instead.
+    if( chunk.mesh.is_null() && _meshes.size() >= MaxMeshes + _world.get_chunk_count() )
+    {
+      std::cout << "mesh registry full, static chunk " << id << " left unbatched" << std::endl;
+      for( uint32_t index : chunk.objects )
+      {
+        RenderObject& object = _renderables[ index ];
+        object.staticChunk = -1;
+        object.bvhProxy = _renderableBVH.create_proxy( object.worldBounds, index );
+      }
+      chunk.objects.clear();
+      continue;
+    }
+
+    // world space vertices, the normals through the inverse transpose so any scale works
+    Mesh merged;
+    for( uint32_t index : chunk.objects )
+    {
+      const RenderObject& object = _renderables[ index ];
+      const glm::mat3 normalMatrix = glm::transpose( glm::inverse( glm::mat3( object.transformMatrix ) ) );
+      for( const Vertex& vertex : get_static_source_vertices( object.mesh ) )
+      {
+        Vertex& out = merged._verticies.emplace_back();
+        out.position = glm::vec3( object.transformMatrix * glm::vec4( vertex.position, 1 ) );
+        out.normal = glm::normalize( normalMatrix * vertex.normal );
+        out.color = vertex.color;
+        out.uv = vertex.uv;
+      }
+    }
+    merged.compute_bounds();
+
+    if( chunk.mesh.is_null() )
+      chunk.mesh = _meshes.add( hash_name( "static chunk " + std::to_string( id ) ), Mesh() );
+    Mesh& mesh = *_meshes.get( chunk.mesh );
+    mesh._bounds = merged._bounds;
+    const bool empty = merged._verticies.empty();
+    snapshot.uploads.push_back( { &mesh, std::move( merged._verticies ) } );
+
+    // an empty chunk keeps its renderable, out of the bvh, so no index changes under the caller
+    if( empty )
+    {
+      if( chunk.renderable >= 0 && _renderables[ chunk.renderable ].bvhProxy != DynamicBVH::NullNode )
+      {
+        _renderableBVH.destroy_proxy( _renderables[ chunk.renderable ].bvhProxy );
+        _renderables[ chunk.renderable ].bvhProxy = DynamicBVH::NullNode;
+      }
+      continue;
+    }
+
+    if( chunk.renderable < 0 )
+    {
+      RenderObject object;
+      object.mesh = chunk.mesh;
+      object.material = chunk.material;
+      object.transformMatrix = glm::mat4( 1 );
+      object.isChunk = true;
+      object.staticChunk = ( int )id;
+      chunk.renderable = ( int )add_renderable( object );
+    }
+    else
+    {
+      RenderObject& object = _renderables[ chunk.renderable ];
+      object.worldBounds = mesh._bounds;
+      if( object.bvhProxy == DynamicBVH::NullNode )
+        object.bvhProxy = _renderableBVH.create_proxy( object.worldBounds, ( uint32_t )chunk.renderable );
+      else
+        _renderableBVH.move_proxy( object.bvhProxy, object.worldBounds );
+    }
+  }
+}
+
+void VulkanEngine::update_world( RenderSnapshot& snapshot,
+                                 const glm::vec3& cameraPosition,
+                                 const glm::vec3& cameraForward,
+                                 const glm::mat4& viewProj )
+{
+  if( !_world.is_open() )
+    return;
+  _world.update( cameraPosition, cameraForward, Frustum::from_matrix( viewProj ) );
+  snapshot.worldStats = _world.get_stats();
+
+  // the render thread frees an evicted chunk's buffer once the frames in flight are done with it
+  for( uint32_t chunk : _world.get_evictions() )
+  {
+    remove_renderable( ( uint32_t )_worldRenderables[ chunk ] );
+    _worldRenderables[ chunk ] = -1;
+    snapshot.uploads.push_back( { _meshes.get( _worldMeshes[ chunk ] ), {} } );
+  }
+  for( WorldChunkLoad& load : _world.get_uploads() )
+  {
+    snapshot.uploads.push_back( { _meshes.get( _worldMeshes[ load.chunk ] ), std::move( load.vertices ) } );
+    RenderObject object;
+    object.mesh = _worldMeshes[ load.chunk ];
+    object.material = get_material( TexturedMaterial );
+    object.transformMatrix = glm::mat4( 1 );
+    object.worldChunk = ( int )load.chunk;
+    _worldRenderables[ load.chunk ] = ( int )add_renderable( object );
+  }
+}
+
+void VulkanEngine::apply_mesh_uploads( const RenderSnapshot& snapshot )
+{
+  // The frames in flight may still draw the buffers of rebuilt and evicted chunks.
+  // They stay tracked until they are freed, defragmentation may be moving them and
+  // patches the retired copy, so none is freed while it runs.
+  if( !_memory.is_defragmenting() )
+    _retiredChunkBuffers.remove_if( [ this ]( RetiredBuffer& retired ) {
+      if( retired.frame + FRAME_OVERLAP > _frameNumber )
+        return false;
+      _memory.untrack( retired.buffer._allocation );
+      vmaDestroyBuffer( _allocator, retired.buffer._buffer, retired.buffer._allocation );
+      return true;
+    } );
+
+  for( const MeshUpload& upload : snapshot.uploads )
+  {
+    Mesh& mesh = *upload.mesh;
+    if( mesh._vertexBuffer._buffer )
+    {
+      RetiredBuffer& retired = _retiredChunkBuffers.emplace_back( RetiredBuffer{ mesh._vertexBuffer, _frameNumber } );
+      _memory.set_owner( retired.buffer._allocation, &retired.buffer );
+      mesh._vertexBuffer = {};
+      _meshRevision++;
+    }
+    mesh._vertexCount = 0;
+    if( !upload.vertices.empty() )
+      create_vertex_buffer( mesh, upload.vertices );
+  }
+}
+
+int VulkanEngine::pick_renderable( int x, int y ) const
+{
+  // unproject the pixel at the near and far planes
+  const glm::mat4 invViewProj = glm::inverse( get_view_proj() );
+  const float ndcX = 2.0f * ( x + 0.5f ) / _windowExtent.width - 1.0f;
+  const float ndcY = 2.0f * ( y + 0.5f ) / _windowExtent.height - 1.0f;
+  glm::vec4 nearPoint = invViewProj * glm::vec4( ndcX, ndcY, -1, 1 );
+  glm::vec4 farPoint = invViewProj * glm::vec4( ndcX, ndcY, 1, 1 );
+  nearPoint /= nearPoint.w;
+  farPoint /= farPoint.w;
+
+  Ray ray;
+  ray.origin = glm::vec3( nearPoint );
+  ray.dir = glm::vec3( farPoint - nearPoint );
+
+  // dir is not normalized, so t = 1 is the far plane
+  int picked = -1;
+  _renderableBVH.query_ray( ray, 1.0f, [ & ]( uint32_t index, float tMax ) {
+    // a chunk is not pickable itself, the objects merged into it are
+    const RenderObject& hit = _renderables[ index ];
+    const uint32_t* candidates = &index;
+    size_t candidateCount = 1;
+    if( hit.isChunk )
+    {
+      candidates = _staticChunks[ hit.staticChunk ].objects.data();
+      candidateCount = _staticChunks[ hit.staticChunk ].objects.size();
+    }
+    for( size_t i = 0; i < candidateCount; ++i )
+    {
+      float t;
+      if( ray.intersect( _renderables[ candidates[ i ] ].worldBounds, tMax, &t ) )
+      {
+        picked = ( int )candidates[ i ];
+        tMax = t;
+      }
+    }
+    return tMax;
+  } );
+  return picked;
+}
+
+glm::mat4 VulkanEngine::get_view() const
+{
+  return glm::translate( glm::mat4( 1 ), _camPos );
+}
+
+glm::mat4 VulkanEngine::get_projection() const
 {
   const float aspect = ( float )_windowExtent.width / ( float )_windowExtent.height;
-  glm::vec3 camPos (  0, -2, -10 );
-  glm::mat4 view = glm::translate( glm::mat4( 1 ), camPos );
   glm::mat4 proj = glm::perspective( glm::radians( 70.0f ),
                                      aspect,
-                                     0.1f,
-                                     200.0f );
+                                     _zNear,
+                                     _zFar );
   proj[ 1 ][ 1 ] *= -1;
+  return proj;
+}
 
-  Mesh* lastMesh = nullptr;
-  Material* lastMaterial = nullptr;
-  for( int iObject = 0; iObject < objectCount; ++iObject )
+glm::mat4 VulkanEngine::get_view_proj() const
+{
+  return get_projection() * get_view();
+}
+
+void VulkanEngine::draw_objects( VkCommandBuffer cmd, int phase )
+{
+  if( _drawnObjects == 0 )
+    return;
+  const VkDeviceSize stride = sizeof( VkDrawIndirectCommand );
+  const FrameData& frame = get_current_frame();
+  const VkDeviceSize phaseOffset = frame._draws.offset + ( VkDeviceSize )phase * _drawnObjects * stride;
+
+  const Mesh* lastMesh = nullptr;
+  VkPipeline lastPipeline = VK_NULL_HANDLE;
+  for( const DrawBatch& batch : _snapshot->batches )
   {
-    RenderObject* object = &objects[ iObject ];
-    if( object->material != lastMaterial )
+    if( batch.pipeline != lastPipeline )
+    {
+      vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, batch.pipeline );
+      const std::array sets = { frame._objectSet, frame._lightSet };
+      vkCmdBindDescriptorSets( cmd,
+                               VK_PIPELINE_BIND_POINT_GRAPHICS,
+                               batch.pipelineLayout,
+                               0, ( uint32_t )sets.size(), sets.data(),
+                               0, nullptr );
+      lastPipeline = batch.pipeline;
+    }
+    if( batch.mesh != lastMesh )
     {
-      vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, object->material->pipeline );
-      lastMaterial = object->material;
+      // the draw commands of skinned objects start at their vertices
+      const VkBuffer buffer = batch.mesh->is_skinned() ? _skinning.get_output_buffer() : batch.mesh->_vertexBuffer._buffer;
+      VkDeviceSize offset = 0;
+      vkCmdBindVertexBuffers( cmd, 0, 1, &buffer, &offset );
+      lastMesh = batch.mesh;
     }
 
-    glm::mat4 model = object->transformMatrix;
-    glm::mat4 mesh_matrix = proj * view * model;
+    const VkDeviceSize offset = phaseOffset + batch.first * stride;
+    if( _multiDrawIndirect )
+      vkCmdDrawIndirect( cmd, frame._draws.buffer, offset, batch.count, ( uint32_t )stride );
+    else
+      for( uint32_t d = 0; d < batch.count; ++d )
+        vkCmdDrawIndirect( cmd, frame._draws.buffer, offset + d * stride, 1, ( uint32_t )stride );
+  }
+}
+
+void VulkanEngine::execute_draws( VkCommandBuffer cmd, int phase )
+{
+  // The recording only refers to the frame's sets, its ring ranges and the vertex
+  // buffers, the camera and the culling results are read from buffers. Writing the
+  // sets invalidates it in render, a new scene, new mesh buffers or moved ones here.
+  CachedDraws& cached = get_current_frame()._cachedDraws[ phase ];
+  if( _snapshot->reuseDraws &&
+      cached.valid &&
+      cached.sceneRevision == _snapshot->sceneRevision &&
+      cached.meshRevision == _meshRevision &&
+      cached.bufferRevision == _memory.get_buffer_revision() )
+  {
+    _drawsReused++;
+  }
+  else
+  {
+    // the early and late render passes only differ in load ops, so they are compatible
+    VkCommandBufferInheritanceInfo inheritance = {};
+    inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance.renderPass = _renderPass;
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    beginInfo.pInheritanceInfo = &inheritance;
+
+    // the pool resets individual buffers, begin resets it
+    VK_CHECK( vkBeginCommandBuffer( cached.cmd, &beginInfo ) );
+    draw_objects( cached.cmd, phase );
+    VK_CHECK( vkEndCommandBuffer( cached.cmd ) );
+    cached.valid = true;
+    cached.sceneRevision = _snapshot->sceneRevision;
+    cached.meshRevision = _meshRevision;
+    cached.bufferRevision = _memory.get_buffer_revision();
+    _drawsRecorded++;
+  }
+  vkCmdExecuteCommands( cmd, 1, &cached.cmd );
+}
 
-    MeshPushConstants constants;
-    constants.render_matrix = mesh_matrix;
-    vkCmdPushConstants( cmd,
-                        object->material->pipelineLayout,
-                        VK_SHADER_STAGE_VERTEX_BIT,
-                        0,
-                        sizeof( MeshPushConstants ),
-                        &constants );
-    if( object->mesh != lastMesh )
+void VulkanEngine::cull_objects( VkCommandBuffer cmd, int phase, uint32_t objectCount )
+{
+  if( objectCount == 0 )
+    return;
+
+  CullPushConstants constants;
+  constants.viewProj = _snapshot->lighting.viewProj;
+  constants.objectCount = objectCount;
+  constants.phase = ( uint32_t )phase;
+  constants.drawOffset = phase * objectCount;
+  constants.pyramidLevels = _depthPyramidLevels;
+
+  vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _cullPipeline );
+  vkCmdBindDescriptorSets( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _cullLayout, 0, 1, &get_current_frame()._cullSet, 0, nullptr );
+  vkCmdPushConstants( cmd, _cullLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( constants ), &constants );
+  vkCmdDispatch( cmd, ( objectCount + 63 ) / 64, 1, 1 );
+}
+
+void VulkanEngine::bin_lights( VkCommandBuffer cmd )
+{
+  // one thread per cluster
+  const uint32_t clusterCount = ClustersX * ClustersY * ClustersZ;
+  vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _lightCullPipeline );
+  vkCmdBindDescriptorSets( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _lightCullLayout, 0, 1, &get_current_frame()._lightSet, 0, nullptr );
+  vkCmdDispatch( cmd, ( clusterCount + 127 ) / 128, 1, 1 );
+}
+
+void VulkanEngine::draw_shadow_casters( VkCommandBuffer cmd, const ShadowTileDraws& tileDraws )
+{
+  const ShadowTile& tile = tileDraws.tile;
+  const VkViewport viewport = { ( float )tile.rect.offset.x,
+                                ( float )tile.rect.offset.y,
+                                ( float )tile.rect.extent.width,
+                                ( float )tile.rect.extent.height,
+                                0, 1 };
+  vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _shadowPipeline );
+  vkCmdSetViewport( cmd, 0, 1, &viewport );
+  vkCmdSetScissor( cmd, 0, 1, &tile.rect );
+  if( tileDraws.isStatic )
+  {
+    VkClearAttachment clear = {};
+    clear.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    clear.clearValue.depthStencil = { 1, 0 };
+    const VkClearRect clearRect = { tile.rect, 0, 1 };
+    vkCmdClearAttachments( cmd, 1, &clear, 1, &clearRect );
+  }
+
+  // render made the meshes resident
+  const Mesh* lastMesh = nullptr;
+  for( uint32_t i = tileDraws.first; i < tileDraws.first + tileDraws.count; ++i )
+  {
+    const ShadowDraw& draw = _snapshot->shadowDraws[ i ];
+    if( draw.mesh != lastMesh )
     {
+      const VkBuffer buffer = draw.mesh->is_skinned() ? _skinning.get_output_buffer() : draw.mesh->_vertexBuffer._buffer;
       VkDeviceSize offset = 0;
-      vkCmdBindVertexBuffers( cmd, 0, 1, &object->mesh->_vertexBuffer._buffer, &offset );
-      lastMesh = object->mesh;
+      vkCmdBindVertexBuffers( cmd, 0, 1, &buffer, &offset );
+      lastMesh = draw.mesh;
     }
-    vkCmdDraw( cmd, (uint32_t) object->mesh->_verticies.size(), 1, 0, 0 );
+    ShadowPushConstants constants;
+    constants.mvp = draw.mvp;
+    vkCmdPushConstants( cmd, _shadowPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof( constants ), &constants );
+    vkCmdDraw( cmd, draw.mesh->_vertexCount, 1, draw.firstVertex, 0 );
+  }
+}
+
+void VulkanEngine::prepare_shadow_cache( VkCommandBuffer cmd )
+{
+  // contents are undefined, but the first update renders the whole cache
+  if( _frameNumber != 0 )
+    return;
+  VkImageMemoryBarrier barrier = vkinit::image_barrier( _staticShadowAtlas._image,
+                                                        0,
+                                                        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                                                        VK_IMAGE_LAYOUT_UNDEFINED,
+                                                        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                                        VK_IMAGE_ASPECT_DEPTH_BIT );
+  vkCmdPipelineBarrier( cmd,
+                        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                        0, 0, nullptr, 0, nullptr, 1, &barrier );
+}
+
+void VulkanEngine::submit_async_cull( FrameData& frame )
+{
+  const VkDeviceSize statsOffset = ( _frameNumber % FRAME_OVERLAP ) * _cullStatsStride;
+  VkCommandBuffer cmd = frame._computeCommandBuffer;
+  VK_CHECK( vkResetCommandBuffer( cmd, 0 ) );
+  VkCommandBufferBeginInfo cmdBeginInfo = {};
+  cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK( vkBeginCommandBuffer( cmd, &cmdBeginInfo ) );
+  if( frame._computeTimestampPool )
+  {
+    vkCmdResetQueryPool( cmd, frame._computeTimestampPool, 0, 2 );
+    vkCmdWriteTimestamp( cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame._computeTimestampPool, 0 );
   }
+
+  // Nothing was visible before the first frame, after that the previous frame's
+  // late cull released the visibility on the graphics queue. The ring region and
+  // the stats slot were released by the late draw of the frame that used them
+  // last, whose fence the cpu waited for before refilling the region.
+  if( _frameNumber == 0 )
+    vkCmdFillBuffer( cmd, _visibilityBuffer._buffer, 0, VK_WHOLE_SIZE, 0 );
+  std::array acquire = {
+    vkinit::buffer_barrier( _frameRing.get_buffer(),
+                            0,
+                            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+                            _graphicsQueueFamily,
+                            _computeQueueFamily,
+                            _frameRing.get_region_offset(),
+                            _frameRing.get_region_size() ),
+    vkinit::buffer_barrier( _cullStatsBuffer._buffer,
+                            0,
+                            VK_ACCESS_TRANSFER_WRITE_BIT,
+                            _graphicsQueueFamily,
+                            _computeQueueFamily,
+                            statsOffset,
+                            sizeof( GPUCullStats ) ),
+    vkinit::buffer_barrier( _visibilityBuffer._buffer,
+                            0,
+                            VK_ACCESS_SHADER_READ_BIT,
+                            _graphicsQueueFamily,
+                            _computeQueueFamily ),
+  };
+  const uint32_t firstAcquire = _frameNumber >= FRAME_OVERLAP ? 0 : 2;
+  const uint32_t endAcquire = _frameNumber > 0 ? 3 : 2;
+  if( endAcquire > firstAcquire )
+    vkCmdPipelineBarrier( cmd,
+                          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                          0, 0, nullptr, endAcquire - firstAcquire, acquire.data() + firstAcquire, 0, nullptr );
+  vkCmdFillBuffer( cmd, _cullStatsBuffer._buffer, statsOffset, sizeof( GPUCullStats ), 0 );
+  VkMemoryBarrier fillBarrier = vkinit::memory_barrier( VK_ACCESS_TRANSFER_WRITE_BIT,
+                                                        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT );
+  vkCmdPipelineBarrier( cmd,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        0, 1, &fillBarrier, 0, nullptr, 0, nullptr );
+
+  cull_objects( cmd, 0, _drawnObjects );
+
+  // hand the draws, stats and visibility over to the graphics queue
+  std::array release = {
+    vkinit::buffer_barrier( _frameRing.get_buffer(),
+                            VK_ACCESS_SHADER_WRITE_BIT,
+                            0,
+                            _computeQueueFamily,
+                            _graphicsQueueFamily,
+                            _frameRing.get_region_offset(),
+                            _frameRing.get_region_size() ),
+    vkinit::buffer_barrier( _cullStatsBuffer._buffer,
+                            VK_ACCESS_SHADER_WRITE_BIT,
+                            0,
+                            _computeQueueFamily,
+                            _graphicsQueueFamily,
+                            statsOffset,
+                            sizeof( GPUCullStats ) ),
+    vkinit::buffer_barrier( _visibilityBuffer._buffer,
+                            VK_ACCESS_TRANSFER_WRITE_BIT,
+                            0,
+                            _computeQueueFamily,
+                            _graphicsQueueFamily ),
+  };
+  vkCmdPipelineBarrier( cmd,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        0, 0, nullptr, ( uint32_t )release.size(), release.data(), 0, nullptr );
+  if( frame._computeTimestampPool )
+    vkCmdWriteTimestamp( cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame._computeTimestampPool, 1 );
+  VK_CHECK( vkEndCommandBuffer( cmd ) );
+
+  // waits for the previous frame's late cull, only as far as its visibility writes
+  const FrameData& previous = _frames[ ( _frameNumber + FRAME_OVERLAP - 1 ) % FRAME_OVERLAP ];
+  VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  VkSubmitInfo submit = {};
+  submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit.waitSemaphoreCount = _frameNumber > 0 ? 1 : 0;
+  submit.pWaitSemaphores = &previous._visibilitySemaphore;
+  submit.pWaitDstStageMask = &waitStage;
+  submit.commandBufferCount = 1;
+  submit.pCommandBuffers = &cmd;
+  submit.signalSemaphoreCount = 1;
+  submit.pSignalSemaphores = &frame._computeSemaphore;
+  VK_CHECK( vkQueueSubmit( _computeQueue, 1, &submit, VK_NULL_HANDLE ) );
 }
 
+void VulkanEngine::submit_async_graphics( FrameData& frame, uint32_t swapchainImage )
+{
+  const VkDeviceSize statsOffset = ( _frameNumber % FRAME_OVERLAP ) * _cullStatsStride;
+  VkCommandBufferBeginInfo cmdBeginInfo = {};
+  cmdBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  cmdBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  VkCommandBuffer cmd = frame._mainCommandBuffer;
+  VK_CHECK( vkResetCommandBuffer( cmd, 0 ) );
+  VK_CHECK( vkBeginCommandBuffer( cmd, &cmdBeginInfo ) );
+  if( frame._graphicsTimestampPool )
+  {
+    vkCmdResetQueryPool( cmd, frame._graphicsTimestampPool, 0, 2 );
+    vkCmdWriteTimestamp( cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame._graphicsTimestampPool, 0 );
+  }
 
+  // acquire what the early cull released, at the stages the compute semaphore is waited at
+  const VkPipelineStageFlags cullResultStages = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                                                VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                                                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  const VkAccessFlags cullResultAccess = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+                                         VK_ACCESS_SHADER_READ_BIT |
+                                         VK_ACCESS_SHADER_WRITE_BIT;
+  std::array acquire = {
+    vkinit::buffer_barrier( _frameRing.get_buffer(),
+                            0,
+                            cullResultAccess,
+                            _computeQueueFamily,
+                            _graphicsQueueFamily,
+                            _frameRing.get_region_offset(),
+                            _frameRing.get_region_size() ),
+    vkinit::buffer_barrier( _cullStatsBuffer._buffer,
+                            0,
+                            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+                            _computeQueueFamily,
+                            _graphicsQueueFamily,
+                            statsOffset,
+                            sizeof( GPUCullStats ) ),
+    vkinit::buffer_barrier( _visibilityBuffer._buffer,
+                            0,
+                            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+                            _computeQueueFamily,
+                            _graphicsQueueFamily ),
+  };
+  vkCmdPipelineBarrier( cmd,
+                        cullResultStages,
+                        cullResultStages,
+                        0, 0, nullptr, ( uint32_t )acquire.size(), acquire.data(), 0, nullptr );
+  prepare_shadow_cache( cmd );
+  _virtualTexture.prepare( cmd );
+  _post.prepare( cmd );
+
+  // moves vertex buffers, before the draws read them
+  _memory.defragment( cmd );
+
+  // early draw, pyramid and late cull, then the visibility goes back to the compute queue
+  _renderGraph.execute( cmd, swapchainImage, 0, _cullLatePass + 1 );
+  VkBufferMemoryBarrier release = vkinit::buffer_barrier( _visibilityBuffer._buffer,
+                                                          VK_ACCESS_SHADER_WRITE_BIT,
+                                                          0,
+                                                          _graphicsQueueFamily,
+                                                          _computeQueueFamily );
+  vkCmdPipelineBarrier( cmd,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        0, 0, nullptr, 1, &release, 0, nullptr );
+  VK_CHECK( vkEndCommandBuffer( cmd ) );
 
+  VkCommandBuffer lateCmd = frame._lateCommandBuffer;
+  VK_CHECK( vkResetCommandBuffer( lateCmd, 0 ) );
+  VK_CHECK( vkBeginCommandBuffer( lateCmd, &cmdBeginInfo ) );
+  _renderGraph.execute( lateCmd, swapchainImage, _cullLatePass + 1, _renderGraph.get_pass_count() );
+
+  // the ring region and the stats slot go back to the compute queue for the
+  // next frame that fills them, the fence orders the reads before it
+  std::array returned = {
+    vkinit::buffer_barrier( _frameRing.get_buffer(),
+                            VK_ACCESS_SHADER_WRITE_BIT,
+                            0,
+                            _graphicsQueueFamily,
+                            _computeQueueFamily,
+                            _frameRing.get_region_offset(),
+                            _frameRing.get_region_size() ),
+    vkinit::buffer_barrier( _cullStatsBuffer._buffer,
+                            VK_ACCESS_SHADER_WRITE_BIT,
+                            0,
+                            _graphicsQueueFamily,
+                            _computeQueueFamily,
+                            statsOffset,
+                            sizeof( GPUCullStats ) ),
+  };
+  vkCmdPipelineBarrier( lateCmd,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        0, 0, nullptr, ( uint32_t )returned.size(), returned.data(), 0, nullptr );
+  if( frame._graphicsTimestampPool )
+    vkCmdWriteTimestamp( lateCmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame._graphicsTimestampPool, 1 );
+  VK_CHECK( vkEndCommandBuffer( lateCmd ) );
+
+  // The first part waits for the early cull and the swapchain image, and lets the
+  // next frame's early cull start once it is done. The late draw signals the
+  // present semaphore and the frame fence.
+  std::array firstWaitSemaphores = { frame._computeSemaphore, frame._presentSemaphore };
+  std::array< VkPipelineStageFlags, 2 > firstWaitStages = { cullResultStages,
+                                                            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
+  std::array< VkSubmitInfo, 2 > submits = {};
+  submits[ 0 ].sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submits[ 0 ].waitSemaphoreCount = ( uint32_t )firstWaitSemaphores.size();
+  submits[ 0 ].pWaitSemaphores = firstWaitSemaphores.data();
+  submits[ 0 ].pWaitDstStageMask = firstWaitStages.data();
+  submits[ 0 ].commandBufferCount = 1;
+  submits[ 0 ].pCommandBuffers = &cmd;
+  submits[ 0 ].signalSemaphoreCount = 1;
+  submits[ 0 ].pSignalSemaphores = &frame._visibilitySemaphore;
+  submits[ 1 ].sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submits[ 1 ].commandBufferCount = 1;
+  submits[ 1 ].pCommandBuffers = &lateCmd;
+  submits[ 1 ].signalSemaphoreCount = 1;
+  submits[ 1 ].pSignalSemaphores = &frame._renderSemaphore;
+  VK_CHECK( vkQueueSubmit( _graphicsQueue, ( uint32_t )submits.size(), submits.data(), frame._renderFence ) );
+}
 
+void VulkanEngine::read_compute_timings( FrameData& frame )
+{
+  // compute begin, end, graphics begin, end
+  uint64_t ticks[ 4 ];
+  if( vkGetQueryPoolResults( _device,
+                             frame._computeTimestampPool,
+                             0, 2,
+                             2 * sizeof( uint64_t ), ticks, sizeof( uint64_t ),
+                             VK_QUERY_RESULT_64_BIT ) != VK_SUCCESS ||
+      vkGetQueryPoolResults( _device,
+                             frame._graphicsTimestampPool,
+                             0, 2,
+                             2 * sizeof( uint64_t ), ticks + 2, sizeof( uint64_t ),
+                             VK_QUERY_RESULT_64_BIT ) != VK_SUCCESS )
+    return;
 
+  // The compute work can only overlap the previous frame's graphics, this frame's
+  // waits for it. Both queues count on the device timestamp clock in practice.
+  const float msPerTick = _timestampPeriod / 1000000.0f;
+  const uint64_t overlapBegin = std::max( ticks[ 0 ], _lastGraphicsBegin );
+  const uint64_t overlapEnd = std::min( ticks[ 1 ], _lastGraphicsEnd );
+  _computeTimings.computeMs = ( ticks[ 1 ] - ticks[ 0 ] ) * msPerTick;
+  _computeTimings.overlappedMs = overlapEnd > overlapBegin ? ( overlapEnd - overlapBegin ) * msPerTick : 0;
+  _lastGraphicsBegin = ticks[ 2 ];
+  _lastGraphicsEnd = ticks[ 3 ];
+}
+
+void VulkanEngine::build_depth_pyramid( VkCommandBuffer cmd )
+{
+  // the graph moves depth to a sampled layout before and back to an attachment after
+  vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _depthReducePipeline );
+  VkExtent2D srcSize = _windowExtent;
+  for( uint32_t level = 0; level < _depthPyramidLevels; ++level )
+  {
+    VkExtent2D dstSize = { std::max( _depthPyramidExtent.width >> level, 1u ),
+                           std::max( _depthPyramidExtent.height >> level, 1u ) };
+    DepthReducePushConstants constants;
+    constants.srcSize = glm::ivec2( srcSize.width, srcSize.height );
+    constants.dstSize = glm::ivec2( dstSize.width, dstSize.height );
+    vkCmdBindDescriptorSets( cmd,
+                             VK_PIPELINE_BIND_POINT_COMPUTE,
+                             _depthReduceLayout,
+                             0, 1, &_depthReduceSets[ level ],
+                             0, nullptr );
+    vkCmdPushConstants( cmd, _depthReduceLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( constants ), &constants );
+    vkCmdDispatch( cmd, ( dstSize.width + 7 ) / 8, ( dstSize.height + 7 ) / 8, 1 );
+
+    // next level reads this one, the graph orders the last one against the culling pass
+    if( level + 1 < _depthPyramidLevels )
+    {
+      VkMemoryBarrier reduceBarrier = vkinit::memory_barrier( VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT );
+      vkCmdPipelineBarrier( cmd,
+                            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                            0, 1, &reduceBarrier, 0, nullptr, 0, nullptr );
+    }
+    srcSize = dstSize;
+  }
+}
+
+AllocatedBuffer VulkanEngine::create_buffer( size_t size,
+                                             VkBufferUsageFlags usage,
+                                             VmaMemoryUsage memoryUsage,
+                                             MemoryCategory category )
+{
+  VkBufferCreateInfo bufferInfo = vkinit::buffer_create_info( size, usage );
+  VmaAllocationCreateInfo vmaAllocInfo = {};
+  vmaAllocInfo.usage = memoryUsage;
+  AllocatedBuffer buffer;
+  VK_CHECK( vmaCreateBuffer( _allocator,
+                             &bufferInfo,
+                             &vmaAllocInfo,
+                             &buffer._buffer,
+                             &buffer._allocation,
+                             nullptr ) );
+  _memory.track( buffer._allocation, category );
+  return buffer;
+}
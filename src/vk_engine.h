@@ -5,29 +5,331 @@
 
 #include <vk_types.h>
 #include <vk_mesh.h>
+#include <vk_bvh.h>
+#include <vk_render_graph.h>
+#include <vk_memory.h>
+#include <vk_ring_buffer.h>
+#include <vk_frame_arena.h>
+#include <vk_alloc_counter.h>
+#include <vk_registry.h>
+#include <vk_pipeline.h>
+#include <vk_particles.h>
+#include <vk_shadows.h>
+#include <vk_virtual_texture.h>
+#include <vk_readback.h>
+#include <vk_skinning.h>
+#include <vk_post.h>
+#include <vk_world.h>
+#include <vk_capture.h>
+#include <vk_snapshot_queue.h>
 #include "vk_mem_alloc.h"
 #include <glm/glm.hpp>
 
+#include <array>
+#include <atomic>
+#include <future>
+#include <list>
+#include <string>
 #include <vector>
 #include <unordered_map>
+#include <chrono>
 
-struct MeshPushConstants
+struct CullPushConstants
 {
-  glm::vec4 data;
-  glm::mat4 render_matrix;
+  glm::mat4 viewProj;
+  uint32_t objectCount;
+  uint32_t phase;
+  uint32_t drawOffset;
+  uint32_t pyramidLevels;
+};
+
+// static and dynamic casters of the shadow maps are drawn one by one
+struct ShadowPushConstants
+{
+  glm::mat4 mvp;
+};
+
+struct DepthReducePushConstants
+{
+  glm::ivec2 srcSize;
+  glm::ivec2 dstSize;
+};
+
+// Per object data read by the mesh vertex shader and the culling compute shader.
+// Indexed by the draw's firstInstance, so only frustum visible objects are written.
+struct GPUObjectData
+{
+  glm::mat4 model;
+  glm::vec4 boundsMin; // world space
+  glm::vec4 boundsMax;
+  glm::uvec4 info;     // x = index into _renderables, z = first vertex in the skinned vertices
+};
+
+enum class LightType
+{
+  Point,
+  Spot,
+};
+
+struct Light
+{
+  LightType type = LightType::Point;
+  glm::vec3 position = { 0, 0, 0 };
+  float radius = 10; // no light reaches past it
+  glm::vec3 color = { 1, 1, 1 };
+  float intensity = 1;
+  glm::vec3 direction = { 0, -1, 0 }; // spot lights only, angles in radians
+  float innerAngle = 0.3f;
+  float outerAngle = 0.5f;
+};
+
+// One per light, written into the ring every frame
+struct GPULight
+{
+  glm::vec4 positionRadius; // world space
+  glm::vec4 color;          // rgb times intensity, w cos of the spot's inner angle
+  glm::vec4 spot;           // xyz direction, w cos of the outer angle, -2 for point lights
+};
+
+// Uniform read by the light binning pass and the mesh shaders
+struct GPULightingParams
+{
+  glm::mat4 viewProj; // in a buffer so recorded draws don't depend on the camera
+  glm::mat4 view;
+  glm::mat4 invProj;
+  glm::uvec4 grid;   // xyz clusters, w max lights per cluster
+  glm::uvec4 info;   // x light count
+  glm::vec4 depth;   // xy near and far, z w slice = log( view depth ) * z - w
+  glm::vec4 tile;    // xy cluster size in pixels
+  glm::vec4 ambient;
+
+  // the sun and its shadow cascades, see ShadowCache
+  glm::mat4 lightView;
+  glm::vec4 sunDirection; // xyz the way the light travels, w shadow depth range
+  glm::vec4 sunColor;     // w shadow map resolution
+  glm::vec4 cascades[ ShadowCache::CascadeCount ]; // xy window origin in texels, z texel size
+
+  // set by the render thread, see VirtualTexture::get_feedback_params
+  glm::uvec4 feedback;
+};
+
+// Written by occlusion_cull.comp
+struct GPUCullStats
+{
+  uint32_t occlusionCulled;
+  uint32_t drawnEarly;
+  uint32_t drawnLate;
+};
+
+struct CullingStats
+{
+  uint32_t objects = 0;         // renderables in the scene
+  uint32_t frustumCulled = 0;   // rejected by the bvh on the cpu
+  uint32_t occlusionCulled = 0; // rejected by the hi-z test on the gpu
+  uint32_t drawnEarly = 0;      // visible last frame, drawn before the pyramid is built
+  uint32_t drawnLate = 0;       // became visible this frame, drawn after
+};
+
+// Gpu time of the async early cull and how much of it ran while the graphics
+// queue was still busy with the previous frame
+struct ComputeTimings
+{
+  float computeMs = 0;
+  float overlappedMs = 0;
+};
+
+// Input latency of one frame, only filled in for frames that sampled input
+struct LatencyStats
+{
+  bool hasInput = false;
+  float inputToSubmitMs = 0;  // oldest input event of the frame to vkQueueSubmit
+  float inputToPresentMs = 0; // to the frame's fence signalling, the earliest it can be presented
+  float cpuWorkMs = 0;        // input sampling to submit
+};
+
+// frames the cpu can record ahead of the gpu
+constexpr uint32_t FRAME_OVERLAP = 2;
+
+// Draws of one phase recorded into a secondary command buffer, executed again
+// as long as the scene and the buffers it was recorded with stay the same
+struct CachedDraws
+{
+  VkCommandBuffer cmd = VK_NULL_HANDLE;
+  bool valid = false;
+  uint64_t sceneRevision = 0;
+  uint64_t meshRevision = 0;
+  uint64_t bufferRevision = 0;
+};
+
+// Everything a frame in flight owns, reused once its fence signals
+struct FrameData
+{
+  VkSemaphore _presentSemaphore = VK_NULL_HANDLE;
+  VkSemaphore _renderSemaphore = VK_NULL_HANDLE;
+  VkFence _renderFence = VK_NULL_HANDLE;
+  VkCommandPool _commandPool = VK_NULL_HANDLE;
+  VkCommandBuffer _mainCommandBuffer = VK_NULL_HANDLE;
+
+  // pointed at this frame's objects and draws in the ring every frame
+  VkDescriptorSet _objectSet = VK_NULL_HANDLE;
+  VkDescriptorSet _cullSet = VK_NULL_HANDLE;
+  VkDescriptorSet _lightSet = VK_NULL_HANDLE;
+  RingAllocation _objects; // one GPUObjectData per frustum visible object
+  RingAllocation _lights;  // one GPULight per light
+  RingAllocation _lightingParams;
+  RingAllocation _draws;   // one draw per visible object and phase
+  RingAllocation _pageTable; // the virtual texture's
+
+  CullingStats _cullingStats; // cpu side counts, the gpu ones are read back after the fence
+  LatencyStats _latency;
+  std::chrono::steady_clock::time_point _inputTime;
+
+  // async compute only. The graphics work is split after the late cull so the
+  // next frame's early cull can start while this frame's late draw runs.
+  VkCommandPool _computeCommandPool = VK_NULL_HANDLE;
+  VkCommandBuffer _computeCommandBuffer = VK_NULL_HANDLE;
+  VkCommandBuffer _lateCommandBuffer = VK_NULL_HANDLE;
+  VkSemaphore _computeSemaphore = VK_NULL_HANDLE;    // early cull done, waited by the graphics
+  VkSemaphore _visibilitySemaphore = VK_NULL_HANDLE; // late cull done, waited by the next frame's compute
+  // begin and end, one pool per queue so each resets and writes only its own
+  VkQueryPool _computeTimestampPool = VK_NULL_HANDLE;
+  VkQueryPool _graphicsTimestampPool = VK_NULL_HANDLE;
+
+  // the early and late draws, see VulkanEngine::execute_draws
+  CachedDraws _cachedDraws[ 2 ];
+  std::array< VkDescriptorBufferInfo, 5 > _descriptorInfos = {}; // objects, draws, lighting, lights, page table last written
 };
 
 struct Material
 {
   VkPipeline pipeline;
   VkPipelineLayout pipelineLayout;
+  int texture = -1; // virtual texture id, -1 for vertex colors
+};
+
+using MeshHandle = Handle< Mesh >;
+using MaterialHandle = Handle< Material >;
+
+// Consecutive visible objects with the same pipeline and mesh, one multi draw
+struct DrawBatch
+{
+  VkPipeline pipeline;             // of the material, the render thread doesn't look materials up
+  VkPipelineLayout pipelineLayout;
+  Mesh* mesh;                      // nor meshes, see RenderSnapshot
+  uint32_t first;                  // index into the visible objects and the phase's draw commands
+  uint32_t count;
 };
 
 struct RenderObject
 {
-  Mesh* mesh;
-  Material* material;
+  MeshHandle mesh;
+  MaterialHandle material;
   glm::mat4 transformMatrix;
+
+  // mesh bounds transformed by transformMatrix, kept up to date by the engine
+  AABB worldBounds;
+  int bvhProxy = DynamicBVH::NullNode;
+
+  // static objects are cached in the shadow maps, moving them invalidates the cache under them
+  bool isStatic = true;
+
+  // With static batching, static objects are merged into the chunk at this index of
+  // _staticChunks and aren't drawn on their own. Chunks are renderables too, with isChunk.
+  int staticChunk = -1;
+  bool isChunk = false;
+
+  // index into _skinnedObjects when the mesh is skinned, such objects are never static
+  int skinnedObject = -1;
+
+  // Chunk of the streamed world it draws, already in world space and never batched.
+  // Added and removed by the streaming, see VulkanEngine::update_world.
+  int worldChunk = -1;
+};
+
+// Static objects of one material in one grid cell, their vertices transformed into
+// world space and merged into one mesh. Drawn as a single renderable.
+struct StaticChunk
+{
+  MaterialHandle material;
+  glm::ivec3 cell;
+  MeshHandle mesh;                 // null until first built
+  int renderable = -1;             // index into _renderables, -1 until first built
+  std::vector< uint32_t > objects; // indexes into _renderables
+  bool dirty = false;              // rebuilt by the next snapshot
+};
+
+// A shadow caster, drawn into the tile it was collected for
+struct ShadowDraw
+{
+  glm::mat4 mvp;
+  Mesh* mesh;
+  uint32_t firstVertex; // in the skinned vertices, for skinned meshes
+};
+
+// The casters of one shadow tile, a range of RenderSnapshot::shadowDraws
+struct ShadowTileDraws
+{
+  ShadowTile tile;
+  bool isStatic; // a static tile of the cache, or a cascade's whole dynamic window
+  uint32_t first;
+  uint32_t count;
+};
+
+// New vertices for a mesh, rebuilt static chunks, put in its buffer before drawing
+struct MeshUpload
+{
+  Mesh* mesh;
+  std::vector< Vertex > vertices; // empty leaves the mesh without a buffer
+};
+
+// Input asking the render thread to do something, carried by the next snapshot
+struct RenderRequests
+{
+  bool printStats = false;
+  bool printMemory = false;
+  bool defragment = false;
+  bool toggleLatencyLog = false;
+  bool screenshot = false;
+  bool pick = false;
+  int32_t pickX = 0; // window pixel
+  int32_t pickY = 0;
+};
+
+// Everything the render thread needs for a frame, built by the simulation.
+//
+// Nothing in it changes once published and the render thread reads nothing else
+// of the scene. Meshes are reached through the pointers in here, the registry
+// doesn't move them; the simulation only reads their bounds and sources, the
+// render thread owns their buffers and vertex counts.
+struct RenderSnapshot
+{
+  FrameArena arena; // the containers below allocate from it, reset by clear
+  FrameVector< uint32_t > visible{ FrameAllocator< uint32_t >( &arena ) }; // indexes into _renderables
+  FrameVector< GPUObjectData > objects{ FrameAllocator< GPUObjectData >( &arena ) }; // one per visible object
+  FrameVector< DrawBatch > batches{ FrameAllocator< DrawBatch >( &arena ) };
+  FrameVector< GPULight > lights{ FrameAllocator< GPULight >( &arena ) };
+  FrameVector< ShadowTileDraws > shadowTiles{ FrameAllocator< ShadowTileDraws >( &arena ) };
+  FrameVector< ShadowDraw > shadowDraws{ FrameAllocator< ShadowDraw >( &arena ) };
+  FrameVector< SkinInstance > skinInstances{ FrameAllocator< SkinInstance >( &arena ) }; // one per skinned object
+  FrameVector< glm::mat4 > joints{ FrameAllocator< glm::mat4 >( &arena ) };              // their palettes
+  std::vector< MeshUpload > uploads; // rare and large, so from the heap
+
+  GPULightingParams lighting; // the camera included
+  glm::vec3 cameraRight;      // particles face the camera
+  glm::vec3 cameraUp;
+  float dt = 0;               // simulation time step
+  uint32_t objectCount = 0;   // renderables in the scene
+  uint64_t sceneRevision = 0; // see VulkanEngine::_sceneRevision
+  bool reuseDraws = false;
+  ShadowStats shadowStats;    // the caster counts, the render thread doesn't add to them
+  WorldStreamStats worldStats;
+
+  bool hasInput = false;
+  std::chrono::steady_clock::time_point inputTime; // oldest input event the snapshot saw
+  RenderRequests requests;
+
+  // empties the containers, then resets the arena under them
+  void clear();
 };
 
 class VulkanEngine
@@ -57,73 +359,384 @@ public:
   VkFormat _swapchainImageFormat = VK_FORMAT_UNDEFINED;
   std::vector< VkImage > _swapchainImages;
   std::vector< VkImageView > _swapchainImageViews;
+  bool _swapchainStorage = false; // post processing writes it directly, else copies into it
 
   // Command submission
   VkQueue _graphicsQueue = VK_NULL_HANDLE;
   uint32_t _graphicsQueueFamily = -1;
-  VkCommandPool _commandPool = VK_NULL_HANDLE;
-  VkCommandBuffer _mainCommandBuffer = VK_NULL_HANDLE;
+  FrameData _frames[ FRAME_OVERLAP ];
+
+  FrameData& get_current_frame() { return _frames[ _frameNumber % FRAME_OVERLAP ]; }
 
-  // Render pass
+  // Async compute
+  // With a compute only queue family the early cull runs there, the buffers it
+  // shares with the graphics queue change owners every frame. Without one,
+  // everything stays on the graphics queue.
+  bool _asyncComputeRequested = true;
+  bool _asyncCompute = false;
+  VkQueue _computeQueue = VK_NULL_HANDLE;
+  uint32_t _computeQueueFamily = -1;
+  float _timestampPeriod = 0; // ns per tick, 0 when both queues can't write timestamps
+  float _graphicsTimestampPeriod = 0; // the same, for the graphics queue alone
+  ComputeTimings _computeTimings; // last frame read back
+  uint64_t _lastGraphicsBegin = 0; // timestamps of the frame before it
+  uint64_t _lastGraphicsEnd = 0;
+  RGPass _cullLatePass;
+
+  // Render graph
+  // the early draw clears and draws the objects visible last frame, the late draw
+  // loads its results and draws the objects that were found visible after it.
+  // _renderPass is the early draw's, owned by the graph, pipelines are built against it.
+  RenderGraph _renderGraph;
   VkRenderPass _renderPass;
-  std::vector< VkFramebuffer > _framebuffers;
 
-  // Main loop
-  VkSemaphore _presentSemaphore = VK_NULL_HANDLE;
-  VkSemaphore _renderSemaphore = VK_NULL_HANDLE;
-  VkFence _renderFence = VK_NULL_HANDLE;
+  // Presentation and frame pacing
+  // FIFO waits for vblank, MAILBOX replaces the queued image, IMMEDIATE tears.
+  // Unsupported modes fall back towards FIFO, which is always available.
+  VkPresentModeKHR _requestedPresentMode = VK_PRESENT_MODE_FIFO_KHR;
+  VkPresentModeKHR _presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  float _maxFrameRate = 0; // 0 disables the limiter
+  bool _logLatency = false;
+  bool _logAllocations = false;
+  AllocationCounters _frameAllocations; // heap use of the last main loop iteration
+  LatencyStats _latencyStats; // last frame with input that finished on the gpu
+
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point _nextFrameDeadline; // when the next submit should happen
+  Clock::duration _frameWorkTime = {};  // input sampling to submit, smoothed
+  Clock::time_point _frameStart;        // render thread
+  Clock::time_point _frameInputTime;    // oldest input event of the snapshot being built
+  Clock::time_point _lastSimulationTime; // for the simulation time step
+  bool _frameHasInput = false;
 
   // pipeline
-  VkPipelineLayout _trianglePipelineLayout = VK_NULL_HANDLE;
   VkPipelineLayout _meshPipelineLayout = VK_NULL_HANDLE;
-  VkPipeline _trianglePipeline = VK_NULL_HANDLE;
-  VkPipeline _redTrianglePipeline = VK_NULL_HANDLE;
   VkPipeline _meshPipeline = VK_NULL_HANDLE;
+  PipelineCache _pipelineCache; // owns the graphics pipelines above and their shader modules
+
+  // spir-v by path, read ahead at startup and freed once the pipelines are built
+  std::unordered_map< std::string, std::vector< char > > _shaderFiles;
 
   // Shader switching
   int _selectedShader = 0;
 
   // Allocator
   VmaAllocator _allocator;
+  MemoryManager _memory;
 
-  // Meshes
-  Mesh _triangleMesh;
-  Mesh _monkeyMesh;
+  // per frame data the cpu writes, one region per frame in flight
+  RingBuffer _frameRing;
 
-  // Depth Image
-  VkImageView _depthImageView;
-  AllocatedImage _depthImage;
+  // Depth Image, owned by the render graph
+  RGHandle _depthImage;
   VkFormat _depthFormat;
 
+  // Hi-z depth pyramid, mip 0 is half the depth image, owned by the render graph
+  RGHandle _depthPyramid;
+  VkExtent2D _depthPyramidExtent;
+  uint32_t _depthPyramidLevels;
+  VkSampler _depthSampler;
+
+  // Descriptors
+  VkDescriptorPool _descriptorPool;
+  VkDescriptorSetLayout _objectSetLayout;
+  VkDescriptorSetLayout _depthReduceSetLayout;
+  std::vector< VkDescriptorSet > _depthReduceSets; // one per pyramid mip
+  VkDescriptorSetLayout _cullSetLayout;
+  VkDescriptorSetLayout _lightSetLayout; // set 0 of the binning, set 1 of the mesh pipeline
+
+  // Gpu culling
+  static const uint32_t MaxObjects = 100000;
+  AllocatedBuffer _visibilityBuffer; // one uint per renderable, last phase 1 result
+  AllocatedBuffer _cullStatsBuffer; // one GPUCullStats per frame in flight
+  char* _cullStatsData; // persistently mapped
+  VkDeviceSize _cullStatsStride; // sizeof( GPUCullStats ) rounded up to the storage offset alignment
+  VkPipelineLayout _depthReduceLayout;
+  VkPipeline _depthReducePipeline;
+  VkPipelineLayout _cullLayout;
+  VkPipeline _cullPipeline;
+  bool _multiDrawIndirect = false;
+  CullingStats _cullingStats; // from the last completed frame
+
+  // Render thread
+  // run() simulates on the calling thread and renders on another one. The main loop
+  // polls input, updates the scene and publishes a RenderSnapshot; the render thread
+  // waits for the frame's fence, records and presents it. The scene functions below
+  // belong to the simulation, the render thread only sees snapshots. draw() does both
+  // halves on the calling thread, for replays and benchmarks.
+  //
+  // Two slots keep the input latency lowest, three absorb a hitch on either side.
+  // Replays always draw on the calling thread.
+  static const uint32_t RenderSnapshotSlots = 3;
+  bool _renderThread = true;
+  SnapshotQueue< RenderSnapshot, RenderSnapshotSlots > _snapshots;
+  const RenderSnapshot* _snapshot = nullptr; // rendered last, render thread only
+  uint32_t _drawnObjects = 0;                // of the snapshot's objects, 0 when they didn't fit the frame
+  RenderRequests _pendingRequests;           // for the next snapshot
+
+  // Draw recording
+  // The object draws are recorded into secondary command buffers per frame slot
+  // and phase, and executed again until _sceneRevision changes. With reuse on, the
+  // cpu doesn't frustum cull so the draw list only depends on the scene, the gpu
+  // culling tests the frustum instead.
+  bool _reuseDraws = true;
+  uint64_t _sceneRevision = 1; // simulation, bumped by scene changes that change what the draws record
+  uint64_t _meshRevision = 1;  // render thread, bumped when a mesh buffer is created or freed
+  uint32_t _drawsRecorded = 0; // phases recorded and reused since the last stats print
+  uint32_t _drawsReused = 0;
+
+  // Gpu particles, simulated before the early draw and drawn after the late one
+  uint32_t _particleCapacity = 1 << 20;
+  ParticleSystem _particles;
+  RGPass _particleDrawPass;
+
+  // Clustered lighting
+  // Every frame a compute pass bins the lights into a froxel grid, view space
+  // tiles split into exponential depth slices. The mesh fragment shader only
+  // looks at the lights of its cluster.
+  static const uint32_t MaxLights = 16384;
+  static const uint32_t MaxLightsPerCluster = 256; // the rest are dropped
+  static const uint32_t ClustersX = 16;
+  static const uint32_t ClustersY = 9;
+  static const uint32_t ClustersZ = 24;
+  std::vector< Light > _lights;
+  glm::vec3 _ambientLight = { 0.08f, 0.08f, 0.1f };
+  AllocatedBuffer _clusterBuffer; // light count per cluster, then MaxLightsPerCluster indices per cluster
+  VkPipelineLayout _lightCullLayout;
+  VkPipeline _lightCullPipeline;
+
+  // Sun shadows
+  // Static casters are cached across frames, dynamic ones drawn every frame, see ShadowCache
+  static const uint32_t ShadowResolution = 1024;
+  glm::vec3 _sunDirection = { -0.4f, -1.0f, -0.3f };
+  glm::vec3 _sunColor = { 1.0f, 0.95f, 0.85f };
+  ShadowCache _shadowCache;
+  AllocatedImage _staticShadowAtlas; // the cache, owned by the engine so it outlives frames
+  VkImageView _staticShadowView;
+  RGHandle _staticShadows;
+  RGHandle _dynamicShadows; // owned by the render graph, cleared every frame
+  VkSampler _shadowSampler;
+  VkPipelineLayout _shadowPipelineLayout;
+  VkPipeline _shadowPipeline;
+  RGPass _shadowCachePass;
+
+  // Virtual texturing
+  // Textured materials sample pages of huge textures out of a fixed atlas, the pages
+  // the mesh shader asked for are loaded in the background, see VirtualTexture.
+  // Render thread only after init.
+  VirtualTexture _virtualTexture;
+
+  // Readback
+  // Results the cpu wants from the gpu are copied into the readback queue and arrive
+  // FRAME_OVERLAP frames later, without a stall. The main passes write the renderable
+  // index + 1 of every pixel into _objectIds, 0 where nothing was drawn. A click asks
+  // the render thread for its pixel and report_pick resolves the id on the simulation.
+  static constexpr uint32_t NoPick = ~0u;
+  ReadbackQueue _readback;
+  RGHandle _objectIds;
+  uint32_t _swapchainImageIndex = 0;              // render thread, the image being recorded
+  std::atomic< uint32_t > _pickResult{ NoPick };  // written by the render thread
+  glm::ivec2 _pickPosition = {};                  // simulation, of the last click
+  std::string _screenshotDir;  // where 'p' writes frame_<n>.ppm, if set a replay also shoots its last frame
+  std::vector< std::future< void > > _screenshotWrites; // render thread, files being written off it
+
+  // Skinned meshes
+  // Objects with a skinned mesh are posed by the simulation every frame and skinned by
+  // one compute pass into a shared vertex buffer, which the shadow and main passes draw
+  // from, see SkinningSystem. Each object's vertices start where the ones before end.
+  uint32_t _skinnedVertexCapacity = 1 << 20; // summed over the skinned objects
+  SkinningSystem _skinning;
+  std::vector< uint32_t > _skinnedObjects;   // indexes into _renderables
+  uint32_t _skinnedVertexCount = 0;          // summed over _skinnedObjects
+  uint32_t _skinnedJointCount = 0;
+  float _animationTime = 0;                  // simulation seconds
+
+  // Post processing
+  // The scene is drawn in hdr, compute passes add bloom and tonemap, grade and
+  // dither it into the swapchain, see PostProcess. Render thread only after init.
+  PostProcess _post;
+
+  // World streaming
+  // With a world file the chunks around the camera are streamed in and out under a
+  // budget, see WorldStreamer. Every chunk has a mesh from the start, only its bounds
+  // until the chunk is resident, then a renderable as well. Simulation only.
+  std::string _worldPath; // empty for no world
+  WorldStreamer _world;
+  std::vector< MeshHandle > _worldMeshes; // per chunk
+  std::vector< int > _worldRenderables;   // per chunk, index into _renderables, -1 when not resident
+
+  // Capture and replay
+  // A capture records the scene once initialized, then every frame's camera, transform
+  // changes and input, and is written on quit. A replay builds the scene from a capture
+  // and draws its frames in a hidden window at a fixed time step, timing each frame.
+  static constexpr float ReplayTimestep = 1.0f / 60.0f;
+  std::string _capturePath; // empty when not capturing
+  bool _capturing = false;
+  bool _replay = false;     // _capture was loaded to be replayed
+  std::string _timingsPath; // where the replay writes its timings, empty for none
+  Capture _capture;
+  uint32_t _replayMissing = 0; // captured objects whose mesh or material this build lacks
+  float _fixedTimestep = 0;    // seconds per frame for the simulation, 0 to go by the clock
+
+  // Static batching
+  // Static objects are grouped by material into cells of StaticChunkSize and each
+  // group is merged into one pre-transformed mesh, culled and drawn as one object.
+  // Adding, removing or moving a static object only rebuilds its chunks.
+  static const uint32_t MaxMeshes = 4096; // reserved along with the world's chunks, the memory manager points into the registry
+  static constexpr float StaticChunkSize = 8.0f;
+  bool _staticBatching = true;
+  std::vector< StaticChunk > _staticChunks;
+  std::unordered_map< uint64_t, uint32_t > _staticChunkLookup; // material and cell to chunk
+  std::unordered_map< uint64_t, std::vector< Vertex > > _staticSourceVertices; // by mesh handle
+  struct RetiredBuffer
+  {
+    AllocatedBuffer buffer;
+    int frame; // replaced before recording this frame
+  };
+  std::list< RetiredBuffer > _retiredChunkBuffers; // render thread, the memory manager points into it
+
+  // Camera
+  glm::vec3 _camPos = { 0, -2, -10 };
+  float _zNear = 0.1f;
+  float _zFar = 200.0f;
+
   // Renderable objects
   std::vector< RenderObject > _renderables;
-  std::unordered_map< std::string, Material > _materials;
-  std::unordered_map< std::string, Mesh > _meshes;
+  DynamicBVH _renderableBVH;
+
+  // Meshes and materials, looked up by hash_name of their name
+  Registry< Material > _materials;
+  Registry< Mesh > _meshes;
+
+  MaterialHandle create_material( VkPipeline, VkPipelineLayout, NameHash name );
 
-  Material* create_material( VkPipeline, VkPipelineLayout, const std::string& name );
+  // returns the null handle if not found
+  MaterialHandle get_material( NameHash name );
 
-  // returns nullptr if not found
-  Material* get_material( const std::string& name );
+  // returns the null handle if not found
+  MeshHandle get_mesh( NameHash name );
 
-  // returns nullptr if not found
-  Mesh* get_mesh( const std::string& name );
+  // returns the index of the new object in _renderables
+  uint32_t add_renderable( const RenderObject& );
 
-  void draw_objects( VkCommandBuffer, RenderObject*, int );
+  // swaps the last renderable into the removed slot, so it invalidates that index
+  void remove_renderable( uint32_t index );
+
+  // refits the object in the bvh, cheap if it only moved a little
+  void set_renderable_transform( uint32_t index, const glm::mat4& transform );
+
+  // returns the index of the closest renderable under the window pixel, or -1
+  int pick_renderable( int x, int y ) const;
+
+  // merges or splits the static objects, takes effect with the next draw
+  void set_static_batching( bool enabled );
+
+  glm::mat4 get_view() const;
+  glm::mat4 get_projection() const;
+  glm::mat4 get_view_proj() const;
+
+  // Records the indirect draws of the snapshot's batches. The gpu culling pass decides
+  // which of them have an instance count in the given phase.
+  void draw_objects( VkCommandBuffer, int phase );
+
+  // executes the phase's cached draws, recording them again first if they are out of date
+  void execute_draws( VkCommandBuffer, int phase );
+
+  // fills _clusterBuffer from this frame's lights
+  void bin_lights( VkCommandBuffer );
+
+  // Renders the casters the snapshot collected for the tile into its rect. The
+  // static tiles are cleared first, the dynamic map is cleared by its pass.
+  void draw_shadow_casters( VkCommandBuffer, const ShadowTileDraws& );
+
+  // the render graph expects the cache in the layout frames leave it in, the first frame puts it there
+  void prepare_shadow_cache( VkCommandBuffer );
+
+  // key and mouse input, from SDL or a replay
+  void handle_event( const union SDL_Event& );
 
 
 private:
 
+  // Sleeps for the frame limiter, then waits for the frame slot about to be reused. Without
+  // the render thread it is called before input is polled, so the input is as fresh as
+  // possible when used.
+  void pace_frame();
+  // Finishes the latency of the frames with input whose fence signalled since the last
+  // poll, timed at the poll. Returns whether a frame with input is still on the gpu.
+  bool poll_latency();
+
+  // the simulation's half of a frame, everything the render thread needs goes into the snapshot
+  void build_snapshot( RenderSnapshot& );
+  // the casters overlapping the tile, static or dynamic ones, into the snapshot
+  void collect_shadow_casters( RenderSnapshot&, const ShadowTile&, bool isStatic );
+  // the render thread's half, records, submits and presents the snapshot
+  void render( const RenderSnapshot& );
+  // renders the snapshots run publishes until the queue is closed
+  void render_loop();
+  void print_render_stats( const RenderSnapshot& );
+  // the copies the snapshot's requests ask for, in the readback pass
+  void record_readbacks( VkCommandBuffer );
+  // prints the pick that arrived since the last call, if any
+  void report_pick();
+  // until every screenshot is on disk, after the readbacks finished
+  void wait_for_screenshots();
+
   void init_vulkan();
   void init_swapchain();
   void init_commands();
-  void init_default_renderpass();
-  void init_framebuffers();
   void init_sync_structures();
+  void init_buffers();
+  void init_render_graph();
+  void init_descriptor_layouts();
+  void init_descriptors();
   void init_pipelines();
+  void init_compute_pipelines();
   void init_scene();
+  void init_scene_from_capture();
 
-  // returns false on failure
+  // snapshots the scene into _capture, frames are appended by run
+  void begin_capture();
+  void run_replay();
+
+  // reads every spir-v file into _shaderFiles
+  void read_shaders();
+  // padded to whole words, empty if the file couldn't be read
+  std::vector< char > read_spirv( const char* spirvpath );
+  // returns false on failure, the caller owns the module
   bool load_shader_module( const char* spirvpath, VkShaderModule* out );
+  // deduplicated by content and owned by _pipelineCache, null on failure
+  VkShaderModule get_shader_module( const char* spirvpath );
+  // loads the vertices on the cpu, upload_meshes creates their buffers
   void load_meshes();
-  void upload_mesh( Mesh& mesh );
+  // a mesh for every chunk of the world, if one was opened
+  void load_world();
+  void upload_meshes();
+  // streamable, evicted meshes are uploaded again when drawn
+  void upload_mesh( Mesh& );
+  void make_mesh_resident( Mesh& );
+  // creates and tracks the mesh's buffer, evictable if the mesh has a source
+  void create_vertex_buffer( Mesh&, const std::vector< Vertex >& );
+  AllocatedBuffer create_buffer( size_t size, VkBufferUsageFlags, VmaMemoryUsage, MemoryCategory );
+
+  void cull_objects( VkCommandBuffer, int phase, uint32_t objectCount );
+
+  // moves the renderable into the chunk of its material and cell, it loses its bvh proxy
+  void batch_static_object( uint32_t index );
+  void remove_from_static_chunk( uint32_t index );
+  // rebuilds the dirty chunks, their new vertices go with the snapshot
+  void update_static_chunks( RenderSnapshot& );
+  // adds the world chunks the streaming made resident to the scene and removes the evicted ones
+  void update_world( RenderSnapshot&, const glm::vec3& cameraPosition, const glm::vec3& cameraForward, const glm::mat4& viewProj );
+  // puts the snapshot's vertices in their meshes' buffers, frees the buffers they replaced once unused
+  void apply_mesh_uploads( const RenderSnapshot& );
+  // vertices of a mesh merged into chunks, read back once and kept
+  const std::vector< Vertex >& get_static_source_vertices( MeshHandle );
+
+  // records and submits the reset and early cull on the compute queue
+  void submit_async_cull( FrameData& );
+  // records and submits the graphics work in two parts, split after the late cull
+  void submit_async_graphics( FrameData&, uint32_t swapchainImage );
+  void read_compute_timings( FrameData& );
+  void build_depth_pyramid( VkCommandBuffer );
 };
@@ -0,0 +1,56 @@
+﻿#include <vk_frame_arena.h>
+
+#include <algorithm>
+#include <cassert>
+
+FrameArena::~FrameArena()
+{
+  for( char* overflow : _overflowBlocks )
+    delete[] overflow;
+  delete[] _block;
+}
+
+void FrameArena::init( size_t capacity )
+{
+  assert( !_block );
+  _block = new char[ capacity ];
+  _capacity = capacity;
+  _head = 0;
+}
+
+void* FrameArena::allocate( size_t size, size_t alignment )
+{
+  // alignment is relative to the block, new[] aligns it for any fundamental type
+  const size_t offset = ( _head + alignment - 1 ) / alignment * alignment;
+  if( offset + size <= _capacity )
+  {
+    _head = offset + size;
+    return _block + offset;
+  }
+
+  // over aligned types aren't used for frame data
+  assert( alignment <= alignof( std::max_align_t ) );
+  char* overflow = new char[ size ];
+  _overflowBlocks.push_back( overflow );
+  _overflowBytes += size + alignment;
+  return overflow;
+}
+
+void FrameArena::reset()
+{
+  const size_t used = _head + _overflowBytes;
+  _peakUsage = std::max( _peakUsage, used );
+  _head = 0;
+  if( _overflowBlocks.empty() )
+    return;
+
+  // grow once, with some room so a slowly growing frame doesn't regrow every time
+  for( char* overflow : _overflowBlocks )
+    delete[] overflow;
+  _overflowBlocks.clear();
+  _overflowBytes = 0;
+  delete[] _block;
+  _capacity = used + used / 2;
+  _block = new char[ _capacity ];
+}
+
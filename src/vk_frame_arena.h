@@ -0,0 +1,68 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+// Linear allocator for cpu data that only lives while one frame is recorded:
+// visible lists, sort keys, batch tables. Allocating bumps a pointer and
+// everything is freed at once by reset, nothing is freed on its own.
+//
+// When a frame needs more than the block holds, the rest comes from the heap
+// and the block grows to the frame's total on the next reset, so a steady
+// state frame never touches the heap.
+class FrameArena
+{
+public:
+  FrameArena() = default;
+  FrameArena( const FrameArena& ) = delete;
+  FrameArena& operator=( const FrameArena& ) = delete;
+  ~FrameArena();
+
+  void init( size_t capacity );
+  void* allocate( size_t size, size_t alignment );
+  void reset();
+
+  size_t get_capacity() const { return _capacity; }
+  size_t get_peak_usage() const { return _peakUsage; }
+
+private:
+  char* _block = nullptr;
+  size_t _capacity = 0;
+  size_t _head = 0;
+  std::vector< char* > _overflowBlocks; // heap fallbacks of this frame
+  size_t _overflowBytes = 0;
+  size_t _peakUsage = 0;
+};
+
+// Standard allocator over a FrameArena, deallocation is a no-op
+template< typename T >
+class FrameAllocator
+{
+public:
+  using value_type = T;
+
+  FrameAllocator( FrameArena* arena ) : _arena( arena ) {}
+  template< typename U >
+  FrameAllocator( const FrameAllocator< U >& other ) : _arena( other._arena ) {}
+
+  T* allocate( size_t count ) { return ( T* )_arena->allocate( count * sizeof( T ), alignof( T ) ); }
+  void deallocate( T*, size_t ) {}
+
+  template< typename U >
+  bool operator==( const FrameAllocator< U >& other ) const { return _arena == other._arena; }
+  template< typename U >
+  bool operator!=( const FrameAllocator< U >& other ) const { return _arena != other._arena; }
+
+  FrameArena* _arena;
+};
+
+// Containers for frame transient data. They must be emptied, or swapped with
+// an empty one, before the arena they allocate from is reset.
+template< typename T >
+using FrameVector = std::vector< T, FrameAllocator< T > >;
+
+template< typename K, typename V, typename Hash = std::hash< K > >
+using FrameHashMap = std::unordered_map< K, V, Hash, std::equal_to< K >, FrameAllocator< std::pair< const K, V > > >;
+
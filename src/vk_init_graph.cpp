@@ -0,0 +1,131 @@
+﻿#include <vk_init_graph.h>
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+InitGraph::Step InitGraph::add_step( const char* name,
+                                     std::initializer_list< Step > dependencies,
+                                     StepFn fn,
+                                     bool mainThread )
+{
+  const Step step = ( Step )_steps.size();
+  StepInfo info = {};
+  info.name = name;
+  info.dependencies = dependencies;
+  info.fn = std::move( fn );
+  info.mainThread = mainThread;
+  for( Step dependency : dependencies )
+  {
+    assert( dependency < step && "dependencies are added before their dependents" );
+    _steps[ dependency ].dependents.push_back( step );
+  }
+  _steps.push_back( std::move( info ) );
+  return step;
+}
+
+void InitGraph::run( uint32_t threadCount )
+{
+  _threadCount = std::max( threadCount, 1u );
+  _runStart = Clock::now();
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque< Step > ready;
+  std::deque< Step > readyMain;
+  size_t remaining = _steps.size();
+  for( Step step = 0; step < _steps.size(); ++step )
+  {
+    _steps[ step ].pending = ( uint32_t )_steps[ step ].dependencies.size();
+    if( _steps[ step ].pending == 0 )
+      ( _steps[ step ].mainThread ? readyMain : ready ).push_back( step );
+  }
+
+  auto worker = [ & ]( bool isMain ) {
+    std::unique_lock< std::mutex > lock( mutex );
+    while( true )
+    {
+      wake.wait( lock, [ & ] { return remaining == 0 || !ready.empty() || ( isMain && !readyMain.empty() ); } );
+      if( remaining == 0 )
+        return;
+      std::deque< Step >& queue = isMain && !readyMain.empty() ? readyMain : ready;
+      const Step step = queue.front();
+      queue.pop_front();
+
+      StepInfo& info = _steps[ step ];
+      lock.unlock();
+      info.start = Clock::now();
+      info.fn();
+      info.end = Clock::now();
+      lock.lock();
+
+      for( Step dependent : info.dependents )
+        if( --_steps[ dependent ].pending == 0 )
+          ( _steps[ dependent ].mainThread ? readyMain : ready ).push_back( dependent );
+      --remaining;
+      wake.notify_all();
+    }
+  };
+
+  std::vector< std::thread > threads;
+  for( uint32_t i = 1; i < _threadCount; ++i )
+    threads.emplace_back( worker, false );
+  worker( true );
+  for( std::thread& thread : threads )
+    thread.join();
+
+  _runEnd = Clock::now();
+}
+
+void InitGraph::print_report() const
+{
+  auto to_ms = []( Clock::duration duration ) { return std::chrono::duration< float, std::milli >( duration ).count(); };
+
+  // steps are in dependency order, so each chain is known before its dependents need it
+  std::vector< Clock::duration > critical( _steps.size() );
+  std::vector< int > criticalParent( _steps.size(), -1 );
+  Clock::duration serial = {};
+  Step last = 0;
+  for( Step step = 0; step < _steps.size(); ++step )
+  {
+    const StepInfo& info = _steps[ step ];
+    Clock::duration longest = {};
+    for( Step dependency : info.dependencies )
+    {
+      if( critical[ dependency ] > longest )
+      {
+        longest = critical[ dependency ];
+        criticalParent[ step ] = ( int )dependency;
+      }
+    }
+    critical[ step ] = longest + ( info.end - info.start );
+    serial += info.end - info.start;
+    if( critical[ step ] > critical[ last ] )
+      last = step;
+  }
+
+  printf( "startup %.1f ms on %u threads, %.1f ms of steps\n", to_ms( _runEnd - _runStart ), _threadCount, to_ms( serial ) );
+  printf( "  step                  start(ms)  time(ms)  critical path(ms)\n" );
+  for( Step step = 0; step < _steps.size(); ++step )
+  {
+    const StepInfo& info = _steps[ step ];
+    printf( "  %-20s  %9.1f  %8.1f  %17.1f\n",
+            info.name,
+            to_ms( info.start - _runStart ),
+            to_ms( info.end - info.start ),
+            to_ms( critical[ step ] ) );
+  }
+
+  printf( "  critical path:" );
+  std::vector< Step > chain;
+  for( int step = _steps.empty() ? -1 : ( int )last; step >= 0; step = criticalParent[ step ] )
+    chain.push_back( ( Step )step );
+  for( auto it = chain.rbegin(); it != chain.rend(); ++it )
+    printf( "%s %s", it == chain.rbegin() ? "" : " ->", _steps[ *it ].name );
+  printf( "\n" );
+}
+
@@ -0,0 +1,51 @@
+﻿#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+// Startup steps and what they depend on. run executes every step once its
+// dependencies are done, independent ones on several threads at once.
+//
+// Steps marked main thread only run on the thread that called run, for window
+// system calls. Steps may not add steps.
+class InitGraph
+{
+public:
+  using Step = uint32_t;
+  using StepFn = std::function< void() >;
+
+  // dependencies must have been added before
+  Step add_step( const char* name, std::initializer_list< Step > dependencies, StepFn fn, bool mainThread = false );
+
+  // threadCount includes the calling thread. Blocks until every step ran.
+  void run( uint32_t threadCount );
+
+  // Start and duration of every step, and its critical path: the longest chain
+  // of step times through its dependencies, what it would take with unlimited
+  // threads. Ends with the chain that bounds the whole startup.
+  void print_report() const;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct StepInfo
+  {
+    const char* name;
+    std::vector< Step > dependencies;
+    std::vector< Step > dependents;
+    StepFn fn;
+    bool mainThread;
+    uint32_t pending; // dependencies not done yet, only while running
+    Clock::time_point start;
+    Clock::time_point end;
+  };
+
+  std::vector< StepInfo > _steps;
+  Clock::time_point _runStart;
+  Clock::time_point _runEnd;
+  uint32_t _threadCount = 0;
+};
+
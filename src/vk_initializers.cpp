@@ -140,3 +140,118 @@ VkRenderPassBeginInfo vkinit::renderpass_begin_info( VkRenderPass renderPass,
   rpInfo.framebuffer = framebuffer;
   return rpInfo;
 }
+
+VkBufferCreateInfo vkinit::buffer_create_info( VkDeviceSize size, VkBufferUsageFlags usage )
+{
+  VkBufferCreateInfo info = {};
+  info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  info.size = size;
+  info.usage = usage;
+  return info;
+}
+
+VkSamplerCreateInfo vkinit::sampler_create_info( VkFilter filter, VkSamplerAddressMode addressMode )
+{
+  VkSamplerCreateInfo info = {};
+  info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  info.magFilter = filter;
+  info.minFilter = filter;
+  info.addressModeU = addressMode;
+  info.addressModeV = addressMode;
+  info.addressModeW = addressMode;
+  info.maxLod = VK_LOD_CLAMP_NONE;
+  return info;
+}
+
+VkDescriptorSetLayoutBinding vkinit::descriptor_set_layout_binding( VkDescriptorType type,
+                                                                    VkShaderStageFlags stageFlags,
+                                                                    uint32_t binding )
+{
+  VkDescriptorSetLayoutBinding info = {};
+  info.binding = binding;
+  info.descriptorCount = 1;
+  info.descriptorType = type;
+  info.stageFlags = stageFlags;
+  return info;
+}
+
+VkWriteDescriptorSet vkinit::write_descriptor_buffer( VkDescriptorType type,
+                                                      VkDescriptorSet dstSet,
+                                                      const VkDescriptorBufferInfo* bufferInfo,
+                                                      uint32_t binding )
+{
+  VkWriteDescriptorSet write = {};
+  write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  write.dstBinding = binding;
+  write.dstSet = dstSet;
+  write.descriptorCount = 1;
+  write.descriptorType = type;
+  write.pBufferInfo = bufferInfo;
+  return write;
+}
+
+VkWriteDescriptorSet vkinit::write_descriptor_image( VkDescriptorType type,
+                                                     VkDescriptorSet dstSet,
+                                                     const VkDescriptorImageInfo* imageInfo,
+                                                     uint32_t binding )
+{
+  VkWriteDescriptorSet write = {};
+  write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  write.dstBinding = binding;
+  write.dstSet = dstSet;
+  write.descriptorCount = 1;
+  write.descriptorType = type;
+  write.pImageInfo = imageInfo;
+  return write;
+}
+
+VkMemoryBarrier vkinit::memory_barrier( VkAccessFlags srcAccess, VkAccessFlags dstAccess )
+{
+  VkMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = srcAccess;
+  barrier.dstAccessMask = dstAccess;
+  return barrier;
+}
+
+VkImageMemoryBarrier vkinit::image_barrier( VkImage image,
+                                            VkAccessFlags srcAccess,
+                                            VkAccessFlags dstAccess,
+                                            VkImageLayout oldLayout,
+                                            VkImageLayout newLayout,
+                                            VkImageAspectFlags aspectMask )
+{
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = srcAccess;
+  barrier.dstAccessMask = dstAccess;
+  barrier.oldLayout = oldLayout;
+  barrier.newLayout = newLayout;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange.aspectMask = aspectMask;
+  barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+  barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+  return barrier;
+}
+
+VkBufferMemoryBarrier vkinit::buffer_barrier( VkBuffer buffer,
+                                              VkAccessFlags srcAccess,
+                                              VkAccessFlags dstAccess,
+                                              uint32_t srcQueueFamily,
+                                              uint32_t dstQueueFamily,
+                                              VkDeviceSize offset,
+                                              VkDeviceSize size )
+{
+  VkBufferMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = srcAccess;
+  barrier.dstAccessMask = dstAccess;
+  barrier.srcQueueFamilyIndex = srcQueueFamily;
+  barrier.dstQueueFamilyIndex = dstQueueFamily;
+  barrier.buffer = buffer;
+  barrier.offset = offset;
+  barrier.size = size;
+  return barrier;
+}
@@ -29,5 +29,31 @@ namespace vkinit
   VkImageViewCreateInfo image_view_create_info( VkFormat, VkImage, VkImageAspectFlags );
 
   VkRenderPassBeginInfo renderpass_begin_info( VkRenderPass, VkExtent2D, VkFramebuffer );
+
+  VkBufferCreateInfo buffer_create_info( VkDeviceSize, VkBufferUsageFlags );
+  VkSamplerCreateInfo sampler_create_info( VkFilter, VkSamplerAddressMode );
+
+  VkDescriptorSetLayoutBinding descriptor_set_layout_binding( VkDescriptorType, VkShaderStageFlags, uint32_t binding );
+  VkWriteDescriptorSet write_descriptor_buffer( VkDescriptorType, VkDescriptorSet, const VkDescriptorBufferInfo*, uint32_t binding );
+  VkWriteDescriptorSet write_descriptor_image( VkDescriptorType, VkDescriptorSet, const VkDescriptorImageInfo*, uint32_t binding );
+
+  // barriers are always for the whole resource ( all mips, all layers )
+  VkMemoryBarrier memory_barrier( VkAccessFlags srcAccess, VkAccessFlags dstAccess );
+  VkImageMemoryBarrier image_barrier( VkImage,
+                                      VkAccessFlags srcAccess,
+                                      VkAccessFlags dstAccess,
+                                      VkImageLayout oldLayout,
+                                      VkImageLayout newLayout,
+                                      VkImageAspectFlags );
+
+  // Buffer ranges with a queue family ownership transfer. Record the same barrier
+  // as the release on the source queue and the acquire on the destination queue.
+  VkBufferMemoryBarrier buffer_barrier( VkBuffer,
+                                        VkAccessFlags srcAccess,
+                                        VkAccessFlags dstAccess,
+                                        uint32_t srcQueueFamily,
+                                        uint32_t dstQueueFamily,
+                                        VkDeviceSize offset = 0,
+                                        VkDeviceSize size = VK_WHOLE_SIZE );
 }
 
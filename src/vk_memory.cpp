@@ -0,0 +1,304 @@
+﻿#include <vk_memory.h>
+#include <vk_initializers.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+
+const char* memory_category_name( MemoryCategory category )
+{
+  switch( category )
+  {
+    case MemoryCategory::Mesh: return "meshes";
+    case MemoryCategory::Texture: return "textures";
+    case MemoryCategory::RenderTarget: return "render targets";
+    case MemoryCategory::Staging: return "staging";
+    case MemoryCategory::GpuData: return "gpu data";
+    default: return "unknown";
+  }
+}
+
+void MemoryManager::init( VkDevice device, VmaAllocator allocator, bool memoryBudgetExt, uint32_t framesInFlight )
+{
+  _device = device;
+  _allocator = allocator;
+  _memoryBudgetExt = memoryBudgetExt;
+  _framesInFlight = framesInFlight;
+
+  const VkPhysicalDeviceMemoryProperties* properties;
+  vmaGetMemoryProperties( _allocator, &properties );
+  _heapCount = properties->memoryHeapCount;
+  vmaGetBudget( _allocator, _budgets );
+}
+
+void MemoryManager::destroy()
+{
+  // only called once the device is idle, so an open pass has finished its copies
+  if( _defragContext )
+  {
+    if( _defragPassOpen )
+      vmaEndDefragmentationPass( _allocator, _defragContext );
+    vmaDefragmentationEnd( _allocator, _defragContext );
+    _defragContext = VK_NULL_HANDLE;
+  }
+  for( VkBuffer buffer : _retiredBuffers )
+    vkDestroyBuffer( _device, buffer, nullptr );
+  _retiredBuffers.clear();
+}
+
+void MemoryManager::track( VmaAllocation allocation,
+                           MemoryCategory category,
+                           AllocatedBuffer* owner,
+                           VkDeviceSize size,
+                           VkBufferUsageFlags usage,
+                           EvictFn evict )
+{
+  VmaAllocationInfo info;
+  vmaGetAllocationInfo( _allocator, allocation, &info );
+  const VkPhysicalDeviceMemoryProperties* properties;
+  vmaGetMemoryProperties( _allocator, &properties );
+
+  Tracked tracked;
+  tracked.category = category;
+  tracked.bytes = info.size;
+  tracked.heap = properties->memoryTypes[ info.memoryType ].heapIndex;
+  tracked.owner = owner;
+  tracked.size = size;
+  tracked.usage = usage;
+  tracked.evict = evict;
+  tracked.lastUsedFrame = _frameNumber;
+  _tracked[ allocation ] = tracked;
+
+  CategoryStats& stats = _categories[ ( int )category ];
+  stats.bytes += tracked.bytes;
+  stats.count++;
+}
+
+void MemoryManager::untrack( VmaAllocation allocation )
+{
+  auto it = _tracked.find( allocation );
+  if( it == _tracked.end() )
+    return;
+  assert( std::find( _defragAllocations.begin(), _defragAllocations.end(), allocation ) == _defragAllocations.end() &&
+          "allocations can't be freed while they are being defragmented" );
+  CategoryStats& stats = _categories[ ( int )it->second.category ];
+  stats.bytes -= it->second.bytes;
+  stats.count--;
+  _tracked.erase( it );
+}
+
+void MemoryManager::set_owner( VmaAllocation allocation, AllocatedBuffer* owner )
+{
+  auto it = _tracked.find( allocation );
+  if( it == _tracked.end() )
+    return;
+  it->second.owner = owner;
+  it->second.evict = nullptr;
+}
+
+void MemoryManager::touch( VmaAllocation allocation )
+{
+  auto it = _tracked.find( allocation );
+  if( it != _tracked.end() )
+    it->second.lastUsedFrame = _frameNumber;
+}
+
+void MemoryManager::make_room( uint32_t memoryTypeIndex, VkDeviceSize size )
+{
+  const VkPhysicalDeviceMemoryProperties* properties;
+  vmaGetMemoryProperties( _allocator, &properties );
+  const uint32_t heap = properties->memoryTypes[ memoryTypeIndex ].heapIndex;
+
+  vmaGetBudget( _allocator, _budgets );
+  const VmaBudget& budget = _budgets[ heap ];
+  if( budget.usage + size > ( VkDeviceSize )( budget.budget * _evictThreshold ) )
+  {
+    const VkDeviceSize target = ( VkDeviceSize )( budget.budget * _evictTarget );
+    evict( heap, target > size ? target - size : 0 );
+  }
+}
+
+void MemoryManager::begin_frame( uint32_t frameNumber )
+{
+  _frameNumber = frameNumber;
+
+  // the copies of the open pass are done once the frame that recorded them is
+  if( _defragPassOpen && _defragPassFrame + _framesInFlight <= frameNumber )
+  {
+    VkResult result = vmaEndDefragmentationPass( _allocator, _defragContext );
+    _defragPassOpen = false;
+    for( VkBuffer buffer : _retiredBuffers )
+      vkDestroyBuffer( _device, buffer, nullptr );
+    _retiredBuffers.clear();
+    if( result == VK_SUCCESS )
+    {
+      vmaDefragmentationEnd( _allocator, _defragContext );
+      _defragContext = VK_NULL_HANDLE;
+      _defragAllocations.clear();
+      std::cout << "defragmentation moved " << _defragMoves << " allocations, "
+                << _defragBytes / 1024 << " KiB" << std::endl;
+    }
+  }
+
+  // the budget refreshes with the frame index
+  vmaSetCurrentFrameIndex( _allocator, frameNumber );
+  vmaGetBudget( _allocator, _budgets );
+  for( uint32_t heap = 0; heap < _heapCount; ++heap )
+  {
+    const VmaBudget& budget = _budgets[ heap ];
+    if( budget.usage > ( VkDeviceSize )( budget.budget * _evictThreshold ) )
+      evict( heap, ( VkDeviceSize )( budget.budget * _evictTarget ) );
+  }
+
+  if( _defragRequested && !_defragContext )
+    begin_defragmentation();
+}
+
+void MemoryManager::evict( uint32_t heap, VkDeviceSize targetUsage )
+{
+  // Frames older than the ones in flight finished, so anything only they used is
+  // safe to free. What the newest finished frame used is likely needed again, keep it too.
+  std::vector< std::pair< uint32_t, VmaAllocation > > candidates;
+  for( const auto& [ allocation, tracked ] : _tracked )
+  {
+    if( tracked.evict &&
+        tracked.heap == heap &&
+        tracked.lastUsedFrame + _framesInFlight < _frameNumber &&
+        std::find( _defragAllocations.begin(), _defragAllocations.end(), allocation ) == _defragAllocations.end() )
+      candidates.push_back( { tracked.lastUsedFrame, allocation } );
+  }
+  std::sort( candidates.begin(), candidates.end(), []( const auto& a, const auto& b ) { return a.first < b.first; } );
+
+  VkDeviceSize usage = _budgets[ heap ].usage;
+  for( const auto& candidate : candidates )
+  {
+    if( usage <= targetUsage )
+      break;
+    const Tracked& tracked = _tracked[ candidate.second ];
+    const VkDeviceSize bytes = tracked.bytes;
+
+    // copy the callback, it frees the allocation and untracks it
+    EvictFn evictFn = tracked.evict;
+    evictFn();
+    usage = usage > bytes ? usage - bytes : 0;
+    _evictions++;
+    _evictedBytes += bytes;
+  }
+  vmaGetBudget( _allocator, _budgets );
+
+  // eviction leaves holes behind
+  if( !candidates.empty() )
+    _defragRequested = true;
+}
+
+void MemoryManager::begin_defragmentation()
+{
+  _defragRequested = false;
+  _defragAllocations.clear();
+  for( const auto& [ allocation, tracked ] : _tracked )
+    if( tracked.owner )
+      _defragAllocations.push_back( allocation );
+  if( _defragAllocations.empty() )
+    return;
+
+  VmaDefragmentationInfo2 info = {};
+  info.flags = VMA_DEFRAGMENTATION_FLAG_INCREMENTAL;
+  info.allocationCount = ( uint32_t )_defragAllocations.size();
+  info.pAllocations = _defragAllocations.data();
+  info.maxCpuBytesToMove = VK_WHOLE_SIZE;
+  info.maxCpuAllocationsToMove = UINT32_MAX;
+  info.maxGpuBytesToMove = VK_WHOLE_SIZE;
+  info.maxGpuAllocationsToMove = UINT32_MAX;
+  VkResult result = vmaDefragmentationBegin( _allocator, &info, nullptr, &_defragContext );
+  if( result != VK_NOT_READY )
+  {
+    // nothing to move, or it failed, either way there is no context to keep
+    if( _defragContext )
+      vmaDefragmentationEnd( _allocator, _defragContext );
+    _defragContext = VK_NULL_HANDLE;
+    _defragAllocations.clear();
+    return;
+  }
+  _defragMoves = 0;
+  _defragBytes = 0;
+}
+
+void MemoryManager::defragment( VkCommandBuffer cmd )
+{
+  if( !_defragContext || _defragPassOpen )
+    return;
+
+  const auto start = std::chrono::steady_clock::now();
+  _defragPassMoves.resize( _defragMovesPerPass );
+  VmaDefragmentationPassInfo pass = {};
+  pass.moveCount = _defragMovesPerPass;
+  pass.pMoves = _defragPassMoves.data();
+  VK_CHECK( vmaBeginDefragmentationPass( _allocator, _defragContext, &pass ) );
+  _defragPassOpen = true;
+  _defragPassFrame = _frameNumber;
+
+  // Each move gets a new buffer bound at its destination and a copy of the
+  // contents. The owner switches over now, the old buffer dies with the pass.
+  for( uint32_t i = 0; i < pass.moveCount; ++i )
+  {
+    const VmaDefragmentationPassMoveInfo& move = pass.pMoves[ i ];
+    Tracked& tracked = _tracked[ move.allocation ];
+
+    VkBufferCreateInfo bufferInfo = vkinit::buffer_create_info( tracked.size, tracked.usage );
+    VkBuffer buffer;
+    VK_CHECK( vkCreateBuffer( _device, &bufferInfo, nullptr, &buffer ) );
+    VK_CHECK( vkBindBufferMemory( _device, buffer, move.memory, move.offset ) );
+
+    VkBufferCopy region = { 0, 0, tracked.size };
+    vkCmdCopyBuffer( cmd, tracked.owner->_buffer, buffer, 1, &region );
+    _retiredBuffers.push_back( tracked.owner->_buffer );
+    tracked.owner->_buffer = buffer;
+    _bufferRevision++;
+    _defragMoves++;
+    _defragBytes += tracked.size;
+  }
+
+  if( pass.moveCount > 0 )
+  {
+    VkMemoryBarrier barrier = vkinit::memory_barrier( VK_ACCESS_TRANSFER_WRITE_BIT,
+                                                      VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+                                                      VK_ACCESS_SHADER_READ_BIT |
+                                                      VK_ACCESS_INDEX_READ_BIT );
+    vkCmdPipelineBarrier( cmd,
+                          VK_PIPELINE_STAGE_TRANSFER_BIT,
+                          VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                          0, 1, &barrier, 0, nullptr, 0, nullptr );
+  }
+
+  // aim for half the budget, a pass can't be split once it has been handed out
+  const float elapsedMs = std::chrono::duration< float, std::milli >( std::chrono::steady_clock::now() - start ).count();
+  if( elapsedMs > _defragTimeBudgetMs && _defragMovesPerPass > 1 )
+    _defragMovesPerPass /= 2;
+  else if( elapsedMs < _defragTimeBudgetMs * 0.5f && pass.moveCount == _defragMovesPerPass )
+    _defragMovesPerPass = std::min( _defragMovesPerPass * 2, 256u );
+}
+
+void MemoryManager::print_report() const
+{
+  std::cout << "memory budget" << ( _memoryBudgetExt ? "" : " ( estimated, no VK_EXT_memory_budget )" ) << std::endl;
+  for( uint32_t heap = 0; heap < _heapCount; ++heap )
+  {
+    const VmaBudget& budget = _budgets[ heap ];
+    std::cout << "  heap " << heap
+              << " usage " << budget.usage / ( 1024 * 1024 ) << " / " << budget.budget / ( 1024 * 1024 ) << " MiB"
+              << ", blocks " << budget.blockBytes / ( 1024 * 1024 ) << " MiB"
+              << ", allocations " << budget.allocationBytes / ( 1024 * 1024 ) << " MiB" << std::endl;
+  }
+  for( int i = 0; i < ( int )MemoryCategory::Count; ++i )
+  {
+    std::cout << "  " << memory_category_name( ( MemoryCategory )i )
+              << " " << _categories[ i ].count << " allocations, "
+              << _categories[ i ].bytes / 1024 << " KiB" << std::endl;
+  }
+  std::cout << "  evicted " << _evictions << " allocations, " << _evictedBytes / 1024 << " KiB" << std::endl;
+  if( _defragContext )
+    std::cout << "  defragmenting, " << _defragMoves << " moves so far, "
+              << _defragMovesPerPass << " per frame" << std::endl;
+}
+
@@ -0,0 +1,131 @@
+﻿#pragma once
+
+#include <vk_types.h>
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+enum class MemoryCategory
+{
+  Mesh,
+  Texture,
+  RenderTarget,
+  Staging,
+  GpuData, // culling buffers and other per frame data
+  Count,
+};
+
+const char* memory_category_name( MemoryCategory );
+
+// Budget, accounting, eviction and defragmentation for the engine's vma allocations.
+//
+// Every allocation is tracked with a category. Streamable ones also get an evict
+// callback that frees them, their owner makes them resident again when they are
+// needed. When a heap gets close to its budget the least recently used streamable
+// allocations are evicted. Movable buffers are compacted by incremental
+// defragmentation, a few moves per frame within a time budget.
+//
+// The budget comes from VK_EXT_memory_budget when the device has it, otherwise
+// vma estimates it from the heap sizes.
+class MemoryManager
+{
+public:
+  using EvictFn = std::function< void() >;
+
+  // framesInFlight is how many frames back the gpu may still be using memory
+  void init( VkDevice, VmaAllocator, bool memoryBudgetExt, uint32_t framesInFlight );
+  void destroy();
+
+  // owner is patched when defragmentation moves the buffer, pass nullptr for
+  // allocations that can't move. size and usage are what the buffer was created with.
+  void track( VmaAllocation,
+              MemoryCategory,
+              AllocatedBuffer* owner = nullptr,
+              VkDeviceSize size = 0,
+              VkBufferUsageFlags usage = 0,
+              EvictFn evict = nullptr );
+  void untrack( VmaAllocation );
+  // Hands a movable allocation to another owner, for a buffer that outlives the
+  // object it was tracked for. It isn't evicted any more.
+  void set_owner( VmaAllocation, AllocatedBuffer* owner );
+
+  // marks a streamable allocation as used by the frame being recorded
+  void touch( VmaAllocation );
+
+  // Evicts least recently used streamable allocations until size more bytes fit
+  // into the heap of memoryTypeIndex. Call before making something resident.
+  void make_room( uint32_t memoryTypeIndex, VkDeviceSize size );
+
+  // Once per frame after the frame fence: finishes the defragmentation pass once
+  // the frame that recorded it is done, refreshes the budget and evicts if a heap
+  // is over the threshold.
+  void begin_frame( uint32_t frameNumber );
+
+  // Records this frame's buffer moves, before anything reads the moved buffers.
+  void defragment( VkCommandBuffer );
+
+  // compacts all movable allocations over the next frames
+  void request_defragmentation() { _defragRequested = true; }
+  // movable allocations can't be freed while this is true
+  bool is_defragmenting() const { return _defragContext != VK_NULL_HANDLE; }
+
+  // changes whenever defragmentation hands an owner a new buffer, so commands
+  // recorded with the old one can tell they need recording again
+  uint64_t get_buffer_revision() const { return _bufferRevision; }
+
+  void print_report() const;
+
+  float _evictThreshold = 0.9f; // fraction of the heap budget that starts eviction
+  float _evictTarget = 0.8f;    // evicts down to this fraction
+  float _defragTimeBudgetMs = 0.5f;
+
+private:
+  struct Tracked
+  {
+    MemoryCategory category;
+    VkDeviceSize bytes;
+    uint32_t heap;
+    AllocatedBuffer* owner;
+    VkDeviceSize size;
+    VkBufferUsageFlags usage;
+    EvictFn evict;
+    uint32_t lastUsedFrame;
+  };
+
+  struct CategoryStats
+  {
+    VkDeviceSize bytes = 0;
+    uint32_t count = 0;
+  };
+
+  void evict( uint32_t heap, VkDeviceSize targetUsage );
+  void begin_defragmentation();
+
+  VkDevice _device = VK_NULL_HANDLE;
+  VmaAllocator _allocator = VK_NULL_HANDLE;
+  bool _memoryBudgetExt = false;
+  uint32_t _framesInFlight = 1;
+  uint32_t _frameNumber = 0;
+  uint32_t _heapCount = 0;
+  VmaBudget _budgets[ VK_MAX_MEMORY_HEAPS ] = {};
+
+  std::unordered_map< VmaAllocation, Tracked > _tracked;
+  CategoryStats _categories[ ( int )MemoryCategory::Count ];
+  uint32_t _evictions = 0;
+  VkDeviceSize _evictedBytes = 0;
+
+  // incremental defragmentation
+  bool _defragRequested = false;
+  VmaDefragmentationContext _defragContext = VK_NULL_HANDLE;
+  bool _defragPassOpen = false;
+  uint32_t _defragPassFrame = 0; // frame that recorded the open pass
+  uint32_t _defragMovesPerPass = 8; // adapted to stay within the time budget
+  uint32_t _defragMoves = 0;
+  uint64_t _bufferRevision = 0;
+  VkDeviceSize _defragBytes = 0;
+  std::vector< VmaAllocation > _defragAllocations;
+  std::vector< VmaDefragmentationPassMoveInfo > _defragPassMoves;
+  std::vector< VkBuffer > _retiredBuffers; // replaced by the open pass, freed once it ends
+};
+
@@ -1,6 +1,10 @@
 ﻿#include <vk_mesh.h>
 #include <tiny_obj_loader.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <glm/geometric.hpp>
 
 VertexInputDescription Vertex::get_vertex_description()
 {
@@ -33,6 +37,13 @@ VertexInputDescription Vertex::get_vertex_description()
         attribute.format = VK_FORMAT_R32G32B32_SFLOAT;
         attribute.offset = offsetof( Vertex, color );
         return attribute;
+    }( ),
+    []() {
+        VkVertexInputAttributeDescription attribute = {};
+        attribute.location = 3;
+        attribute.format = VK_FORMAT_R32G32_SFLOAT;
+        attribute.offset = offsetof( Vertex, uv );
+        return attribute;
     }( )
   };
   return description;
@@ -40,6 +51,30 @@ VertexInputDescription Vertex::get_vertex_description()
 
 
 
+// the skinning lines tinyobj skips, the nth vs line skins the nth position
+static void read_obj_skin( const char* path, std::vector< VertexSkin >& skin, std::vector< glm::vec3 >& pivots )
+{
+  std::ifstream file( path );
+  std::string line;
+  while( std::getline( file, line ) )
+  {
+    VertexSkin vertex;
+    glm::vec3 pivot;
+    if( sscanf( line.c_str(),
+                "vs %u %u %u %u %f %f %f %f",
+                &vertex.joints.x, &vertex.joints.y, &vertex.joints.z, &vertex.joints.w,
+                &vertex.weights.x, &vertex.weights.y, &vertex.weights.z, &vertex.weights.w ) == 8 )
+    {
+      const float sum = vertex.weights.x + vertex.weights.y + vertex.weights.z + vertex.weights.w;
+      if( sum > 0 )
+        vertex.weights /= sum;
+      skin.push_back( vertex );
+    }
+    else if( sscanf( line.c_str(), "jp %f %f %f", &pivot.x, &pivot.y, &pivot.z ) == 3 )
+      pivots.push_back( pivot );
+  }
+}
+
 bool Mesh::load_from_obj( const char* path )
 {
   tinyobj::attrib_t attrib;
@@ -47,11 +82,18 @@ bool Mesh::load_from_obj( const char* path )
   std::vector< tinyobj::material_t > materials;
   std::string warn;
   std::string err;
+  _sourcePath = path;
   tinyobj::LoadObj( &attrib, &shapes, &materials, &warn, &err, path, nullptr );
   if( !warn.empty() )
     std::cout << warn << std::endl;
   if( !err.empty() )
     std::cout << err << std::endl;
+
+  // positions past the last vs line follow the root joint
+  std::vector< VertexSkin > positionSkins;
+  _jointPivots.clear();
+  _skin.clear();
+  read_obj_skin( path, positionSkins, _jointPivots );
   for( size_t s = 0; s < shapes.size(); ++s )
   {
     int index_offset = 0;
@@ -71,10 +113,51 @@ bool Mesh::load_from_obj( const char* path )
         new_vert.normal.y = attrib.normals[ 3 * idx.normal_index + 1 ];
         new_vert.normal.z = attrib.normals[ 3 * idx.normal_index + 2 ];
         new_vert.color = new_vert.normal;
+        // obj has v going up, images start at the top
+        new_vert.uv = glm::vec2( 0 );
+        if( idx.texcoord_index >= 0 )
+        {
+          new_vert.uv.x = attrib.texcoords[ 2 * idx.texcoord_index + 0 ];
+          new_vert.uv.y = 1 - attrib.texcoords[ 2 * idx.texcoord_index + 1 ];
+        }
         _verticies.push_back( new_vert );
+        if( is_skinned() )
+        {
+          const size_t position = ( size_t )idx.vertex_index;
+          _skin.push_back( position < positionSkins.size() ? positionSkins[ position ] : VertexSkin() );
+        }
       }
       index_offset += ( int )shape->mesh.num_face_vertices[ f ];
     }
   }
+  compute_bounds();
   return err.empty();
 }
+
+void Mesh::compute_bounds()
+{
+  _bounds = AABB();
+  if( !is_skinned() )
+  {
+    for( const Vertex& vertex : _verticies )
+      _bounds.grow( vertex.position );
+    return;
+  }
+
+  // A joint moves its pivot at most the length of the chain above it away from the
+  // root, and a vertex keeps its distance to the pivot. A blend of such points stays
+  // inside the largest of their spheres around the root.
+  std::vector< float > reach( _jointPivots.size(), 0.0f );
+  for( size_t j = 1; j < _jointPivots.size(); ++j )
+    reach[ j ] = reach[ j - 1 ] + glm::distance( _jointPivots[ j ], _jointPivots[ j - 1 ] );
+  float radius = 0;
+  for( size_t v = 0; v < _verticies.size(); ++v )
+    for( int k = 0; k < 4; ++k )
+    {
+      const uint32_t joint = std::min( _skin[ v ].joints[ k ], ( uint32_t )_jointPivots.size() - 1 );
+      if( _skin[ v ].weights[ k ] > 0 )
+        radius = std::max( radius, reach[ joint ] + glm::distance( _verticies[ v ].position, _jointPivots[ joint ] ) );
+    }
+  _bounds.grow( _jointPivots[ 0 ] - glm::vec3( radius ) );
+  _bounds.grow( _jointPivots[ 0 ] + glm::vec3( radius ) );
+}
@@ -1,8 +1,12 @@
 ﻿#pragma once
 
 #include <vk_types.h>
+#include <vk_bounds.h>
+#include <string>
 #include <vector>
+#include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
 
 struct VertexInputDescription
 {
@@ -16,16 +20,46 @@ struct Vertex
   glm::vec3 position;
   glm::vec3 normal;
   glm::vec3 color;
+  glm::vec2 uv;
   static VertexInputDescription get_vertex_description();
 };
 
+// Up to four joints moving a vertex, the weights sum to 1
+struct VertexSkin
+{
+  glm::uvec4 joints = glm::uvec4( 0 );
+  glm::vec4 weights = glm::vec4( 1, 0, 0, 0 );
+};
+
 
 struct Mesh
 {
+  // only held until they are in the vertex buffer, _vertexCount stays
   std::vector< Vertex > _verticies;
+  uint32_t _vertexCount = 0;
   AllocatedBuffer _vertexBuffer;
 
+  // local space bounds of the vertices
+  AABB _bounds;
+
+  // obj the vertices came from, empty for generated meshes. Only meshes with
+  // a source can have their buffer evicted, they are reloaded from it.
+  std::string _sourcePath;
+
+  // Skinned meshes only: a skin per vertex and the bind pose pivot of every joint,
+  // the parent of a joint is the one before it. They have no vertex buffer of their
+  // own, the gpu skins every instance each frame, see SkinningSystem.
+  std::vector< VertexSkin > _skin;
+  std::vector< glm::vec3 > _jointPivots;
+  uint32_t _skinSource = 0; // first vertex in the skinning system's bind pose buffer
+
+  bool is_skinned() const { return !_jointPivots.empty(); }
+
+  // Besides the usual obj lines, `jp x y z` adds a joint pivot and
+  // `vs j0 j1 j2 j3 w0 w1 w2 w3` skins the `v` line of the same index.
   bool load_from_obj( const char* path);
+  // for a skinned mesh, the bounds of any pose the joints can bend it into
+  void compute_bounds();
 };
 
 
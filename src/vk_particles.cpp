@@ -0,0 +1,267 @@
+﻿#include <vk_particles.h>
+#include <vk_initializers.h>
+#include <vk_pipeline.h>
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+
+namespace
+{
+  // offsets into the counter buffer, see particle_reset.comp
+  const VkDeviceSize DispatchOffset = 16;
+  const VkDeviceSize DrawOffset = 32;
+  const uint32_t GroupSize = 256;
+}
+
+void ParticleSystem::init( VkDevice device, VmaAllocator allocator, MemoryManager& memory, uint32_t capacity )
+{
+  _device = device;
+  _allocator = allocator;
+  _capacity = capacity;
+
+  // on average a particle lives 3/4 of the lifetime
+  _emitter.rate = capacity / ( 0.75f * _emitter.lifetime );
+
+  auto create_buffer = [ & ]( VkDeviceSize size, VkBufferUsageFlags usage ) {
+    VkBufferCreateInfo bufferInfo = vkinit::buffer_create_info( size, usage );
+    VmaAllocationCreateInfo vmaAllocInfo = {};
+    vmaAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    AllocatedBuffer buffer;
+    VK_CHECK( vmaCreateBuffer( _allocator, &bufferInfo, &vmaAllocInfo, &buffer._buffer, &buffer._allocation, nullptr ) );
+    memory.track( buffer._allocation, MemoryCategory::GpuData );
+    return buffer;
+  };
+  _particles = create_buffer( ( VkDeviceSize )capacity * 2 * sizeof( glm::vec4 ), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT );
+  _lists = create_buffer( ( VkDeviceSize )capacity * 3 * sizeof( uint32_t ), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT );
+  _counters = create_buffer( DrawOffset + 2 * sizeof( VkDrawIndirectCommand ),
+                             VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT );
+
+  const VkShaderStageFlags stages = VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_VERTEX_BIT;
+  std::array bindings = {
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, stages, 0 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, stages, 1 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, stages, 2 ),
+  };
+  VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+  layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layoutInfo.bindingCount = ( uint32_t )bindings.size();
+  layoutInfo.pBindings = bindings.data();
+  VK_CHECK( vkCreateDescriptorSetLayout( _device, &layoutInfo, nullptr, &_setLayout ) );
+
+  VkDescriptorPoolSize poolSize = { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, ( uint32_t )bindings.size() };
+  VkDescriptorPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolInfo.maxSets = 1;
+  poolInfo.poolSizeCount = 1;
+  poolInfo.pPoolSizes = &poolSize;
+  VK_CHECK( vkCreateDescriptorPool( _device, &poolInfo, nullptr, &_descriptorPool ) );
+
+  VkDescriptorSetAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocInfo.descriptorPool = _descriptorPool;
+  allocInfo.descriptorSetCount = 1;
+  allocInfo.pSetLayouts = &_setLayout;
+  VK_CHECK( vkAllocateDescriptorSets( _device, &allocInfo, &_set ) );
+
+  std::array infos = {
+    VkDescriptorBufferInfo{ _particles._buffer, 0, VK_WHOLE_SIZE },
+    VkDescriptorBufferInfo{ _lists._buffer, 0, VK_WHOLE_SIZE },
+    VkDescriptorBufferInfo{ _counters._buffer, 0, VK_WHOLE_SIZE },
+  };
+  std::array writes = {
+    vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _set, &infos[ 0 ], 0 ),
+    vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _set, &infos[ 1 ], 1 ),
+    vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _set, &infos[ 2 ], 2 ),
+  };
+  vkUpdateDescriptorSets( _device, ( uint32_t )writes.size(), writes.data(), 0, nullptr );
+}
+
+void ParticleSystem::destroy()
+{
+  for( VkPipeline pipeline : { _resetPipeline, _emitPipeline, _preparePipeline, _simulatePipeline, _drawPipeline } )
+    vkDestroyPipeline( _device, pipeline, nullptr );
+  vkDestroyPipelineLayout( _device, _computeLayout, nullptr );
+  vkDestroyPipelineLayout( _device, _drawLayout, nullptr );
+  vkDestroyDescriptorPool( _device, _descriptorPool, nullptr );
+  vkDestroyDescriptorSetLayout( _device, _setLayout, nullptr );
+  for( AllocatedBuffer* buffer : { &_particles, &_lists, &_counters } )
+    vmaDestroyBuffer( _allocator, buffer->_buffer, buffer->_allocation );
+}
+
+void ParticleSystem::add_simulation_pass( RenderGraph& graph )
+{
+  // the simulation of one frame follows the draw of the previous one
+  RGImportDesc import = {};
+  import.initialStages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  import.initialWriteAccess = VK_ACCESS_SHADER_WRITE_BIT;
+  import.finalStages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  import.finalAccess = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+  _particlesHandle = graph.import_buffer( "particles", _particles._buffer, import );
+  _listsHandle = graph.import_buffer( "particle lists", _lists._buffer, import );
+  _countersHandle = graph.import_buffer( "particle counters", _counters._buffer, import );
+
+  graph.add_compute_pass( "particle simulation",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.storage_buffer( _particlesHandle, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::ReadWrite );
+      builder.storage_buffer( _listsHandle, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::ReadWrite );
+      builder.storage_buffer( _countersHandle, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::ReadWrite );
+      builder.indirect_buffer( _countersHandle );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      record_simulation( cmd );
+    } );
+}
+
+RGPass ParticleSystem::add_draw_pass( RenderGraph& graph, RGHandle color, RGHandle depth )
+{
+  return graph.add_raster_pass( "particles",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.color_attachment( color );
+      builder.depth_attachment( depth );
+      builder.storage_buffer( _particlesHandle, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, RGUsage::Read );
+      builder.storage_buffer( _listsHandle, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, RGUsage::Read );
+      builder.indirect_buffer( _countersHandle );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      record_draw( cmd );
+    } );
+}
+
+void ParticleSystem::init_pipelines( VkRenderPass renderPass, VkExtent2D extent, const LoadShaderFn& load )
+{
+  auto create_layout = [ & ]( VkShaderStageFlags stage, uint32_t pushConstantSize, VkPipelineLayout* out ) {
+    VkPushConstantRange push_constant = {};
+    push_constant.size = pushConstantSize;
+    push_constant.stageFlags = stage;
+    VkPipelineLayoutCreateInfo layout_info = vkinit::pipeline_layout_create_info();
+    layout_info.setLayoutCount = 1;
+    layout_info.pSetLayouts = &_setLayout;
+    layout_info.pushConstantRangeCount = 1;
+    layout_info.pPushConstantRanges = &push_constant;
+    VK_CHECK( vkCreatePipelineLayout( _device, &layout_info, nullptr, out ) );
+  };
+  create_layout( VK_SHADER_STAGE_COMPUTE_BIT, sizeof( ParticlePushConstants ), &_computeLayout );
+  create_layout( VK_SHADER_STAGE_VERTEX_BIT, sizeof( ParticleDrawPushConstants ), &_drawLayout );
+
+  auto create_compute = [ & ]( const char* path ) {
+    VkShaderModule shaderModule = load( path );
+    if( !shaderModule )
+      return VkPipeline( VK_NULL_HANDLE );
+    VkPipeline pipeline = build_compute_pipeline( _device, _computeLayout, shaderModule );
+    vkDestroyShaderModule( _device, shaderModule, nullptr );
+    return pipeline;
+  };
+  _resetPipeline = create_compute( "shaders/particle_reset.comp.spv" );
+  _emitPipeline = create_compute( "shaders/particle_emit.comp.spv" );
+  _preparePipeline = create_compute( "shaders/particle_prepare.comp.spv" );
+  _simulatePipeline = create_compute( "shaders/particle_simulate.comp.spv" );
+
+  VkShaderModule vertexModule = load( "shaders/particle.vert.spv" );
+  VkShaderModule fragmentModule = load( "shaders/particle.frag.spv" );
+  if( vertexModule && fragmentModule )
+  {
+    PipelineBuilder pipelineBuilder = {};
+    pipelineBuilder._shaderStages = {
+      vkinit::shader_stage_create_info( VK_SHADER_STAGE_VERTEX_BIT, vertexModule ),
+      vkinit::shader_stage_create_info( VK_SHADER_STAGE_FRAGMENT_BIT, fragmentModule ),
+    };
+    // the quads come from the vertex index
+    pipelineBuilder._vertexInputInfo = vkinit::vertex_input_state_create_info();
+    pipelineBuilder._inputAssembly = vkinit::input_assembly_create_info( VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST );
+    pipelineBuilder._viewport = { 0, 0, ( float )extent.width, ( float )extent.height, 0, 1 };
+    pipelineBuilder._scissor = { { 0, 0 }, extent };
+    pipelineBuilder._rasterizer = vkinit::rasterization_state_create_info( VK_POLYGON_MODE_FILL );
+    pipelineBuilder._multisampling = vkinit::multisample_state_create_info();
+
+    // additive, so the order particles are drawn in doesn't matter
+    pipelineBuilder._colorBlendAttachment = vkinit::color_blend_attachment_state();
+    pipelineBuilder._colorBlendAttachment.blendEnable = VK_TRUE;
+    pipelineBuilder._colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+    pipelineBuilder._colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+    pipelineBuilder._colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+    pipelineBuilder._colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+    pipelineBuilder._colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    pipelineBuilder._colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+
+    // tested against the scene, but particles don't occlude each other
+    pipelineBuilder._depthStencil = vkinit::depth_stencil_create_info( true, false, VK_COMPARE_OP_LESS_OR_EQUAL );
+    pipelineBuilder._pipelineLayout = _drawLayout;
+    _drawPipeline = pipelineBuilder.build_pipeline( _device, renderPass );
+  }
+  if( vertexModule )
+    vkDestroyShaderModule( _device, vertexModule, nullptr );
+  if( fragmentModule )
+    vkDestroyShaderModule( _device, fragmentModule, nullptr );
+}
+
+void ParticleSystem::update( float dt, const glm::mat4& viewProj, const glm::vec3& cameraRight, const glm::vec3& cameraUp )
+{
+  // whole particles only, the fraction carries over. Whatever doesn't fit is dropped.
+  _emitAccumulator += _emitter.rate * dt;
+  const uint32_t emitCount = ( uint32_t )std::min( _emitAccumulator, ( float )_capacity );
+  _emitAccumulator = emitCount == _capacity ? 0 : _emitAccumulator - emitCount;
+
+  // last frame's survivors are this frame's current list
+  _constants.emitter = glm::vec4( _emitter.position, _emitter.speed );
+  _constants.gravity = glm::vec4( _emitter.gravity, dt );
+  _constants.capacity = _capacity;
+  _constants.emitCount = emitCount;
+  _constants.current ^= 1;
+  _constants.seed++;
+  _constants.lifetime = _emitter.lifetime;
+
+  _drawConstants.viewProj = viewProj;
+  _drawConstants.cameraRight = glm::vec4( cameraRight, _emitter.size );
+  _drawConstants.cameraUp = glm::vec4( cameraUp, 0 );
+  _drawConstants.capacity = _capacity;
+  _drawConstants.list = 1 - _constants.current;
+}
+
+void ParticleSystem::record_simulation( VkCommandBuffer cmd )
+{
+  vkCmdBindDescriptorSets( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _computeLayout, 0, 1, &_set, 0, nullptr );
+  vkCmdPushConstants( cmd, _computeLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( _constants ), &_constants );
+
+  // each step reads what the one before wrote
+  auto barrier = [ & ]( VkAccessFlags dstAccess, VkPipelineStageFlags dstStages ) {
+    VkMemoryBarrier memoryBarrier = vkinit::memory_barrier( VK_ACCESS_SHADER_WRITE_BIT, dstAccess );
+    vkCmdPipelineBarrier( cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, dstStages, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr );
+  };
+  const VkAccessFlags readWrite = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+  if( _resetPending )
+  {
+    vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _resetPipeline );
+    vkCmdDispatch( cmd, ( _capacity + GroupSize - 1 ) / GroupSize, 1, 1 );
+    barrier( readWrite, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT );
+    _resetPending = false;
+  }
+
+  if( _constants.emitCount > 0 )
+  {
+    vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _emitPipeline );
+    vkCmdDispatch( cmd, ( _constants.emitCount + GroupSize - 1 ) / GroupSize, 1, 1 );
+    barrier( readWrite, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT );
+  }
+
+  vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _preparePipeline );
+  vkCmdDispatch( cmd, 1, 1, 1 );
+  barrier( readWrite | VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT );
+
+  vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _simulatePipeline );
+  vkCmdDispatchIndirect( cmd, _counters._buffer, DispatchOffset );
+}
+
+void ParticleSystem::record_draw( VkCommandBuffer cmd )
+{
+  vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _drawPipeline );
+  vkCmdBindDescriptorSets( cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _drawLayout, 0, 1, &_set, 0, nullptr );
+  vkCmdPushConstants( cmd, _drawLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof( _drawConstants ), &_drawConstants );
+  vkCmdDrawIndirect( cmd,
+                     _counters._buffer,
+                     DrawOffset + _drawConstants.list * sizeof( VkDrawIndirectCommand ),
+                     1,
+                     sizeof( VkDrawIndirectCommand ) );
+}
@@ -0,0 +1,108 @@
+﻿#pragma once
+
+#include <vk_types.h>
+#include <vk_render_graph.h>
+#include <vk_memory.h>
+#include <glm/glm.hpp>
+
+#include <functional>
+
+struct ParticleEmitter
+{
+  glm::vec3 position = { 0, 2, 0 };
+  float rate = 0;     // particles per second, set from the capacity by init
+  float speed = 6;
+  float lifetime = 3; // seconds, each particle lives between half and all of it
+  float size = 0.02f; // world space radius
+  glm::vec3 gravity = { 0, -9.8f, 0 };
+};
+
+// Written by the cpu every frame, the same for all particle compute shaders
+struct ParticlePushConstants
+{
+  glm::vec4 emitter; // xyz position, w speed
+  glm::vec4 gravity; // xyz gravity, w dt
+  uint32_t capacity;
+  uint32_t emitCount;
+  uint32_t current; // alive list emitted into and simulated from, the other one is drawn
+  uint32_t seed;
+  float lifetime;
+};
+
+struct ParticleDrawPushConstants
+{
+  glm::mat4 viewProj;
+  glm::vec4 cameraRight; // w size
+  glm::vec4 cameraUp;
+  uint32_t capacity;
+  uint32_t list;
+};
+
+// Particles simulated and drawn entirely on the gpu.
+//
+// Particle state lives in a storage buffer, slots are handed out by an atomic free
+// list. Each frame the emit shader pops slots and appends them to the current alive
+// list, the simulate shader ages the particles in it and appends the survivors to
+// the other list, pushing the dead back on the free list. The alive counts are the
+// instance counts of indirect draws, so the count of the dispatch that simulates
+// them and the count of the draw both come from the gpu.
+//
+// The cpu only writes push constants, its cost doesn't depend on the particle count.
+class ParticleSystem
+{
+public:
+  using LoadShaderFn = std::function< VkShaderModule( const char* path ) >;
+
+  // creates the buffers and descriptors, emission defaults to keeping the capacity full
+  void init( VkDevice, VmaAllocator, MemoryManager&, uint32_t capacity );
+  void destroy();
+
+  // Simulation is one compute pass, drawing one raster pass loading color and depth.
+  // Add the draw after the opaque passes.
+  void add_simulation_pass( RenderGraph& );
+  RGPass add_draw_pass( RenderGraph&, RGHandle color, RGHandle depth );
+
+  // after the graph compiled, renderPass is the draw pass's. load returns null on failure.
+  void init_pipelines( VkRenderPass, VkExtent2D, const LoadShaderFn& load );
+
+  // once per frame before recording
+  void update( float dt, const glm::mat4& viewProj, const glm::vec3& cameraRight, const glm::vec3& cameraUp );
+
+  // empties the system, recorded with the next simulation
+  void reset() { _resetPending = true; }
+
+  uint32_t get_capacity() const { return _capacity; }
+
+  ParticleEmitter _emitter;
+
+private:
+  void record_simulation( VkCommandBuffer );
+  void record_draw( VkCommandBuffer );
+
+  VkDevice _device = VK_NULL_HANDLE;
+  VmaAllocator _allocator = VK_NULL_HANDLE;
+  uint32_t _capacity = 0;
+
+  AllocatedBuffer _particles; // 2 vec4 per particle
+  AllocatedBuffer _lists;     // free list, alive list 0, alive list 1, capacity uints each
+  AllocatedBuffer _counters;  // free count, simulate dispatch args, one draw per alive list
+  RGHandle _particlesHandle;
+  RGHandle _listsHandle;
+  RGHandle _countersHandle;
+
+  VkDescriptorSetLayout _setLayout = VK_NULL_HANDLE;
+  VkDescriptorPool _descriptorPool = VK_NULL_HANDLE;
+  VkDescriptorSet _set = VK_NULL_HANDLE;
+  VkPipelineLayout _computeLayout = VK_NULL_HANDLE;
+  VkPipelineLayout _drawLayout = VK_NULL_HANDLE;
+  VkPipeline _resetPipeline = VK_NULL_HANDLE;
+  VkPipeline _emitPipeline = VK_NULL_HANDLE;
+  VkPipeline _preparePipeline = VK_NULL_HANDLE;
+  VkPipeline _simulatePipeline = VK_NULL_HANDLE;
+  VkPipeline _drawPipeline = VK_NULL_HANDLE;
+
+  bool _resetPending = true;
+  float _emitAccumulator = 0;
+  ParticlePushConstants _constants = {};
+  ParticleDrawPushConstants _drawConstants = {};
+};
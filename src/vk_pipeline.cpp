@@ -1,12 +1,45 @@
 ﻿#include "vk_pipeline.h"
+#include <vk_initializers.h>
+#include <algorithm>
 #include <array>
+#include <cstring>
 #include <iostream>
 
-VkPipeline PipelineBuilder::build_pipeline( VkDevice device, VkRenderPass pass )
+// 64 bit FNV-1a, fed field by field so padding and pointers never reach it
+struct StateHasher
+{
+  uint64_t hash = 14695981039346656037ull;
+
+  void add_bytes( const void* data, size_t size )
+  {
+    const uint8_t* bytes = ( const uint8_t* )data;
+    for( size_t i = 0; i < size; ++i )
+    {
+      hash ^= bytes[ i ];
+      hash *= 1099511628211ull;
+    }
+  }
+
+  template< typename T >
+  void add( const T& value )
+  {
+    add_bytes( &value, sizeof( T ) );
+  }
+
+  template< typename T >
+  void add_array( const T* values, uint32_t count )
+  {
+    add( count );
+    add_bytes( values, sizeof( T ) * count );
+  }
+};
+
+VkPipeline PipelineBuilder::build_pipeline( VkDevice device, VkRenderPass pass, VkPipelineCache cache ) const
 {
   std::array viewports = { _viewport };
   std::array scissors = { _scissor };
-  std::array attachments = { _colorBlendAttachment };
+  // the same blend state for every attachment
+  std::vector< VkPipelineColorBlendAttachmentState > attachments( _colorAttachmentCount, _colorBlendAttachment );
 
   VkPipelineViewportStateCreateInfo viewportState = {};
   viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
@@ -17,13 +50,32 @@ VkPipeline PipelineBuilder::build_pipeline( VkDevice device, VkRenderPass pass )
 
   VkPipelineColorBlendStateCreateInfo colorBlending = {};
   colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-  colorBlending.attachmentCount = ( int )attachments.size();
+  colorBlending.attachmentCount = _colorAttachmentCount;
   colorBlending.pAttachments = attachments.data();
 
+  VkPipelineDynamicStateCreateInfo dynamicState = {};
+  dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamicState.dynamicStateCount = ( uint32_t )_dynamicStates.size();
+  dynamicState.pDynamicStates = _dynamicStates.data();
+
+  std::vector< VkSpecializationMapEntry > specializationEntries;
+  for( uint32_t i = 0; i < ( uint32_t )_specializationConstants.size(); ++i )
+    specializationEntries.push_back( { i, i * ( uint32_t )sizeof( uint32_t ), sizeof( uint32_t ) } );
+  VkSpecializationInfo specialization = {};
+  specialization.mapEntryCount = ( uint32_t )specializationEntries.size();
+  specialization.pMapEntries = specializationEntries.data();
+  specialization.dataSize = _specializationConstants.size() * sizeof( uint32_t );
+  specialization.pData = _specializationConstants.data();
+  std::vector< VkPipelineShaderStageCreateInfo > stages = _shaderStages;
+  if( !_specializationConstants.empty() )
+    for( VkPipelineShaderStageCreateInfo& stage : stages )
+      if( !stage.pSpecializationInfo )
+        stage.pSpecializationInfo = &specialization;
+
   VkGraphicsPipelineCreateInfo pipelineInfo = {};
   pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-  pipelineInfo.stageCount = ( int )_shaderStages.size();
-  pipelineInfo.pStages = _shaderStages.data();
+  pipelineInfo.stageCount = ( int )stages.size();
+  pipelineInfo.pStages = stages.data();
   pipelineInfo.pVertexInputState = &_vertexInputInfo;
   pipelineInfo.pInputAssemblyState = &_inputAssembly;
   pipelineInfo.pViewportState = &viewportState;
@@ -33,11 +85,12 @@ VkPipeline PipelineBuilder::build_pipeline( VkDevice device, VkRenderPass pass )
   pipelineInfo.layout = _pipelineLayout;
   pipelineInfo.renderPass = pass;
   pipelineInfo.pDepthStencilState = &_depthStencil;
+  pipelineInfo.pDynamicState = _dynamicStates.empty() ? nullptr : &dynamicState;
 
   std::array pipelineInfos = { pipelineInfo };
   VkPipeline pipeline;
   if( VK_SUCCESS == vkCreateGraphicsPipelines( device,
-                                               VK_NULL_HANDLE,
+                                               cache,
                                                ( int )pipelineInfos.size(),
                                                pipelineInfos.data(),
                                                nullptr,
@@ -48,3 +101,142 @@ VkPipeline PipelineBuilder::build_pipeline( VkDevice device, VkRenderPass pass )
   return VK_NULL_HANDLE;
 }
 
+uint64_t PipelineBuilder::hash_state( VkRenderPass pass ) const
+{
+  StateHasher hasher;
+  hasher.add( ( uint32_t )_shaderStages.size() );
+  for( const VkPipelineShaderStageCreateInfo& stage : _shaderStages )
+  {
+    hasher.add( stage.stage );
+    hasher.add( stage.module );
+    hasher.add_bytes( stage.pName, strlen( stage.pName ) + 1 );
+    if( const VkSpecializationInfo* info = stage.pSpecializationInfo )
+    {
+      hasher.add_array( info->pMapEntries, info->mapEntryCount );
+      hasher.add( info->dataSize );
+      hasher.add_bytes( info->pData, info->dataSize );
+    }
+  }
+  hasher.add_array( _specializationConstants.data(), ( uint32_t )_specializationConstants.size() );
+
+  hasher.add_array( _vertexInputInfo.pVertexBindingDescriptions, _vertexInputInfo.vertexBindingDescriptionCount );
+  hasher.add_array( _vertexInputInfo.pVertexAttributeDescriptions, _vertexInputInfo.vertexAttributeDescriptionCount );
+  hasher.add( _inputAssembly.topology );
+  hasher.add( _inputAssembly.primitiveRestartEnable );
+
+  hasher.add_array( _dynamicStates.data(), ( uint32_t )_dynamicStates.size() );
+  auto isDynamic = [ this ]( VkDynamicState state ) {
+    return std::find( _dynamicStates.begin(), _dynamicStates.end(), state ) != _dynamicStates.end();
+  };
+  if( !isDynamic( VK_DYNAMIC_STATE_VIEWPORT ) )
+    hasher.add( _viewport );
+  if( !isDynamic( VK_DYNAMIC_STATE_SCISSOR ) )
+    hasher.add( _scissor );
+
+  hasher.add( _rasterizer.depthClampEnable );
+  hasher.add( _rasterizer.rasterizerDiscardEnable );
+  hasher.add( _rasterizer.polygonMode );
+  hasher.add( _rasterizer.cullMode );
+  hasher.add( _rasterizer.frontFace );
+  hasher.add( _rasterizer.depthBiasEnable );
+  hasher.add( _rasterizer.depthBiasConstantFactor );
+  hasher.add( _rasterizer.depthBiasClamp );
+  hasher.add( _rasterizer.depthBiasSlopeFactor );
+  hasher.add( _rasterizer.lineWidth );
+
+  hasher.add( _colorAttachmentCount );
+  if( _colorAttachmentCount > 0 )
+    hasher.add( _colorBlendAttachment );
+
+  hasher.add( _multisampling.rasterizationSamples );
+  hasher.add( _multisampling.sampleShadingEnable );
+  hasher.add( _multisampling.minSampleShading );
+  hasher.add( _multisampling.alphaToCoverageEnable );
+  hasher.add( _multisampling.alphaToOneEnable );
+
+  hasher.add( _depthStencil.depthTestEnable );
+  hasher.add( _depthStencil.depthWriteEnable );
+  hasher.add( _depthStencil.depthCompareOp );
+  hasher.add( _depthStencil.depthBoundsTestEnable );
+  hasher.add( _depthStencil.stencilTestEnable );
+  hasher.add( _depthStencil.front );
+  hasher.add( _depthStencil.back );
+  hasher.add( _depthStencil.minDepthBounds );
+  hasher.add( _depthStencil.maxDepthBounds );
+
+  hasher.add( _pipelineLayout );
+  hasher.add( pass );
+  return hasher.hash;
+}
+
+void PipelineCache::init( VkDevice device )
+{
+  _device = device;
+  VkPipelineCacheCreateInfo info = {};
+  info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  VK_CHECK( vkCreatePipelineCache( _device, &info, nullptr, &_driverCache ) );
+}
+
+void PipelineCache::destroy()
+{
+  for( auto& [ hash, pipeline ] : _pipelines )
+    vkDestroyPipeline( _device, pipeline, nullptr );
+  for( auto& [ hash, shaderModule ] : _modules )
+    vkDestroyShaderModule( _device, shaderModule, nullptr );
+  _pipelines.clear();
+  _modules.clear();
+  vkDestroyPipelineCache( _device, _driverCache, nullptr );
+  _driverCache = VK_NULL_HANDLE;
+}
+
+VkShaderModule PipelineCache::get_shader_module( const std::vector< char >& spirv )
+{
+  StateHasher hasher;
+  hasher.add_bytes( spirv.data(), spirv.size() );
+  auto it = _modules.find( hasher.hash );
+  if( it != _modules.end() )
+    return it->second;
+
+  VkShaderModuleCreateInfo createInfo = {};
+  createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  createInfo.codeSize = spirv.size();
+  createInfo.pCode = ( const uint32_t* )spirv.data();
+  VkShaderModule shaderModule;
+  if( vkCreateShaderModule( _device, &createInfo, nullptr, &shaderModule ) != VK_SUCCESS )
+    return VK_NULL_HANDLE;
+  _modules[ hasher.hash ] = shaderModule;
+  return shaderModule;
+}
+
+VkPipeline PipelineCache::get_pipeline( const PipelineBuilder& builder, VkRenderPass pass )
+{
+  const uint64_t key = builder.hash_state( pass );
+  auto it = _pipelines.find( key );
+  if( it != _pipelines.end() )
+  {
+    _reused++;
+    return it->second;
+  }
+
+  // failures aren't cached, asking again tries again
+  VkPipeline pipeline = builder.build_pipeline( _device, pass, _driverCache );
+  if( pipeline )
+    _pipelines[ key ] = pipeline;
+  return pipeline;
+}
+
+VkPipeline build_compute_pipeline( VkDevice device, VkPipelineLayout layout, VkShaderModule shaderModule )
+{
+  VkComputePipelineCreateInfo pipelineInfo = {};
+  pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipelineInfo.stage = vkinit::shader_stage_create_info( VK_SHADER_STAGE_COMPUTE_BIT, shaderModule );
+  pipelineInfo.layout = layout;
+
+  VkPipeline pipeline;
+  if( VK_SUCCESS == vkCreateComputePipelines( device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline ) )
+    return pipeline;
+
+  std::cout << "Failed to create compute pipieline" << std::endl;
+  return VK_NULL_HANDLE;
+}
+
@@ -2,6 +2,7 @@
 
 #include <vk_types.h>
 
+#include <unordered_map>
 #include <vector>
 
 class PipelineBuilder
@@ -14,9 +15,53 @@ public:
   VkRect2D _scissor;
   VkPipelineRasterizationStateCreateInfo _rasterizer;
   VkPipelineColorBlendAttachmentState _colorBlendAttachment;
+  uint32_t _colorAttachmentCount = 1; // 0 for depth only passes, all blend the same
   VkPipelineMultisampleStateCreateInfo _multisampling;
   VkPipelineLayout _pipelineLayout;
   VkPipelineDepthStencilStateCreateInfo _depthStencil;
-  VkPipeline build_pipeline( VkDevice, VkRenderPass );
+  std::vector< VkDynamicState > _dynamicStates; // _viewport and _scissor are ignored for the dynamic ones
+
+  // Shader variants. constant_id i is element i, in every stage without its own
+  // pSpecializationInfo. Ids a stage doesn't declare are ignored.
+  std::vector< uint32_t > _specializationConstants;
+
+  VkPipeline build_pipeline( VkDevice, VkRenderPass, VkPipelineCache = VK_NULL_HANDLE ) const;
+
+  // Hash of everything build_pipeline reads, by value rather than by pointer.
+  // Shader modules are hashed by handle, see PipelineCache::get_shader_module.
+  uint64_t hash_state( VkRenderPass ) const;
+};
+
+// Graphics pipelines by the hash of their state and shader modules by the hash
+// of their spir-v, so asking twice for the same pipeline or module creates it once.
+// Owns both. Pipelines that only differ in specialization constants are separate
+// pipelines, the driver cache lets them share what it compiled.
+//
+// Keys are 64 bit hashes, a collision would hand out the wrong pipeline.
+class PipelineCache
+{
+public:
+  void init( VkDevice );
+  void destroy();
+
+  // spirv is padded to whole words, returns VK_NULL_HANDLE on failure
+  VkShaderModule get_shader_module( const std::vector< char >& spirv );
+
+  // returns VK_NULL_HANDLE on failure
+  VkPipeline get_pipeline( const PipelineBuilder&, VkRenderPass );
+
+  uint32_t get_pipeline_count() const { return ( uint32_t )_pipelines.size(); }
+  uint32_t get_module_count() const { return ( uint32_t )_modules.size(); }
+  uint32_t get_reuse_count() const { return _reused; } // requests served from the cache
+
+private:
+  VkDevice _device = VK_NULL_HANDLE;
+  VkPipelineCache _driverCache = VK_NULL_HANDLE;
+  std::unordered_map< uint64_t, VkShaderModule > _modules;
+  std::unordered_map< uint64_t, VkPipeline > _pipelines;
+  uint32_t _reused = 0;
 };
 
+// returns VK_NULL_HANDLE on failure
+VkPipeline build_compute_pipeline( VkDevice, VkPipelineLayout, VkShaderModule );
+
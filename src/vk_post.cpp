@@ -0,0 +1,428 @@
+﻿#include <vk_post.h>
+#include <vk_initializers.h>
+#include <vk_pipeline.h>
+
+#include <glm/geometric.hpp>
+#include <algorithm>
+#include <array>
+
+namespace
+{
+  const uint32_t GroupSize = 16;
+
+  // A mild grade of display referred colors: a little more contrast and saturation,
+  // slightly warm. Stands in for a lut authored in an image editor.
+  glm::vec3 grade( glm::vec3 color )
+  {
+    color = glm::clamp( ( color - 0.5f ) * 1.08f + 0.5f, 0.0f, 1.0f );
+    const float luma = glm::dot( color, glm::vec3( 0.2126f, 0.7152f, 0.0722f ) );
+    color = glm::mix( glm::vec3( luma ), color, 1.1f );
+    return glm::clamp( color * glm::vec3( 1.03f, 1.0f, 0.96f ), 0.0f, 1.0f );
+  }
+
+  // the composite can only store to unorm formats, copies to srgb images keep the bits
+  VkFormat unorm_format( VkFormat format )
+  {
+    switch( format )
+    {
+      case VK_FORMAT_B8G8R8A8_SRGB: return VK_FORMAT_B8G8R8A8_UNORM;
+      case VK_FORMAT_R8G8B8A8_SRGB: return VK_FORMAT_R8G8B8A8_UNORM;
+      default: return format;
+    }
+  }
+}
+
+void PostProcess::init( VkDevice device,
+                        VmaAllocator allocator,
+                        MemoryManager& memory,
+                        float timestampPeriod,
+                        uint32_t framesInFlight )
+{
+  _device = device;
+  _allocator = allocator;
+  _timestampPeriod = timestampPeriod;
+
+  // the lut is written before the first frame, the staging buffer stays until destroy
+  const VkFormat lutFormat = VK_FORMAT_R8G8B8A8_UNORM;
+  VkImageCreateInfo imageInfo = vkinit::image_create_info( lutFormat,
+                                                           VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                                                           { LutSize, LutSize, LutSize } );
+  imageInfo.imageType = VK_IMAGE_TYPE_3D;
+  VmaAllocationCreateInfo imageAllocInfo = {};
+  imageAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+  VK_CHECK( vmaCreateImage( _allocator, &imageInfo, &imageAllocInfo, &_lut._image, &_lut._allocation, nullptr ) );
+  memory.track( _lut._allocation, MemoryCategory::Texture );
+  VkImageViewCreateInfo viewInfo = vkinit::image_view_create_info( lutFormat, _lut._image, VK_IMAGE_ASPECT_COLOR_BIT );
+  viewInfo.viewType = VK_IMAGE_VIEW_TYPE_3D;
+  VK_CHECK( vkCreateImageView( _device, &viewInfo, nullptr, &_lutView ) );
+
+  VkBufferCreateInfo bufferInfo = vkinit::buffer_create_info( LutSize * LutSize * LutSize * sizeof( uint32_t ),
+                                                              VK_BUFFER_USAGE_TRANSFER_SRC_BIT );
+  VmaAllocationCreateInfo bufferAllocInfo = {};
+  bufferAllocInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+  VK_CHECK( vmaCreateBuffer( _allocator, &bufferInfo, &bufferAllocInfo, &_lutStaging._buffer, &_lutStaging._allocation, nullptr ) );
+  memory.track( _lutStaging._allocation, MemoryCategory::Staging );
+  uint8_t* texels;
+  VK_CHECK( vmaMapMemory( _allocator, _lutStaging._allocation, ( void** )&texels ) );
+  for( uint32_t b = 0; b < LutSize; ++b )
+    for( uint32_t g = 0; g < LutSize; ++g )
+      for( uint32_t r = 0; r < LutSize; ++r )
+      {
+        const glm::vec3 color = grade( glm::vec3( r, g, b ) / ( float )( LutSize - 1 ) );
+        uint8_t* texel = texels + ( ( b * LutSize + g ) * LutSize + r ) * 4;
+        for( int c = 0; c < 3; ++c )
+          texel[ c ] = ( uint8_t )( color[ c ] * 255 + 0.5f );
+        texel[ 3 ] = 255;
+      }
+  VK_CHECK( vmaFlushAllocation( _allocator, _lutStaging._allocation, 0, VK_WHOLE_SIZE ) );
+  vmaUnmapMemory( _allocator, _lutStaging._allocation );
+
+  VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info( VK_FILTER_LINEAR, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE );
+  VK_CHECK( vkCreateSampler( _device, &samplerInfo, nullptr, &_sampler ) );
+
+  auto create_set_layout = [ & ]( auto& bindings, VkDescriptorSetLayout* out ) {
+    VkDescriptorSetLayoutCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    info.bindingCount = ( uint32_t )bindings.size();
+    info.pBindings = bindings.data();
+    VK_CHECK( vkCreateDescriptorSetLayout( _device, &info, nullptr, out ) );
+  };
+  std::array downBindings = {
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 0 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1 ),
+  };
+  downBindings[ 1 ].descriptorCount = BloomLevels;
+  create_set_layout( downBindings, &_downSetLayout );
+  std::array upBindings = {
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 0 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1 ),
+  };
+  upBindings[ 0 ].descriptorCount = BloomLevels;
+  create_set_layout( upBindings, &_upSetLayout );
+  std::array compositeBindings = {
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 0 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 1 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 2 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 3 ),
+  };
+  create_set_layout( compositeBindings, &_compositeSetLayout );
+
+  if( _timestampPeriod > 0 )
+  {
+    _queryPools.resize( framesInFlight );
+    for( VkQueryPool& pool : _queryPools )
+    {
+      VkQueryPoolCreateInfo queryPoolInfo = {};
+      queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+      queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+      queryPoolInfo.queryCount = QueriesPerFrame;
+      VK_CHECK( vkCreateQueryPool( _device, &queryPoolInfo, nullptr, &pool ) );
+    }
+  }
+}
+
+void PostProcess::destroy()
+{
+  for( VkPipeline pipeline : { _downPipeline, _upPipeline, _compositePipeline } )
+    vkDestroyPipeline( _device, pipeline, nullptr );
+  for( VkPipelineLayout layout : { _downLayout, _upLayout, _compositeLayout } )
+    vkDestroyPipelineLayout( _device, layout, nullptr );
+  vkDestroyDescriptorPool( _device, _descriptorPool, nullptr );
+  for( VkDescriptorSetLayout layout : { _downSetLayout, _upSetLayout, _compositeSetLayout } )
+    vkDestroyDescriptorSetLayout( _device, layout, nullptr );
+  for( VkQueryPool pool : _queryPools )
+    vkDestroyQueryPool( _device, pool, nullptr );
+  vkDestroySampler( _device, _sampler, nullptr );
+  vkDestroyImageView( _device, _lutView, nullptr );
+  vmaDestroyImage( _allocator, _lut._image, _lut._allocation );
+  vmaDestroyBuffer( _allocator, _lutStaging._buffer, _lutStaging._allocation );
+}
+
+RGHandle PostProcess::create_target( RenderGraph& graph, VkExtent2D extent )
+{
+  _extent = extent;
+  _target = graph.create_image( "hdr color", { HdrFormat, extent, 1 } );
+  return _target;
+}
+
+void PostProcess::add_passes( RenderGraph& graph, RGHandle output, VkFormat outputFormat, bool outputIsStorage )
+{
+  _output = output;
+  _outputIsStorage = outputIsStorage;
+  _bloomExtent = { std::max( _extent.width / 2, 1u ), std::max( _extent.height / 2, 1u ) };
+  _bloomChain = graph.create_image( "bloom chain", { HdrFormat, _bloomExtent, BloomLevels } );
+  _bloom = graph.create_image( "bloom", { HdrFormat, _bloomExtent, 1 } );
+
+  graph.add_compute_pass( "bloom downsample",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.sampled_image( _target, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT );
+      builder.storage_image( _bloomChain, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::Write );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      record_bloom_down( cmd );
+    } );
+
+  graph.add_compute_pass( "bloom upsample",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.storage_image( _bloomChain, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::Read );
+      builder.storage_image( _bloom, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::Write );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      record_bloom_up( cmd );
+    } );
+
+  // the copy source has the output's bits in a format that can be stored to
+  if( !outputIsStorage )
+  {
+    _copyFormat = unorm_format( outputFormat );
+    _copySource = graph.create_image( "post output", { _copyFormat, _extent, 1 } );
+  }
+  const RGHandle composited = outputIsStorage ? output : _copySource;
+  graph.add_compute_pass( "post composite",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.sampled_image( _target, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT );
+      builder.sampled_image( _bloom, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT );
+      builder.storage_image( composited, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::Write );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      record_composite( cmd );
+    } );
+
+  if( !outputIsStorage )
+    graph.add_compute_pass( "post copy",
+      [ & ]( RGPassBuilder& builder ) {
+        builder.transfer_read( _copySource );
+        builder.transfer_write( output );
+      },
+      [ this ]( VkCommandBuffer cmd ) {
+        record_copy( cmd );
+      } );
+}
+
+void PostProcess::init_pipelines( const RenderGraph& graph, const LoadShaderFn& load )
+{
+  _outputImages.resize( graph.get_variant_count( _output ) );
+  for( uint32_t i = 0; i < ( uint32_t )_outputImages.size(); ++i )
+    _outputImages[ i ] = graph.get_image( _output, i );
+  if( !_outputIsStorage )
+    _copyImage = graph.get_image( _copySource );
+
+  const uint32_t outputCount = _outputIsStorage ? ( uint32_t )_outputImages.size() : 1;
+  std::array poolSizes = {
+    VkDescriptorPoolSize{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 + 3 * outputCount },
+    VkDescriptorPoolSize{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2 * BloomLevels + 1 + outputCount },
+  };
+  VkDescriptorPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolInfo.maxSets = 2 + outputCount;
+  poolInfo.poolSizeCount = ( uint32_t )poolSizes.size();
+  poolInfo.pPoolSizes = poolSizes.data();
+  VK_CHECK( vkCreateDescriptorPool( _device, &poolInfo, nullptr, &_descriptorPool ) );
+
+  auto allocate_set = [ & ]( VkDescriptorSetLayout layout ) {
+    VkDescriptorSetAllocateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    info.descriptorPool = _descriptorPool;
+    info.descriptorSetCount = 1;
+    info.pSetLayouts = &layout;
+    VkDescriptorSet set;
+    VK_CHECK( vkAllocateDescriptorSets( _device, &info, &set ) );
+    return set;
+  };
+  _downSet = allocate_set( _downSetLayout );
+  _upSet = allocate_set( _upSetLayout );
+  _compositeSets.resize( outputCount );
+  for( VkDescriptorSet& set : _compositeSets )
+    set = allocate_set( _compositeSetLayout );
+
+  // the images are the graph's, so the sets are written once they exist
+  VkDescriptorImageInfo targetInfo = { _sampler, graph.get_image_view( _target ), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+  VkDescriptorImageInfo bloomSampledInfo = { _sampler, graph.get_image_view( _bloom ), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+  VkDescriptorImageInfo bloomStorageInfo = { VK_NULL_HANDLE, graph.get_image_view( _bloom ), VK_IMAGE_LAYOUT_GENERAL };
+  VkDescriptorImageInfo lutInfo = { _sampler, _lutView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+  std::array< VkDescriptorImageInfo, BloomLevels > levelInfos;
+  for( uint32_t level = 0; level < BloomLevels; ++level )
+    levelInfos[ level ] = { VK_NULL_HANDLE, graph.get_mip_view( _bloomChain, level ), VK_IMAGE_LAYOUT_GENERAL };
+  std::vector< VkDescriptorImageInfo > outputInfos( outputCount );
+  for( uint32_t i = 0; i < outputCount; ++i )
+    outputInfos[ i ] = { VK_NULL_HANDLE,
+                         _outputIsStorage ? graph.get_image_view( _output, i ) : graph.get_image_view( _copySource ),
+                         VK_IMAGE_LAYOUT_GENERAL };
+
+  std::vector< VkWriteDescriptorSet > writes = {
+    vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _downSet, &targetInfo, 0 ),
+    vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _downSet, levelInfos.data(), 1 ),
+    vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _upSet, levelInfos.data(), 0 ),
+    vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _upSet, &bloomStorageInfo, 1 ),
+  };
+  writes[ 1 ].descriptorCount = BloomLevels;
+  writes[ 2 ].descriptorCount = BloomLevels;
+  for( uint32_t i = 0; i < outputCount; ++i )
+  {
+    writes.push_back( vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _compositeSets[ i ], &targetInfo, 0 ) );
+    writes.push_back( vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _compositeSets[ i ], &bloomSampledInfo, 1 ) );
+    writes.push_back( vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _compositeSets[ i ], &lutInfo, 2 ) );
+    writes.push_back( vkinit::write_descriptor_image( VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _compositeSets[ i ], &outputInfos[ i ], 3 ) );
+  }
+  vkUpdateDescriptorSets( _device, ( uint32_t )writes.size(), writes.data(), 0, nullptr );
+
+  auto create_pipeline = [ & ]( const char* path,
+                                VkDescriptorSetLayout setLayout,
+                                uint32_t pushConstantSize,
+                                VkPipelineLayout* outLayout,
+                                VkPipeline* outPipeline ) {
+    VkPushConstantRange pushConstant = {};
+    pushConstant.size = pushConstantSize;
+    pushConstant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+    layoutInfo.setLayoutCount = 1;
+    layoutInfo.pSetLayouts = &setLayout;
+    layoutInfo.pushConstantRangeCount = pushConstantSize > 0 ? 1 : 0;
+    layoutInfo.pPushConstantRanges = &pushConstant;
+    VK_CHECK( vkCreatePipelineLayout( _device, &layoutInfo, nullptr, outLayout ) );
+
+    VkShaderModule shaderModule = load( path );
+    if( !shaderModule )
+      return;
+    *outPipeline = build_compute_pipeline( _device, *outLayout, shaderModule );
+    vkDestroyShaderModule( _device, shaderModule, nullptr );
+  };
+  create_pipeline( "shaders/post_bloom_down.comp.spv", _downSetLayout, sizeof( BloomPushConstants ), &_downLayout, &_downPipeline );
+  create_pipeline( "shaders/post_bloom_up.comp.spv", _upSetLayout, 0, &_upLayout, &_upPipeline );
+  create_pipeline( "shaders/post_composite.comp.spv",
+                   _compositeSetLayout,
+                   sizeof( CompositePushConstants ),
+                   &_compositeLayout,
+                   &_compositePipeline );
+}
+
+void PostProcess::prepare( VkCommandBuffer cmd )
+{
+  if( _prepared )
+    return;
+  _prepared = true;
+
+  VkImageMemoryBarrier toTransfer = vkinit::image_barrier( _lut._image,
+                                                           0,
+                                                           VK_ACCESS_TRANSFER_WRITE_BIT,
+                                                           VK_IMAGE_LAYOUT_UNDEFINED,
+                                                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                                           VK_IMAGE_ASPECT_COLOR_BIT );
+  vkCmdPipelineBarrier( cmd,
+                        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        0, 0, nullptr, 0, nullptr, 1, &toTransfer );
+  VkBufferImageCopy copy = {};
+  copy.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+  copy.imageExtent = { LutSize, LutSize, LutSize };
+  vkCmdCopyBufferToImage( cmd, _lutStaging._buffer, _lut._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy );
+  VkImageMemoryBarrier toSampled = vkinit::image_barrier( _lut._image,
+                                                          VK_ACCESS_TRANSFER_WRITE_BIT,
+                                                          VK_ACCESS_SHADER_READ_BIT,
+                                                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                                          VK_IMAGE_ASPECT_COLOR_BIT );
+  vkCmdPipelineBarrier( cmd,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                        0, 0, nullptr, 0, nullptr, 1, &toSampled );
+}
+
+void PostProcess::begin_frame( uint32_t frameIndex, uint32_t frameNumber, uint32_t outputVariant )
+{
+  _frameIndex = frameIndex;
+  _frameNumber = frameNumber;
+  _outputVariant = outputVariant;
+
+  // the frame that last used the pool is done, its fence signalled
+  if( _queryPools.empty() || frameNumber < _queryPools.size() )
+    return;
+  uint64_t ticks[ QueriesPerFrame ];
+  if( vkGetQueryPoolResults( _device,
+                             _queryPools[ frameIndex ],
+                             0, QueriesPerFrame,
+                             sizeof( ticks ), ticks, sizeof( uint64_t ),
+                             VK_QUERY_RESULT_64_BIT ) != VK_SUCCESS )
+    return;
+  const float msPerTick = _timestampPeriod / 1000000.0f;
+  _timings.bloomDownMs = ( ticks[ 1 ] - ticks[ 0 ] ) * msPerTick;
+  _timings.bloomUpMs = ( ticks[ 2 ] - ticks[ 1 ] ) * msPerTick;
+  _timings.compositeMs = ( ticks[ 3 ] - ticks[ 2 ] ) * msPerTick;
+  _timings.totalMs = ( ticks[ 3 ] - ticks[ 0 ] ) * msPerTick;
+}
+
+void PostProcess::write_timestamp( VkCommandBuffer cmd, uint32_t query )
+{
+  // at the bottom of the pipe, each one waits for the work recorded before it
+  if( !_queryPools.empty() )
+    vkCmdWriteTimestamp( cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, _queryPools[ _frameIndex ], query );
+}
+
+void PostProcess::record_bloom_down( VkCommandBuffer cmd )
+{
+  if( !_queryPools.empty() )
+    vkCmdResetQueryPool( cmd, _queryPools[ _frameIndex ], 0, QueriesPerFrame );
+  write_timestamp( cmd, 0 );
+  if( _downPipeline )
+  {
+    BloomPushConstants constants;
+    constants.invSourceExtent = 1.0f / glm::vec2( _extent.width, _extent.height );
+    constants.threshold = _settings.bloomThreshold;
+    constants.knee = _settings.bloomKnee;
+    vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _downPipeline );
+    vkCmdBindDescriptorSets( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _downLayout, 0, 1, &_downSet, 0, nullptr );
+    vkCmdPushConstants( cmd, _downLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( constants ), &constants );
+    vkCmdDispatch( cmd, ( _bloomExtent.width + GroupSize - 1 ) / GroupSize, ( _bloomExtent.height + GroupSize - 1 ) / GroupSize, 1 );
+  }
+  write_timestamp( cmd, 1 );
+}
+
+void PostProcess::record_bloom_up( VkCommandBuffer cmd )
+{
+  if( _upPipeline )
+  {
+    vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _upPipeline );
+    vkCmdBindDescriptorSets( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _upLayout, 0, 1, &_upSet, 0, nullptr );
+    vkCmdDispatch( cmd, ( _bloomExtent.width + GroupSize - 1 ) / GroupSize, ( _bloomExtent.height + GroupSize - 1 ) / GroupSize, 1 );
+  }
+  write_timestamp( cmd, 2 );
+}
+
+void PostProcess::record_composite( VkCommandBuffer cmd )
+{
+  if( _compositePipeline )
+  {
+    CompositePushConstants constants;
+    constants.invExtent = 1.0f / glm::vec2( _extent.width, _extent.height );
+    constants.exposure = _settings.exposure;
+    constants.bloomIntensity = _settings.bloomIntensity;
+    constants.frame = _frameNumber;
+    constants.dither = _settings.dither ? 1 : 0;
+    vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _compositePipeline );
+    vkCmdBindDescriptorSets( cmd,
+                             VK_PIPELINE_BIND_POINT_COMPUTE,
+                             _compositeLayout,
+                             0, 1, &_compositeSets[ _outputIsStorage ? _outputVariant : 0 ],
+                             0, nullptr );
+    vkCmdPushConstants( cmd, _compositeLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( constants ), &constants );
+    vkCmdDispatch( cmd, ( _extent.width + GroupSize - 1 ) / GroupSize, ( _extent.height + GroupSize - 1 ) / GroupSize, 1 );
+  }
+  if( _outputIsStorage )
+    write_timestamp( cmd, 3 );
+}
+
+void PostProcess::record_copy( VkCommandBuffer cmd )
+{
+  // the formats only differ in how the bits are read, so this is a plain copy
+  VkImageCopy copy = {};
+  copy.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+  copy.dstSubresource = copy.srcSubresource;
+  copy.extent = { _extent.width, _extent.height, 1 };
+  vkCmdCopyImage( cmd,
+                  _copyImage,
+                  VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                  _outputImages[ _outputVariant ],
+                  VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                  1, &copy );
+  write_timestamp( cmd, 3 );
+}
@@ -0,0 +1,140 @@
+﻿#pragma once
+
+#include <vk_types.h>
+#include <vk_render_graph.h>
+#include <vk_memory.h>
+#include <glm/glm.hpp>
+
+#include <functional>
+#include <vector>
+
+struct PostSettings
+{
+  float exposure = 1;         // scales the hdr color before the tonemap
+  float bloomThreshold = 1.5f; // brightness bloom starts at, with a soft knee below
+  float bloomKnee = 0.5f;
+  float bloomIntensity = 0.08f;
+  bool dither = true;
+};
+
+// Gpu time of the post processing passes, 0 without timestamps
+struct PostTimings
+{
+  float bloomDownMs = 0;
+  float bloomUpMs = 0;
+  float compositeMs = 0; // exposure, tonemap, grade and dither, plus the copy when there is one
+  float totalMs = 0;
+};
+
+// Compute post processing from the hdr scene color to the swapchain.
+//
+// The scene is drawn into an rgba16f target. Bloom is two dispatches: the first
+// builds every level of the downsample chain from 32x32 tiles in shared memory,
+// the second upsamples the whole chain back to half resolution, each workgroup
+// recomputing the coarse texels around its tile in shared memory. The point-wise
+// stages ( exposure, bloom add, tonemap, the color grading lut and dithering ) are
+// fused into one dispatch reading the scene color once and writing the swapchain
+// once. When the swapchain can't be a storage image it writes an image of the same
+// bits instead, copied into the swapchain.
+class PostProcess
+{
+public:
+  using LoadShaderFn = std::function< VkShaderModule( const char* path ) >;
+
+  static constexpr VkFormat HdrFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
+  static constexpr uint32_t BloomLevels = 5; // half resolution down to 1/32
+  static constexpr uint32_t LutSize = 32;
+
+  // timestampPeriod is ns per tick of the graphics queue, 0 disables the timings
+  void init( VkDevice, VmaAllocator, MemoryManager&, float timestampPeriod, uint32_t framesInFlight );
+  void destroy();
+
+  // The hdr target, for the passes drawing the scene
+  RGHandle create_target( RenderGraph&, VkExtent2D );
+
+  // Bloom and the composite, after every pass drawing into the target. output is
+  // an 8 bit unorm or srgb image, written as a storage image when outputIsStorage.
+  void add_passes( RenderGraph&, RGHandle output, VkFormat outputFormat, bool outputIsStorage );
+
+  // after the graph compiled, load returns null on failure
+  void init_pipelines( const RenderGraph&, const LoadShaderFn& load );
+
+  // uploads the grading lut, recorded before the first frame's passes
+  void prepare( VkCommandBuffer );
+
+  // After the frame's fence, reads back that frame's timings. outputVariant is the
+  // swapchain image the frame writes.
+  void begin_frame( uint32_t frameIndex, uint32_t frameNumber, uint32_t outputVariant );
+
+  PostTimings get_timings() const { return _timings; }
+
+  PostSettings _settings;
+
+private:
+  struct CompositePushConstants
+  {
+    glm::vec2 invExtent;
+    float exposure;
+    float bloomIntensity;
+    uint32_t frame;
+    uint32_t dither;
+  };
+
+  struct BloomPushConstants
+  {
+    glm::vec2 invSourceExtent;
+    float threshold;
+    float knee;
+  };
+
+  void record_bloom_down( VkCommandBuffer );
+  void record_bloom_up( VkCommandBuffer );
+  void record_composite( VkCommandBuffer );
+  void record_copy( VkCommandBuffer );
+  void write_timestamp( VkCommandBuffer, uint32_t query );
+
+  VkDevice _device = VK_NULL_HANDLE;
+  VmaAllocator _allocator = VK_NULL_HANDLE;
+  VkExtent2D _extent = {};
+  VkExtent2D _bloomExtent = {};
+
+  RGHandle _target = 0;
+  RGHandle _bloomChain = 0;  // downsampled levels
+  RGHandle _bloom = 0;       // the upsampled chain at half resolution
+  RGHandle _output = 0;
+  RGHandle _copySource = 0;  // the composite's image when the output isn't storage
+  bool _outputIsStorage = false;
+  VkFormat _copyFormat = VK_FORMAT_UNDEFINED;
+  std::vector< VkImage > _outputImages; // per variant
+  VkImage _copyImage = VK_NULL_HANDLE;
+
+  AllocatedImage _lut = {};
+  VkImageView _lutView = VK_NULL_HANDLE;
+  AllocatedBuffer _lutStaging = {};
+  bool _prepared = false;
+  VkSampler _sampler = VK_NULL_HANDLE; // linear, clamped
+
+  VkDescriptorSetLayout _downSetLayout = VK_NULL_HANDLE;
+  VkDescriptorSetLayout _upSetLayout = VK_NULL_HANDLE;
+  VkDescriptorSetLayout _compositeSetLayout = VK_NULL_HANDLE;
+  VkDescriptorPool _descriptorPool = VK_NULL_HANDLE;
+  VkDescriptorSet _downSet = VK_NULL_HANDLE;
+  VkDescriptorSet _upSet = VK_NULL_HANDLE;
+  std::vector< VkDescriptorSet > _compositeSets; // per output variant
+  VkPipelineLayout _downLayout = VK_NULL_HANDLE;
+  VkPipelineLayout _upLayout = VK_NULL_HANDLE;
+  VkPipelineLayout _compositeLayout = VK_NULL_HANDLE;
+  VkPipeline _downPipeline = VK_NULL_HANDLE;
+  VkPipeline _upPipeline = VK_NULL_HANDLE;
+  VkPipeline _compositePipeline = VK_NULL_HANDLE;
+
+  // start, after the downsample, after the upsample, after the composite
+  static constexpr uint32_t QueriesPerFrame = 4;
+  std::vector< VkQueryPool > _queryPools; // per frame in flight, empty without timestamps
+  float _timestampPeriod = 0;
+  PostTimings _timings;
+
+  uint32_t _frameIndex = 0;
+  uint32_t _frameNumber = 0;
+  uint32_t _outputVariant = 0;
+};
@@ -0,0 +1,95 @@
+﻿#include <vk_readback.h>
+#include <vk_initializers.h>
+
+namespace
+{
+  // copies into a buffer must start at a multiple of 4 and of the texel size
+  const VkDeviceSize CopyAlignment = 16;
+}
+
+void ReadbackQueue::init( VmaAllocator allocator, MemoryManager& memory, VkDeviceSize regionSize, uint32_t regionCount )
+{
+  _allocator = allocator;
+  _regionSize = ( regionSize + CopyAlignment - 1 ) / CopyAlignment * CopyAlignment;
+  _pending.resize( regionCount );
+
+  VkBufferCreateInfo bufferInfo = vkinit::buffer_create_info( _regionSize * regionCount, VK_BUFFER_USAGE_TRANSFER_DST_BIT );
+  VmaAllocationCreateInfo vmaAllocInfo = {};
+  vmaAllocInfo.usage = VMA_MEMORY_USAGE_GPU_TO_CPU;
+  VK_CHECK( vmaCreateBuffer( _allocator, &bufferInfo, &vmaAllocInfo, &_buffer._buffer, &_buffer._allocation, nullptr ) );
+  memory.track( _buffer._allocation, MemoryCategory::Staging );
+  VK_CHECK( vmaMapMemory( _allocator, _buffer._allocation, ( void** )&_mapped ) );
+}
+
+void ReadbackQueue::destroy()
+{
+  vmaUnmapMemory( _allocator, _buffer._allocation );
+  vmaDestroyBuffer( _allocator, _buffer._buffer, _buffer._allocation );
+}
+
+void ReadbackQueue::begin_frame( uint32_t region )
+{
+  deliver( region );
+  _region = region;
+  _head = 0;
+}
+
+void ReadbackQueue::finish()
+{
+  // oldest first, in the order the frames were recorded
+  for( uint32_t i = 1; i <= ( uint32_t )_pending.size(); ++i )
+    deliver( ( _region + i ) % ( uint32_t )_pending.size() );
+}
+
+bool ReadbackQueue::copy_buffer( VkCommandBuffer cmd, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, Callback callback )
+{
+  const VkDeviceSize dst = allocate( size );
+  if( dst == ~0ull )
+    return false;
+  VkBufferCopy copy = { offset, dst, size };
+  vkCmdCopyBuffer( cmd, buffer, _buffer._buffer, 1, &copy );
+  _pending[ _region ].push_back( { dst, size, std::move( callback ) } );
+  return true;
+}
+
+bool ReadbackQueue::copy_image( VkCommandBuffer cmd,
+                                VkImage image,
+                                VkImageAspectFlags aspect,
+                                VkOffset2D offset,
+                                VkExtent2D extent,
+                                uint32_t texelSize,
+                                Callback callback )
+{
+  const VkDeviceSize size = ( VkDeviceSize )extent.width * extent.height * texelSize;
+  const VkDeviceSize dst = allocate( size );
+  if( dst == ~0ull )
+    return false;
+  VkBufferImageCopy copy = {};
+  copy.bufferOffset = dst;
+  copy.imageSubresource = { aspect, 0, 0, 1 };
+  copy.imageOffset = { offset.x, offset.y, 0 };
+  copy.imageExtent = { extent.width, extent.height, 1 };
+  vkCmdCopyImageToBuffer( cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, _buffer._buffer, 1, &copy );
+  _pending[ _region ].push_back( { dst, size, std::move( callback ) } );
+  return true;
+}
+
+VkDeviceSize ReadbackQueue::allocate( VkDeviceSize size )
+{
+  const VkDeviceSize start = ( _head + CopyAlignment - 1 ) / CopyAlignment * CopyAlignment;
+  if( start + size > _regionSize )
+    return ~0ull;
+  _head = start + size;
+  return _region * _regionSize + start;
+}
+
+void ReadbackQueue::deliver( uint32_t region )
+{
+  std::vector< Pending >& pending = _pending[ region ];
+  if( pending.empty() )
+    return;
+  VK_CHECK( vmaInvalidateAllocation( _allocator, _buffer._allocation, region * _regionSize, _regionSize ) );
+  for( Pending& copy : pending )
+    copy.callback( _mapped + copy.offset, copy.size );
+  pending.clear();
+}
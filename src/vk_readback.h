@@ -0,0 +1,67 @@
+﻿#pragma once
+
+#include <vk_types.h>
+#include <vk_memory.h>
+
+#include <functional>
+#include <vector>
+
+// Gpu results copied back to the cpu without waiting for the gpu.
+//
+// Copies are recorded into the frame being recorded, into that frame's region of
+// a host visible buffer. When the region comes round again its frame's fence has
+// signalled, so begin_frame hands every copy to its callback: results arrive as
+// many frames later as there are regions, and nothing ever stalls.
+//
+// Callbacks run on the thread calling begin_frame, the data is only valid during the call.
+class ReadbackQueue
+{
+public:
+  using Callback = std::function< void( const void* data, VkDeviceSize size ) >;
+
+  // regionSize bounds what one frame can read back
+  void init( VmaAllocator, MemoryManager&, VkDeviceSize regionSize, uint32_t regionCount );
+  void destroy();
+
+  // After the fence of the frame that last used the region: delivers that frame's
+  // copies and starts filling the region again.
+  void begin_frame( uint32_t region );
+
+  // Once the device is idle: delivers everything still pending.
+  void finish();
+
+  // Record a copy into the current region, false without recording anything if
+  // it doesn't fit. Whatever wrote the source must be visible to transfer reads.
+  bool copy_buffer( VkCommandBuffer, VkBuffer, VkDeviceSize offset, VkDeviceSize size, Callback );
+
+  // A rect of mip 0 layer 0, in TRANSFER_SRC_OPTIMAL. Rows are tightly packed.
+  bool copy_image( VkCommandBuffer,
+                   VkImage,
+                   VkImageAspectFlags,
+                   VkOffset2D,
+                   VkExtent2D,
+                   uint32_t texelSize,
+                   Callback );
+
+  VkBuffer get_buffer() const { return _buffer._buffer; }
+
+private:
+  struct Pending
+  {
+    VkDeviceSize offset; // in the buffer
+    VkDeviceSize size;
+    Callback callback;
+  };
+
+  // space in the current region, ~0 if there is none
+  VkDeviceSize allocate( VkDeviceSize size );
+  void deliver( uint32_t region );
+
+  VmaAllocator _allocator = VK_NULL_HANDLE;
+  AllocatedBuffer _buffer = {};
+  const char* _mapped = nullptr;
+  VkDeviceSize _regionSize = 0;
+  uint32_t _region = 0;
+  VkDeviceSize _head = 0; // relative to the region start
+  std::vector< std::vector< Pending > > _pending; // per region
+};
@@ -0,0 +1,154 @@
+﻿#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// 32 bit FNV-1a of a resource name. constexpr, so names written in the source
+// hash at compile time and only the hash is looked up at runtime.
+using NameHash = uint32_t;
+
+constexpr NameHash hash_name( std::string_view name )
+{
+  NameHash hash = 2166136261u;
+  for( char c : name )
+  {
+    hash ^= ( uint8_t )c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Refers to a resource in a Registry. The generation tells a handle to a
+// removed resource from one to whatever took its slot afterwards. The default
+// handle is null, slots start at generation 1.
+template< typename T >
+struct Handle
+{
+  uint32_t index = 0;
+  uint32_t generation = 0;
+
+  bool is_null() const { return generation == 0; }
+  bool operator==( const Handle& other ) const { return index == other.index && generation == other.generation; }
+  bool operator!=( const Handle& other ) const { return !( *this == other ); }
+};
+
+// Resources stored densely, in a vector without holes, behind generational
+// handles. A handle resolves to its resource with two array lookups; names go
+// through a hash map of NameHash, meant for load time.
+//
+// Removing swaps the last resource into the hole, so pointers returned by get
+// are invalidated by remove, and by add once the capacity is exceeded.
+template< typename T >
+class Registry
+{
+public:
+  void reserve( uint32_t capacity )
+  {
+    _dense.reserve( capacity );
+    _denseSlots.reserve( capacity );
+    _slots.reserve( capacity );
+  }
+
+  // the name must not be registered already, hash collisions included
+  Handle< T > add( NameHash name, T&& value )
+  {
+    assert( _names.find( name ) == _names.end() && "resource name registered twice" );
+    uint32_t slot;
+    if( _freeSlot != NullSlot )
+    {
+      slot = _freeSlot;
+      _freeSlot = _slots[ slot ].dense;
+    }
+    else
+    {
+      slot = ( uint32_t )_slots.size();
+      _slots.push_back( { 0, 1 } );
+    }
+    _slots[ slot ].dense = ( uint32_t )_dense.size();
+    _dense.push_back( std::move( value ) );
+    _denseSlots.push_back( { slot, name } );
+    _names[ name ] = slot;
+    return { slot, _slots[ slot ].generation };
+  }
+
+  void remove( Handle< T > handle )
+  {
+    if( !get( handle ) )
+      return;
+    Slot& slot = _slots[ handle.index ];
+    const uint32_t dense = slot.dense;
+    _names.erase( _denseSlots[ dense ].name );
+    if( dense != _dense.size() - 1 )
+    {
+      _dense[ dense ] = std::move( _dense.back() );
+      _denseSlots[ dense ] = _denseSlots.back();
+      _slots[ _denseSlots[ dense ].slot ].dense = dense;
+    }
+    _dense.pop_back();
+    _denseSlots.pop_back();
+
+    // outdates every handle to the slot, 0 is the null handle's
+    slot.generation = slot.generation + 1 ? slot.generation + 1 : 1;
+    slot.dense = _freeSlot;
+    _freeSlot = handle.index;
+  }
+
+  // nullptr for the null handle and handles to removed resources
+  T* get( Handle< T > handle )
+  {
+    return const_cast< T* >( static_cast< const Registry* >( this )->get( handle ) );
+  }
+
+  const T* get( Handle< T > handle ) const
+  {
+    if( handle.is_null() || handle.index >= _slots.size() || _slots[ handle.index ].generation != handle.generation )
+      return nullptr;
+    return &_dense[ _slots[ handle.index ].dense ];
+  }
+
+  // the null handle if not found
+  Handle< T > find( NameHash name ) const
+  {
+    auto it = _names.find( name );
+    if( it == _names.end() )
+      return {};
+    return { it->second, _slots[ it->second ].generation };
+  }
+
+  // the name the resource was added with, 0 for the null handle and removed resources
+  NameHash get_name( Handle< T > handle ) const
+  {
+    if( !get( handle ) )
+      return 0;
+    return _denseSlots[ _slots[ handle.index ].dense ].name;
+  }
+
+  uint32_t size() const { return ( uint32_t )_dense.size(); }
+  T* begin() { return _dense.data(); }
+  T* end() { return _dense.data() + _dense.size(); }
+
+private:
+  static const uint32_t NullSlot = ~0u;
+
+  struct Slot
+  {
+    uint32_t dense;      // index into _dense, the next free slot while free
+    uint32_t generation; // bumped when the resource is removed
+  };
+
+  struct DenseSlot
+  {
+    uint32_t slot;
+    NameHash name;
+  };
+
+  std::vector< T > _dense;
+  std::vector< DenseSlot > _denseSlots; // parallel to _dense
+  std::vector< Slot > _slots;
+  uint32_t _freeSlot = NullSlot;
+  std::unordered_map< NameHash, uint32_t > _names; // slot of each name
+};
+
@@ -0,0 +1,942 @@
+﻿#include <vk_render_graph.h>
+#include <vk_initializers.h>
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+
+static const VkAccessFlags WriteAccessMask =
+  VK_ACCESS_SHADER_WRITE_BIT |
+  VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+  VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+  VK_ACCESS_TRANSFER_WRITE_BIT |
+  VK_ACCESS_HOST_WRITE_BIT |
+  VK_ACCESS_MEMORY_WRITE_BIT;
+
+static VkImageAspectFlags aspect_from_format( VkFormat format )
+{
+  switch( format )
+  {
+    case VK_FORMAT_D16_UNORM:
+    case VK_FORMAT_X8_D24_UNORM_PACK32:
+    case VK_FORMAT_D32_SFLOAT:
+      return VK_IMAGE_ASPECT_DEPTH_BIT;
+    case VK_FORMAT_D16_UNORM_S8_UINT:
+    case VK_FORMAT_D24_UNORM_S8_UINT:
+    case VK_FORMAT_D32_SFLOAT_S8_UINT:
+      return VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+    case VK_FORMAT_S8_UINT:
+      return VK_IMAGE_ASPECT_STENCIL_BIT;
+    default:
+      return VK_IMAGE_ASPECT_COLOR_BIT;
+  }
+}
+
+static const char* load_op_name( VkAttachmentLoadOp op )
+{
+  switch( op )
+  {
+    case VK_ATTACHMENT_LOAD_OP_LOAD: return "load";
+    case VK_ATTACHMENT_LOAD_OP_CLEAR: return "clear";
+    default: return "dont care";
+  }
+}
+
+// ---- Pass builder ---- //
+
+void RGPassBuilder::color_attachment( RGHandle handle, const VkClearColorValue* clear )
+{
+  _graph->add_access( _pass,
+                      handle,
+                      RenderGraph::AccessType::ColorAttachment,
+                      VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                      VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                      VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                      !clear,
+                      true );
+  if( clear )
+  {
+    _graph->_passes[ _pass ].accesses.back().clear = true;
+    _graph->_passes[ _pass ].accesses.back().clearValue.color = *clear;
+  }
+}
+
+void RGPassBuilder::depth_attachment( RGHandle handle, const VkClearDepthStencilValue* clear )
+{
+  _graph->add_access( _pass,
+                      handle,
+                      RenderGraph::AccessType::DepthAttachment,
+                      VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                      VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                      !clear,
+                      true );
+  if( clear )
+  {
+    _graph->_passes[ _pass ].accesses.back().clear = true;
+    _graph->_passes[ _pass ].accesses.back().clearValue.depthStencil = *clear;
+  }
+}
+
+void RGPassBuilder::sampled_image( RGHandle handle, VkPipelineStageFlags stages )
+{
+  _graph->add_access( _pass,
+                      handle,
+                      RenderGraph::AccessType::Sampled,
+                      stages,
+                      VK_ACCESS_SHADER_READ_BIT,
+                      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                      true,
+                      false );
+}
+
+void RGPassBuilder::storage_image( RGHandle handle, VkPipelineStageFlags stages, RGUsage usage )
+{
+  const bool write = usage != RGUsage::Read;
+  _graph->add_access( _pass,
+                      handle,
+                      RenderGraph::AccessType::Storage,
+                      stages,
+                      VK_ACCESS_SHADER_READ_BIT | ( write ? VK_ACCESS_SHADER_WRITE_BIT : 0 ),
+                      VK_IMAGE_LAYOUT_GENERAL,
+                      usage != RGUsage::Write,
+                      write );
+}
+
+void RGPassBuilder::storage_buffer( RGHandle handle, VkPipelineStageFlags stages, RGUsage usage )
+{
+  const bool write = usage != RGUsage::Read;
+  _graph->add_access( _pass,
+                      handle,
+                      RenderGraph::AccessType::Buffer,
+                      stages,
+                      VK_ACCESS_SHADER_READ_BIT | ( write ? VK_ACCESS_SHADER_WRITE_BIT : 0 ),
+                      VK_IMAGE_LAYOUT_UNDEFINED,
+                      usage != RGUsage::Write,
+                      write );
+}
+
+void RGPassBuilder::vertex_buffer( RGHandle handle )
+{
+  _graph->add_access( _pass,
+                      handle,
+                      RenderGraph::AccessType::Buffer,
+                      VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                      VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT,
+                      VK_IMAGE_LAYOUT_UNDEFINED,
+                      true,
+                      false );
+}
+
+void RGPassBuilder::indirect_buffer( RGHandle handle )
+{
+  _graph->add_access( _pass,
+                      handle,
+                      RenderGraph::AccessType::Buffer,
+                      VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                      VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+                      VK_IMAGE_LAYOUT_UNDEFINED,
+                      true,
+                      false );
+}
+
+void RGPassBuilder::transfer_write( RGHandle handle, RGUsage usage )
+{
+  const bool image = _graph->_resources[ handle ].type == RenderGraph::ResourceType::Image;
+  _graph->add_access( _pass,
+                      handle,
+                      image ? RenderGraph::AccessType::Storage : RenderGraph::AccessType::Buffer,
+                      VK_PIPELINE_STAGE_TRANSFER_BIT,
+                      VK_ACCESS_TRANSFER_WRITE_BIT,
+                      image ? VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED,
+                      usage != RGUsage::Write,
+                      true );
+}
+
+void RGPassBuilder::transfer_read( RGHandle handle )
+{
+  const bool image = _graph->_resources[ handle ].type == RenderGraph::ResourceType::Image;
+  _graph->add_access( _pass,
+                      handle,
+                      image ? RenderGraph::AccessType::Storage : RenderGraph::AccessType::Buffer,
+                      VK_PIPELINE_STAGE_TRANSFER_BIT,
+                      VK_ACCESS_TRANSFER_READ_BIT,
+                      image ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED,
+                      true,
+                      false );
+}
+
+void RGPassBuilder::secondary_command_buffers()
+{
+  assert( _graph->_passes[ _pass ].raster );
+  _graph->_passes[ _pass ].secondary = true;
+}
+
+// ---- Declaration ---- //
+
+RGHandle RenderGraph::import_image( const char* name,
+                                    const std::vector< VkImage >& variants,
+                                    const std::vector< VkImageView >& views,
+                                    const RGImageDesc& desc,
+                                    const RGImportDesc& importDesc )
+{
+  Resource resource;
+  resource.name = name;
+  resource.type = ResourceType::Image;
+  resource.imported = true;
+  resource.desc = desc;
+  resource.import = importDesc;
+  resource.images = variants;
+  resource.views = views;
+  resource.aspect = aspect_from_format( desc.format );
+  _resources.push_back( resource );
+  return ( RGHandle )_resources.size() - 1;
+}
+
+RGHandle RenderGraph::import_buffer( const char* name, VkBuffer buffer, const RGImportDesc& importDesc )
+{
+  Resource resource;
+  resource.name = name;
+  resource.type = ResourceType::Buffer;
+  resource.imported = true;
+  resource.import = importDesc;
+  resource.buffer = buffer;
+  _resources.push_back( resource );
+  return ( RGHandle )_resources.size() - 1;
+}
+
+RGHandle RenderGraph::create_image( const char* name, const RGImageDesc& desc )
+{
+  Resource resource;
+  resource.name = name;
+  resource.type = ResourceType::Image;
+  resource.imported = false;
+  resource.desc = desc;
+  resource.aspect = aspect_from_format( desc.format );
+  _resources.push_back( resource );
+  return ( RGHandle )_resources.size() - 1;
+}
+
+RGPass RenderGraph::add_raster_pass( const char* name, const SetupFn& setup, const ExecuteFn& execute )
+{
+  return add_pass( name, true, setup, execute );
+}
+
+RGPass RenderGraph::add_compute_pass( const char* name, const SetupFn& setup, const ExecuteFn& execute )
+{
+  return add_pass( name, false, setup, execute );
+}
+
+RGPass RenderGraph::add_pass( const char* name, bool raster, const SetupFn& setup, const ExecuteFn& execute )
+{
+  Pass pass;
+  pass.name = name;
+  pass.raster = raster;
+  pass.execute = execute;
+  _passes.push_back( pass );
+
+  RGPassBuilder builder( this, ( RGPass )_passes.size() - 1 );
+  setup( builder );
+  return builder._pass;
+}
+
+void RenderGraph::add_access( RGPass pass,
+                              RGHandle resource,
+                              AccessType type,
+                              VkPipelineStageFlags stages,
+                              VkAccessFlags access,
+                              VkImageLayout layout,
+                              bool read,
+                              bool write )
+{
+  // the same resource declared twice in a pass merges into one access
+  for( Access& existing : _passes[ pass ].accesses )
+  {
+    if( existing.resource != resource )
+      continue;
+    assert( existing.layout == layout && "a pass can only use an image in one layout" );
+    existing.stages |= stages;
+    existing.access |= access;
+    existing.read |= read;
+    existing.write |= write;
+    return;
+  }
+
+  Access a = {};
+  a.resource = resource;
+  a.type = type;
+  a.stages = stages;
+  a.access = access;
+  a.layout = layout;
+  a.read = read;
+  a.write = write;
+  a.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  a.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  a.finalLayout = layout;
+  _passes[ pass ].accesses.push_back( a );
+}
+
+bool RenderGraph::is_output( const Resource& resource ) const
+{
+  return resource.imported && resource.import.finalStages != 0;
+}
+
+// ---- Compile ---- //
+
+void RenderGraph::compile( VkDevice device, VmaAllocator allocator )
+{
+  _device = device;
+  _allocator = allocator;
+
+  cull_passes();
+  derive_attachment_ops();
+  create_images();
+  derive_barriers();
+  create_render_passes();
+}
+
+// Walks backwards from the outputs. A pass survives if it writes something a
+// later surviving pass ( or the outside ) reads.
+void RenderGraph::cull_passes()
+{
+  std::vector< bool > needed( _resources.size() );
+  for( size_t i = 0; i < _resources.size(); ++i )
+    needed[ i ] = is_output( _resources[ i ] );
+
+  for( int p = ( int )_passes.size() - 1; p >= 0; --p )
+  {
+    Pass& pass = _passes[ p ];
+    pass.culled = true;
+    for( const Access& a : pass.accesses )
+      if( a.write && needed[ a.resource ] )
+        pass.culled = false;
+    if( pass.culled )
+      continue;
+
+    // a full overwrite makes whatever came before irrelevant
+    for( const Access& a : pass.accesses )
+      if( a.write && !a.read )
+        needed[ a.resource ] = false;
+    for( const Access& a : pass.accesses )
+      if( a.read )
+        needed[ a.resource ] = true;
+  }
+}
+
+void RenderGraph::derive_attachment_ops()
+{
+  // loads: only attachments with something in them are worth loading
+  std::vector< bool > hasContents( _resources.size() );
+  for( size_t i = 0; i < _resources.size(); ++i )
+    hasContents[ i ] = _resources[ i ].imported && _resources[ i ].import.initialWriteAccess != 0;
+
+  for( int p = 0; p < ( int )_passes.size(); ++p )
+  {
+    Pass& pass = _passes[ p ];
+    if( pass.culled )
+      continue;
+    for( Access& a : pass.accesses )
+    {
+      Resource& resource = _resources[ a.resource ];
+      if( resource.firstPass < 0 )
+        resource.firstPass = p;
+      resource.lastPass = p;
+
+      if( a.type == AccessType::ColorAttachment || a.type == AccessType::DepthAttachment )
+      {
+        if( a.clear )
+          a.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        else if( hasContents[ a.resource ] )
+          a.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+        else
+          a.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+
+        a.read = a.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD;
+        if( a.read && a.type == AccessType::ColorAttachment )
+          a.access |= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
+      }
+      if( a.write )
+        hasContents[ a.resource ] = true;
+    }
+  }
+
+  // stores: only what the next user reads, or what leaves the graph
+  for( int p = 0; p < ( int )_passes.size(); ++p )
+  {
+    Pass& pass = _passes[ p ];
+    if( pass.culled )
+      continue;
+    for( Access& a : pass.accesses )
+    {
+      if( a.type != AccessType::ColorAttachment && a.type != AccessType::DepthAttachment )
+        continue;
+
+      bool store = is_output( _resources[ a.resource ] );
+      bool found = false;
+      for( int next = p + 1; next < ( int )_passes.size() && !found; ++next )
+      {
+        if( _passes[ next ].culled )
+          continue;
+        for( const Access& b : _passes[ next ].accesses )
+        {
+          if( b.resource != a.resource )
+            continue;
+          store = b.read;
+          found = true;
+        }
+      }
+      a.storeOp = store ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    }
+  }
+
+  // graph images that never leave a render pass don't need real memory
+  for( Resource& resource : _resources )
+  {
+    if( resource.imported || resource.type != ResourceType::Image || resource.firstPass < 0 )
+      continue;
+    resource.transient = true;
+    for( const Pass& pass : _passes )
+    {
+      if( pass.culled )
+        continue;
+      for( const Access& a : pass.accesses )
+      {
+        if( &_resources[ a.resource ] != &resource )
+          continue;
+        const bool attachment = a.type == AccessType::ColorAttachment || a.type == AccessType::DepthAttachment;
+        if( !attachment || a.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD || a.storeOp == VK_ATTACHMENT_STORE_OP_STORE )
+          resource.transient = false;
+      }
+    }
+  }
+}
+
+void RenderGraph::create_images()
+{
+  std::vector< RGHandle > images;
+  for( RGHandle h = 0; h < ( RGHandle )_resources.size(); ++h )
+  {
+    Resource& resource = _resources[ h ];
+    if( resource.imported || resource.type != ResourceType::Image || resource.firstPass < 0 )
+      continue;
+
+    for( const Pass& pass : _passes )
+    {
+      if( pass.culled )
+        continue;
+      for( const Access& a : pass.accesses )
+      {
+        if( a.resource != h )
+          continue;
+        switch( a.type )
+        {
+          case AccessType::ColorAttachment: resource.usage |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT; break;
+          case AccessType::DepthAttachment: resource.usage |= VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT; break;
+          case AccessType::Sampled: resource.usage |= VK_IMAGE_USAGE_SAMPLED_BIT; break;
+          case AccessType::Storage:
+            if( a.layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL )
+              resource.usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+            else if( a.layout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL )
+              resource.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+            else
+              resource.usage |= VK_IMAGE_USAGE_STORAGE_BIT;
+            break;
+          default: break;
+        }
+      }
+    }
+    if( resource.transient )
+      resource.usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+
+    VkImageCreateInfo info = vkinit::image_create_info( resource.desc.format,
+                                                        resource.usage,
+                                                        { resource.desc.extent.width, resource.desc.extent.height, 1 } );
+    info.mipLevels = resource.desc.mipLevels;
+    VkImage image;
+    VK_CHECK( vkCreateImage( _device, &info, nullptr, &image ) );
+    vkGetImageMemoryRequirements( _device, image, &resource.requirements );
+    resource.images = { image };
+    images.push_back( h );
+  }
+
+  // Alias memory, biggest images first. An image can join a slot if the memory
+  // types agree and it isn't alive at the same time as anything already in it.
+  std::sort( images.begin(), images.end(), [ & ]( RGHandle a, RGHandle b ) {
+    return _resources[ a ].requirements.size > _resources[ b ].requirements.size;
+  } );
+  for( RGHandle h : images )
+  {
+    Resource& resource = _resources[ h ];
+    int slotIndex = -1;
+    for( int s = 0; s < ( int )_memorySlots.size() && slotIndex < 0; ++s )
+    {
+      const MemorySlot& slot = _memorySlots[ s ];
+      if( slot.transient != resource.transient ||
+          !( slot.requirements.memoryTypeBits & resource.requirements.memoryTypeBits ) )
+        continue;
+      bool overlaps = false;
+      for( RGHandle other : slot.images )
+        overlaps |= resource.firstPass <= _resources[ other ].lastPass &&
+                    _resources[ other ].firstPass <= resource.lastPass;
+      if( !overlaps )
+        slotIndex = s;
+    }
+    if( slotIndex < 0 )
+    {
+      MemorySlot slot;
+      slot.requirements = resource.requirements;
+      slot.transient = resource.transient;
+      _memorySlots.push_back( slot );
+      slotIndex = ( int )_memorySlots.size() - 1;
+    }
+    MemorySlot& slot = _memorySlots[ slotIndex ];
+    slot.requirements.size = std::max( slot.requirements.size, resource.requirements.size );
+    slot.requirements.alignment = std::max( slot.requirements.alignment, resource.requirements.alignment );
+    slot.requirements.memoryTypeBits &= resource.requirements.memoryTypeBits;
+    slot.images.push_back( h );
+    resource.memorySlot = slotIndex;
+  }
+
+  for( MemorySlot& slot : _memorySlots )
+  {
+    VmaAllocationCreateInfo allocInfo = {};
+    allocInfo.usage = slot.transient ? VMA_MEMORY_USAGE_GPU_LAZILY_ALLOCATED : VMA_MEMORY_USAGE_GPU_ONLY;
+    VkResult result = vmaAllocateMemory( _allocator, &slot.requirements, &allocInfo, &slot.allocation, nullptr );
+
+    // desktop gpus usually have no lazily allocated memory, transient images still save bandwidth there
+    if( result != VK_SUCCESS && slot.transient )
+    {
+      allocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+      result = vmaAllocateMemory( _allocator, &slot.requirements, &allocInfo, &slot.allocation, nullptr );
+    }
+    VK_CHECK( result );
+    for( RGHandle h : slot.images )
+      VK_CHECK( vmaBindImageMemory( _allocator, slot.allocation, _resources[ h ].images[ 0 ] ) );
+  }
+
+  for( RGHandle h : images )
+  {
+    Resource& resource = _resources[ h ];
+    VkImageViewCreateInfo viewInfo = vkinit::image_view_create_info( resource.desc.format,
+                                                                     resource.images[ 0 ],
+                                                                     resource.aspect );
+    viewInfo.subresourceRange.levelCount = resource.desc.mipLevels;
+    VkImageView view;
+    VK_CHECK( vkCreateImageView( _device, &viewInfo, nullptr, &view ) );
+    resource.views = { view };
+
+    if( resource.desc.mipLevels > 1 )
+    {
+      resource.mipViews.resize( resource.desc.mipLevels );
+      for( uint32_t mip = 0; mip < resource.desc.mipLevels; ++mip )
+      {
+        viewInfo.subresourceRange.baseMipLevel = mip;
+        viewInfo.subresourceRange.levelCount = 1;
+        VK_CHECK( vkCreateImageView( _device, &viewInfo, nullptr, &resource.mipViews[ mip ] ) );
+      }
+    }
+  }
+}
+
+void RenderGraph::derive_barriers()
+{
+  // Graph images start each frame where the last frame left their memory. One
+  // dry run finds that state, the second one emits the barriers.
+  _slotStates.assign( _memorySlots.size(), SyncState() );
+  track_accesses( false );
+  track_accesses( true );
+}
+
+void RenderGraph::track_accesses( bool emit )
+{
+  std::vector< SyncState > states( _resources.size() );
+  std::vector< bool > started( _resources.size() );
+  std::vector< SyncState > slotStates = _slotStates;
+
+  auto begin_access = [ & ]( RGHandle h ) -> SyncState& {
+    SyncState& state = states[ h ];
+    if( started[ h ] )
+      return state;
+    started[ h ] = true;
+    const Resource& resource = _resources[ h ];
+    if( resource.imported )
+    {
+      // without contents the initial stages still have to finish first ( think acquire semaphores )
+      state.layout = resource.import.initialLayout;
+      state.writeAccess = resource.import.initialWriteAccess;
+      if( state.writeAccess )
+        state.writeStages = resource.import.initialStages;
+      else
+        state.readStages = resource.import.initialStages;
+    }
+    else
+    {
+      state = slotStates[ resource.memorySlot ];
+      state.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    }
+    return state;
+  };
+
+  for( int p = 0; p < ( int )_passes.size(); ++p )
+  {
+    Pass& pass = _passes[ p ];
+    if( pass.culled )
+      continue;
+    if( emit )
+    {
+      pass.srcStages = 0;
+      pass.dstStages = 0;
+      pass.memoryBarrier = vkinit::memory_barrier( 0, 0 );
+      pass.imageBarriers.clear();
+      pass.imageBarrierResources.clear();
+    }
+
+    for( Access& a : pass.accesses )
+    {
+      const Resource& resource = _resources[ a.resource ];
+      const bool image = resource.type == ResourceType::Image;
+      SyncState& state = begin_access( a.resource );
+
+      // reads without a layout change only wait for the last write, and only once per stage
+      const bool layoutChange = image && state.layout != a.layout;
+      VkPipelineStageFlags srcStages = 0;
+      VkAccessFlags srcAccess = 0;
+      bool needBarrier = false;
+      if( a.write || layoutChange )
+      {
+        srcStages = state.writeStages | state.readStages;
+        srcAccess = state.writeAccess;
+        needBarrier = srcStages != 0 || layoutChange;
+      }
+      else if( state.writeStages &&
+               ( ( state.readStages & a.stages ) != a.stages || ( state.readAccess & a.access ) != a.access ) )
+      {
+        srcStages = state.writeStages;
+        srcAccess = state.writeAccess;
+        needBarrier = true;
+      }
+
+      if( emit && needBarrier )
+      {
+        pass.srcStages |= srcStages ? srcStages : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        pass.dstStages |= a.stages;
+        if( image )
+        {
+          // old contents we don't read can be discarded
+          VkImageLayout oldLayout = a.read ? state.layout : VK_IMAGE_LAYOUT_UNDEFINED;
+          pass.imageBarriers.push_back( vkinit::image_barrier( VK_NULL_HANDLE,
+                                                               srcAccess,
+                                                               a.access,
+                                                               oldLayout,
+                                                               a.layout,
+                                                               resource.aspect ) );
+          pass.imageBarrierResources.push_back( a.resource );
+        }
+        else
+        {
+          pass.memoryBarrier.srcAccessMask |= srcAccess;
+          pass.memoryBarrier.dstAccessMask |= a.access;
+        }
+      }
+
+      if( a.write )
+      {
+        state.writeStages = a.stages;
+        state.writeAccess = a.access & WriteAccessMask;
+        state.readStages = 0;
+        state.readAccess = 0;
+      }
+      else if( layoutChange )
+      {
+        // the transition is a write that the barrier already made visible to these stages
+        state.writeStages = a.stages;
+        state.writeAccess = 0;
+        state.readStages = a.stages;
+        state.readAccess = a.access;
+      }
+      else
+      {
+        state.readStages |= a.stages;
+        state.readAccess |= a.access;
+      }
+      state.layout = a.layout;
+
+      // presentation is the only outside user that a render pass final layout can hand over to
+      a.finalLayout = a.layout;
+      if( pass.raster && p == resource.lastPass && is_output( resource ) &&
+          resource.import.finalStages == VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT &&
+          resource.import.finalLayout != VK_IMAGE_LAYOUT_UNDEFINED )
+      {
+        a.finalLayout = resource.import.finalLayout;
+        state.layout = a.finalLayout;
+      }
+
+      if( !resource.imported && p == resource.lastPass )
+        slotStates[ resource.memorySlot ] = state;
+    }
+  }
+
+  if( !emit )
+  {
+    _slotStates = slotStates;
+    return;
+  }
+
+  // hand the outputs over to whoever uses them after the graph
+  _finalSrcStages = 0;
+  _finalDstStages = 0;
+  _finalMemoryBarrier = vkinit::memory_barrier( 0, 0 );
+  _finalImageBarriers.clear();
+  _finalImageBarrierResources.clear();
+  for( RGHandle h = 0; h < ( RGHandle )_resources.size(); ++h )
+  {
+    const Resource& resource = _resources[ h ];
+    if( !is_output( resource ) || !started[ h ] )
+      continue;
+    const SyncState& state = states[ h ];
+    const bool image = resource.type == ResourceType::Image;
+    const bool layoutChange = image &&
+                              resource.import.finalLayout != VK_IMAGE_LAYOUT_UNDEFINED &&
+                              resource.import.finalLayout != state.layout;
+    if( !layoutChange && ( !state.writeStages || resource.import.finalStages == VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT ) )
+      continue;
+
+    _finalSrcStages |= state.writeStages | state.readStages;
+    _finalDstStages |= resource.import.finalStages;
+    if( image )
+    {
+      _finalImageBarriers.push_back( vkinit::image_barrier( VK_NULL_HANDLE,
+                                                            state.writeAccess,
+                                                            resource.import.finalAccess,
+                                                            state.layout,
+                                                            layoutChange ? resource.import.finalLayout : state.layout,
+                                                            resource.aspect ) );
+      _finalImageBarrierResources.push_back( h );
+    }
+    else
+    {
+      _finalMemoryBarrier.srcAccessMask |= state.writeAccess;
+      _finalMemoryBarrier.dstAccessMask |= resource.import.finalAccess;
+    }
+  }
+}
+
+void RenderGraph::create_render_passes()
+{
+  for( Pass& pass : _passes )
+  {
+    if( pass.culled || !pass.raster )
+      continue;
+
+    std::vector< VkAttachmentDescription > attachments;
+    std::vector< VkAttachmentReference > colorRefs;
+    VkAttachmentReference depthRef = {};
+    bool hasDepth = false;
+    uint32_t variantCount = 1;
+    std::vector< RGHandle > attachmentResources;
+    for( const Access& a : pass.accesses )
+    {
+      if( a.type != AccessType::ColorAttachment && a.type != AccessType::DepthAttachment )
+        continue;
+      const Resource& resource = _resources[ a.resource ];
+      const bool hasStencil = ( resource.aspect & VK_IMAGE_ASPECT_STENCIL_BIT ) != 0;
+
+      VkAttachmentDescription attachment = {};
+      attachment.format = resource.desc.format;
+      attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+      attachment.loadOp = a.loadOp;
+      attachment.storeOp = a.storeOp;
+      attachment.stencilLoadOp = hasStencil ? a.loadOp : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+      attachment.stencilStoreOp = hasStencil ? a.storeOp : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+
+      // the barriers before the pass already put it in the right layout
+      attachment.initialLayout = a.layout;
+      attachment.finalLayout = a.finalLayout;
+
+      VkAttachmentReference ref = { ( uint32_t )attachments.size(), a.layout };
+      if( a.type == AccessType::ColorAttachment )
+        colorRefs.push_back( ref );
+      else
+      {
+        depthRef = ref;
+        hasDepth = true;
+      }
+      attachments.push_back( attachment );
+      attachmentResources.push_back( a.resource );
+      pass.clearValues.push_back( a.clearValue );
+      pass.extent = resource.desc.extent;
+      variantCount = std::max( variantCount, ( uint32_t )resource.views.size() );
+    }
+
+    VkSubpassDescription subpass = {};
+    subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass.colorAttachmentCount = ( uint32_t )colorRefs.size();
+    subpass.pColorAttachments = colorRefs.data();
+    subpass.pDepthStencilAttachment = hasDepth ? &depthRef : nullptr;
+
+    VkRenderPassCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    info.attachmentCount = ( uint32_t )attachments.size();
+    info.pAttachments = attachments.data();
+    info.subpassCount = 1;
+    info.pSubpasses = &subpass;
+    VK_CHECK( vkCreateRenderPass( _device, &info, nullptr, &pass.renderPass ) );
+
+    pass.framebuffers.resize( variantCount );
+    for( uint32_t variant = 0; variant < variantCount; ++variant )
+    {
+      std::vector< VkImageView > views;
+      for( RGHandle h : attachmentResources )
+        views.push_back( get_image_view( h, variant ) );
+      VkFramebufferCreateInfo fbInfo = {};
+      fbInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+      fbInfo.renderPass = pass.renderPass;
+      fbInfo.attachmentCount = ( uint32_t )views.size();
+      fbInfo.pAttachments = views.data();
+      fbInfo.width = pass.extent.width;
+      fbInfo.height = pass.extent.height;
+      fbInfo.layers = 1;
+      VK_CHECK( vkCreateFramebuffer( _device, &fbInfo, nullptr, &pass.framebuffers[ variant ] ) );
+    }
+  }
+}
+
+// ---- Execute ---- //
+
+void RenderGraph::execute( VkCommandBuffer cmd, uint32_t variant )
+{
+  execute( cmd, variant, 0, ( RGPass )_passes.size() );
+}
+
+void RenderGraph::execute( VkCommandBuffer cmd, uint32_t variant, RGPass first, RGPass end )
+{
+  auto emit_barriers = [ & ]( VkPipelineStageFlags src,
+                              VkPipelineStageFlags dst,
+                              const VkMemoryBarrier& memory,
+                              const std::vector< VkImageMemoryBarrier >& images,
+                              const std::vector< RGHandle >& resources ) {
+    if( !dst )
+      return;
+    _scratchBarriers = images;
+    for( size_t i = 0; i < images.size(); ++i )
+      _scratchBarriers[ i ].image = get_image( resources[ i ], variant );
+    const bool hasMemory = memory.srcAccessMask || memory.dstAccessMask;
+    vkCmdPipelineBarrier( cmd,
+                          src,
+                          dst,
+                          0,
+                          hasMemory ? 1 : 0, hasMemory ? &memory : nullptr,
+                          0, nullptr,
+                          ( uint32_t )_scratchBarriers.size(), _scratchBarriers.data() );
+  };
+
+  for( RGPass p = first; p < end; ++p )
+  {
+    Pass& pass = _passes[ p ];
+    if( pass.culled )
+      continue;
+    emit_barriers( pass.srcStages, pass.dstStages, pass.memoryBarrier, pass.imageBarriers, pass.imageBarrierResources );
+
+    if( !pass.raster )
+    {
+      pass.execute( cmd );
+      continue;
+    }
+
+    VkRenderPassBeginInfo rpInfo = vkinit::renderpass_begin_info( pass.renderPass,
+                                                                  pass.extent,
+                                                                  pass.framebuffers[ variant % pass.framebuffers.size() ] );
+    rpInfo.clearValueCount = ( uint32_t )pass.clearValues.size();
+    rpInfo.pClearValues = pass.clearValues.data();
+    vkCmdBeginRenderPass( cmd,
+                          &rpInfo,
+                          pass.secondary ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE );
+    pass.execute( cmd );
+    vkCmdEndRenderPass( cmd );
+  }
+
+  if( end == _passes.size() )
+    emit_barriers( _finalSrcStages, _finalDstStages, _finalMemoryBarrier, _finalImageBarriers, _finalImageBarrierResources );
+}
+
+VkImage RenderGraph::get_image( RGHandle handle, uint32_t variant ) const
+{
+  const Resource& resource = _resources[ handle ];
+  return resource.images[ variant % resource.images.size() ];
+}
+
+VkImageView RenderGraph::get_image_view( RGHandle handle, uint32_t variant ) const
+{
+  const Resource& resource = _resources[ handle ];
+  return resource.views[ variant % resource.views.size() ];
+}
+
+std::vector< VmaAllocation > RenderGraph::get_allocations() const
+{
+  std::vector< VmaAllocation > allocations;
+  for( const MemorySlot& slot : _memorySlots )
+    allocations.push_back( slot.allocation );
+  return allocations;
+}
+
+void RenderGraph::destroy()
+{
+  for( Pass& pass : _passes )
+  {
+    for( VkFramebuffer framebuffer : pass.framebuffers )
+      vkDestroyFramebuffer( _device, framebuffer, nullptr );
+    if( pass.renderPass )
+      vkDestroyRenderPass( _device, pass.renderPass, nullptr );
+  }
+  for( Resource& resource : _resources )
+  {
+    if( resource.imported || resource.images.empty() )
+      continue;
+    for( VkImageView view : resource.mipViews )
+      vkDestroyImageView( _device, view, nullptr );
+    vkDestroyImageView( _device, resource.views[ 0 ], nullptr );
+    vkDestroyImage( _device, resource.images[ 0 ], nullptr );
+  }
+  for( MemorySlot& slot : _memorySlots )
+    vmaFreeMemory( _allocator, slot.allocation );
+  _passes.clear();
+  _resources.clear();
+  _memorySlots.clear();
+}
+
+void RenderGraph::print_summary() const
+{
+  for( const Pass& pass : _passes )
+  {
+    std::cout << ( pass.culled ? "  culled " : "  pass   " ) << pass.name << std::endl;
+    if( pass.culled )
+      continue;
+    for( const Access& a : pass.accesses )
+    {
+      if( a.type != AccessType::ColorAttachment && a.type != AccessType::DepthAttachment )
+        continue;
+      std::cout << "           " << _resources[ a.resource ].name
+                << " load " << load_op_name( a.loadOp )
+                << " store " << ( a.storeOp == VK_ATTACHMENT_STORE_OP_STORE ? "store" : "dont care" )
+                << std::endl;
+    }
+  }
+
+  VkDeviceSize imageBytes = 0;
+  VkDeviceSize allocatedBytes = 0;
+  for( const Resource& resource : _resources )
+  {
+    if( resource.imported || resource.memorySlot < 0 )
+      continue;
+    imageBytes += resource.requirements.size;
+    std::cout << "  image  " << resource.name
+              << " " << resource.requirements.size / 1024 << " KiB"
+              << " slot " << resource.memorySlot
+              << ( resource.transient ? " transient" : "" ) << std::endl;
+  }
+  for( const MemorySlot& slot : _memorySlots )
+    allocatedBytes += slot.requirements.size;
+  std::cout << "  graph images " << imageBytes / 1024 << " KiB, allocated "
+            << allocatedBytes / 1024 << " KiB after aliasing" << std::endl;
+}
+
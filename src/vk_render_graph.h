@@ -0,0 +1,244 @@
+﻿#pragma once
+
+#include <vk_types.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Frame graph. Passes declare which resources they read and write, then
+// compile() works out everything that used to be written by hand:
+//
+// - passes whose results nobody uses are culled
+// - attachment load / store ops ( clear, load what an earlier pass wrote,
+//   store only what a later pass or the outside world reads )
+// - image layout transitions and the pipeline barriers between passes
+// - images owned by the graph are created with the usage they need, attachments
+//   that never leave their render pass become transient ( lazily allocated ) and
+//   images whose lifetimes don't overlap share memory
+//
+// The graph is compiled once and replayed every frame by execute(). Imported
+// resources can have several variants ( one per swapchain image ), execute picks one.
+using RGHandle = uint32_t;
+using RGPass = uint32_t;
+
+struct RGImageDesc
+{
+  VkFormat format = VK_FORMAT_UNDEFINED;
+  VkExtent2D extent = {};
+  uint32_t mipLevels = 1;
+};
+
+// State of an imported resource at the start and end of the graph
+struct RGImportDesc
+{
+  // stages and writes of whoever touched it before the graph. If there are no
+  // previous contents worth keeping, leave initialWriteAccess at 0.
+  VkImageLayout initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkPipelineStageFlags initialStages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+  VkAccessFlags initialWriteAccess = 0;
+
+  // layout and access it must be in for whoever reads it after the graph.
+  // Imports with a final stage count as graph outputs and are never culled.
+  VkImageLayout finalLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkPipelineStageFlags finalStages = 0;
+  VkAccessFlags finalAccess = 0;
+};
+
+class RenderGraph;
+
+enum class RGUsage
+{
+  Read,
+  Write,     // the pass produces the whole contents, what was there before doesn't matter
+  ReadWrite,
+};
+
+class RGPassBuilder
+{
+public:
+  // Clearing is the only way to say the old contents don't matter, otherwise the
+  // attachment is loaded if anything before wrote it.
+  void color_attachment( RGHandle, const VkClearColorValue* clear = nullptr );
+  void depth_attachment( RGHandle, const VkClearDepthStencilValue* clear = nullptr );
+
+  void sampled_image( RGHandle, VkPipelineStageFlags );
+  void storage_image( RGHandle, VkPipelineStageFlags, RGUsage );
+  void storage_buffer( RGHandle, VkPipelineStageFlags, RGUsage );
+  void vertex_buffer( RGHandle );
+  void indirect_buffer( RGHandle );
+  // ReadWrite for copies that only update part of the resource
+  void transfer_write( RGHandle, RGUsage usage = RGUsage::Write );
+  void transfer_read( RGHandle );
+
+  // Raster passes only. The render pass is begun for secondary command buffers,
+  // execute records nothing itself and only calls vkCmdExecuteCommands.
+  void secondary_command_buffers();
+
+private:
+  friend class RenderGraph;
+  RGPassBuilder( RenderGraph* graph, RGPass pass ) : _graph( graph ), _pass( pass ) {}
+  RenderGraph* _graph;
+  RGPass _pass;
+};
+
+class RenderGraph
+{
+public:
+  using SetupFn = std::function< void( RGPassBuilder& ) >;
+  using ExecuteFn = std::function< void( VkCommandBuffer ) >;
+
+  RGHandle import_image( const char* name,
+                         const std::vector< VkImage >& variants,
+                         const std::vector< VkImageView >& views,
+                         const RGImageDesc&,
+                         const RGImportDesc& );
+  RGHandle import_buffer( const char* name, VkBuffer, const RGImportDesc& );
+  RGHandle create_image( const char* name, const RGImageDesc& );
+
+  // Raster passes get one subpass with the attachments they declared. The render
+  // pass is begun and ended by the graph, execute only records the draws.
+  RGPass add_raster_pass( const char* name, const SetupFn&, const ExecuteFn& );
+  RGPass add_compute_pass( const char* name, const SetupFn&, const ExecuteFn& );
+
+  void compile( VkDevice, VmaAllocator );
+  void execute( VkCommandBuffer, uint32_t variant = 0 );
+
+  // Records the passes in [ first, end ), to split a frame over several submissions
+  // on the same queue. The barriers between passes still hold across submissions,
+  // the final ones are recorded with the last pass.
+  void execute( VkCommandBuffer, uint32_t variant, RGPass first, RGPass end );
+  void destroy();
+
+  // valid after compile
+  VkRenderPass get_render_pass( RGPass pass ) const { return _passes[ pass ].renderPass; }
+  bool is_pass_culled( RGPass pass ) const { return _passes[ pass ].culled; }
+  RGPass get_pass_count() const { return ( RGPass )_passes.size(); }
+  VkImage get_image( RGHandle handle, uint32_t variant = 0 ) const;
+  uint32_t get_variant_count( RGHandle handle ) const { return ( uint32_t )_resources[ handle ].images.size(); }
+  VkImageView get_image_view( RGHandle handle, uint32_t variant = 0 ) const;
+  VkImageView get_mip_view( RGHandle handle, uint32_t mip ) const { return _resources[ handle ].mipViews[ mip ]; }
+  std::vector< VmaAllocation > get_allocations() const;
+
+  // pass order, attachment ops and memory use, for checking what compile decided
+  void print_summary() const;
+
+private:
+  friend class RGPassBuilder;
+
+  enum class ResourceType { Image, Buffer };
+
+  enum class AccessType
+  {
+    ColorAttachment,
+    DepthAttachment,
+    Sampled,
+    Storage,
+    Buffer, // storage, vertex, indirect or transfer
+  };
+
+  struct Access
+  {
+    RGHandle resource;
+    AccessType type;
+    VkPipelineStageFlags stages;
+    VkAccessFlags access;
+    VkImageLayout layout;
+    bool read;
+    bool write;
+    bool clear;
+    VkClearValue clearValue;
+
+    // attachments, filled in by compile
+    VkAttachmentLoadOp loadOp;
+    VkAttachmentStoreOp storeOp;
+    VkImageLayout finalLayout;
+  };
+
+  struct Resource
+  {
+    std::string name;
+    ResourceType type;
+    bool imported;
+    RGImageDesc desc;
+    RGImportDesc import;
+    std::vector< VkImage > images; // one per variant
+    std::vector< VkImageView > views;
+    std::vector< VkImageView > mipViews; // graph owned images with mips only
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VkImageUsageFlags usage = 0;
+    VkImageAspectFlags aspect = 0;
+    VkMemoryRequirements requirements = {};
+
+    // compile results
+    int firstPass = -1;
+    int lastPass = -1;
+    bool transient = false;
+    int memorySlot = -1;
+  };
+
+  struct Pass
+  {
+    std::string name;
+    bool raster;
+    ExecuteFn execute;
+    std::vector< Access > accesses;
+    bool culled = false;
+    bool secondary = false; // contents come from secondary command buffers
+
+    // compile results
+    VkPipelineStageFlags srcStages = 0;
+    VkPipelineStageFlags dstStages = 0;
+    VkMemoryBarrier memoryBarrier = {};
+    std::vector< VkImageMemoryBarrier > imageBarriers; // .image patched per variant
+    std::vector< RGHandle > imageBarrierResources;
+    VkRenderPass renderPass = VK_NULL_HANDLE;
+    std::vector< VkFramebuffer > framebuffers; // one per variant
+    std::vector< VkClearValue > clearValues;
+    VkExtent2D extent = {};
+  };
+
+  // where a resource ( or the memory under it ) was last touched
+  struct SyncState
+  {
+    VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkPipelineStageFlags writeStages = 0;
+    VkAccessFlags writeAccess = 0;
+    VkPipelineStageFlags readStages = 0;
+    VkAccessFlags readAccess = 0;
+  };
+
+  struct MemorySlot
+  {
+    VkMemoryRequirements requirements;
+    VmaAllocation allocation = VK_NULL_HANDLE;
+    std::vector< RGHandle > images;
+    bool transient = false;
+  };
+
+  RGPass add_pass( const char* name, bool raster, const SetupFn&, const ExecuteFn& );
+  void add_access( RGPass, RGHandle, AccessType, VkPipelineStageFlags, VkAccessFlags, VkImageLayout, bool read, bool write );
+  bool is_output( const Resource& ) const;
+
+  void cull_passes();
+  void derive_attachment_ops();
+  void create_images();
+  void derive_barriers();
+  void track_accesses( bool emit );
+  void create_render_passes();
+
+  std::vector< Resource > _resources;
+  std::vector< Pass > _passes;
+  std::vector< MemorySlot > _memorySlots;
+  std::vector< SyncState > _slotStates; // memory slot state at the end of the frame
+  std::vector< VkImageMemoryBarrier > _finalImageBarriers;
+  std::vector< RGHandle > _finalImageBarrierResources;
+  VkMemoryBarrier _finalMemoryBarrier = {};
+  VkPipelineStageFlags _finalSrcStages = 0;
+  VkPipelineStageFlags _finalDstStages = 0;
+  std::vector< VkImageMemoryBarrier > _scratchBarriers;
+
+  VkDevice _device = VK_NULL_HANDLE;
+  VmaAllocator _allocator = VK_NULL_HANDLE;
+};
+
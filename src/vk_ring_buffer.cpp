@@ -0,0 +1,79 @@
+﻿#include <vk_ring_buffer.h>
+#include <vk_initializers.h>
+
+#include <algorithm>
+#include <cassert>
+
+void RingBuffer::init( VmaAllocator allocator,
+                       VkDeviceSize regionSize,
+                       uint32_t regionCount,
+                       VkBufferUsageFlags usage,
+                       VkDeviceSize alignment )
+{
+  _allocator = allocator;
+  _alignment = std::max< VkDeviceSize >( alignment, 1 );
+  _regionSize = ( regionSize + _alignment - 1 ) / _alignment * _alignment;
+  _regionCount = regionCount;
+
+  // mapped for its whole life, vma keeps the pointer
+  VkBufferCreateInfo bufferInfo = vkinit::buffer_create_info( _regionSize * _regionCount, usage );
+  VmaAllocationCreateInfo vmaAllocInfo = {};
+  vmaAllocInfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+  vmaAllocInfo.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+  VmaAllocationInfo info;
+  VK_CHECK( vmaCreateBuffer( _allocator,
+                             &bufferInfo,
+                             &vmaAllocInfo,
+                             &_buffer._buffer,
+                             &_buffer._allocation,
+                             &info ) );
+  _mapped = ( char* )info.pMappedData;
+}
+
+void RingBuffer::destroy()
+{
+  vmaDestroyBuffer( _allocator, _buffer._buffer, _buffer._allocation );
+  _buffer = {};
+  _mapped = nullptr;
+}
+
+void RingBuffer::begin_frame( uint32_t region )
+{
+  assert( region < _regionCount );
+  _regionStart = region * _regionSize;
+  _head = 0;
+}
+
+RingAllocation RingBuffer::allocate( VkDeviceSize size )
+{
+  return allocate( size, _alignment );
+}
+
+RingAllocation RingBuffer::allocate( VkDeviceSize size, VkDeviceSize alignment )
+{
+  const VkDeviceSize offset = ( _head + alignment - 1 ) / alignment * alignment;
+  if( offset + size > _regionSize )
+    return {};
+  _head = offset + size;
+  _peakUsage = std::max( _peakUsage, _head );
+
+  RingAllocation allocation;
+  allocation.data = _mapped + _regionStart + offset;
+  allocation.buffer = _buffer._buffer;
+  allocation.offset = _regionStart + offset;
+  allocation.size = size;
+  return allocation;
+}
+
+void RingBuffer::rewind( const RingAllocation& allocation )
+{
+  assert( allocation.data && allocation.offset >= _regionStart && allocation.offset - _regionStart <= _head );
+  _head = allocation.offset - _regionStart;
+}
+
+void RingBuffer::flush()
+{
+  if( _head > 0 )
+    VK_CHECK( vmaFlushAllocation( _allocator, _buffer._allocation, _regionStart, _head ) );
+}
+
@@ -0,0 +1,63 @@
+﻿#pragma once
+
+#include <vk_types.h>
+
+// A sub allocation of the ring, data is where the cpu writes it
+struct RingAllocation
+{
+  void* data = nullptr;
+  VkBuffer buffer = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+};
+
+// Persistently mapped buffer for data the cpu writes every frame: uniforms,
+// instance data, dynamic vertices. Split into one region per frame in flight,
+// allocations bump a pointer through the region of the frame being recorded.
+//
+// A region is reused once the fence of the frame that filled it signalled, so
+// nothing is ever freed and writing the data is the only cost.
+class RingBuffer
+{
+public:
+  // alignment is the default for allocate, usually the largest of the uniform
+  // and storage buffer offset alignments so any allocation can be bound
+  void init( VmaAllocator,
+             VkDeviceSize regionSize,
+             uint32_t regionCount,
+             VkBufferUsageFlags,
+             VkDeviceSize alignment );
+  void destroy();
+
+  // Starts filling the given region. The frame that used it last must have finished.
+  void begin_frame( uint32_t region );
+
+  // Returns an allocation with a null data pointer when the region is full, the
+  // caller has to leave out whatever needed it. Nothing is allocated then.
+  RingAllocation allocate( VkDeviceSize size );
+  RingAllocation allocate( VkDeviceSize size, VkDeviceSize alignment );
+  // gives back the allocation and everything allocated after it this frame
+  void rewind( const RingAllocation& );
+
+  // makes this frame's writes visible to the gpu, before submit. Free on coherent memory.
+  void flush();
+
+  VkBuffer get_buffer() const { return _buffer._buffer; }
+  VmaAllocation get_allocation() const { return _buffer._allocation; }
+  VkDeviceSize get_region_size() const { return _regionSize; }
+  VkDeviceSize get_region_offset() const { return _regionStart; } // of the region being filled
+  VkDeviceSize get_peak_usage() const { return _peakUsage; }
+
+private:
+  VmaAllocator _allocator = VK_NULL_HANDLE;
+  AllocatedBuffer _buffer = {};
+  char* _mapped = nullptr;
+  VkDeviceSize _regionSize = 0;
+  uint32_t _regionCount = 0;
+  VkDeviceSize _alignment = 1;
+
+  VkDeviceSize _regionStart = 0;
+  VkDeviceSize _head = 0; // relative to the region start
+  VkDeviceSize _peakUsage = 0;
+};
+
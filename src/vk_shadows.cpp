@@ -0,0 +1,155 @@
+﻿#include <vk_shadows.h>
+
+#include <glm/gtc/matrix_transform.hpp>
+#include <cassert>
+#include <cstdlib>
+
+// also right for negative texels, n is a power of two
+static int wrap( int texel, int n )
+{
+  return texel & ( n - 1 );
+}
+
+void ShadowCache::init( uint32_t resolution, const std::array< float, CascadeCount >& extents, float depthRange )
+{
+  assert( ( resolution & ( resolution - 1 ) ) == 0 );
+  _resolution = resolution;
+  _depthRange = depthRange;
+  for( uint32_t c = 0; c < CascadeCount; ++c )
+    _texelSizes[ c ] = extents[ c ] / resolution;
+  _allDirty = true;
+}
+
+void ShadowCache::update( const glm::vec3& lightDirection, const glm::vec3& cameraPosition )
+{
+  const glm::vec3 direction = glm::normalize( lightDirection );
+  if( direction != _lightDirection )
+  {
+    _lightDirection = direction;
+    const glm::vec3 up = std::abs( direction.y ) > 0.99f ? glm::vec3( 1, 0, 0 ) : glm::vec3( 0, 1, 0 );
+    _lightView = glm::lookAt( glm::vec3( 0 ), direction, up );
+    _allDirty = true;
+  }
+
+  _tiles.clear();
+  _updatedCascades = 0;
+  const int n = ( int )_resolution;
+  const glm::vec2 camera = glm::vec2( _lightView * glm::vec4( cameraPosition, 1 ) );
+  for( uint32_t c = 0; c < CascadeCount; ++c )
+  {
+    const glm::ivec2 origin = glm::ivec2( glm::floor( camera / _texelSizes[ c ] ) ) - n / 2;
+    const glm::ivec2 delta = origin - _origins[ c ];
+    const glm::ivec2 old = _origins[ c ];
+    _origins[ c ] = origin;
+
+    std::vector< TexelRect >& dirty = _dirty[ c ];
+    if( _allDirty || std::abs( delta.x ) >= n || std::abs( delta.y ) >= n )
+    {
+      dirty.clear();
+      dirty.push_back( get_window_rect( c ) );
+    }
+    else
+    {
+      // the strips that scrolled into view, what stayed in view is still valid
+      if( delta.x > 0 )
+        dirty.push_back( { { old.x + n, origin.y }, { origin.x + n, origin.y + n } } );
+      if( delta.x < 0 )
+        dirty.push_back( { { origin.x, origin.y }, { old.x, origin.y + n } } );
+      if( delta.y > 0 )
+        dirty.push_back( { { origin.x, old.y + n }, { origin.x + n, origin.y + n } } );
+      if( delta.y < 0 )
+        dirty.push_back( { { origin.x, origin.y }, { origin.x + n, old.y } } );
+    }
+
+    // invalidations outside the window are forgotten, the texels are rendered when they scroll in
+    const TexelRect window = get_window_rect( c );
+    const size_t tileCount = _tiles.size();
+    for( const TexelRect& rect : dirty )
+    {
+      const TexelRect clipped = { glm::max( rect.min, window.min ), glm::min( rect.max, window.max ) };
+      if( clipped.min.x < clipped.max.x && clipped.min.y < clipped.max.y )
+        add_tiles( c, clipped );
+    }
+    dirty.clear();
+    if( _tiles.size() > tileCount )
+      _updatedCascades++;
+  }
+  _allDirty = false;
+}
+
+void ShadowCache::invalidate( const AABB& bounds )
+{
+  if( _allDirty || bounds.is_empty() )
+    return;
+
+  // a texel of margin for the filtering
+  const AABB lightBounds = transform_aabb( bounds, _lightView );
+  for( uint32_t c = 0; c < CascadeCount; ++c )
+  {
+    const glm::ivec2 min = glm::ivec2( glm::floor( glm::vec2( lightBounds.min ) / _texelSizes[ c ] ) ) - 1;
+    const glm::ivec2 max = glm::ivec2( glm::floor( glm::vec2( lightBounds.max ) / _texelSizes[ c ] ) ) + 2;
+    _dirty[ c ].push_back( { min, max } );
+  }
+}
+
+ShadowTile ShadowCache::get_window( uint32_t cascade ) const
+{
+  ShadowTile tile;
+  tile.cascade = cascade;
+  tile.rect = { { ( int32_t )( cascade * _resolution ), 0 }, { _resolution, _resolution } };
+  tile.viewProj = get_view_proj( cascade, get_window_rect( cascade ) );
+  return tile;
+}
+
+glm::vec4 ShadowCache::get_cascade_params( uint32_t cascade ) const
+{
+  return glm::vec4( _origins[ cascade ].x, _origins[ cascade ].y, _texelSizes[ cascade ], 0 );
+}
+
+ShadowCache::TexelRect ShadowCache::get_window_rect( uint32_t cascade ) const
+{
+  const glm::ivec2 origin = _origins[ cascade ];
+  return { origin, origin + ( int )_resolution };
+}
+
+glm::mat4 ShadowCache::get_view_proj( uint32_t cascade, const TexelRect& rect ) const
+{
+  // light space y grows with the atlas rows, depth is 0 at -_depthRange along the light
+  const float s = _texelSizes[ cascade ];
+  return glm::orthoRH_ZO( rect.min.x * s, rect.max.x * s, rect.min.y * s, rect.max.y * s, -_depthRange, _depthRange ) *
+         _lightView;
+}
+
+void ShadowCache::add_tiles( uint32_t cascade, const TexelRect& rect )
+{
+  // No larger than the window, so it crosses at most one wrap boundary per axis.
+  // Each piece is rendered with its own projection into its place in the atlas.
+  const int n = ( int )_resolution;
+  auto split = [ n ]( int lo, int hi, std::array< glm::ivec2, 2 >& out ) {
+    const int boundary = lo - wrap( lo, n ) + n;
+    if( hi <= boundary )
+    {
+      out[ 0 ] = { lo, hi };
+      return 1;
+    }
+    out[ 0 ] = { lo, boundary };
+    out[ 1 ] = { boundary, hi };
+    return 2;
+  };
+  std::array< glm::ivec2, 2 > xs, ys;
+  const int xCount = split( rect.min.x, rect.max.x, xs );
+  const int yCount = split( rect.min.y, rect.max.y, ys );
+  for( int x = 0; x < xCount; ++x )
+  {
+    for( int y = 0; y < yCount; ++y )
+    {
+      const TexelRect piece = { { xs[ x ].x, ys[ y ].x }, { xs[ x ].y, ys[ y ].y } };
+      ShadowTile tile;
+      tile.cascade = cascade;
+      tile.rect.offset = { ( int32_t )cascade * n + wrap( piece.min.x, n ), wrap( piece.min.y, n ) };
+      tile.rect.extent = { ( uint32_t )( piece.max.x - piece.min.x ), ( uint32_t )( piece.max.y - piece.min.y ) };
+      tile.viewProj = get_view_proj( cascade, piece );
+      _tiles.push_back( tile );
+    }
+  }
+}
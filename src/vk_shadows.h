@@ -0,0 +1,95 @@
+﻿#pragma once
+
+#include <vk_types.h>
+#include <vk_bounds.h>
+#include <glm/glm.hpp>
+
+#include <array>
+#include <vector>
+
+// A region of one cascade to render, in the shadow atlas
+struct ShadowTile
+{
+  uint32_t cascade;
+  VkRect2D rect;
+  glm::mat4 viewProj; // maps the region's light space box onto rect
+};
+
+// Counts of the last frame
+struct ShadowStats
+{
+  uint32_t cascadesCached = 0;  // static part reused as is
+  uint32_t cascadesUpdated = 0; // some of the static part was rendered again
+  uint32_t tilesRendered = 0;
+  uint32_t staticCasters = 0;   // draws into the static cache
+  uint32_t dynamicCasters = 0;  // draws into the dynamic maps
+};
+
+// Bookkeeping for cached directional light cascades.
+//
+// Each cascade is a square window of the light's view, centred on the camera and
+// snapped to whole texels. Static casters are rendered into a cache that persists
+// across frames, dynamic casters into a map that is cleared every frame, and the
+// shader tests both. The cache is addressed toroidally: a texel's place in the
+// cache only depends on its light space position, so when the camera moves the
+// window scrolls and only the strips that came into view are rendered. Static
+// objects that move, appear or go away invalidate the texels under their bounds.
+//
+// Cascades sit side by side in an atlas of CascadeCount * resolution by resolution.
+// The light view is a rotation only, so light space is absolute and depth is
+// measured across a fixed range around the origin.
+class ShadowCache
+{
+public:
+  static const uint32_t CascadeCount = 3;
+
+  // resolution must be a power of two, extents are the world size of each cascade
+  void init( uint32_t resolution, const std::array< float, CascadeCount >& extents, float depthRange );
+
+  // Once per frame. Scrolls the windows with the camera and turns everything that
+  // became invalid into tiles. A new light direction invalidates all cascades.
+  void update( const glm::vec3& lightDirection, const glm::vec3& cameraPosition );
+
+  // static casters inside the world space box changed
+  void invalidate( const AABB& bounds );
+  void invalidate_all() { _allDirty = true; }
+
+  // static tiles to render this frame, cleared first
+  const std::vector< ShadowTile >& get_tiles() const { return _tiles; }
+
+  // the cascade's whole window, where the dynamic casters go
+  ShadowTile get_window( uint32_t cascade ) const;
+
+  const glm::mat4& get_light_view() const { return _lightView; }
+  uint32_t get_resolution() const { return _resolution; }
+  float get_depth_range() const { return _depthRange; }
+
+  // xy window origin in texels, z texel size in world units
+  glm::vec4 get_cascade_params( uint32_t cascade ) const;
+
+  // cascades the last update made tiles for
+  uint32_t get_updated_cascades() const { return _updatedCascades; }
+
+private:
+  // texels in light space, max exclusive
+  struct TexelRect
+  {
+    glm::ivec2 min;
+    glm::ivec2 max;
+  };
+
+  TexelRect get_window_rect( uint32_t cascade ) const;
+  glm::mat4 get_view_proj( uint32_t cascade, const TexelRect& ) const;
+  void add_tiles( uint32_t cascade, const TexelRect& );
+
+  uint32_t _resolution = 0;
+  float _depthRange = 0;
+  std::array< float, CascadeCount > _texelSizes = {};
+  std::array< glm::ivec2, CascadeCount > _origins = {};
+  std::array< std::vector< TexelRect >, CascadeCount > _dirty;
+  glm::vec3 _lightDirection = glm::vec3( 0 );
+  glm::mat4 _lightView = glm::mat4( 1 );
+  bool _allDirty = true;
+  std::vector< ShadowTile > _tiles;
+  uint32_t _updatedCascades = 0;
+};
@@ -0,0 +1,239 @@
+﻿#include <vk_skinning.h>
+#include <vk_initializers.h>
+#include <vk_pipeline.h>
+
+#include <glm/gtx/transform.hpp>
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+namespace
+{
+  const uint32_t GroupSize = 64;
+}
+
+// the skinning shader writes the vertices as floats
+static_assert( sizeof( Vertex ) == 11 * sizeof( float ), "skinning.comp writes Vertex as 11 floats" );
+
+void pose_joint_chain( const Mesh& mesh, float time, float phase, glm::mat4* palette )
+{
+  // the frame of a joint is its parent's, moved to the joint's pivot and bent there
+  glm::mat4 parent( 1 );
+  glm::vec3 parentPivot( 0 );
+  for( size_t j = 0; j < mesh._jointPivots.size(); ++j )
+  {
+    const glm::vec3& pivot = mesh._jointPivots[ j ];
+    const float t = time * 2.0f + phase + j * 0.6f;
+    const glm::mat4 bend = glm::rotate( 0.35f * std::sin( t ), glm::vec3( 0, 0, 1 ) ) *
+                           glm::rotate( 0.2f * std::cos( t * 0.7f ), glm::vec3( 1, 0, 0 ) );
+    const glm::mat4 frame = parent * glm::translate( pivot - parentPivot ) * bend;
+    palette[ j ] = frame * glm::translate( -pivot );
+    parent = frame;
+    parentPivot = pivot;
+  }
+}
+
+void SkinningSystem::init( VkDevice device,
+                           VmaAllocator allocator,
+                           MemoryManager& memory,
+                           uint32_t outputCapacity,
+                           uint32_t framesInFlight )
+{
+  _device = device;
+  _allocator = allocator;
+  _outputCapacity = outputCapacity;
+
+  auto create_buffer = [ & ]( VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage, void** mapped ) {
+    VkBufferCreateInfo bufferInfo = vkinit::buffer_create_info( size, usage );
+    VmaAllocationCreateInfo vmaAllocInfo = {};
+    vmaAllocInfo.usage = memoryUsage;
+    AllocatedBuffer buffer;
+    VK_CHECK( vmaCreateBuffer( _allocator, &bufferInfo, &vmaAllocInfo, &buffer._buffer, &buffer._allocation, nullptr ) );
+    memory.track( buffer._allocation, MemoryCategory::GpuData );
+    if( mapped )
+      VK_CHECK( vmaMapMemory( _allocator, buffer._allocation, mapped ) );
+    return buffer;
+  };
+  _source = create_buffer( MaxSourceVertices * sizeof( GPUSourceVertex ),
+                           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                           VMA_MEMORY_USAGE_CPU_TO_GPU,
+                           ( void** )&_sourceData );
+  _instances = create_buffer( ( VkDeviceSize )MaxInstances * framesInFlight * sizeof( SkinInstance ),
+                              VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                              VMA_MEMORY_USAGE_CPU_TO_GPU,
+                              ( void** )&_instanceData );
+  _joints = create_buffer( ( VkDeviceSize )MaxJoints * framesInFlight * sizeof( glm::mat4 ),
+                           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                           VMA_MEMORY_USAGE_CPU_TO_GPU,
+                           ( void** )&_jointData );
+  _output = create_buffer( ( VkDeviceSize )std::max( outputCapacity, 1u ) * sizeof( Vertex ),
+                           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                           VMA_MEMORY_USAGE_GPU_ONLY,
+                           nullptr );
+
+  std::array bindings = {
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2 ),
+    vkinit::descriptor_set_layout_binding( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3 ),
+  };
+  VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+  layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layoutInfo.bindingCount = ( uint32_t )bindings.size();
+  layoutInfo.pBindings = bindings.data();
+  VK_CHECK( vkCreateDescriptorSetLayout( _device, &layoutInfo, nullptr, &_setLayout ) );
+
+  VkDescriptorPoolSize poolSize = { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, ( uint32_t )bindings.size() };
+  VkDescriptorPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolInfo.maxSets = 1;
+  poolInfo.poolSizeCount = 1;
+  poolInfo.pPoolSizes = &poolSize;
+  VK_CHECK( vkCreateDescriptorPool( _device, &poolInfo, nullptr, &_descriptorPool ) );
+
+  VkDescriptorSetAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocInfo.descriptorPool = _descriptorPool;
+  allocInfo.descriptorSetCount = 1;
+  allocInfo.pSetLayouts = &_setLayout;
+  VK_CHECK( vkAllocateDescriptorSets( _device, &allocInfo, &_set ) );
+
+  // the frames' regions are picked by the push constants
+  std::array infos = {
+    VkDescriptorBufferInfo{ _source._buffer, 0, VK_WHOLE_SIZE },
+    VkDescriptorBufferInfo{ _instances._buffer, 0, VK_WHOLE_SIZE },
+    VkDescriptorBufferInfo{ _joints._buffer, 0, VK_WHOLE_SIZE },
+    VkDescriptorBufferInfo{ _output._buffer, 0, VK_WHOLE_SIZE },
+  };
+  std::array writes = {
+    vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _set, &infos[ 0 ], 0 ),
+    vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _set, &infos[ 1 ], 1 ),
+    vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _set, &infos[ 2 ], 2 ),
+    vkinit::write_descriptor_buffer( VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _set, &infos[ 3 ], 3 ),
+  };
+  vkUpdateDescriptorSets( _device, ( uint32_t )writes.size(), writes.data(), 0, nullptr );
+}
+
+void SkinningSystem::destroy()
+{
+  vkDestroyPipeline( _device, _pipeline, nullptr );
+  vkDestroyPipelineLayout( _device, _layout, nullptr );
+  vkDestroyDescriptorPool( _device, _descriptorPool, nullptr );
+  vkDestroyDescriptorSetLayout( _device, _setLayout, nullptr );
+  for( AllocatedBuffer* buffer : { &_source, &_instances, &_joints } )
+    vmaUnmapMemory( _allocator, buffer->_allocation );
+  for( AllocatedBuffer* buffer : { &_source, &_instances, &_joints, &_output } )
+    vmaDestroyBuffer( _allocator, buffer->_buffer, buffer->_allocation );
+}
+
+bool SkinningSystem::add_mesh( Mesh& mesh )
+{
+  const uint32_t count = ( uint32_t )mesh._verticies.size();
+  if( _sourceCount + count > MaxSourceVertices || mesh._skin.size() != count )
+    return false;
+
+  // joints past the last pivot would read the next instance's palette
+  const uint32_t lastJoint = ( uint32_t )mesh._jointPivots.size() - 1;
+  for( uint32_t v = 0; v < count; ++v )
+  {
+    const Vertex& vertex = mesh._verticies[ v ];
+    GPUSourceVertex& source = _sourceData[ _sourceCount + v ];
+    source.position = glm::vec4( vertex.position, vertex.uv.x );
+    source.normal = glm::vec4( vertex.normal, vertex.uv.y );
+    source.color = glm::vec4( vertex.color, 0 );
+    source.joints = glm::min( mesh._skin[ v ].joints, glm::uvec4( lastJoint ) );
+    source.weights = mesh._skin[ v ].weights;
+  }
+  VK_CHECK( vmaFlushAllocation( _allocator,
+                                _source._allocation,
+                                _sourceCount * sizeof( GPUSourceVertex ),
+                                count * sizeof( GPUSourceVertex ) ) );
+  mesh._skinSource = _sourceCount;
+  mesh._vertexCount = count;
+  _sourceCount += count;
+  return true;
+}
+
+void SkinningSystem::add_pass( RenderGraph& graph )
+{
+  // written every frame, after the previous frame's draws are done reading it
+  RGImportDesc import = {};
+  import.finalStages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  import.finalAccess = VK_ACCESS_SHADER_WRITE_BIT;
+  _outputHandle = graph.import_buffer( "skinned vertices", _output._buffer, import );
+
+  graph.add_compute_pass( "skinning",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.storage_buffer( _outputHandle, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, RGUsage::Write );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      record( cmd );
+    } );
+}
+
+void SkinningSystem::init_pipeline( const LoadShaderFn& load )
+{
+  VkPushConstantRange pushConstant = {};
+  pushConstant.size = sizeof( PushConstants );
+  pushConstant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  VkPipelineLayoutCreateInfo layoutInfo = vkinit::pipeline_layout_create_info();
+  layoutInfo.setLayoutCount = 1;
+  layoutInfo.pSetLayouts = &_setLayout;
+  layoutInfo.pushConstantRangeCount = 1;
+  layoutInfo.pPushConstantRanges = &pushConstant;
+  VK_CHECK( vkCreatePipelineLayout( _device, &layoutInfo, nullptr, &_layout ) );
+
+  VkShaderModule shaderModule = load( "shaders/skinning.comp.spv" );
+  if( !shaderModule )
+    return;
+  _pipeline = build_compute_pipeline( _device, _layout, shaderModule );
+  vkDestroyShaderModule( _device, shaderModule, nullptr );
+}
+
+void SkinningSystem::update( uint32_t frameIndex,
+                             const SkinInstance* instances,
+                             uint32_t instanceCount,
+                             const glm::mat4* joints,
+                             uint32_t jointCount )
+{
+  instanceCount = std::min( instanceCount, MaxInstances );
+  jointCount = std::min( jointCount, MaxJoints );
+  _constants.instanceBase = frameIndex * MaxInstances;
+  _constants.jointBase = frameIndex * MaxJoints;
+  _constants.instanceCount = instanceCount;
+
+  _maxVertexCount = 0;
+  SkinInstance* dst = _instanceData + _constants.instanceBase;
+  for( uint32_t i = 0; i < instanceCount; ++i )
+  {
+    // whatever doesn't fit the output isn't skinned
+    dst[ i ] = instances[ i ];
+    if( instances[ i ].outputFirst + instances[ i ].vertexCount > _outputCapacity )
+      dst[ i ].vertexCount = 0;
+    _maxVertexCount = std::max( _maxVertexCount, dst[ i ].vertexCount );
+  }
+  std::copy( joints, joints + jointCount, _jointData + _constants.jointBase );
+  if( instanceCount > 0 )
+  {
+    VK_CHECK( vmaFlushAllocation( _allocator,
+                                  _instances._allocation,
+                                  _constants.instanceBase * sizeof( SkinInstance ),
+                                  instanceCount * sizeof( SkinInstance ) ) );
+    VK_CHECK( vmaFlushAllocation( _allocator,
+                                  _joints._allocation,
+                                  _constants.jointBase * sizeof( glm::mat4 ),
+                                  jointCount * sizeof( glm::mat4 ) ) );
+  }
+}
+
+void SkinningSystem::record( VkCommandBuffer cmd )
+{
+  if( !_pipeline || _constants.instanceCount == 0 || _maxVertexCount == 0 )
+    return;
+
+  // x covers the largest instance, the instances shorter than that return early
+  vkCmdBindPipeline( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _pipeline );
+  vkCmdBindDescriptorSets( cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _layout, 0, 1, &_set, 0, nullptr );
+  vkCmdPushConstants( cmd, _layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof( _constants ), &_constants );
+  vkCmdDispatch( cmd, ( _maxVertexCount + GroupSize - 1 ) / GroupSize, _constants.instanceCount, 1 );
+}
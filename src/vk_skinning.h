@@ -0,0 +1,107 @@
+﻿#pragma once
+
+#include <vk_types.h>
+#include <vk_render_graph.h>
+#include <vk_memory.h>
+#include <vk_mesh.h>
+#include <glm/glm.hpp>
+
+#include <functional>
+
+// One skinned object of a frame, as the skinning shader reads it
+struct SkinInstance
+{
+  uint32_t sourceFirst; // Mesh::_skinSource
+  uint32_t vertexCount;
+  uint32_t outputFirst; // first vertex written, the object's draws start there
+  uint32_t firstJoint;  // its palette in the frame's joint matrices
+};
+
+// Poses a skinned mesh: every joint sways about its pivot, carrying the joints after
+// it. palette gets one matrix per joint, from the bind pose to the pose.
+void pose_joint_chain( const Mesh&, float time, float phase, glm::mat4* palette );
+
+// Skinned meshes skinned once per frame on the gpu.
+//
+// The bind pose and skin of every skinned mesh are in one buffer. Each frame the cpu
+// writes the frame's instances and their joint palettes, and one dispatch skins every
+// instance into the output buffer, in the layout of Vertex and in model space. The
+// shadow and main passes then draw the instances from it like any vertex buffer, so
+// the skinning isn't repeated per pass.
+class SkinningSystem
+{
+public:
+  using LoadShaderFn = std::function< VkShaderModule( const char* path ) >;
+
+  static constexpr uint32_t MaxSourceVertices = 1 << 16;
+  static constexpr uint32_t MaxInstances = 8192; // per frame
+  static constexpr uint32_t MaxJoints = 1 << 15; // per frame, summed over the instances
+
+  // outputCapacity is in vertices, summed over the instances of a frame
+  void init( VkDevice, VmaAllocator, MemoryManager&, uint32_t outputCapacity, uint32_t framesInFlight );
+  void destroy();
+
+  // Before the first frame. Copies the bind pose and skin into the source buffer and
+  // sets _skinSource and _vertexCount, false if the buffer is full.
+  bool add_mesh( Mesh& );
+
+  // One compute pass writing the output, passes drawing skinned objects declare
+  // get_output as a vertex buffer.
+  void add_pass( RenderGraph& );
+  RGHandle get_output() const { return _outputHandle; }
+  VkBuffer get_output_buffer() const { return _output._buffer; }
+  uint32_t get_output_capacity() const { return _outputCapacity; }
+
+  // load returns null on failure
+  void init_pipeline( const LoadShaderFn& load );
+
+  // once per frame after the frame's fence, the counts are clamped to the maximums
+  void update( uint32_t frameIndex,
+               const SkinInstance* instances,
+               uint32_t instanceCount,
+               const glm::mat4* joints,
+               uint32_t jointCount );
+
+private:
+  // per vertex, the shader's SourceVertex
+  struct GPUSourceVertex
+  {
+    glm::vec4 position; // w uv.x
+    glm::vec4 normal;   // w uv.y
+    glm::vec4 color;
+    glm::uvec4 joints;
+    glm::vec4 weights;
+  };
+
+  struct PushConstants
+  {
+    uint32_t instanceBase; // first instance and joint of the frame's region
+    uint32_t jointBase;
+    uint32_t instanceCount;
+  };
+
+  void record( VkCommandBuffer );
+
+  VkDevice _device = VK_NULL_HANDLE;
+  VmaAllocator _allocator = VK_NULL_HANDLE;
+  uint32_t _outputCapacity = 0;
+
+  AllocatedBuffer _source = {};    // host visible, written before the first frame
+  GPUSourceVertex* _sourceData = nullptr;
+  uint32_t _sourceCount = 0;
+  AllocatedBuffer _instances = {}; // MaxInstances per frame in flight
+  SkinInstance* _instanceData = nullptr;
+  AllocatedBuffer _joints = {};    // MaxJoints per frame in flight
+  glm::mat4* _jointData = nullptr;
+  AllocatedBuffer _output = {};
+  RGHandle _outputHandle = 0;
+
+  VkDescriptorSetLayout _setLayout = VK_NULL_HANDLE;
+  VkDescriptorPool _descriptorPool = VK_NULL_HANDLE;
+  VkDescriptorSet _set = VK_NULL_HANDLE;
+  VkPipelineLayout _layout = VK_NULL_HANDLE;
+  VkPipeline _pipeline = VK_NULL_HANDLE;
+
+  PushConstants _constants = {};
+  uint32_t _maxVertexCount = 0; // of the frame's instances, the dispatch width
+};
@@ -0,0 +1,83 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+// Hands whole frames of data from one thread to another without locks.
+//
+// One producer fills slots and one consumer reads them in the same order. The
+// slots are reused, so whatever they hold keeps its capacity from frame to frame.
+// At most N slots are queued or being read: a producer that gets that far ahead
+// waits, and so does a consumer with nothing queued. Both sides add up the time
+// they spent waiting on the other.
+template< typename T, uint32_t N >
+class SnapshotQueue
+{
+public:
+  // Waits for a free slot, which is the producer's until end_write
+  T& begin_write()
+  {
+    const uint64_t written = _written.load( std::memory_order_relaxed );
+    wait( _producerWaitNs, [ & ] { return written - _read.load( std::memory_order_acquire ) < N; } );
+    return _slots[ written % N ];
+  }
+
+  // publishes the slot begin_write returned
+  void end_write() { _written.store( _written.load( std::memory_order_relaxed ) + 1, std::memory_order_release ); }
+
+  // Waits for the oldest published slot, which is the consumer's until end_read.
+  // nullptr once the queue is closed and everything published was read.
+  T* begin_read()
+  {
+    const uint64_t read = _read.load( std::memory_order_relaxed );
+    wait( _consumerWaitNs, [ & ] {
+      return _written.load( std::memory_order_acquire ) != read || _closed.load( std::memory_order_acquire );
+    } );
+    if( _written.load( std::memory_order_acquire ) == read )
+      return nullptr;
+    return &_slots[ read % N ];
+  }
+
+  // frees the slot begin_read returned
+  void end_read() { _read.store( _read.load( std::memory_order_relaxed ) + 1, std::memory_order_release ); }
+
+  // from the producer after its last end_write, the consumer drains what is left
+  void close() { _closed.store( true, std::memory_order_release ); }
+
+  uint64_t get_read_count() const { return _read.load( std::memory_order_relaxed ); }
+  double get_producer_wait_ms() const { return _producerWaitNs.load( std::memory_order_relaxed ) * 1e-6; }
+  double get_consumer_wait_ms() const { return _consumerWaitNs.load( std::memory_order_relaxed ) * 1e-6; }
+
+  // only while neither side is using the queue
+  T& get_slot( uint32_t index ) { return _slots[ index ]; }
+
+private:
+  // yields at first, then sleeps a little so a long wait doesn't keep a core busy
+  template< typename Ready >
+  static void wait( std::atomic< uint64_t >& waitedNs, const Ready& ready )
+  {
+    if( ready() )
+      return;
+    const auto start = std::chrono::steady_clock::now();
+    for( uint32_t tries = 0; !ready(); ++tries )
+    {
+      if( tries < 64 )
+        std::this_thread::yield();
+      else
+        std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+    }
+    const auto waited = std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now() - start );
+    waitedNs.fetch_add( ( uint64_t )waited.count(), std::memory_order_relaxed );
+  }
+
+  T _slots[ N ];
+
+  // counts of slots ever published and freed, each written by one side only
+  alignas( 64 ) std::atomic< uint64_t > _written{ 0 };
+  alignas( 64 ) std::atomic< uint64_t > _read{ 0 };
+  std::atomic< bool > _closed{ false };
+  std::atomic< uint64_t > _producerWaitNs{ 0 };
+  std::atomic< uint64_t > _consumerWaitNs{ 0 };
+};
@@ -3,11 +3,15 @@
 
 #pragma once
 
-#include <vulkan/vulkan.h>
+// volk loads the vulkan functions, device level ones straight from the driver
+#include <volk.h>
 #include <vk_mem_alloc.h>
 
 //we will add our main reusable types here
 
+// aborts on anything but VK_SUCCESS
+void VK_CHECK( VkResult err );
+
 struct AllocatedBuffer
 {
   VkBuffer _buffer;
@@ -0,0 +1,513 @@
+﻿#include <vk_virtual_texture.h>
+#include <vk_initializers.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+  const VkFormat AtlasFormat = VK_FORMAT_R8G8B8A8_SRGB;
+  const VkDeviceSize PageBytes = VirtualTexture::SlotSize * VirtualTexture::SlotSize * sizeof( uint32_t );
+
+  // rgba bytes, shown when the image can't be decoded rather than leaving its pages pending
+  const uint32_t Magenta = 0xffff00ff;
+
+  // Box filtered in srgb space, close enough for mips that are only seen from afar.
+  // Returns magenta mips if the image can't be loaded.
+  std::vector< std::vector< uint32_t > > load_mips( const std::string& path, uint32_t size, uint32_t mipCount )
+  {
+    std::vector< std::vector< uint32_t > > mips( mipCount );
+    int width, height, channels;
+    stbi_uc* pixels = stbi_load( path.c_str(), &width, &height, &channels, STBI_rgb_alpha );
+    if( !pixels || ( uint32_t )width != size || ( uint32_t )height != size )
+    {
+      std::cout << "virtual texture: can't load " << path << std::endl;
+      stbi_image_free( pixels );
+      for( uint32_t m = 0; m < mipCount; ++m )
+        mips[ m ].assign( ( size_t )( size >> m ) * ( size >> m ), Magenta );
+      return mips;
+    }
+    mips[ 0 ].resize( ( size_t )size * size );
+    memcpy( mips[ 0 ].data(), pixels, mips[ 0 ].size() * sizeof( uint32_t ) );
+    stbi_image_free( pixels );
+
+    for( uint32_t m = 1; m < mipCount; ++m )
+    {
+      const uint32_t srcSize = size >> ( m - 1 );
+      const uint32_t dstSize = size >> m;
+      const uint8_t* src = ( const uint8_t* )mips[ m - 1 ].data();
+      mips[ m ].resize( ( size_t )dstSize * dstSize );
+      uint8_t* dst = ( uint8_t* )mips[ m ].data();
+      for( uint32_t y = 0; y < dstSize; ++y )
+      {
+        const uint8_t* row0 = src + ( size_t )( 2 * y ) * srcSize * 4;
+        const uint8_t* row1 = row0 + ( size_t )srcSize * 4;
+        for( uint32_t x = 0; x < dstSize; ++x )
+          for( uint32_t c = 0; c < 4; ++c )
+          {
+            const uint32_t sum = row0[ 8 * x + c ] + row0[ 8 * x + 4 + c ] + row1[ 8 * x + c ] + row1[ 8 * x + 4 + c ];
+            dst[ ( ( size_t )y * dstSize + x ) * 4 + c ] = ( uint8_t )( ( sum + 2 ) / 4 );
+          }
+      }
+    }
+    return mips;
+  }
+}
+
+void VirtualTexture::init( VkDevice device,
+                           VmaAllocator allocator,
+                           MemoryManager& memory,
+                           VkExtent2D extent,
+                           uint32_t framesInFlight,
+                           VkDeviceSize alignment )
+{
+  _device = device;
+  _allocator = allocator;
+  _framesInFlight = framesInFlight;
+
+  const uint32_t atlasSize = AtlasPages * SlotSize;
+  VkImageCreateInfo imageInfo = vkinit::image_create_info( AtlasFormat,
+                                                           VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                                                           { atlasSize, atlasSize, 1 } );
+  VmaAllocationCreateInfo imageAllocInfo = {};
+  imageAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+  VK_CHECK( vmaCreateImage( _allocator, &imageInfo, &imageAllocInfo, &_atlas._image, &_atlas._allocation, nullptr ) );
+  memory.track( _atlas._allocation, MemoryCategory::Texture );
+  VkImageViewCreateInfo viewInfo = vkinit::image_view_create_info( AtlasFormat, _atlas._image, VK_IMAGE_ASPECT_COLOR_BIT );
+  VK_CHECK( vkCreateImageView( _device, &viewInfo, nullptr, &_atlasView ) );
+
+  // pages have borders, so filtering never reaches into the neighbouring slot
+  VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info( VK_FILTER_LINEAR, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE );
+  VK_CHECK( vkCreateSampler( _device, &samplerInfo, nullptr, &_sampler ) );
+
+  auto create_buffer = [ & ]( VkDeviceSize size, VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage, MemoryCategory category ) {
+    VkBufferCreateInfo bufferInfo = vkinit::buffer_create_info( size, usage );
+    VmaAllocationCreateInfo vmaAllocInfo = {};
+    vmaAllocInfo.usage = memoryUsage;
+    AllocatedBuffer buffer;
+    VK_CHECK( vmaCreateBuffer( _allocator, &bufferInfo, &vmaAllocInfo, &buffer._buffer, &buffer._allocation, nullptr ) );
+    memory.track( buffer._allocation, category );
+    return buffer;
+  };
+  _staging = create_buffer( framesInFlight * MaxUploadsPerFrame * PageBytes,
+                            VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                            VMA_MEMORY_USAGE_CPU_TO_GPU,
+                            MemoryCategory::Staging );
+  VK_CHECK( vmaMapMemory( _allocator, _staging._allocation, ( void** )&_stagingData ) );
+
+  _feedbackWidth = ( extent.width + FeedbackScale - 1 ) / FeedbackScale;
+  _feedbackCount = _feedbackWidth * ( ( extent.height + FeedbackScale - 1 ) / FeedbackScale );
+  _feedbackStride = ( _feedbackCount * sizeof( uint32_t ) + alignment - 1 ) / alignment * alignment;
+  _feedback = create_buffer( framesInFlight * _feedbackStride,
+                             VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                             VMA_MEMORY_USAGE_GPU_TO_CPU,
+                             MemoryCategory::GpuData );
+  VK_CHECK( vmaMapMemory( _allocator, _feedback._allocation, ( void** )&_feedbackData ) );
+
+  _textures.reserve( MaxTextures );
+  _pageTable.assign( MaxTextures * HeaderSize, 0 );
+  _pageSlots.assign( _pageTable.size(), Absent );
+  _requestFrames.assign( _pageTable.size(), 0 );
+  _slots.resize( AtlasPages * AtlasPages );
+  _missing.reserve( _feedbackCount + MaxTextures );
+  _arrived.reserve( MaxUploadsPerFrame );
+  _copies.reserve( MaxUploadsPerFrame );
+
+  _pageBuffers.resize( MaxPendingPages * SlotSize * SlotSize );
+  _freeBuffers.reserve( MaxPendingPages );
+  for( uint32_t i = 0; i < MaxPendingPages; ++i )
+    _freeBuffers.push_back( i );
+  _requests.reserve( MaxPendingPages );
+  _loaded.reserve( MaxPendingPages );
+  _loader = std::thread( [ this ] { load_pages(); } );
+  _statsStart = std::chrono::steady_clock::now();
+}
+
+void VirtualTexture::destroy()
+{
+  {
+    std::lock_guard< std::mutex > lock( _mutex );
+    _stop = true;
+  }
+  _wake.notify_one();
+  if( _loader.joinable() )
+    _loader.join();
+
+  vmaUnmapMemory( _allocator, _staging._allocation );
+  vmaUnmapMemory( _allocator, _feedback._allocation );
+  vmaDestroyBuffer( _allocator, _staging._buffer, _staging._allocation );
+  vmaDestroyBuffer( _allocator, _feedback._buffer, _feedback._allocation );
+  vkDestroySampler( _device, _sampler, nullptr );
+  vkDestroyImageView( _device, _atlasView, nullptr );
+  vmaDestroyImage( _allocator, _atlas._image, _atlas._allocation );
+}
+
+int VirtualTexture::add_texture( const char* path )
+{
+  int width, height, channels;
+  if( _textures.size() == MaxTextures || !stbi_info( path, &width, &height, &channels ) )
+  {
+    std::cout << "virtual texture: can't read " << path << std::endl;
+    return -1;
+  }
+  // the feedback has 10 bits for page coordinates
+  const uint32_t size = ( uint32_t )width;
+  if( width != height || size < PageSize || size > 1024 * PageSize || ( size & ( size - 1 ) ) != 0 )
+  {
+    std::cout << "virtual texture: " << path << " isn't square with a power of two size between "
+              << PageSize << " and " << 1024 * PageSize << std::endl;
+    return -1;
+  }
+
+  // down to a single page
+  uint32_t mipCount = 0;
+  size_t entries = 0;
+  for( uint32_t pages = size / PageSize; pages > 0; pages >>= 1 )
+  {
+    entries += ( size_t )pages * pages;
+    mipCount++;
+  }
+  if( _pageTable.size() + entries > MaxPageTableEntries )
+  {
+    std::cout << "virtual texture: " << path << " needs " << entries << " page table entries, "
+              << MaxPageTableEntries - _pageTable.size() << " are left" << std::endl;
+    return -1;
+  }
+
+  const uint32_t id = ( uint32_t )_textures.size();
+  Texture& texture = _textures.emplace_back();
+  texture.path = path;
+  texture.size = size;
+  texture.mipCount = mipCount;
+
+  // pages per side at mip 0, the mip count, then where each mip's entries start
+  _pageTable[ id * HeaderSize ] = size / PageSize;
+  _pageTable[ id * HeaderSize + 1 ] = texture.mipCount;
+  for( uint32_t m = 0; m < texture.mipCount; ++m )
+  {
+    const uint32_t pages = ( size / PageSize ) >> m;
+    _pageTable[ id * HeaderSize + 2 + m ] = ( uint32_t )_pageTable.size();
+    _pageTable.resize( _pageTable.size() + pages * pages, NotMapped );
+  }
+  _pageSlots.resize( _pageTable.size(), Absent );
+  _requestFrames.resize( _pageTable.size(), 0 );
+
+  // the single page of the coarsest mip is never evicted, so the texture always shows something
+  const uint16_t last = ( uint16_t )( texture.mipCount - 1 );
+  _missing.push_back( { get_entry( id, last, 0, 0 ), ( uint16_t )id, last, 0, 0, 0 } );
+  request_pages();
+  return ( int )id;
+}
+
+void VirtualTexture::add_upload_pass( RenderGraph& graph )
+{
+  // pages were uploaded and sampled by the previous frames, the rest stays as it is
+  RGImportDesc atlasImport = {};
+  atlasImport.initialLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  atlasImport.initialStages = VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+  atlasImport.initialWriteAccess = VK_ACCESS_TRANSFER_WRITE_BIT;
+  atlasImport.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  atlasImport.finalStages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+  atlasImport.finalAccess = VK_ACCESS_SHADER_READ_BIT;
+  const uint32_t atlasSize = AtlasPages * SlotSize;
+  _atlasHandle = graph.import_image( "virtual texture atlas",
+                                     { _atlas._image },
+                                     { _atlasView },
+                                     { AtlasFormat, { atlasSize, atlasSize }, 1 },
+                                     atlasImport );
+
+  // read back on the cpu once the fence signals, frames in flight write separate regions
+  RGImportDesc feedbackImport = {};
+  feedbackImport.finalStages = VK_PIPELINE_STAGE_HOST_BIT;
+  feedbackImport.finalAccess = VK_ACCESS_HOST_READ_BIT;
+  _feedbackHandle = graph.import_buffer( "virtual texture feedback", _feedback._buffer, feedbackImport );
+
+  graph.add_compute_pass( "virtual texture upload",
+    [ & ]( RGPassBuilder& builder ) {
+      builder.transfer_write( _atlasHandle, RGUsage::ReadWrite );
+      builder.transfer_write( _feedbackHandle, RGUsage::ReadWrite );
+    },
+    [ this ]( VkCommandBuffer cmd ) {
+      vkCmdFillBuffer( cmd, _feedback._buffer, _frameIndex * _feedbackStride, _feedbackCount * sizeof( uint32_t ), NotMapped );
+      if( !_copies.empty() )
+        vkCmdCopyBufferToImage( cmd,
+                                _staging._buffer,
+                                _atlas._image,
+                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                ( uint32_t )_copies.size(),
+                                _copies.data() );
+    } );
+}
+
+void VirtualTexture::prepare( VkCommandBuffer cmd )
+{
+  // nothing is mapped before the first upload, so the contents don't matter
+  if( _prepared )
+    return;
+  _prepared = true;
+  VkImageMemoryBarrier barrier = vkinit::image_barrier( _atlas._image,
+                                                        0,
+                                                        VK_ACCESS_SHADER_READ_BIT,
+                                                        VK_IMAGE_LAYOUT_UNDEFINED,
+                                                        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                                                        VK_IMAGE_ASPECT_COLOR_BIT );
+  vkCmdPipelineBarrier( cmd,
+                        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                        0, 0, nullptr, 0, nullptr, 1, &barrier );
+}
+
+void VirtualTexture::begin_frame( uint32_t frameIndex, uint32_t frameNumber )
+{
+  _frameIndex = frameIndex;
+  if( frameNumber >= _framesInFlight )
+  {
+    read_feedback( frameIndex, frameNumber );
+    request_pages();
+  }
+  stage_uploads( frameIndex, frameNumber );
+  if( _tableDirty )
+    rebuild_page_table();
+}
+
+void VirtualTexture::write_page_table( void* dst ) const
+{
+  memcpy( dst, _pageTable.data(), get_page_table_size() );
+}
+
+glm::uvec4 VirtualTexture::get_feedback_params( uint32_t frameNumber ) const
+{
+  // a different pixel of each square every frame, all of them every FeedbackScale² frames
+  const uint32_t i = frameNumber % ( FeedbackScale * FeedbackScale );
+  return glm::uvec4( i % FeedbackScale, ( i / FeedbackScale + 3 * i ) % FeedbackScale, _feedbackWidth, 0 );
+}
+
+VkDescriptorImageInfo VirtualTexture::get_atlas_info() const
+{
+  return { _sampler, _atlasView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+}
+
+VkDescriptorBufferInfo VirtualTexture::get_feedback_info( uint32_t frameIndex ) const
+{
+  return { _feedback._buffer, frameIndex * _feedbackStride, _feedbackCount * sizeof( uint32_t ) };
+}
+
+VirtualTextureStats VirtualTexture::take_stats()
+{
+  const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  VirtualTextureStats stats = _stats;
+  stats.seconds = std::chrono::duration< float >( now - _statsStart ).count();
+  _stats = {};
+  _statsStart = now;
+  return stats;
+}
+
+uint32_t VirtualTexture::get_resident_pages() const
+{
+  return ( uint32_t )std::count_if( _slots.begin(), _slots.end(), []( const Slot& slot ) { return slot.entry >= 0; } );
+}
+
+void VirtualTexture::load_pages()
+{
+  std::unique_lock< std::mutex > lock( _mutex );
+  for( ;; )
+  {
+    _wake.wait( lock, [ this ] { return _stop || !_requests.empty(); } );
+    if( _stop )
+      return;
+    // in the order they were asked for, request_pages puts coarse pages first
+    const PageRequest request = _requests.front();
+    _requests.erase( _requests.begin() );
+    lock.unlock();
+    copy_page( request );
+    lock.lock();
+    _loaded.push_back( request );
+  }
+}
+
+void VirtualTexture::copy_page( const PageRequest& request )
+{
+  Texture& texture = _textures[ request.texture ];
+  if( texture.mips.empty() )
+    texture.mips = load_mips( texture.path, texture.size, texture.mipCount );
+
+  // the border wraps around like the uvs do
+  const std::vector< uint32_t >& mip = texture.mips[ request.mip ];
+  const int size = ( int )( texture.size >> request.mip );
+  const int x0 = request.x * ( int )PageSize - ( int )PageBorder;
+  const int y0 = request.y * ( int )PageSize - ( int )PageBorder;
+  uint32_t* out = &_pageBuffers[ ( size_t )request.buffer * SlotSize * SlotSize ];
+  for( int y = 0; y < ( int )SlotSize; ++y )
+  {
+    const uint32_t* row = &mip[ ( size_t )( ( y0 + y ) & ( size - 1 ) ) * size ];
+    for( int x = 0; x < ( int )SlotSize; ++x )
+      *out++ = row[ ( x0 + x ) & ( size - 1 ) ];
+  }
+}
+
+void VirtualTexture::read_feedback( uint32_t frameIndex, uint32_t frameNumber )
+{
+  VK_CHECK( vmaInvalidateAllocation( _allocator,
+                                     _feedback._allocation,
+                                     frameIndex * _feedbackStride,
+                                     _feedbackCount * sizeof( uint32_t ) ) );
+  const uint32_t* feedback = _feedbackData + frameIndex * _feedbackStride / sizeof( uint32_t );
+  for( uint32_t i = 0; i < _feedbackCount; ++i )
+  {
+    // texture 8 bits, mip 4, page y 10, page x 10, see mesh_clustered.frag
+    const uint32_t value = feedback[ i ];
+    if( value == NotMapped )
+      continue;
+    const uint32_t t = value >> 24;
+    const uint32_t mip = ( value >> 20 ) & 15;
+    const uint32_t y = ( value >> 10 ) & 1023;
+    const uint32_t x = value & 1023;
+    if( t >= _textures.size() || mip >= _textures[ t ].mipCount )
+      continue;
+    const uint32_t pages = ( _textures[ t ].size / PageSize ) >> mip;
+    if( x >= pages || y >= pages )
+      continue;
+
+    // many pixels ask for the same page
+    const uint32_t entry = get_entry( t, mip, x, y );
+    if( _requestFrames[ entry ] == frameNumber + 1 )
+      continue;
+    _requestFrames[ entry ] = frameNumber + 1;
+    _stats.requested++;
+
+    // whatever stands in for the page is in use as well
+    const uint32_t mapped = _pageTable[ entry ];
+    if( mapped != NotMapped )
+      _slots[ mapped & 0xffff ].lastUsed = frameNumber;
+    if( _pageSlots[ entry ] >= 0 )
+      _stats.resident++;
+    else if( _pageSlots[ entry ] == Absent )
+      _missing.push_back( { entry, ( uint16_t )t, ( uint16_t )mip, ( uint16_t )x, ( uint16_t )y, 0 } );
+  }
+}
+
+void VirtualTexture::request_pages()
+{
+  // a coarse page stands in for more of the finer ones. Whatever doesn't fit is asked
+  // for again by the next feedback, if it is still wanted then.
+  std::sort( _missing.begin(), _missing.end(), []( const PageRequest& a, const PageRequest& b ) {
+    return a.mip > b.mip;
+  } );
+  {
+    std::lock_guard< std::mutex > lock( _mutex );
+    for( PageRequest& request : _missing )
+    {
+      if( _freeBuffers.empty() )
+        break;
+      request.buffer = _freeBuffers.back();
+      _freeBuffers.pop_back();
+      _pageSlots[ request.entry ] = Pending;
+      _requests.push_back( request );
+    }
+  }
+  _missing.clear();
+  _wake.notify_one();
+}
+
+void VirtualTexture::stage_uploads( uint32_t frameIndex, uint32_t frameNumber )
+{
+  _arrived.clear();
+  _copies.clear();
+  {
+    std::lock_guard< std::mutex > lock( _mutex );
+    const size_t count = std::min< size_t >( _loaded.size(), MaxUploadsPerFrame );
+    _arrived.assign( _loaded.begin(), _loaded.begin() + count );
+    _loaded.erase( _loaded.begin(), _loaded.begin() + count );
+  }
+
+  // the frame's staging region is free, its fence signalled
+  const VkDeviceSize stagingOffset = frameIndex * MaxUploadsPerFrame * PageBytes;
+  for( const PageRequest& request : _arrived )
+  {
+    _freeBuffers.push_back( request.buffer );
+    const int32_t slot = find_slot( frameNumber );
+    if( slot < 0 )
+    {
+      // all of the atlas is in use, the feedback asks again while the page is still wanted
+      _pageSlots[ request.entry ] = Absent;
+      continue;
+    }
+    Slot& target = _slots[ slot ];
+    if( target.entry >= 0 )
+    {
+      _pageSlots[ target.entry ] = Absent;
+      _stats.evicted++;
+    }
+    target.entry = ( int32_t )request.entry;
+    target.lastUsed = frameNumber;
+    target.locked = request.mip == _textures[ request.texture ].mipCount - 1;
+    _pageSlots[ request.entry ] = slot;
+    _tableDirty = true;
+
+    const VkDeviceSize offset = stagingOffset + _copies.size() * PageBytes;
+    memcpy( _stagingData + offset, &_pageBuffers[ ( size_t )request.buffer * SlotSize * SlotSize ], PageBytes );
+    VkBufferImageCopy& copy = _copies.emplace_back();
+    copy = {};
+    copy.bufferOffset = offset;
+    copy.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    copy.imageOffset = { ( int32_t )( slot % AtlasPages * SlotSize ), ( int32_t )( slot / AtlasPages * SlotSize ), 0 };
+    copy.imageExtent = { SlotSize, SlotSize, 1 };
+    _stats.uploaded++;
+    _stats.uploadBytes += PageBytes;
+  }
+  if( !_copies.empty() )
+    VK_CHECK( vmaFlushAllocation( _allocator, _staging._allocation, stagingOffset, _copies.size() * PageBytes ) );
+}
+
+int32_t VirtualTexture::find_slot( uint32_t frameNumber ) const
+{
+  // a free slot, otherwise the least recently used one the last feedback didn't ask for
+  int32_t best = -1;
+  for( int32_t i = 0; i < ( int32_t )_slots.size(); ++i )
+  {
+    const Slot& slot = _slots[ i ];
+    if( slot.entry < 0 )
+      return i;
+    if( slot.locked || slot.lastUsed == frameNumber )
+      continue;
+    if( best < 0 || slot.lastUsed < _slots[ best ].lastUsed )
+      best = i;
+  }
+  return best;
+}
+
+void VirtualTexture::rebuild_page_table()
+{
+  // coarse to fine, so a missing page takes what its parent maps to
+  for( uint32_t t = 0; t < ( uint32_t )_textures.size(); ++t )
+  {
+    const Texture& texture = _textures[ t ];
+    for( int32_t mip = ( int32_t )texture.mipCount - 1; mip >= 0; --mip )
+    {
+      const uint32_t pages = ( texture.size / PageSize ) >> mip;
+      for( uint32_t y = 0; y < pages; ++y )
+        for( uint32_t x = 0; x < pages; ++x )
+        {
+          const uint32_t entry = get_entry( t, mip, x, y );
+          const int32_t slot = _pageSlots[ entry ];
+          if( slot >= 0 )
+            _pageTable[ entry ] = ( uint32_t )slot | ( uint32_t )mip << 16;
+          else if( mip + 1 < ( int32_t )texture.mipCount )
+            _pageTable[ entry ] = _pageTable[ get_entry( t, mip + 1, x / 2, y / 2 ) ];
+          else
+            _pageTable[ entry ] = NotMapped;
+        }
+    }
+  }
+  _tableDirty = false;
+}
+
+uint32_t VirtualTexture::get_entry( uint32_t texture, uint32_t mip, uint32_t x, uint32_t y ) const
+{
+  const uint32_t* header = &_pageTable[ texture * HeaderSize ];
+  return header[ 2 + mip ] + y * ( header[ 0 ] >> mip ) + x;
+}
@@ -0,0 +1,182 @@
+﻿#pragma once
+
+#include <vk_types.h>
+#include <vk_render_graph.h>
+#include <vk_memory.h>
+#include <glm/glm.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Counts since the last take_stats
+struct VirtualTextureStats
+{
+  uint32_t requested = 0; // distinct pages the feedback asked for, summed over frames
+  uint32_t resident = 0;  // of those, already in the atlas
+  uint32_t uploaded = 0;
+  uint32_t evicted = 0;
+  uint64_t uploadBytes = 0;
+  float seconds = 0;      // the counts cover
+};
+
+// Textures far bigger than the memory they get, paged into a fixed atlas.
+//
+// Every texture is cut into PageSize pages at every mip down to a single page. The
+// atlas holds AtlasPages * AtlasPages of them, each with a border copied from its
+// neighbours so bilinear filtering doesn't need to know about pages. A page table
+// maps every virtual page to its atlas slot, or to the slot of its finest resident
+// ancestor, so a missing page shows a blurrier version of itself instead of nothing.
+//
+// Which pages are needed comes from the gpu: the mesh shader writes the page it
+// wanted for one pixel of every FeedbackScale square, rotating the pixel each
+// frame. The cpu reads that once the frame's fence signals, marks the resident pages
+// as used and asks a loader thread for the missing ones, coarser mips first. Pages
+// the loader finished replace the least recently used slots, never one that was
+// asked for in the same feedback. The coarsest page of every texture never leaves.
+//
+// The loader decodes a texture and builds its mips on the first page asked for,
+// then only copies pages out of them.
+class VirtualTexture
+{
+public:
+  static constexpr uint32_t PageSize = 128;
+  static constexpr uint32_t PageBorder = 4;
+  static constexpr uint32_t SlotSize = PageSize + 2 * PageBorder;
+  static constexpr uint32_t AtlasPages = 16;    // per side
+  static constexpr uint32_t FeedbackScale = 8;  // pixels per feedback entry, per side
+  static constexpr uint32_t MaxTextures = 16;
+  static constexpr uint32_t HeaderSize = 16;    // uints per texture at the start of the page table
+  static constexpr uint32_t MaxPageTableEntries = 1 << 18; // headers included, the frame ring is sized for it
+  static constexpr uint32_t MaxPendingPages = 32;
+  static constexpr uint32_t MaxUploadsPerFrame = 8;
+
+  // extent is the size the feedback is written at, alignment the storage buffer offset alignment
+  void init( VkDevice,
+             VmaAllocator,
+             MemoryManager&,
+             VkExtent2D extent,
+             uint32_t framesInFlight,
+             VkDeviceSize alignment );
+  void destroy();
+
+  // Before the first frame, only reads the image's header. The image must be square
+  // with a power of two size of at least PageSize, and its pages must fit into what
+  // is left of MaxPageTableEntries. Returns the id the mesh shader takes, -1 if the
+  // image can't be used.
+  int add_texture( const char* path );
+
+  // Clears the frame's feedback and copies the pages that arrived into the atlas.
+  // Passes sampling the atlas declare get_atlas sampled and get_feedback written.
+  void add_upload_pass( RenderGraph& );
+  RGHandle get_atlas() const { return _atlasHandle; }
+  RGHandle get_feedback() const { return _feedbackHandle; }
+
+  // the graph expects the atlas ready to sample, the first frame records that
+  void prepare( VkCommandBuffer );
+
+  // Once per frame after the frame's fence: reads the feedback the frame slot wrote
+  // last, asks the loader for missing pages and stages the ones it finished.
+  void begin_frame( uint32_t frameIndex, uint32_t frameNumber );
+
+  // the page table the shader translates through, written into the frame ring every frame
+  size_t get_page_table_size() const { return _pageTable.size() * sizeof( uint32_t ); }
+  void write_page_table( void* dst ) const;
+
+  // xy the pixel of each FeedbackScale square writing feedback, z the feedback width
+  glm::uvec4 get_feedback_params( uint32_t frameNumber ) const;
+
+  VkDescriptorImageInfo get_atlas_info() const;
+  VkDescriptorBufferInfo get_feedback_info( uint32_t frameIndex ) const;
+
+  VirtualTextureStats take_stats();
+  uint32_t get_resident_pages() const;
+
+private:
+  struct Texture
+  {
+    std::string path;
+    uint32_t size;
+    uint32_t mipCount;
+    std::vector< std::vector< uint32_t > > mips; // rgba, decoded by the loader
+  };
+
+  struct PageRequest
+  {
+    uint32_t entry;
+    uint16_t texture;
+    uint16_t mip;
+    uint16_t x;
+    uint16_t y;
+    uint32_t buffer; // page buffer the loader copies into
+  };
+
+  struct Slot
+  {
+    int32_t entry = -1;
+    uint32_t lastUsed = 0;
+    bool locked = false;
+  };
+
+  // page table entries, slot in the low 16 bits and the mip it came from above
+  static constexpr uint32_t NotMapped = ~0u;  // also no feedback
+  static constexpr int32_t Absent = -1;
+  static constexpr int32_t Pending = -2;
+
+  void load_pages();
+  void copy_page( const PageRequest& );
+  void read_feedback( uint32_t frameIndex, uint32_t frameNumber );
+  void request_pages();
+  void stage_uploads( uint32_t frameIndex, uint32_t frameNumber );
+  int32_t find_slot( uint32_t frameNumber ) const;
+  void rebuild_page_table();
+  uint32_t get_entry( uint32_t texture, uint32_t mip, uint32_t x, uint32_t y ) const;
+
+  VkDevice _device = VK_NULL_HANDLE;
+  VmaAllocator _allocator = VK_NULL_HANDLE;
+  uint32_t _framesInFlight = 1;
+
+  AllocatedImage _atlas = {};
+  VkImageView _atlasView = VK_NULL_HANDLE;
+  VkSampler _sampler = VK_NULL_HANDLE;
+  AllocatedBuffer _staging = {};   // MaxUploadsPerFrame pages per frame in flight
+  uint8_t* _stagingData = nullptr;
+  AllocatedBuffer _feedback = {};  // one region per frame in flight
+  const uint32_t* _feedbackData = nullptr;
+  VkDeviceSize _feedbackStride = 0;
+  uint32_t _feedbackWidth = 0;
+  uint32_t _feedbackCount = 0;
+  RGHandle _atlasHandle = 0;
+  RGHandle _feedbackHandle = 0;
+  bool _prepared = false;
+
+  std::vector< Texture > _textures; // reserved, the loader holds on to elements
+  std::vector< uint32_t > _pageTable;
+  std::vector< int32_t > _pageSlots;      // per entry, a slot, Absent or Pending
+  std::vector< uint32_t > _requestFrames; // per entry, frame number + 1 it was last asked for
+  std::vector< Slot > _slots;
+  bool _tableDirty = true;
+
+  // per frame, reserved so a frame doesn't allocate
+  std::vector< PageRequest > _missing;
+  std::vector< PageRequest > _arrived;
+  std::vector< VkBufferImageCopy > _copies;
+  uint32_t _frameIndex = 0;
+
+  // page buffers are handed to the loader with a request and come back with it
+  std::vector< uint32_t > _pageBuffers;
+  std::vector< uint32_t > _freeBuffers;
+
+  std::thread _loader;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::vector< PageRequest > _requests; // guarded by _mutex
+  std::vector< PageRequest > _loaded;   // guarded by _mutex
+  bool _stop = false;                   // guarded by _mutex
+
+  VirtualTextureStats _stats;
+  std::chrono::steady_clock::time_point _statsStart;
+};
@@ -0,0 +1,374 @@
+﻿#include <vk_world.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+
+// Layout, little endian:
+//   magic, version, uint32 chunk count, float chunk size
+//   chunks: 6 floats bounds, uint32 vertex count, uint64 offset of the vertices
+//   the vertices of every chunk, Vertex as laid out in memory, three per triangle
+static const uint32_t WorldMagic = 0x44574b56; // "VKWD"
+static const uint32_t WorldVersion = 1;
+static const size_t ChunkEntrySize = 6 * sizeof( float ) + sizeof( uint32_t ) + sizeof( uint64_t );
+static const float OutOfRange = std::numeric_limits< float >::infinity();
+
+template< typename T >
+static void put( std::ofstream& out, const T& value )
+{
+  out.write( ( const char* )&value, sizeof( T ) );
+}
+
+template< typename T >
+static T get( std::ifstream& in )
+{
+  T value = {};
+  in.read( ( char* )&value, sizeof( T ) );
+  return value;
+}
+
+bool WorldStreamer::build( const char* objPath, const char* worldPath, float chunkSize )
+{
+  Mesh mesh;
+  if( !mesh.load_from_obj( objPath ) || mesh._verticies.empty() )
+  {
+    std::cout << "could not load " << objPath << std::endl;
+    return false;
+  }
+  return build( mesh._verticies, worldPath, chunkSize );
+}
+
+bool WorldStreamer::build( const std::vector< Vertex >& triangles, const char* worldPath, float chunkSize )
+{
+  if( chunkSize <= 0 || triangles.size() % 3 != 0 )
+  {
+    std::cout << "can't cut " << triangles.size() << " vertices into chunks of " << chunkSize << std::endl;
+    return false;
+  }
+
+  // ordered by cell so the same obj always writes the same file
+  std::map< uint64_t, std::vector< Vertex > > cells;
+  for( size_t i = 0; i < triangles.size(); i += 3 )
+  {
+    const glm::vec3 centroid = ( triangles[ i ].position + triangles[ i + 1 ].position + triangles[ i + 2 ].position ) / 3.0f;
+    const glm::ivec3 cell = glm::ivec3( glm::floor( centroid / chunkSize ) ) + ( 1 << 20 );
+    const uint64_t key = ( uint64_t )( cell.x & 0x1fffff ) << 42 | ( uint64_t )( cell.y & 0x1fffff ) << 21 | ( uint64_t )( cell.z & 0x1fffff );
+    std::vector< Vertex >& vertices = cells[ key ];
+    vertices.insert( vertices.end(), triangles.begin() + i, triangles.begin() + i + 3 );
+  }
+
+  std::ofstream file( worldPath, std::ios::binary );
+  put( file, WorldMagic );
+  put( file, WorldVersion );
+  put( file, ( uint32_t )cells.size() );
+  put( file, chunkSize );
+  uint64_t offset = 4 * sizeof( uint32_t ) + cells.size() * ChunkEntrySize;
+  for( const auto& [ key, vertices ] : cells )
+  {
+    // a triangle sticks out of its cell by up to two thirds of itself
+    AABB bounds;
+    for( const Vertex& vertex : vertices )
+      bounds.grow( vertex.position );
+    put( file, bounds.min );
+    put( file, bounds.max );
+    put( file, ( uint32_t )vertices.size() );
+    put( file, offset );
+    offset += vertices.size() * sizeof( Vertex );
+  }
+  for( const auto& [ key, vertices ] : cells )
+    file.write( ( const char* )vertices.data(), vertices.size() * sizeof( Vertex ) );
+  if( !file )
+  {
+    std::cout << "could not write world " << worldPath << std::endl;
+    return false;
+  }
+  std::cout << "world " << worldPath << ": " << cells.size() << " chunks of " << chunkSize << ", "
+            << offset / ( 1024 * 1024 ) << " MiB" << std::endl;
+  return true;
+}
+
+bool WorldStreamer::open( const char* path )
+{
+  std::ifstream file( path, std::ios::binary | std::ios::ate );
+  if( !file.is_open() )
+  {
+    std::cout << "could not open world " << path << std::endl;
+    return false;
+  }
+  const uint64_t fileSize = ( uint64_t )file.tellg();
+  file.seekg( 0 );
+  if( get< uint32_t >( file ) != WorldMagic || get< uint32_t >( file ) != WorldVersion )
+  {
+    std::cout << path << " is not a world of this version" << std::endl;
+    return false;
+  }
+  const uint32_t count = get< uint32_t >( file );
+  const float chunkSize = get< float >( file );
+  if( !file || ( fileSize - 4 * sizeof( uint32_t ) ) / ChunkEntrySize < count )
+  {
+    std::cout << "world " << path << " is truncated" << std::endl;
+    return false;
+  }
+
+  _chunks.resize( count );
+  uint64_t totalBytes = 0;
+  for( Chunk& chunk : _chunks )
+  {
+    chunk.bounds.min = get< glm::vec3 >( file );
+    chunk.bounds.max = get< glm::vec3 >( file );
+    chunk.vertexCount = get< uint32_t >( file );
+    chunk.offset = get< uint64_t >( file );
+    if( chunk.offset > fileSize || ( fileSize - chunk.offset ) / sizeof( Vertex ) < chunk.vertexCount )
+    {
+      std::cout << "world " << path << " is truncated" << std::endl;
+      _chunks.clear();
+      return false;
+    }
+    totalBytes += chunk.get_bytes();
+  }
+  std::cout << "world " << path << ": " << count << " chunks of " << chunkSize << ", "
+            << totalBytes / ( 1024 * 1024 ) << " MiB of vertices" << std::endl;
+
+  _path = path;
+  _frame = 0;
+  _residentBytes = 0;
+  _pendingBytes = 0;
+  _residentCount = 0;
+  _stats = {};
+  _candidates.reserve( count );
+  _victims.reserve( count );
+  _arrived.reserve( MaxPendingRequests );
+  _queue.reserve( MaxPendingRequests );
+  _uploads.reserve( MaxPendingRequests );
+  _evictions.reserve( count );
+  _requests.reserve( MaxPendingRequests );
+  _loaded.reserve( MaxPendingRequests );
+  _stop = false;
+  for( uint32_t i = 0; i < LoaderThreads; ++i )
+    _loaders.emplace_back( [ this ] { load_chunks(); } );
+  return true;
+}
+
+void WorldStreamer::close()
+{
+  {
+    std::lock_guard< std::mutex > lock( _mutex );
+    _stop = true;
+  }
+  _wake.notify_all();
+  for( std::thread& loader : _loaders )
+    loader.join();
+  _loaders.clear();
+  _requests.clear();
+  _loaded.clear();
+  _arrived.clear();
+  _uploads.clear();
+  _chunks.clear();
+}
+
+void WorldStreamer::load_chunks()
+{
+  // every loader reads through its own stream, seeks of one don't move another
+  std::ifstream file( _path, std::ios::binary );
+  std::unique_lock< std::mutex > lock( _mutex );
+  for( ;; )
+  {
+    _wake.wait( lock, [ this ] { return _stop || !_requests.empty(); } );
+    if( _stop )
+      return;
+    const Request request = _requests.back();
+    _requests.pop_back();
+    lock.unlock();
+
+    // empty vertices tell update the read failed
+    WorldChunkLoad load;
+    load.chunk = request.chunk;
+    load.vertices.resize( request.vertexCount );
+    file.clear();
+    file.seekg( request.offset );
+    file.read( ( char* )load.vertices.data(), load.vertices.size() * sizeof( Vertex ) );
+    if( !file )
+      load.vertices.clear();
+
+    lock.lock();
+    _loaded.push_back( std::move( load ) );
+  }
+}
+
+void WorldStreamer::update( const glm::vec3& cameraPosition, const glm::vec3& cameraForward, const Frustum& frustum )
+{
+  // frames count from 1, so a lastVisible of 0 is never
+  _frame++;
+  _uploads.clear();
+  _evictions.clear();
+  _victimsSorted = false;
+
+  // requests no loader started are ranked again with the others
+  {
+    std::lock_guard< std::mutex > lock( _mutex );
+    for( const Request& request : _requests )
+    {
+      _chunks[ request.chunk ].state = ChunkState::Absent;
+      _pendingBytes -= _chunks[ request.chunk ].get_bytes();
+    }
+    _requests.clear();
+    for( WorldChunkLoad& load : _loaded )
+    {
+      Chunk& chunk = _chunks[ load.chunk ];
+      if( load.vertices.empty() )
+      {
+        std::cout << "could not read chunk " << load.chunk << " of world " << _path << std::endl;
+        chunk.state = ChunkState::Failed;
+        _pendingBytes -= chunk.get_bytes();
+        continue;
+      }
+      chunk.state = ChunkState::Loaded;
+      _arrived.push_back( std::move( load ) );
+    }
+    _loaded.clear();
+  }
+
+  // chunks behind the camera count as up to three times as far away
+  _candidates.clear();
+  for( uint32_t i = 0; i < ( uint32_t )_chunks.size(); ++i )
+  {
+    Chunk& chunk = _chunks[ i ];
+    const glm::vec3 toChunk = glm::clamp( cameraPosition, chunk.bounds.min, chunk.bounds.max ) - cameraPosition;
+    const float distance = glm::length( toChunk );
+    chunk.needed = false;
+    if( distance > _viewDistance + _prefetchDistance )
+    {
+      chunk.priority = OutOfRange;
+      continue;
+    }
+    const float facing = distance > 0 ? glm::dot( toChunk / distance, cameraForward ) : 1.0f;
+    chunk.priority = distance * ( 2 - facing );
+    if( frustum.is_visible( chunk.bounds ) )
+    {
+      chunk.lastVisible = _frame;
+      chunk.needed = distance <= _viewDistance;
+    }
+    if( chunk.state == ChunkState::Absent )
+      _candidates.push_back( i );
+  }
+
+  // the closest loaded chunks go first, the rest wait for the next frame
+  std::sort( _arrived.begin(), _arrived.end(), [ this ]( const WorldChunkLoad& a, const WorldChunkLoad& b ) {
+    return _chunks[ a.chunk ].priority < _chunks[ b.chunk ].priority;
+  } );
+  uint64_t uploadBytes = 0;
+  size_t waiting = 0;
+  for( WorldChunkLoad& load : _arrived )
+  {
+    Chunk& chunk = _chunks[ load.chunk ];
+    const uint64_t bytes = chunk.get_bytes();
+    if( chunk.priority == OutOfRange )
+    {
+      chunk.state = ChunkState::Absent;
+      _pendingBytes -= bytes;
+      continue;
+    }
+    if( !_uploads.empty() && uploadBytes + bytes > _uploadBytesPerFrame )
+    {
+      if( &_arrived[ waiting ] != &load )
+        _arrived[ waiting ] = std::move( load );
+      waiting++;
+      continue;
+    }
+    uploadBytes += bytes;
+    _pendingBytes -= bytes;
+    _residentBytes += bytes;
+    _residentCount++;
+    chunk.state = ChunkState::Resident;
+    chunk.residentSince = _frame;
+    _stats.loaded++;
+    _uploads.push_back( std::move( load ) );
+  }
+  _arrived.resize( waiting );
+
+  // Queues the best chunks that fit. A candidate that doesn't fit may only push out
+  // chunks last visible before itself, so what is in view never makes room for what
+  // isn't, and chunks out of view don't take turns pushing each other out.
+  std::sort( _candidates.begin(), _candidates.end(), [ this ]( uint32_t a, uint32_t b ) {
+    return _chunks[ a ].priority < _chunks[ b ].priority;
+  } );
+  uint32_t pending = 0;
+  for( const Chunk& chunk : _chunks )
+    pending += chunk.state == ChunkState::Queued || chunk.state == ChunkState::Loaded;
+  _queue.clear();
+  for( uint32_t i : _candidates )
+  {
+    if( pending == MaxPendingRequests )
+      break;
+    Chunk& chunk = _chunks[ i ];
+    const uint64_t bytes = chunk.get_bytes();
+    bool fits = true;
+    while( fits && _residentBytes + _pendingBytes + bytes > _budgetBytes )
+      fits = evict_one( chunk.lastVisible );
+    if( !fits )
+      continue;
+    chunk.state = ChunkState::Queued;
+    _pendingBytes += bytes;
+    pending++;
+    _queue.push_back( { i, chunk.offset, chunk.vertexCount } );
+  }
+  if( !_queue.empty() )
+  {
+    {
+      std::lock_guard< std::mutex > lock( _mutex );
+      _requests.assign( _queue.rbegin(), _queue.rend() );
+    }
+    _wake.notify_all();
+  }
+
+  uint32_t missing = 0;
+  for( const Chunk& chunk : _chunks )
+    missing += chunk.needed && chunk.state != ChunkState::Resident;
+  _stats.chunks = ( uint32_t )_chunks.size();
+  _stats.residentChunks = _residentCount;
+  _stats.residentBytes = _residentBytes;
+  _stats.budgetBytes = _budgetBytes;
+  _stats.pendingRequests = pending;
+  _stats.missingChunks = missing;
+  _stats.missingFrames += missing > 0;
+  _stats.frames = _frame;
+}
+
+bool WorldStreamer::evict_one( uint32_t visibleBefore )
+{
+  // sorted once per update, chunks made resident in this one stay
+  if( !_victimsSorted )
+  {
+    _victims.clear();
+    for( uint32_t i = 0; i < ( uint32_t )_chunks.size(); ++i )
+      if( _chunks[ i ].state == ChunkState::Resident && _chunks[ i ].residentSince != _frame )
+        _victims.push_back( i );
+    std::sort( _victims.begin(), _victims.end(), [ this ]( uint32_t a, uint32_t b ) {
+      if( _chunks[ a ].lastVisible != _chunks[ b ].lastVisible )
+        return _chunks[ a ].lastVisible > _chunks[ b ].lastVisible;
+      return _chunks[ a ].priority < _chunks[ b ].priority;
+    } );
+    _victimsSorted = true;
+  }
+
+  if( _victims.empty() || _chunks[ _victims.back() ].lastVisible >= visibleBefore )
+    return false;
+  const uint32_t victim = _victims.back();
+  _victims.pop_back();
+  Chunk& chunk = _chunks[ victim ];
+  chunk.state = ChunkState::Absent;
+  _residentBytes -= chunk.get_bytes();
+  _residentCount--;
+  _evictions.push_back( victim );
+  _stats.evicted++;
+  return true;
+}
+
+WorldStreamStats WorldStreamer::get_stats() const
+{
+  return _stats;
+}
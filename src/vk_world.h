@@ -0,0 +1,151 @@
+﻿#pragma once
+
+#include <vk_mesh.h>
+#include <vk_bounds.h>
+#include <glm/glm.hpp>
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Gauges of the last update and counts since the world was opened
+struct WorldStreamStats
+{
+  uint32_t chunks = 0;          // in the world
+  uint32_t residentChunks = 0;
+  uint64_t residentBytes = 0;   // vertex buffers of the resident chunks
+  uint64_t budgetBytes = 0;
+  uint32_t pendingRequests = 0; // waiting for a loader, being read or waiting for their upload
+  uint32_t missingChunks = 0;   // in view within the view distance but not resident, last update
+  uint32_t missingFrames = 0;   // updates with any missing chunk
+  uint32_t frames = 0;
+  uint32_t loaded = 0;
+  uint32_t evicted = 0;
+};
+
+// Vertices of a chunk read by a loader, handed to the engine for upload
+struct WorldChunkLoad
+{
+  uint32_t chunk;
+  std::vector< Vertex > vertices;
+};
+
+// A world too big to keep in memory, cut into chunks on a grid and streamed in
+// around the camera.
+//
+// The chunks come from a world file written by build: the triangles of an obj are
+// sorted into cells by their centroid, each cell's vertices stored whole in world
+// space behind a table of the cells' bounds. Opening the file only reads the table.
+//
+// Every update ranks the chunks within _viewDistance + _prefetchDistance of the
+// camera by their distance, counting the ones behind it as further away, and keeps
+// the best of them queued for the loader threads, which read the vertices off the
+// disk. The prefetch distance is the margin that lets a chunk arrive before it comes
+// into view distance. What the loaders finish is handed out for upload, a few MiB
+// per frame.
+//
+// Before a load is queued its bytes must fit into _budgetBytes along with everything
+// resident or on its way. When they don't, the chunk last visible longest ago gives
+// way, as long as it was last visible before the chunk taking its place. Chunks that
+// never were visible only ever load into free budget.
+class WorldStreamer
+{
+public:
+  static constexpr uint32_t LoaderThreads = 2;
+  static constexpr uint32_t MaxPendingRequests = 16;
+  static constexpr float DefaultChunkSize = 16;
+
+  // Splits the obj's triangles into chunkSize cells and writes the world file,
+  // returns false and prints why on failure
+  static bool build( const char* objPath, const char* worldPath, float chunkSize );
+  static bool build( const std::vector< Vertex >& triangles, const char* worldPath, float chunkSize );
+
+  // reads the chunk table and starts the loaders, returns false and prints why on failure
+  bool open( const char* path );
+  // stops the loaders, waiting for the reads in progress
+  void close();
+  bool is_open() const { return !_loaders.empty(); }
+
+  uint32_t get_chunk_count() const { return ( uint32_t )_chunks.size(); }
+  // world space, the vertices need no transform
+  const AABB& get_chunk_bounds( uint32_t chunk ) const { return _chunks[ chunk ].bounds; }
+
+  // Once per frame. Takes what the loaders finished, picks this frame's uploads and
+  // evictions and queues the next loads.
+  void update( const glm::vec3& cameraPosition, const glm::vec3& cameraForward, const Frustum& );
+
+  // Of the last update. The engine makes the uploads resident and frees the evicted
+  // chunks before its next update, it may move the vertices out of the loads.
+  std::vector< WorldChunkLoad >& get_uploads() { return _uploads; }
+  const std::vector< uint32_t >& get_evictions() const { return _evictions; }
+
+  WorldStreamStats get_stats() const;
+
+  float _viewDistance = 96;     // chunks in view closer than this are missing when not resident
+  float _prefetchDistance = 32; // loaded ahead of coming into view distance
+  uint64_t _budgetBytes = 256ull << 20;
+  uint64_t _uploadBytesPerFrame = 8ull << 20; // at least one chunk is uploaded per frame
+
+private:
+  enum class ChunkState : uint8_t
+  {
+    Absent,
+    Queued,   // requested, waiting for or being read by a loader
+    Loaded,   // read, waiting for its upload
+    Resident,
+    Failed,   // couldn't be read, never asked for again
+  };
+
+  struct Chunk
+  {
+    AABB bounds;
+    uint32_t vertexCount = 0;
+    uint64_t offset = 0; // of the vertices in the file
+    ChunkState state = ChunkState::Absent;
+    uint32_t lastVisible = 0;   // update it was last in view and in range, 0 for never
+    bool needed = false;        // in view within the view distance, this update
+    uint32_t residentSince = 0; // update it was handed out for upload
+    float priority = 0;         // lower loads first, refreshed every update
+
+    uint64_t get_bytes() const { return ( uint64_t )vertexCount * sizeof( Vertex ); }
+  };
+
+  struct Request
+  {
+    uint32_t chunk;
+    uint64_t offset;
+    uint32_t vertexCount;
+  };
+
+  void load_chunks();
+  // evicts the least recently visible resident chunk last seen before the given
+  // update, returns false if there is none
+  bool evict_one( uint32_t visibleBefore );
+
+  std::vector< Chunk > _chunks;
+  std::string _path;
+  uint32_t _frame = 0;
+  uint64_t _residentBytes = 0;
+  uint64_t _pendingBytes = 0; // queued and loaded
+  uint32_t _residentCount = 0;
+  WorldStreamStats _stats;
+
+  // per update, reserved so an update doesn't allocate
+  std::vector< uint32_t > _candidates;
+  std::vector< uint32_t > _victims;   // resident chunks, least recently visible last
+  bool _victimsSorted = false;
+  std::vector< WorldChunkLoad > _arrived; // loaded, waiting for their upload
+  std::vector< Request > _queue;          // this update's requests, the best first
+  std::vector< WorldChunkLoad > _uploads;
+  std::vector< uint32_t > _evictions;
+
+  std::vector< std::thread > _loaders;
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::vector< Request > _requests;       // guarded by _mutex, the best last
+  std::vector< WorldChunkLoad > _loaded;  // guarded by _mutex
+  bool _stop = false;                     // guarded by _mutex
+};